@@ -1,7 +1,7 @@
 #! /bin/bash
 # Define virtio ports in some KVM virtual machine
 #
-# Usage: ./add_virtio_channel domain 
+# Usage: ./add_virtio_channel domain [count]
 
 virsh="virsh -c qemu:///system"
 list=$($virsh list --all --name)
@@ -9,7 +9,7 @@ list=$($virsh list --all --name)
 function usage
 {
   echo "Usage:"
-  echo "    $0 <domain>"
+  echo "    $0 <domain> [<number of channels>]"
   echo
   echo "Currently defined domains are:"
   echo "$list" | sed 's/^/    /'
@@ -17,18 +17,27 @@ function usage
   exit 1
 }
 
-[ $# -eq 1 ] || usage
+[ $# -eq 1 -o $# -eq 2 ] || usage
 [ "$1" != "" ] || usage
 [[ "$list" =~ "$1" ]] || usage
 domain="$1"
+count="${2:-1}"
+[[ "$count" =~ ^[1-8]$ ]] || usage
 
+# The first channel keeps its traditional socket name; any further
+# channels are numbered
 function add_port
 {
-  socket=/run/twopence/${domain}.sock
-  name=org.opensuse.twopence.0
+  index=$1
+  if [ $index -eq 0 ]; then
+    socket=/run/twopence/${domain}.sock
+  else
+    socket=/run/twopence/${domain}.${index}.sock
+  fi
+  name=org.opensuse.twopence.${index}
   grep -q "<target type='virtio' name='${name}'/>" $tmpfile
   if [ $? -eq 0 ]; then
-    echo "Error: virtio port already exists in VM \"${domain}\""
+    echo "Error: virtio port ${name} already exists in VM \"${domain}\""
     echo
   else
     sed -i "/<devices>/ a\ \
@@ -36,7 +45,7 @@ function add_port
        <source mode='bind' path='${socket}'/>\n\
        <target type='virtio' name='${name}'/>\n\
     </channel>" $tmpfile
-    echo "Virtio port added to VM \"${domain}\""
+    echo "Virtio port ${name} added to VM \"${domain}\""
     echo "Note: for a running VM, the changes will only be visible at next restart."
     echo
   fi
@@ -46,6 +55,8 @@ echo "Trying to add virtio ports to VM \"${domain}\"..."
 echo
 tmpfile=$(mktemp "/tmp/add_virtio_portsXXX.xml")
 $virsh dumpxml $domain > $tmpfile
-add_port
+for ((i = 0; i < count; i++)); do
+  add_port $i
+done
 $virsh define $tmpfile > /dev/null
 rm $tmpfile
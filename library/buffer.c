@@ -18,7 +18,11 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
@@ -42,11 +46,34 @@ twopence_buf_init_static(twopence_buf_t *bp, void *data, size_t len)
 	bp->tail = len;
 }
 
+/*
+ * A budget may be shared by buffers that are resized by different threads
+ * (for instance, the I/O threads of several targets), so update it atomically.
+ */
+static inline void
+__twopence_buf_charge(twopence_buf_t *bp, unsigned int old_size, unsigned int new_size)
+{
+	twopence_buf_budget_t *budget = bp->budget;
+
+	if (budget) {
+		if (new_size > old_size)
+			__sync_fetch_and_add(&budget->used, (size_t) (new_size - old_size));
+		else if (old_size > new_size)
+			__sync_fetch_and_sub(&budget->used, (size_t) (old_size - new_size));
+	}
+}
+
 void
 twopence_buf_destroy(twopence_buf_t *bp)
 {
-	if (bp->dynamic)
+	if (bp->mapped) {
+		munmap(bp->base, bp->size);
+		close(bp->spill_fd);
+	} else
+	if (bp->dynamic) {
+		__twopence_buf_charge(bp, bp->size, 0);
 		free(bp->base);
+	}
 	twopence_buf_init(bp);
 }
 
@@ -72,9 +99,29 @@ twopence_buf_clone(twopence_buf_t *bp)
 	return clone;
 }
 
+/*
+ * Take another reference on a buffer allocated with twopence_buf_new().
+ * Every call to twopence_buf_free() drops one; the last one frees the
+ * buffer. Buffers with more than one reference must not be modified.
+ *
+ * Shared buffers may be released by several I/O threads at once, so the
+ * count is updated atomically.
+ */
+twopence_buf_t *
+twopence_buf_hold(twopence_buf_t *bp)
+{
+	__sync_fetch_and_add(&bp->refcount, 1);
+	return bp;
+}
+
 void
 twopence_buf_free(twopence_buf_t *bp)
 {
+	/* The count does not include the owner's reference. Whoever finds
+	 * it at zero before decrementing holds the last one. */
+	if (__sync_fetch_and_sub(&bp->refcount, 1) != 0)
+		return;
+
 	twopence_buf_destroy(bp);
 	free(bp);
 }
@@ -130,6 +177,125 @@ twopence_buf_push(twopence_buf_t *bp, void *data, unsigned int len)
 	return true;
 }
 
+/*
+ * Spilling buffers to disk.
+ * The data is moved to an unlinked temporary file, which is mapped at
+ * bp->base, so that all the usual accessors keep working. The page cache
+ * can write it out and drop it under memory pressure.
+ */
+static int
+__twopence_buf_spill_file(void)
+{
+	char path[PATH_MAX];
+	const char *dir;
+	int fd;
+
+	if ((dir = getenv("TMPDIR")) == NULL)
+		dir = "/tmp";
+
+#ifdef O_TMPFILE
+	if ((fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) >= 0)
+		return fd;
+#endif
+
+	/* No O_TMPFILE, or the file system does not support it */
+	snprintf(path, sizeof(path), "%s/twopence.XXXXXX", dir);
+	if ((fd = mkstemp(path)) >= 0) {
+		unlink(path);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+	return fd;
+}
+
+static void *
+__twopence_buf_map(int fd, unsigned int size)
+{
+	void *base;
+
+	if (ftruncate(fd, size) < 0)
+		return NULL;
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+	return base;
+}
+
+static bool
+__twopence_buf_spill(twopence_buf_t *bp, unsigned int new_size)
+{
+	void *base;
+	int fd;
+
+	if ((fd = __twopence_buf_spill_file()) < 0
+	 || (base = __twopence_buf_map(fd, new_size)) == NULL) {
+		/* Better to go over budget than to lose data */
+		twopence_log_error("unable to spill buffer to disk: %m");
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	twopence_debug("buffer of %u bytes exceeds memory budget, spilling to disk", bp->size);
+	if (bp->base)
+		memcpy(base, bp->base, bp->tail);
+	if (bp->dynamic) {
+		__twopence_buf_charge(bp, bp->size, 0);
+		free(bp->base);
+	}
+
+	bp->base = base;
+	bp->size = new_size;
+	bp->spill_fd = fd;
+	bp->dynamic = 0;
+	bp->mapped = 1;
+	return true;
+}
+
+static bool
+__twopence_buf_resize_mapped(twopence_buf_t *bp, unsigned int want_size)
+{
+	unsigned int new_size;
+	void *base;
+
+	/* Remapping is not cheap, so grow in big steps */
+	new_size = 2 * bp->size;
+	if (new_size < want_size)
+		new_size = want_size;
+
+	/* Map the grown file before dropping the old mapping, so that the
+	 * buffer stays intact if we fail. The file may have grown already;
+	 * that does not matter, as we only ever use bp->size bytes of it. */
+	if ((base = __twopence_buf_map(bp->spill_fd, new_size)) == NULL) {
+		twopence_log_error("unable to grow spilled buffer: %m");
+		return false;
+	}
+
+	munmap(bp->base, bp->size);
+	bp->base = base;
+	bp->size = new_size;
+	return true;
+}
+
+/*
+ * Account the heap memory of this buffer against @budget
+ */
+void
+twopence_buf_set_budget(twopence_buf_t *bp, twopence_buf_budget_t *budget)
+{
+	unsigned int charged = (bp->dynamic && !bp->mapped)? bp->size : 0;
+
+	__twopence_buf_charge(bp, charged, 0);
+	bp->budget = budget;
+	__twopence_buf_charge(bp, 0, charged);
+}
+
+bool
+twopence_buf_is_spilled(const twopence_buf_t *bp)
+{
+	return bp->mapped;
+}
+
 bool
 twopence_buf_resize(twopence_buf_t *bp, unsigned int want_size)
 {
@@ -152,6 +318,18 @@ twopence_buf_resize(twopence_buf_t *bp, unsigned int want_size)
 
 	assert(want_size <= new_size);
 
+	if (bp->mapped)
+		return __twopence_buf_resize_mapped(bp, want_size);
+
+	if (bp->budget && bp->budget->limit) {
+		size_t used = __sync_fetch_and_add(&bp->budget->used, 0) - (bp->dynamic? bp->size : 0);
+
+		if (used + new_size > bp->budget->limit && __twopence_buf_spill(bp, new_size))
+			return true;
+	}
+
+	__twopence_buf_charge(bp, bp->dynamic? bp->size : 0, new_size);
+
 	/* twopence_{m,re}alloc never return a NULL pointer */
 	if (bp->base == NULL || bp->dynamic) {
 		bp->base = twopence_realloc(bp->base, new_size);
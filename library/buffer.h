@@ -25,13 +25,33 @@
 #include <stdbool.h>
 
 typedef struct twopence_buf twopence_buf_t;
+typedef struct twopence_buf_budget twopence_buf_budget_t;
+
+/*
+ * Heap memory used by the buffers attached to a budget is accounted
+ * here. A buffer that would take the total beyond the limit moves its
+ * data to a temporary file instead. A limit of 0 means no limit.
+ */
+struct twopence_buf_budget {
+	size_t		limit;
+	size_t		used;
+};
 
 struct twopence_buf {
 	char *		base;
 	unsigned int	head;
 	unsigned int	tail;
 	unsigned int	size;
-	unsigned int	dynamic : 1;
+	unsigned int	dynamic : 1,
+			mapped : 1;
+
+	/* When mapped is set, base is a mapping of this (unlinked) file */
+	int		spill_fd;
+
+	/* Number of references held in addition to the owner's; see twopence_buf_hold */
+	unsigned int	refcount;
+
+	twopence_buf_budget_t *budget;
 };
 
 extern void		twopence_buf_init(twopence_buf_t *bp);
@@ -40,6 +60,7 @@ extern void		twopence_buf_destroy(twopence_buf_t *bp);
 extern twopence_buf_t *	twopence_buf_new(size_t max_size);
 extern twopence_buf_t *	twopence_buf_clone(twopence_buf_t *bp);
 extern void		twopence_buf_free(twopence_buf_t *bp);
+extern twopence_buf_t *	twopence_buf_hold(twopence_buf_t *bp);
 extern const void *	twopence_buf_head(const twopence_buf_t *bp);
 extern void *		twopence_buf_tail(const twopence_buf_t *bp);
 extern unsigned int	twopence_buf_tailroom(const twopence_buf_t *bp);
@@ -62,5 +83,7 @@ extern void		twopence_buf_reset(twopence_buf_t *bp);
 extern void		twopence_buf_compact(twopence_buf_t *bp);
 extern int		twopence_buf_index(const twopence_buf_t *bp, const char *string);
 extern void		twopence_buf_dump(const twopence_buf_t *bp, unsigned int debuglevel);
+extern void		twopence_buf_set_budget(twopence_buf_t *bp, twopence_buf_budget_t *budget);
+extern bool		twopence_buf_is_spilled(const twopence_buf_t *bp);
 
 #endif /* TWOPENCE_BUFFER_H */
@@ -74,7 +74,7 @@ __twopence_chroot_init(struct twopence_chroot_target *target, const char *direct
  * Returns the file descriptor if successful, or -1 if failed
  */
 static twopence_sock_t *
-__twopence_chroot_open(struct twopence_pipe_target *pipe_handle)
+__twopence_chroot_open(struct twopence_pipe_target *pipe_handle, unsigned int link)
 {
   struct twopence_chroot_target *handle = (struct twopence_chroot_target *) pipe_handle;
   twopence_sock_t *ret_socket = NULL;
@@ -197,14 +197,31 @@ const struct twopence_plugin twopence_chroot_ops = {
 
 	.init = twopence_chroot_init,
 	.set_option = twopence_pipe_set_option,
+	.get_option = twopence_pipe_get_option,
 	.run_test = twopence_pipe_run_test,
 	.wait = twopence_pipe_wait,
+	.wait_many = twopence_pipe_wait_many,
 	.chat_send = twopence_pipe_chat_send,
 	.chat_recv = twopence_pipe_chat_recv,
+	.chat_eof = twopence_pipe_chat_eof,
+	.chat_lock = twopence_pipe_chat_lock,
+	.chat_unlock = twopence_pipe_chat_unlock,
 	.inject_file = twopence_pipe_inject_file,
+	.inject_begin = twopence_pipe_inject_begin,
+	.inject_write = twopence_pipe_inject_write,
+	.file_open = twopence_pipe_file_open,
+	.file_io = twopence_pipe_file_io,
+	.file_close = twopence_pipe_file_close,
+	.list_jobs = twopence_pipe_list_jobs,
+	.reattach = twopence_pipe_reattach,
 	.extract_file = twopence_pipe_extract_file,
 	.exit_remote = twopence_pipe_exit_remote,
 	.interrupt_command = twopence_pipe_interrupt_command,
+	.interrupt_pid = twopence_pipe_interrupt_pid,
+	.wait_ready = twopence_pipe_wait_ready,
+	.connect = twopence_pipe_connect,
+	.get_pollfds = twopence_pipe_get_pollfds,
+	.dispatch = twopence_pipe_dispatch,
 	.cancel_transactions = twopence_pipe_cancel_transactions,
 	.disconnect = twopence_pipe_disconnect,
 	.end = twopence_pipe_end,
@@ -215,14 +232,31 @@ const struct twopence_plugin twopence_local_ops = {
 
 	.init = twopence_local_init,
 	.set_option = twopence_pipe_set_option,
+	.get_option = twopence_pipe_get_option,
 	.run_test = twopence_pipe_run_test,
 	.wait = twopence_pipe_wait,
+	.wait_many = twopence_pipe_wait_many,
 	.chat_send = twopence_pipe_chat_send,
 	.chat_recv = twopence_pipe_chat_recv,
+	.chat_eof = twopence_pipe_chat_eof,
+	.chat_lock = twopence_pipe_chat_lock,
+	.chat_unlock = twopence_pipe_chat_unlock,
 	.inject_file = twopence_pipe_inject_file,
+	.inject_begin = twopence_pipe_inject_begin,
+	.inject_write = twopence_pipe_inject_write,
+	.file_open = twopence_pipe_file_open,
+	.file_io = twopence_pipe_file_io,
+	.file_close = twopence_pipe_file_close,
+	.list_jobs = twopence_pipe_list_jobs,
+	.reattach = twopence_pipe_reattach,
 	.extract_file = twopence_pipe_extract_file,
 	.exit_remote = twopence_pipe_exit_remote,
 	.interrupt_command = twopence_pipe_interrupt_command,
+	.interrupt_pid = twopence_pipe_interrupt_pid,
+	.wait_ready = twopence_pipe_wait_ready,
+	.connect = twopence_pipe_connect,
+	.get_pollfds = twopence_pipe_get_pollfds,
+	.dispatch = twopence_pipe_dispatch,
 	.cancel_transactions = twopence_pipe_cancel_transactions,
 	.disconnect = twopence_pipe_disconnect,
 	.end = twopence_pipe_end,
@@ -40,6 +40,11 @@
 
 #include "connection.h"
 
+/* Transaction IDs are 16bit quantities */
+#define TWOPENCE_XID_MAP_WORDS		(65536 / 32)
+#define TWOPENCE_XID_MAP_WORD(xid)	((xid) / 32)
+#define TWOPENCE_XID_MAP_BIT(xid)	(1U << ((xid) % 32))
+
 
 typedef struct twopence_conn_list {
 	twopence_conn_t *		head;
@@ -57,6 +62,11 @@ struct twopence_connection {
 	twopence_sock_t *		client_sock;
 	unsigned int			client_id;
 
+	/* A secondary link does not track any transactions of its own;
+	 * it carries transactions that belong to its owner. */
+	twopence_conn_t *		owner;
+
+	/* All intervals are in milliseconds */
 	struct {
 		unsigned int		send_timeout;
 		struct timeval		send_deadline;
@@ -67,6 +77,14 @@ struct twopence_connection {
 	/* We may want to have concurrent transactions later on */
 	twopence_transaction_list_t	transactions;
 	twopence_transaction_list_t	done_transactions;
+
+	/* Bitmap of transaction IDs currently in use on the client side.
+	 * A bit is set when the transaction is created, and cleared when
+	 * it is freed. Bit 0 is always set, because xid 0 is reserved. */
+	struct {
+		uint16_t		last;
+		uint32_t		map[TWOPENCE_XID_MAP_WORDS];
+	} xid;
 };
 
 /* When keepalives are enabled, we will shut down the link
@@ -74,6 +92,20 @@ struct twopence_connection {
 #define TWOPENCE_KEEPALIVE_RECV_TIMEOUT	TWOPENCE_PROTO_DEFAULT_KEEPALIVE
 #define TWOPENCE_KEEPALIVE_SEND_TIMEOUT	(TWOPENCE_KEEPALIVE_RECV_TIMEOUT / 4)
 
+/* When the peer sends heartbeats, we consider it dead after this many
+ * heartbeat intervals without any traffic */
+#define TWOPENCE_HEARTBEAT_MISSED	4
+
+static inline void
+__twopence_timeval_add_msec(struct timeval *tv, unsigned int msec)
+{
+	struct timeval delta;
+
+	delta.tv_sec = msec / 1000;
+	delta.tv_usec = (msec % 1000) * 1000;
+	timeradd(tv, &delta, tv);
+}
+
 static void
 twopence_conn_list_insert(twopence_conn_list_t *list, twopence_conn_t *conn)
 {
@@ -95,6 +127,9 @@ twopence_conn_new(twopence_conn_semantics_t *semantics, twopence_sock_t *client_
 	conn->client_sock = client_sock;
 	conn->client_id = client_id;
 
+	/* xid 0 is reserved */
+	conn->xid.map[0] = TWOPENCE_XID_MAP_BIT(0);
+
 	return conn;
 }
 
@@ -115,16 +150,80 @@ twopence_conn_set_keepalive(twopence_conn_t *conn, int keepalive)
 		twopence_debug("using keepalives, set idle timeout to %d seconds", keepalive);
 
 		/* Send at least 3 keepalives during timeout interval */
-		conn->keepalive.send_timeout = keepalive / 4;
+		conn->keepalive.send_timeout = keepalive * 1000 / 4;
 		twopence_sock_enable_xmit_ts(conn->client_sock);
 
-		conn->keepalive.recv_timeout = keepalive;
+		conn->keepalive.recv_timeout = keepalive * 1000;
 
 		twopence_conn_update_send_keepalive(conn);
 		twopence_conn_update_recv_keepalive(conn);
 	}
 }
 
+/*
+ * Aggressive liveness checking.
+ * The server sends heartbeats to the client every @interval_ms when the
+ * link is otherwise idle. The client in turn declares the server dead
+ * if it has not heard anything for TWOPENCE_HEARTBEAT_MISSED intervals.
+ *
+ * This is asymmetric on purpose: a client application may legitimately
+ * stop polling the link for a while, so the server keeps applying the
+ * regular keepalive timeout to the client.
+ */
+void
+twopence_conn_send_heartbeats(twopence_conn_t *conn, unsigned int interval_ms)
+{
+	if (interval_ms == 0)
+		return;
+
+	if (interval_ms < TWOPENCE_PROTO_MIN_HEARTBEAT)
+		interval_ms = TWOPENCE_PROTO_MIN_HEARTBEAT;
+
+	if (conn->keepalive.send_timeout == 0 || interval_ms < conn->keepalive.send_timeout) {
+		twopence_debug("sending heartbeats every %u msec", interval_ms);
+		conn->keepalive.send_timeout = interval_ms;
+		twopence_sock_enable_xmit_ts(conn->client_sock);
+		twopence_conn_update_send_keepalive(conn);
+	}
+}
+
+void
+twopence_conn_expect_heartbeats(twopence_conn_t *conn, unsigned int interval_ms)
+{
+	if (interval_ms == 0)
+		return;
+
+	twopence_debug("expecting heartbeats every %u msec", interval_ms);
+	conn->keepalive.recv_timeout = TWOPENCE_HEARTBEAT_MISSED * interval_ms;
+	twopence_conn_update_recv_keepalive(conn);
+}
+
+/*
+ * Return the time (in msec) after which we declare an idle peer dead,
+ * or 0 if we do not check.
+ */
+unsigned int
+twopence_conn_get_dead_peer_timeout(const twopence_conn_t *conn)
+{
+	return conn->keepalive.recv_timeout;
+}
+
+/*
+ * Attach a freshly opened socket to a connection that was closed.
+ * We retain the transaction state, so that the status of transactions
+ * that completed before the link went down can still be collected.
+ * The caller is expected to set up keepalives again.
+ */
+void
+twopence_conn_reconnect(twopence_conn_t *conn, twopence_sock_t *client_sock, unsigned int client_id)
+{
+	assert(conn->client_sock == NULL);
+
+	conn->client_sock = client_sock;
+	conn->client_id = client_id;
+	memset(&conn->keepalive, 0, sizeof(conn->keepalive));
+}
+
 void
 twopence_conn_unlink(twopence_conn_t *conn)
 {
@@ -139,8 +238,13 @@ twopence_conn_unlink(twopence_conn_t *conn)
 void
 twopence_conn_close(twopence_conn_t *conn)
 {
-	if (conn->client_sock)
+	if (conn->client_sock) {
+		/* Fail the owner's transactions that were using this link,
+		 * before their socket pointer goes stale */
+		if (conn->owner)
+			twopence_conn_cancel_transactions_on_sock(conn->owner, conn->client_sock, TWOPENCE_TRANSPORT_ERROR);
 		twopence_sock_free(conn->client_sock);
+	}
 	conn->client_sock = NULL;
 }
 
@@ -170,7 +274,7 @@ twopence_conn_update_send_keepalive(twopence_conn_t *conn)
 	if (conn->keepalive.send_timeout != 0
 	 && conn->client_sock != NULL
 	 && twopence_sock_get_xmit_ts(conn->client_sock, &conn->keepalive.send_deadline))
-		conn->keepalive.send_deadline.tv_sec += conn->keepalive.send_timeout;
+		__twopence_timeval_add_msec(&conn->keepalive.send_deadline, conn->keepalive.send_timeout);
 }
 
 void
@@ -178,7 +282,7 @@ twopence_conn_update_recv_keepalive(twopence_conn_t *conn)
 {
 	if (conn->keepalive.recv_timeout != 0) {
 		gettimeofday(&conn->keepalive.recv_deadline, NULL);
-		conn->keepalive.recv_deadline.tv_sec += conn->keepalive.recv_timeout;
+		__twopence_timeval_add_msec(&conn->keepalive.recv_deadline, conn->keepalive.recv_timeout);
 	}
 }
 
@@ -220,8 +324,7 @@ twopence_conn_fill_poll(twopence_conn_t *conn, twopence_pollinfo_t *pinfo)
 	sock = conn->client_sock;
 	if (sock && twopence_sock_is_dead(sock)) {
 		twopence_debug("connection: client socket is dead, closing\n");
-		conn->client_sock = NULL;
-		twopence_sock_free(sock);
+		twopence_conn_close(conn);
 		return 0;
 	}
 
@@ -251,9 +354,15 @@ twopence_conn_fill_poll(twopence_conn_t *conn, twopence_pollinfo_t *pinfo)
 		twopence_timeout_update(&pinfo->timeout, &conn->keepalive.send_deadline);
 	}
 	if (!twopence_timeout_update(&pinfo->timeout, &conn->keepalive.recv_deadline)) {
-		twopence_log_error("link is idle for too long, closing");
-		twopence_conn_close(conn);
-		return 0;
+		/* If the application did not poll the link for a while, the
+		 * peer's keepalives may still be sitting unread in the socket
+		 * buffer. Receiving them restarts the deadline; a dead peer
+		 * has not sent anything, and is caught right away. */
+		if (sock == NULL || !twopence_sock_has_pending_input(sock)) {
+			twopence_log_error("link is idle for too long (%u msec), closing", conn->keepalive.recv_timeout);
+			twopence_conn_close(conn);
+			return 0;
+		}
 	}
 
 	/* Return the number of fds we've added */
@@ -289,12 +398,47 @@ twopence_conn_reap_transaction(twopence_conn_t *conn, int wait_for_xid)
 	return NULL;
 }
 
+/*
+ * Reap any completed transaction, except those of the given type.
+ */
+twopence_transaction_t *
+twopence_conn_reap_transaction_except(twopence_conn_t *conn, unsigned int type)
+{
+	twopence_transaction_t *rover;
+
+	for (rover = conn->done_transactions.head; rover != NULL; rover = rover->next) {
+		if (rover->type != type) {
+			twopence_transaction_unlink(rover);
+			return rover;
+		}
+	}
+	return NULL;
+}
+
 bool
 twopence_conn_has_pending_transactions(const twopence_conn_t *conn)
 {
 	return conn->transactions.head != NULL;
 }
 
+bool
+twopence_conn_has_pending_transactions_except(const twopence_conn_t *conn, unsigned int type)
+{
+	twopence_transaction_t *trans;
+
+	for (trans = conn->transactions.head; trans; trans = trans->next) {
+		if (trans->type != type)
+			return true;
+	}
+	return false;
+}
+
+bool
+twopence_conn_has_completed_transactions(const twopence_conn_t *conn)
+{
+	return conn->done_transactions.head != NULL;
+}
+
 static void
 twopence_conn_transaction_complete(twopence_conn_t *conn, twopence_transaction_t *trans)
 {
@@ -329,6 +473,62 @@ twopence_conn_cancel_transactions(twopence_conn_t *conn, int error)
 	}
 }
 
+/*
+ * Cancel only those transactions that use the given socket.
+ */
+void
+twopence_conn_cancel_transactions_on_sock(twopence_conn_t *conn, const twopence_sock_t *sock, int error)
+{
+	twopence_transaction_t *trans, *next;
+
+	for (trans = conn->transactions.head; trans; trans = next) {
+		next = trans->next;
+
+		if (trans->socket != sock)
+			continue;
+
+		twopence_debug("%s: link closed, cancelling transaction", twopence_transaction_describe(trans));
+		twopence_transaction_set_error(trans, error);
+		twopence_conn_transaction_complete(conn, trans);
+	}
+}
+
+/*
+ * Count the pending transactions of @conn that are carried by @link.
+ * If @type is not 0, only transactions of this type are counted.
+ */
+unsigned int
+twopence_conn_count_transactions(const twopence_conn_t *conn, const twopence_conn_t *link, unsigned int type)
+{
+	twopence_transaction_t *trans;
+	unsigned int count = 0;
+
+	if (link->client_sock == NULL)
+		return 0;
+
+	for (trans = conn->transactions.head; trans; trans = trans->next) {
+		if (trans->socket == link->client_sock && (type == 0 || trans->type == type))
+			count++;
+	}
+	return count;
+}
+
+/*
+ * Count the bytes received so far by the pending chat transactions of @conn
+ */
+unsigned int
+twopence_conn_chat_bytes_received(const twopence_conn_t *conn)
+{
+	twopence_transaction_t *trans;
+	unsigned int count = 0;
+
+	for (trans = conn->transactions.head; trans; trans = trans->next) {
+		if (trans->client.chat)
+			count += trans->stats.nbytes_received;
+	}
+	return count;
+}
+
 /*
  * Find the transaction corresponding to a given XID.
  */
@@ -345,10 +545,117 @@ twopence_conn_find_transaction(twopence_conn_t *conn, uint16_t xid)
 	return NULL;
 }
 
+/*
+ * Check whether the transaction with the given XID has completed, but
+ * has not been reaped yet.
+ */
+bool
+twopence_conn_has_completed_transaction(const twopence_conn_t *conn, uint16_t xid)
+{
+	twopence_transaction_t *trans;
+
+	for (trans = conn->done_transactions.head; trans; trans = trans->next) {
+		if (trans->id == xid)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Allocate a transaction ID.
+ * We hand out IDs in increasing order, wrapping around at 65535. IDs that are
+ * still in use by a pending (or completed, but not yet reaped) transaction
+ * are skipped, as is 0.
+ * Returns 0 if all IDs are in use.
+ */
+static uint16_t
+twopence_conn_alloc_xid(twopence_conn_t *conn)
+{
+	unsigned int i, word, xid;
+	uint32_t free_bits;
+
+	xid = (conn->xid.last + 1) & 0xFFFF;
+	word = TWOPENCE_XID_MAP_WORD(xid);
+
+	/* In the first word, ignore all IDs below the one we start with */
+	free_bits = ~conn->xid.map[word] & ~(TWOPENCE_XID_MAP_BIT(xid) - 1);
+
+	/* Note, we loop over the first word twice - the second time around,
+	 * we look at the IDs we ignored initially. */
+	for (i = 0; i <= TWOPENCE_XID_MAP_WORDS; ++i) {
+		if (free_bits) {
+			xid = word * 32 + __builtin_ctz(free_bits);
+			conn->xid.map[word] |= TWOPENCE_XID_MAP_BIT(xid);
+			conn->xid.last = xid;
+			return xid;
+		}
+
+		word = (word + 1) % TWOPENCE_XID_MAP_WORDS;
+		free_bits = ~conn->xid.map[word];
+	}
+
+	return 0;
+}
+
+static void
+twopence_conn_release_xid(twopence_conn_t *conn, uint16_t xid)
+{
+	if (xid != 0)
+		conn->xid.map[TWOPENCE_XID_MAP_WORD(xid)] &= ~TWOPENCE_XID_MAP_BIT(xid);
+}
+
+/*
+ * Create a new client side transaction.
+ * The transaction ID in @ps is ignored; we allocate a unique one instead.
+ */
 twopence_transaction_t *
 twopence_conn_transaction_new(twopence_conn_t *conn, unsigned int type, const twopence_protocol_state_t *ps)
 {
-	return twopence_transaction_new(conn->client_sock, type, ps);
+	twopence_protocol_state_t trans_ps = *ps;
+
+	trans_ps.xid = twopence_conn_alloc_xid(conn);
+	if (trans_ps.xid == 0) {
+		twopence_log_error("unable to create transaction: all transaction IDs in use");
+		return NULL;
+	}
+
+	return twopence_transaction_new(conn->client_sock, type, &trans_ps);
+}
+
+/*
+ * Make a secondary link carry transactions on behalf of @owner.
+ * Packets received on the link are matched against the owner's
+ * transactions.
+ */
+void
+twopence_conn_set_owner(twopence_conn_t *conn, twopence_conn_t *owner)
+{
+	conn->owner = owner;
+}
+
+/*
+ * Move a transaction that has not been started yet over to @link.
+ * The server assigned each link its own client ID, so the
+ * transaction has to use that one, too.
+ */
+void
+twopence_conn_assign_transaction(const twopence_conn_t *link, twopence_transaction_t *trans)
+{
+	trans->socket = link->client_sock;
+	trans->ps.cid = link->client_id;
+}
+
+/*
+ * Free a transaction created via twopence_conn_transaction_new,
+ * and release its transaction ID.
+ */
+void
+twopence_conn_transaction_free(twopence_conn_t *conn, twopence_transaction_t *trans)
+{
+	if (conn)
+		twopence_conn_release_xid(conn, trans->id);
+	twopence_transaction_free(trans);
 }
 
 static bool
@@ -357,19 +664,21 @@ twopence_conn_process_hello(twopence_conn_t *conn, const twopence_hdr_t *hdr,
 {
 	unsigned char client_version[2];
 	unsigned int his_keepalive, my_keepalive;
+	unsigned int heartbeat;
 
-	if (!twopence_protocol_dissect_hello_packet(payload, client_version, &his_keepalive)) {
+	if (!twopence_protocol_dissect_hello_packet(payload, client_version, &his_keepalive, &heartbeat)) {
 		twopence_debug("bad HELLO packet from client");
 		client_version[0] = client_version[1] = 0;
 		his_keepalive = 0;
+		heartbeat = 0;
 	}
 
-	twopence_debug("hello/%u received from client (version %u.%u, keepalive=%u)",
-			ps->xid, client_version[0], client_version[1], his_keepalive);
+	twopence_debug("hello/%u received from client (version %u.%u, keepalive=%u, heartbeat=%u)",
+			ps->xid, client_version[0], client_version[1], his_keepalive, heartbeat);
 
 	if (his_keepalive == 0xFFFF)
 		his_keepalive = TWOPENCE_PROTO_DEFAULT_KEEPALIVE;
-	my_keepalive = conn->keepalive.recv_timeout;
+	my_keepalive = conn->keepalive.recv_timeout / 1000;
 
 	/* Use the smaller of the two keepalive values. Note that the client
 	 * may also disable keepalives by asking for a value of 0. */
@@ -377,8 +686,15 @@ twopence_conn_process_hello(twopence_conn_t *conn, const twopence_hdr_t *hdr,
 		my_keepalive = his_keepalive;
 	twopence_conn_set_keepalive(conn, my_keepalive);
 
+	/* The client asked for heartbeats; tell it what interval we picked */
+	if (heartbeat != 0) {
+		if (heartbeat < TWOPENCE_PROTO_MIN_HEARTBEAT)
+			heartbeat = TWOPENCE_PROTO_MIN_HEARTBEAT;
+		twopence_conn_send_heartbeats(conn, heartbeat);
+	}
+
 	twopence_sock_queue_xmit(conn->client_sock,
-			twopence_protocol_build_hello_packet(conn->client_id, my_keepalive));
+			twopence_protocol_build_hello_packet(conn->client_id, my_keepalive, heartbeat));
 	return true;
 }
 
@@ -449,7 +765,7 @@ twopence_conn_process_packet(twopence_conn_t *conn, twopence_buf_t *bp)
 			continue;
 		}
 
-		trans = twopence_conn_find_transaction(conn, ps.xid);
+		trans = twopence_conn_find_transaction(conn->owner? conn->owner : conn, ps.xid);
 		if (trans != NULL) {
 			twopence_transaction_recv_packet(trans, hdr, &payload);
 		} else {
@@ -582,6 +898,23 @@ twopence_conn_pool_new(void)
 	return pool;
 }
 
+/*
+ * Destroy a connection pool. Connections still attached to it are
+ * handed to the close_connection callback.
+ */
+void
+twopence_conn_pool_free(twopence_conn_pool_t *pool)
+{
+	twopence_conn_t *conn;
+
+	while ((conn = pool->connections.head) != NULL) {
+		twopence_conn_unlink(conn);
+		if (pool->callbacks.close_connection)
+			pool->callbacks.close_connection(conn);
+	}
+	free(pool);
+}
+
 void
 twopence_conn_pool_set_callback_close_connection(twopence_conn_pool_t *pool, void (*cb)(twopence_conn_t *))
 {
@@ -594,16 +927,14 @@ twopence_conn_pool_add_connection(twopence_conn_pool_t *pool, twopence_conn_t *c
 	twopence_conn_list_insert(&pool->connections, conn);
 }
 
-bool
-twopence_conn_pool_poll(twopence_conn_pool_t *pool)
+/*
+ * Return the maximum number of fds the pool may want to poll
+ */
+unsigned int
+twopence_conn_pool_max_fds(const twopence_conn_pool_t *pool)
 {
-	twopence_pollinfo_t poll_info;
-	twopence_conn_t *conn, *next;
+	twopence_conn_t *conn;
 	unsigned int maxfds = 0;
-	sigset_t mask;
-
-	if (pool->connections.head == NULL)
-		return false;
 
 	for (conn = pool->connections.head; conn; conn = conn->next) {
 		twopence_transaction_t *trans;
@@ -612,19 +943,28 @@ twopence_conn_pool_poll(twopence_conn_pool_t *pool)
 		for (trans = conn->transactions.head; trans; trans = trans->next)
 			maxfds += twopence_transaction_num_channels(trans);
 	}
+	return maxfds;
+}
 
-	twopence_pollinfo_init(&poll_info, alloca(maxfds * sizeof(struct pollfd)), maxfds);
+/*
+ * Collect the fds and the timeout the pool wants to wait for.
+ * Returns false if there are no connections left.
+ */
+bool
+twopence_conn_pool_fill_poll(twopence_conn_pool_t *pool, twopence_pollinfo_t *pinfo)
+{
+	twopence_conn_t *conn, *next;
 
 	/* Check the regular timers.
 	 * Note, if any of them has expired, we will set pinfo->timeout.expired.
 	 * This will cause us to pass a timeout value of 0 to ppoll() later
 	 * in twopence_pollinfo_ppoll() */
-	twopence_timers_update_timeout(&poll_info.timeout);
+	twopence_timers_update_timeout(&pinfo->timeout);
 
 	for (conn = pool->connections.head; conn; conn = next) {
 		next = conn->next;
 
-		if (twopence_conn_fill_poll(conn, &poll_info) == 0) {
+		if (twopence_conn_fill_poll(conn, pinfo) == 0) {
 			if (conn->client_sock == NULL) {
 				twopence_conn_unlink(conn);
 
@@ -641,11 +981,17 @@ twopence_conn_pool_poll(twopence_conn_pool_t *pool)
 		return false;
 	}
 
-	/* Query the current sigprocmask, and allow SIGCHLD while we're polling */
-	sigprocmask(SIG_BLOCK, NULL, &mask);
-	sigdelset(&mask, SIGCHLD);
+	return true;
+}
 
-	(void) twopence_pollinfo_ppoll(&poll_info, &mask);
+/*
+ * Process the poll results that twopence_conn_pool_fill_poll() asked for,
+ * and run any expired timers.
+ */
+bool
+twopence_conn_pool_doio(twopence_conn_pool_t *pool)
+{
+	twopence_conn_t *conn;
 
 	for (conn = pool->connections.head; conn; conn = conn->next) {
 		int rc;
@@ -671,3 +1017,28 @@ twopence_conn_pool_poll(twopence_conn_pool_t *pool)
 	return !!pool->connections.head;
 }
 
+bool
+twopence_conn_pool_poll(twopence_conn_pool_t *pool)
+{
+	twopence_pollinfo_t poll_info;
+	unsigned int maxfds;
+	sigset_t mask;
+
+	if (pool->connections.head == NULL)
+		return false;
+
+	maxfds = twopence_conn_pool_max_fds(pool);
+	twopence_pollinfo_init(&poll_info, alloca(maxfds * sizeof(struct pollfd)), maxfds);
+
+	if (!twopence_conn_pool_fill_poll(pool, &poll_info))
+		return false;
+
+	/* Query the current sigprocmask, and allow SIGCHLD while we're polling */
+	sigprocmask(SIG_BLOCK, NULL, &mask);
+	sigdelset(&mask, SIGCHLD);
+
+	(void) twopence_pollinfo_ppoll(&poll_info, &mask);
+
+	return twopence_conn_pool_doio(pool);
+}
+
@@ -38,15 +38,23 @@ struct semantics {
 
 extern twopence_conn_t *	twopence_conn_new(twopence_conn_semantics_t *semantics, twopence_sock_t *sock, unsigned int client_id);
 extern void			twopence_conn_set_keepalive(twopence_conn_t *, int);
+extern void			twopence_conn_send_heartbeats(twopence_conn_t *, unsigned int interval_ms);
+extern void			twopence_conn_expect_heartbeats(twopence_conn_t *, unsigned int interval_ms);
+extern unsigned int		twopence_conn_get_dead_peer_timeout(const twopence_conn_t *);
+extern void			twopence_conn_reconnect(twopence_conn_t *, twopence_sock_t *sock, unsigned int client_id);
+extern void			twopence_conn_unlink(twopence_conn_t *);
 extern void			twopence_conn_free(twopence_conn_t *conn);
 extern unsigned int		twopence_conn_fill_poll(twopence_conn_t *conn, twopence_pollinfo_t *pinfo);
 extern int			twopence_conn_doio(twopence_conn_t *conn);
 extern bool			twopence_conn_process_packet(twopence_conn_t *conn, twopence_buf_t *bp);
 extern bool			twopence_conn_process(twopence_conn_t *conn);
 extern twopence_transaction_t *	twopence_conn_transaction_new(twopence_conn_t *, unsigned int type, const twopence_protocol_state_t *);
+extern void			twopence_conn_transaction_free(twopence_conn_t *, twopence_transaction_t *);
 extern int			twopence_conn_xmit_packet(twopence_conn_t *, twopence_buf_t *);
 extern twopence_sock_t *	twopence_conn_accept(twopence_conn_t *);
 extern void			twopence_conn_close(twopence_conn_t *conn);
+extern void			twopence_conn_set_owner(twopence_conn_t *conn, twopence_conn_t *owner);
+extern void			twopence_conn_assign_transaction(const twopence_conn_t *link, twopence_transaction_t *trans);
 extern bool			twopence_conn_is_closed(const twopence_conn_t *);
 extern void			twopence_conn_update_send_keepalive(twopence_conn_t *conn);
 extern void			twopence_conn_update_recv_keepalive(twopence_conn_t *conn);
@@ -54,13 +62,24 @@ extern void			twopence_conn_update_recv_keepalive(twopence_conn_t *conn);
 extern void			twopence_conn_add_transaction(twopence_conn_t *conn, twopence_transaction_t *trans);
 extern void			twopence_conn_add_transaction_done(twopence_conn_t *conn, twopence_transaction_t *trans);
 extern twopence_transaction_t *	twopence_conn_reap_transaction(twopence_conn_t *conn, int wait_for);
+extern twopence_transaction_t *	twopence_conn_reap_transaction_except(twopence_conn_t *conn, unsigned int type);
 extern twopence_transaction_t *	twopence_conn_find_transaction(twopence_conn_t *conn, uint16_t xid);
 extern bool			twopence_conn_has_pending_transactions(const twopence_conn_t *conn);
+extern bool			twopence_conn_has_pending_transactions_except(const twopence_conn_t *conn, unsigned int type);
+extern bool			twopence_conn_has_completed_transactions(const twopence_conn_t *conn);
+extern bool			twopence_conn_has_completed_transaction(const twopence_conn_t *conn, uint16_t xid);
 extern void			twopence_conn_cancel_transactions(twopence_conn_t *conn, int error);
+extern void			twopence_conn_cancel_transactions_on_sock(twopence_conn_t *conn, const twopence_sock_t *sock, int error);
+extern unsigned int		twopence_conn_count_transactions(const twopence_conn_t *conn, const twopence_conn_t *link, unsigned int type);
+extern unsigned int		twopence_conn_chat_bytes_received(const twopence_conn_t *conn);
 
 extern twopence_conn_pool_t *	twopence_conn_pool_new(void);
+extern void			twopence_conn_pool_free(twopence_conn_pool_t *pool);
 extern void			twopence_conn_pool_add_connection(twopence_conn_pool_t *pool, twopence_conn_t *conn);
 extern bool			twopence_conn_pool_poll(twopence_conn_pool_t *pool);
+extern unsigned int		twopence_conn_pool_max_fds(const twopence_conn_pool_t *pool);
+extern bool			twopence_conn_pool_fill_poll(twopence_conn_pool_t *pool, twopence_pollinfo_t *pinfo);
+extern bool			twopence_conn_pool_doio(twopence_conn_pool_t *pool);
 extern void			twopence_conn_pool_set_callback_close_connection(twopence_conn_pool_t *pool, void (*cb)(twopence_conn_t *));
 
 #endif /* CONNECTION_H */
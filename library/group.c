@@ -0,0 +1,624 @@
+/*
+Running the same command on many targets at once.
+
+
+Copyright (C) 2014-2015 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "twopence.h"
+#include "utils.h"
+
+/* Targets that cannot be hooked into our poll loop are
+ * checked for completed commands at least this often (in msec) */
+#define TWOPENCE_GROUP_POLL_INTERVAL	10
+
+enum {
+  TWOPENCE_GROUP_IDLE,
+  TWOPENCE_GROUP_RUNNING,
+  TWOPENCE_GROUP_DONE,
+};
+
+struct twopence_group_member {
+  twopence_group_result_t	result;
+
+  int				state;
+  int				pid;
+  bool				interrupted;
+  twopence_command_t		cmd;
+
+  /* When broadcasting a file: whether we're still feeding this target,
+   * and whether it has taken the current chunk */
+  bool				feeding;
+  bool				fed;
+
+  /* Our slice of the poll set */
+  twopence_target_pollslice_t	poll;
+};
+
+struct twopence_group {
+  unsigned int			count;
+  struct twopence_group_member *member;
+
+  unsigned int			concurrency;
+  bool				cancel_on_failure;
+
+  twopence_target_pollset_t	pollset;
+};
+
+twopence_group_t *
+twopence_group_new(void)
+{
+  return twopence_calloc(1, sizeof(twopence_group_t));
+}
+
+static void
+__twopence_group_member_reset(struct twopence_group_member *m)
+{
+  twopence_buf_destroy(&m->result.stdout_buf);
+  twopence_buf_destroy(&m->result.stderr_buf);
+  m->result.rc = 0;
+  memset(&m->result.status, 0, sizeof(m->result.status));
+}
+
+void
+twopence_group_free(twopence_group_t *group)
+{
+  unsigned int i;
+
+  for (i = 0; i < group->count; ++i)
+    __twopence_group_member_reset(&group->member[i]);
+  free(group->member);
+  twopence_target_pollset_destroy(&group->pollset);
+  free(group);
+}
+
+/*
+ * Add a target to the group. The group does not take ownership; the
+ * target must stay around for as long as the group is in use.
+ */
+void
+twopence_group_add_target(twopence_group_t *group, twopence_target_t *target)
+{
+  struct twopence_group_member *m;
+
+  group->member = twopence_realloc(group->member, (group->count + 1) * sizeof(group->member[0]));
+  m = &group->member[group->count++];
+  memset(m, 0, sizeof(*m));
+  m->result.target = target;
+}
+
+unsigned int
+twopence_group_count(const twopence_group_t *group)
+{
+  return group->count;
+}
+
+/*
+ * Run the command on at most @max targets at the same time.
+ * 0 means no limit.
+ */
+void
+twopence_group_set_concurrency(twopence_group_t *group, unsigned int max)
+{
+  group->concurrency = max;
+}
+
+void
+twopence_group_set_cancel_on_failure(twopence_group_t *group, bool cancel)
+{
+  group->cancel_on_failure = cancel;
+}
+
+const twopence_group_result_t *
+twopence_group_result(const twopence_group_t *group, unsigned int index)
+{
+  if (index >= group->count)
+    return NULL;
+  return &group->member[index].result;
+}
+
+static inline bool
+__twopence_group_result_failed(const twopence_group_result_t *res)
+{
+  return res->rc < 0 || res->status.major != 0 || res->status.minor != 0;
+}
+
+/*
+ * Start the command on one target. Each target gets a private copy of the
+ * command, with its output captured in the member's result buffers.
+ */
+static int
+__twopence_group_start(struct twopence_group_member *m, const twopence_command_t *tmpl)
+{
+  twopence_command_t *cmd = &m->cmd;
+  twopence_status_t status;
+  int rc;
+
+  twopence_command_init(cmd, tmpl->command);
+  twopence_command_ostreams_reset(cmd);
+  twopence_iostream_add_substream(&cmd->iostream[TWOPENCE_STDOUT],
+		  twopence_substream_new_buffer(&m->result.stdout_buf, true));
+  twopence_iostream_add_substream(&cmd->iostream[TWOPENCE_STDERR],
+		  twopence_substream_new_buffer(&m->result.stderr_buf, true));
+
+  cmd->user = tmpl->user;
+  cmd->timeout = tmpl->timeout;
+  cmd->request_tty = tmpl->request_tty;
+  cmd->background = true;
+  twopence_env_copy(&cmd->env, &tmpl->env);
+
+  rc = twopence_run_test(m->result.target, cmd, &status);
+  if (rc < 0) {
+    m->result.rc = rc;
+    m->state = TWOPENCE_GROUP_DONE;
+    twopence_command_destroy(cmd);
+    return rc;
+  }
+
+  m->pid = rc;
+  m->state = TWOPENCE_GROUP_RUNNING;
+  return 0;
+}
+
+static void
+__twopence_group_complete(struct twopence_group_member *m, int rc, const twopence_status_t *status)
+{
+  m->result.rc = rc;
+  if (rc < 0)
+    memset(&m->result.status, 0, sizeof(m->result.status));
+  else
+    m->result.status = *status;
+
+  /* A command we killed is reported as cancelled, unless it managed
+   * to finish successfully before the interrupt got there */
+  if (m->interrupted && rc >= 0 && __twopence_group_result_failed(&m->result))
+    m->result.rc = TWOPENCE_COMMAND_CANCELED_ERROR;
+  m->state = TWOPENCE_GROUP_DONE;
+  twopence_command_destroy(&m->cmd);
+}
+
+/*
+ * Waiting for several targets at once.
+ * This is shared with the job scheduler.
+ */
+void
+twopence_target_pollset_reset(twopence_target_pollset_t *set)
+{
+  set->count = 0;
+  set->timeout_ms = -1;
+}
+
+void
+twopence_target_pollset_destroy(twopence_target_pollset_t *set)
+{
+  free(set->pfd);
+  memset(set, 0, sizeof(*set));
+}
+
+/*
+ * Add the fds of @target to the poll set, and fold in its timeout. On return,
+ * *slice tells where its fds are; it is 0 entries long if the target
+ * cannot be hooked into a poll loop, in which case we check it regularly.
+ */
+void
+twopence_target_pollset_add(twopence_target_pollset_t *set, twopence_target_t *target, twopence_target_pollslice_t *slice)
+{
+  int count, tmo = -1;
+
+  while (true) {
+    count = twopence_target_get_pollfds(target, set->pfd + set->count, set->size - set->count, &tmo);
+    if (count < 0 || (unsigned int) count <= set->size - set->count)
+      break;
+
+    set->size = set->count + count + 16;
+    set->pfd = twopence_realloc(set->pfd, set->size * sizeof(struct pollfd));
+  }
+
+  slice->offset = set->count;
+  slice->count = 0;
+
+  if (count < 0) {
+    /* The target cannot tell us what to wait for. Check back regularly. */
+    tmo = TWOPENCE_GROUP_POLL_INTERVAL;
+  } else {
+    slice->count = count;
+    set->count += count;
+  }
+
+  if (tmo >= 0 && (set->timeout_ms < 0 || tmo < set->timeout_ms))
+    set->timeout_ms = tmo;
+}
+
+int
+twopence_target_pollset_wait(twopence_target_pollset_t *set)
+{
+  if (poll(set->pfd, set->count, set->timeout_ms) < 0 && errno != EINTR) {
+    twopence_log_error("poll: %m");
+    return TWOPENCE_INTERNAL_ERROR;
+  }
+  return 0;
+}
+
+/*
+ * Pass the poll results on to the target they belong to
+ */
+void
+twopence_target_pollset_dispatch(twopence_target_pollset_t *set, twopence_target_t *target, const twopence_target_pollslice_t *slice)
+{
+  if (slice->count)
+    twopence_target_dispatch(target, set->pfd + slice->offset, slice->count);
+}
+
+/*
+ * Interrupt all commands that are still running, and make sure the
+ * ones that have not been started never are.
+ * Returns the number of commands that were never started.
+ */
+static unsigned int
+__twopence_group_cancel(twopence_group_t *group)
+{
+  unsigned int i, count = 0;
+
+  for (i = 0; i < group->count; ++i) {
+    struct twopence_group_member *m = &group->member[i];
+
+    if (m->state == TWOPENCE_GROUP_IDLE) {
+      m->result.rc = TWOPENCE_COMMAND_CANCELED_ERROR;
+      m->state = TWOPENCE_GROUP_DONE;
+      count++;
+    } else
+    if (m->state == TWOPENCE_GROUP_RUNNING && !m->interrupted) {
+      twopence_interrupt_pid(m->result.target, m->pid);
+      m->interrupted = true;
+    }
+  }
+  return count;
+}
+
+/*
+ * We cannot go on waiting for the commands that are still running. Kill
+ * them, and wait for the targets to report back before we destroy the
+ * commands their transactions refer to.
+ */
+static unsigned int
+__twopence_group_abort(twopence_group_t *group, int error)
+{
+  unsigned int i, count = 0;
+
+  for (i = 0; i < group->count; ++i) {
+    struct twopence_group_member *m = &group->member[i];
+    twopence_status_t status;
+
+    if (m->state != TWOPENCE_GROUP_RUNNING)
+      continue;
+
+    if (!m->interrupted) {
+      twopence_interrupt_pid(m->result.target, m->pid);
+      m->interrupted = true;
+    }
+
+    /* Each target runs only our command, so whatever completes is ours.
+     * If nothing is pending, the transaction has gone away already. */
+    memset(&status, 0, sizeof(status));
+    twopence_wait_many(m->result.target, 1, -1, &status);
+
+    __twopence_group_complete(m, error, &status);
+    count++;
+  }
+  return count;
+}
+
+/*
+ * Run a command on all targets of the group.
+ *
+ * Only the command line, user, timeout, tty flag and environment of @cmd
+ * are used; its I/O streams are not. Standard input of the remote commands
+ * is not connected, and their output is captured in the per-target results.
+ *
+ * Returns the number of targets on which the command failed (including
+ * the ones that were cancelled), or a negative error code.
+ */
+int
+twopence_group_run(twopence_group_t *group, const twopence_command_t *cmd)
+{
+  unsigned int i, next = 0, running = 0, failed = 0;
+  bool cancelled = false;
+  int rc;
+
+  if (cmd == NULL || cmd->command == NULL)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  for (i = 0; i < group->count; ++i) {
+    struct twopence_group_member *m = &group->member[i];
+
+    __twopence_group_member_reset(m);
+    m->state = TWOPENCE_GROUP_IDLE;
+    m->interrupted = false;
+  }
+
+  while (true) {
+
+    /* Start as many commands as we're allowed to */
+    while (next < group->count && (group->concurrency == 0 || running < group->concurrency)) {
+      struct twopence_group_member *m = &group->member[next++];
+
+      if (m->state != TWOPENCE_GROUP_IDLE)
+        continue;
+
+      if (__twopence_group_start(m, cmd) < 0) {
+        failed++;
+        if (group->cancel_on_failure && !cancelled) {
+          failed += __twopence_group_cancel(group);
+          cancelled = true;
+        }
+        continue;
+      }
+      running++;
+    }
+
+    if (running == 0)
+      break;
+
+    twopence_target_pollset_reset(&group->pollset);
+    for (i = 0; i < group->count; ++i) {
+      struct twopence_group_member *m = &group->member[i];
+
+      if (m->state == TWOPENCE_GROUP_RUNNING)
+        twopence_target_pollset_add(&group->pollset, m->result.target, &m->poll);
+    }
+
+    if ((rc = twopence_target_pollset_wait(&group->pollset)) < 0) {
+      failed += __twopence_group_abort(group, rc);
+      running = 0;
+      break;
+    }
+
+    for (i = 0; i < group->count; ++i) {
+      struct twopence_group_member *m = &group->member[i];
+      twopence_status_t status;
+
+      if (m->state != TWOPENCE_GROUP_RUNNING)
+        continue;
+
+      twopence_target_pollset_dispatch(&group->pollset, m->result.target, &m->poll);
+
+      /* Each target runs only our command, so whatever completes is ours */
+      rc = twopence_wait_many(m->result.target, 1, 0, &status);
+      if (rc == 0)
+        continue;
+
+      __twopence_group_complete(m, rc < 0? rc : 0, &status);
+      running--;
+
+      if (__twopence_group_result_failed(&m->result)) {
+        failed++;
+        if (group->cancel_on_failure && !cancelled) {
+          failed += __twopence_group_cancel(group);
+          cancelled = true;
+        }
+      }
+    }
+  }
+
+  /* Anything we did not get to is accounted as failed */
+  for (i = 0; i < group->count; ++i) {
+    struct twopence_group_member *m = &group->member[i];
+
+    if (m->state == TWOPENCE_GROUP_IDLE) {
+      m->result.rc = TWOPENCE_COMMAND_CANCELED_ERROR;
+      m->state = TWOPENCE_GROUP_DONE;
+      failed++;
+    } else if (m->state == TWOPENCE_GROUP_RUNNING) {
+      m->result.rc = TWOPENCE_TRANSPORT_ERROR;
+      twopence_command_destroy(&m->cmd);
+      m->state = TWOPENCE_GROUP_DONE;
+      failed++;
+    }
+  }
+
+  return failed;
+}
+
+/*
+ * Broadcasting a file.
+ *
+ * Hand the current chunk (or the EOF, if @chunk is NULL) to all targets that
+ * have not taken it yet. Returns the number of targets that cannot take it
+ * right now.
+ */
+static unsigned int
+__twopence_group_feed(twopence_group_t *group, twopence_buf_t *chunk)
+{
+  unsigned int i, waiting = 0;
+
+  for (i = 0; i < group->count; ++i) {
+    struct twopence_group_member *m = &group->member[i];
+    int rc;
+
+    if (!m->feeding || m->fed)
+      continue;
+
+    rc = twopence_inject_write(m->result.target, m->pid, chunk);
+    if (rc == 0) {
+      waiting++;
+      continue;
+    }
+
+    /* If the transfer failed, we will learn why when collecting its status */
+    if (rc < 0)
+      m->feeding = false;
+    m->fed = true;
+  }
+
+  return waiting;
+}
+
+/*
+ * Read the next chunk of the file. Returns NULL at the end of the file.
+ */
+static twopence_buf_t *
+__twopence_group_read_chunk(twopence_iostream_t *stream, int *error)
+{
+  twopence_buf_t *chunk;
+  int count;
+
+  chunk = twopence_buf_new(TWOPENCE_INJECT_CHUNK_MAX);
+  do {
+    count = twopence_iostream_read(stream, twopence_buf_tail(chunk), twopence_buf_tailroom(chunk));
+  } while (count < 0 && errno == EINTR);
+
+  if (count <= 0) {
+    if (count < 0) {
+      twopence_log_error("error reading file to broadcast: %m");
+      *error = TWOPENCE_LOCAL_FILE_ERROR;
+    }
+    twopence_buf_free(chunk);
+    return NULL;
+  }
+
+  twopence_buf_advance_tail(chunk, count);
+  return chunk;
+}
+
+/*
+ * Send the same file to all targets of the group.
+ *
+ * The local stream of @xfer is read only once. Every chunk is queued to all
+ * targets by reference, and freed once the last one has sent it.
+ *
+ * Returns the number of targets the transfer failed on, or a negative
+ * error code.
+ */
+int
+twopence_group_inject_file(twopence_group_t *group, twopence_file_xfer_t *xfer)
+{
+  unsigned int i, running = 0, feeding = 0, failed = 0;
+  twopence_buf_t *chunk = NULL;
+  bool pending = false, eof = false;
+  int read_error = 0;
+
+  if (xfer == NULL || xfer->local_stream == NULL || xfer->remote.name == NULL)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  for (i = 0; i < group->count; ++i) {
+    struct twopence_group_member *m = &group->member[i];
+    int xid;
+
+    __twopence_group_member_reset(m);
+    m->interrupted = false;
+    m->feeding = false;
+    m->pid = 0;
+
+    xid = twopence_inject_begin(m->result.target, xfer);
+    if (xid < 0) {
+      m->result.rc = xid;
+      m->state = TWOPENCE_GROUP_DONE;
+      failed++;
+      continue;
+    }
+
+    m->pid = xid;
+    m->state = TWOPENCE_GROUP_RUNNING;
+    m->feeding = true;
+    running++;
+  }
+
+  while (running != 0) {
+    twopence_status_t status;
+    int rc;
+
+    /* Once every target has taken the current chunk, read the next one.
+     * Once the EOF has been handed out, all that's left is waiting. */
+    if (!pending && !eof) {
+      for (i = 0, feeding = 0; i < group->count; ++i) {
+        group->member[i].fed = false;
+        if (group->member[i].feeding)
+          feeding++;
+      }
+
+      if (feeding)
+        chunk = __twopence_group_read_chunk(xfer->local_stream, &read_error);
+      pending = true;
+    }
+
+    if (pending && __twopence_group_feed(group, chunk) == 0) {
+      pending = false;
+      if (chunk == NULL)
+        eof = true;
+      else
+        twopence_buf_free(chunk);
+      chunk = NULL;
+      continue;
+    }
+
+    twopence_target_pollset_reset(&group->pollset);
+    for (i = 0; i < group->count; ++i) {
+      struct twopence_group_member *m = &group->member[i];
+
+      if (m->state == TWOPENCE_GROUP_RUNNING)
+        twopence_target_pollset_add(&group->pollset, m->result.target, &m->poll);
+    }
+
+    if (twopence_target_pollset_wait(&group->pollset) < 0)
+      break;
+
+    for (i = 0; i < group->count; ++i) {
+      struct twopence_group_member *m = &group->member[i];
+
+      if (m->state != TWOPENCE_GROUP_RUNNING)
+        continue;
+
+      twopence_target_pollset_dispatch(&group->pollset, m->result.target, &m->poll);
+
+      rc = twopence_wait_many(m->result.target, 1, 0, &status);
+      if (rc == 0)
+        continue;
+
+      m->result.rc = rc < 0? rc : 0;
+      if (rc > 0)
+        m->result.status = status;
+      m->state = TWOPENCE_GROUP_DONE;
+      m->feeding = false;
+      running--;
+    }
+  }
+
+  if (chunk)
+    twopence_buf_free(chunk);
+
+  for (i = 0; i < group->count; ++i) {
+    struct twopence_group_member *m = &group->member[i];
+
+    if (m->state == TWOPENCE_GROUP_RUNNING) {
+      m->result.rc = TWOPENCE_TRANSPORT_ERROR;
+      m->state = TWOPENCE_GROUP_DONE;
+    } else
+    if (m->pid && read_error && m->result.rc == 0) {
+      /* The targets got a truncated copy */
+      m->result.rc = read_error;
+    }
+
+    if (m->pid && __twopence_group_result_failed(&m->result))
+      failed++;
+  }
+
+  return failed;
+}
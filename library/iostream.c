@@ -40,8 +40,13 @@ struct twopence_io_ops {
 	int			(*set_blocking)(twopence_substream_t *, bool);
 	int			(*getfd)(twopence_substream_t *);
 	long			(*filesize)(twopence_substream_t *);
+
+	/* Optional; used instead of write() when the caller knows the channel */
+	int			(*write_chunk)(twopence_substream_t *, unsigned int channel, const void *, size_t);
 };
 
+static twopence_io_ops_t twopence_buffer_io;
+
 struct twopence_substream {
 	const twopence_io_ops_t *ops;
 	union {
@@ -53,6 +58,11 @@ struct twopence_substream {
 	        int		fd;
 		bool		close;
 	    };
+	    struct {
+	        twopence_iostream_callback_t *callback;
+	        twopence_iostream_producer_t *producer;
+		void *		user_data;
+	    };
 	};
 };
 
@@ -118,6 +128,28 @@ twopence_iostream_wrap_buffer(twopence_buf_t *bp, bool resizable, twopence_iostr
   return 0;
 }
 
+int
+twopence_iostream_wrap_callback(twopence_iostream_callback_t *fn, void *user_data, twopence_iostream_t **ret)
+{
+  if (fn == NULL)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  *ret = twopence_iostream_new();
+  twopence_iostream_add_substream(*ret, twopence_substream_new_callback(fn, user_data));
+  return 0;
+}
+
+int
+twopence_iostream_wrap_producer(twopence_iostream_producer_t *fn, void *user_data, twopence_iostream_t **ret)
+{
+  if (fn == NULL)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  *ret = twopence_iostream_new();
+  twopence_iostream_add_substream(*ret, twopence_substream_new_producer(fn, user_data));
+  return 0;
+}
+
 void
 twopence_iostream_add_substream(twopence_iostream_t *stream, twopence_substream_t *substream)
 {
@@ -271,6 +303,26 @@ twopence_iostream_getfd(twopence_iostream_t *stream)
   return -1;
 }
 
+/*
+ * Account the buffers this stream writes to against @budget. A buffer
+ * that is reused from an earlier command moves its charge over from the
+ * budget it had then. A NULL @budget stops accounting altogether.
+ */
+void
+twopence_iostream_set_budget(twopence_iostream_t *stream, twopence_buf_budget_t *budget)
+{
+  unsigned int i;
+
+  for (i = 0; i < stream->count; ++i) {
+    twopence_substream_t *substream = stream->substream[i];
+
+    if (substream->ops == &twopence_buffer_io
+     && substream->resizable
+     && substream->buffer->budget != budget)
+      twopence_buf_set_budget(substream->buffer, budget);
+  }
+}
+
 /*
  * Read from an iostream
  */
@@ -383,6 +435,15 @@ twopence_iostream_putc(twopence_iostream_t *stream, char c)
 
 int
 twopence_iostream_write(twopence_iostream_t *stream, const char *data, size_t len)
+{
+  return twopence_iostream_write_channel(stream, 0, data, len);
+}
+
+/*
+ * Write a chunk of data received on the given channel
+ */
+int
+twopence_iostream_write_channel(twopence_iostream_t *stream, unsigned int channel, const char *data, size_t len)
 {
   unsigned int i;
 
@@ -392,9 +453,14 @@ twopence_iostream_write(twopence_iostream_t *stream, const char *data, size_t le
   for (i = 0; i < stream->count; ++i) {
     twopence_substream_t *substream = stream->substream[i];
 
-    if (substream->ops == NULL || substream->ops->write == NULL)
+    if (substream->ops == NULL)
+      return -1;
+    if (substream->ops->write_chunk)
+      substream->ops->write_chunk(substream, channel, data, len);
+    else if (substream->ops->write)
+      substream->ops->write(substream, data, len);
+    else
       return -1;
-    substream->ops->write(substream, data, len);
   }
 
   return len;
@@ -594,6 +660,79 @@ twopence_substream_new_fd(int fd, bool closeit)
   return io;
 }
 
+/*
+ * Callback substreams.
+ * These hand every chunk of data to the application as it arrives, along
+ * with the channel it was received on and the time of arrival. Nothing
+ * is buffered.
+ */
+static int
+twopence_substream_callback_write_chunk(twopence_substream_t *sink, unsigned int channel, const void *data, size_t len)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  sink->callback(sink->user_data, channel, &now, data, len);
+  return len;
+}
+
+static int
+twopence_substream_callback_write(twopence_substream_t *sink, const void *data, size_t len)
+{
+  return twopence_substream_callback_write_chunk(sink, 0, data, len);
+}
+
+static twopence_io_ops_t twopence_callback_io = {
+	.write		= twopence_substream_callback_write,
+	.write_chunk	= twopence_substream_callback_write_chunk,
+};
+
+twopence_substream_t *
+twopence_substream_new_callback(twopence_iostream_callback_t *fn, void *user_data)
+{
+  twopence_substream_t *io;
+
+  io = __twopence_substream_new(&twopence_callback_io);
+  io->callback = fn;
+  io->user_data = user_data;
+  return io;
+}
+
+/*
+ * Producer substreams.
+ * These are the input side of callback substreams. Data is requested
+ * from the application only when the transport has room for it, and
+ * the application writes it straight into the packet buffer.
+ */
+static int
+twopence_substream_producer_read(twopence_substream_t *src, void *data, size_t len)
+{
+  return src->producer(src->user_data, data, len);
+}
+
+static int
+twopence_substream_producer_set_blocking(twopence_substream_t *src, bool blocking)
+{
+  /* We only ever call the producer when we want data */
+  return 0;
+}
+
+static twopence_io_ops_t twopence_producer_io = {
+	.read		= twopence_substream_producer_read,
+	.set_blocking	= twopence_substream_producer_set_blocking,
+};
+
+twopence_substream_t *
+twopence_substream_new_producer(twopence_iostream_producer_t *fn, void *user_data)
+{
+  twopence_substream_t *io;
+
+  io = __twopence_substream_new(&twopence_producer_io);
+  io->producer = fn;
+  io->user_data = user_data;
+  return io;
+}
+
 twopence_substream_t *
 twopence_iostream_stdout(void)
 {
@@ -0,0 +1,428 @@
+/*
+Client side job scheduling.
+
+Commands and file transfers are queued up front, with optional
+dependencies between them, and are run in the background on their
+targets as soon as their dependencies are satisfied.
+
+
+Copyright (C) 2014-2015 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "twopence.h"
+#include "utils.h"
+
+/* How many statuses we reap from a target in one go */
+#define TWOPENCE_JOBQ_REAP_MAX	16
+
+enum {
+  TWOPENCE_JOB_COMMAND,
+  TWOPENCE_JOB_INJECT,
+  TWOPENCE_JOB_EXTRACT,
+};
+
+enum {
+  TWOPENCE_JOB_PENDING,
+  TWOPENCE_JOB_RUNNING,
+  TWOPENCE_JOB_DONE,
+};
+
+struct twopence_jobq_target {
+  twopence_target_t *		target;
+  unsigned int			running;
+  twopence_target_pollslice_t	poll;
+};
+
+struct twopence_job {
+  unsigned int			index;
+  int				type;
+  int				state;
+  unsigned int			target;
+
+  twopence_command_t *		cmd;
+  twopence_file_xfer_t *	xfer;
+
+  unsigned int			ndeps;
+  twopence_job_t **		deps;
+
+  int				pid;
+  int				rc;
+  twopence_status_t		status;
+};
+
+struct twopence_jobq {
+  unsigned int			concurrency;
+
+  unsigned int			njobs;
+  twopence_job_t **		jobs;
+
+  unsigned int			ntargets;
+  struct twopence_jobq_target *	targets;
+
+  twopence_target_pollset_t	pollset;
+
+  /* Jobs that failed or were skipped during the current run */
+  unsigned int			failed;
+};
+
+twopence_jobq_t *
+twopence_jobq_new(void)
+{
+  return twopence_calloc(1, sizeof(twopence_jobq_t));
+}
+
+void
+twopence_jobq_free(twopence_jobq_t *q)
+{
+  unsigned int i;
+
+  for (i = 0; i < q->njobs; ++i) {
+    free(q->jobs[i]->deps);
+    free(q->jobs[i]);
+  }
+  free(q->jobs);
+  free(q->targets);
+  twopence_target_pollset_destroy(&q->pollset);
+  free(q);
+}
+
+/*
+ * Run at most @max jobs on any one target at the same time. 0 means
+ * no limit.
+ */
+void
+twopence_jobq_set_concurrency(twopence_jobq_t *q, unsigned int max)
+{
+  q->concurrency = max;
+}
+
+static unsigned int
+__twopence_jobq_target_index(twopence_jobq_t *q, twopence_target_t *target)
+{
+  unsigned int i;
+
+  for (i = 0; i < q->ntargets; ++i) {
+    if (q->targets[i].target == target)
+      return i;
+  }
+
+  q->targets = twopence_realloc(q->targets, (q->ntargets + 1) * sizeof(q->targets[0]));
+  memset(&q->targets[q->ntargets], 0, sizeof(q->targets[0]));
+  q->targets[q->ntargets].target = target;
+  return q->ntargets++;
+}
+
+static twopence_job_t *
+__twopence_jobq_add(twopence_jobq_t *q, int type, twopence_target_t *target)
+{
+  twopence_job_t *job;
+
+  if (target == NULL)
+    return NULL;
+
+  job = twopence_calloc(1, sizeof(*job));
+  job->index = q->njobs;
+  job->type = type;
+  job->state = TWOPENCE_JOB_PENDING;
+  job->target = __twopence_jobq_target_index(q, target);
+
+  q->jobs = twopence_realloc(q->jobs, (q->njobs + 1) * sizeof(q->jobs[0]));
+  q->jobs[q->njobs++] = job;
+  return job;
+}
+
+/*
+ * Queue a command or a file transfer. The command or xfer struct is not
+ * copied; it must stay around until the job has completed.
+ */
+twopence_job_t *
+twopence_jobq_add_command(twopence_jobq_t *q, twopence_target_t *target, twopence_command_t *cmd)
+{
+  twopence_job_t *job;
+
+  if (cmd == NULL || (job = __twopence_jobq_add(q, TWOPENCE_JOB_COMMAND, target)) == NULL)
+    return NULL;
+  job->cmd = cmd;
+  return job;
+}
+
+twopence_job_t *
+twopence_jobq_add_inject(twopence_jobq_t *q, twopence_target_t *target, twopence_file_xfer_t *xfer)
+{
+  twopence_job_t *job;
+
+  if (xfer == NULL || (job = __twopence_jobq_add(q, TWOPENCE_JOB_INJECT, target)) == NULL)
+    return NULL;
+  job->xfer = xfer;
+  return job;
+}
+
+twopence_job_t *
+twopence_jobq_add_extract(twopence_jobq_t *q, twopence_target_t *target, twopence_file_xfer_t *xfer)
+{
+  twopence_job_t *job;
+
+  if (xfer == NULL || (job = __twopence_jobq_add(q, TWOPENCE_JOB_EXTRACT, target)) == NULL)
+    return NULL;
+  job->xfer = xfer;
+  return job;
+}
+
+/*
+ * Run @job only after @dep has completed successfully.
+ * @dep must have been queued before @job; this rules out cycles.
+ */
+int
+twopence_job_depends_on(twopence_job_t *job, twopence_job_t *dep)
+{
+  if (dep == NULL || dep->index >= job->index || job->state != TWOPENCE_JOB_PENDING)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  job->deps = twopence_realloc(job->deps, (job->ndeps + 1) * sizeof(job->deps[0]));
+  job->deps[job->ndeps++] = dep;
+  return 0;
+}
+
+/*
+ * Return the outcome of a job: 0 if it ran, in which case its exit status
+ * is in @status, or a negative error code. Jobs that were skipped because a
+ * dependency failed report TWOPENCE_COMMAND_CANCELED_ERROR.
+ */
+int
+twopence_job_status(const twopence_job_t *job, twopence_status_t *status)
+{
+  if (job->state != TWOPENCE_JOB_DONE)
+    return TWOPENCE_INVALID_TRANSACTION;
+
+  if (status)
+    *status = job->status;
+  return job->rc;
+}
+
+static inline bool
+__twopence_job_failed(const twopence_job_t *job)
+{
+  return job->rc < 0 || job->status.major != 0 || job->status.minor != 0;
+}
+
+/*
+ * Check whether a pending job can be started.
+ * Returns 1 if so, 0 if it has to wait, and -1 if it never will.
+ */
+static int
+__twopence_job_ready(const twopence_job_t *job)
+{
+  unsigned int i;
+  int ready = 1;
+
+  for (i = 0; i < job->ndeps; ++i) {
+    const twopence_job_t *dep = job->deps[i];
+
+    if (dep->state != TWOPENCE_JOB_DONE)
+      ready = 0;
+    else if (__twopence_job_failed(dep))
+      return -1;
+  }
+  return ready;
+}
+
+static int
+__twopence_job_start(twopence_jobq_t *q, twopence_job_t *job)
+{
+  twopence_target_t *target = q->targets[job->target].target;
+  twopence_status_t status;
+  bool background;
+  int rc = TWOPENCE_PARAMETER_ERROR;
+
+  /* We borrow the caller's struct, and hand it back unchanged */
+  switch (job->type) {
+  case TWOPENCE_JOB_COMMAND:
+    background = job->cmd->background;
+    job->cmd->background = true;
+    rc = twopence_run_test(target, job->cmd, &status);
+    job->cmd->background = background;
+    break;
+
+  case TWOPENCE_JOB_INJECT:
+  case TWOPENCE_JOB_EXTRACT:
+    background = job->xfer->background;
+    job->xfer->background = true;
+    if (job->type == TWOPENCE_JOB_INJECT)
+      rc = twopence_send_file(target, job->xfer, &status);
+    else
+      rc = twopence_recv_file(target, job->xfer, &status);
+    job->xfer->background = background;
+    break;
+  }
+
+  if (rc <= 0) {
+    /* A background start must give us an ID to wait for */
+    job->rc = rc? rc : TWOPENCE_INTERNAL_ERROR;
+    job->state = TWOPENCE_JOB_DONE;
+    q->failed++;
+    return job->rc;
+  }
+
+  job->pid = rc;
+  job->state = TWOPENCE_JOB_RUNNING;
+  q->targets[job->target].running++;
+  return 0;
+}
+
+static void
+__twopence_job_complete(twopence_jobq_t *q, twopence_job_t *job, int rc, const twopence_status_t *status)
+{
+  job->rc = rc;
+  job->status = *status;
+  job->state = TWOPENCE_JOB_DONE;
+  q->targets[job->target].running--;
+
+  if (__twopence_job_failed(job))
+    q->failed++;
+}
+
+static twopence_job_t *
+__twopence_jobq_find_running(twopence_jobq_t *q, unsigned int target, int pid)
+{
+  unsigned int i;
+
+  for (i = 0; i < q->njobs; ++i) {
+    twopence_job_t *job = q->jobs[i];
+
+    if (job->state == TWOPENCE_JOB_RUNNING && job->target == target && job->pid == pid)
+      return job;
+  }
+  return NULL;
+}
+
+/*
+ * Collect whatever has completed on the target
+ */
+static void
+__twopence_jobq_reap(twopence_jobq_t *q, unsigned int target)
+{
+  twopence_target_t *handle = q->targets[target].target;
+  twopence_status_t statuses[TWOPENCE_JOBQ_REAP_MAX];
+  twopence_job_t *job;
+  int i, rc;
+
+  while (q->targets[target].running) {
+    rc = twopence_wait_many(handle, TWOPENCE_JOBQ_REAP_MAX, 0, statuses);
+    if (rc == 0)
+      break;
+
+    if (rc < 0) {
+      if ((job = __twopence_jobq_find_running(q, target, statuses[0].pid)) != NULL) {
+        __twopence_job_complete(q, job, rc, &statuses[0]);
+        continue;
+      }
+
+      /* We cannot tell which job this was. Give up on all of them. */
+      twopence_log_error("%s: %s", __func__, twopence_strerror(rc));
+      for (i = 0; i < (int) q->njobs; ++i) {
+        job = q->jobs[i];
+        if (job->state == TWOPENCE_JOB_RUNNING && job->target == target)
+          __twopence_job_complete(q, job, rc, &statuses[0]);
+      }
+      break;
+    }
+
+    for (i = 0; i < rc; ++i) {
+      if ((job = __twopence_jobq_find_running(q, target, statuses[i].pid)) != NULL)
+        __twopence_job_complete(q, job, 0, &statuses[i]);
+    }
+
+    if (rc < TWOPENCE_JOBQ_REAP_MAX)
+      break;
+  }
+}
+
+/*
+ * Run all pending jobs to completion.
+ *
+ * Jobs are started in the order they were queued, as soon as all their
+ * dependencies have succeeded and their target is below its concurrency
+ * limit. All targets are driven from a single event loop.
+ *
+ * Returns the number of jobs that failed or were skipped.
+ */
+int
+twopence_jobq_run(twopence_jobq_t *q)
+{
+  unsigned int i, running;
+
+  q->failed = 0;
+  while (true) {
+    running = 0;
+
+    for (i = 0; i < q->njobs; ++i) {
+      twopence_job_t *job = q->jobs[i];
+      struct twopence_jobq_target *t = &q->targets[job->target];
+      int ready;
+
+      if (job->state != TWOPENCE_JOB_PENDING)
+        continue;
+
+      /* Dependents always come later in the queue, so they see
+       * the outcome of this loop iteration right away */
+      if ((ready = __twopence_job_ready(job)) < 0) {
+        job->rc = TWOPENCE_COMMAND_CANCELED_ERROR;
+        job->state = TWOPENCE_JOB_DONE;
+        q->failed++;
+        continue;
+      }
+
+      if (ready == 0 || (q->concurrency && t->running >= q->concurrency))
+        continue;
+
+      (void) __twopence_job_start(q, job);
+    }
+
+    for (i = 0; i < q->ntargets; ++i)
+      running += q->targets[i].running;
+
+    /* Dependencies only ever point backwards, so once nothing is running,
+     * nothing is left to start either. */
+    if (running == 0)
+      break;
+
+    twopence_target_pollset_reset(&q->pollset);
+    for (i = 0; i < q->ntargets; ++i) {
+      struct twopence_jobq_target *t = &q->targets[i];
+
+      if (t->running)
+        twopence_target_pollset_add(&q->pollset, t->target, &t->poll);
+    }
+
+    if (twopence_target_pollset_wait(&q->pollset) < 0)
+      return TWOPENCE_INTERNAL_ERROR;
+
+    for (i = 0; i < q->ntargets; ++i) {
+      struct twopence_jobq_target *t = &q->targets[i];
+
+      if (t->running == 0)
+        continue;
+
+      twopence_target_pollset_dispatch(&q->pollset, t->target, &t->poll);
+      __twopence_jobq_reap(q, i);
+    }
+  }
+
+  return q->failed;
+}
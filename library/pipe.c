@@ -22,6 +22,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+#ifndef __APPLE__
+#include <sys/eventfd.h>
+#endif
 
 #include "twopence.h"
 #include "protocol.h"
@@ -29,10 +36,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "pipe.h"
 #include "utils.h"
 
-static int				__twopence_pipe_handshake(twopence_sock_t *sock, unsigned int *client_id, unsigned int *keepalive);
+static int				__twopence_pipe_handshake(twopence_sock_t *sock, unsigned int *client_id, unsigned int *keepalive, unsigned int *heartbeat, int timeout_ms);
 static void				__twopence_pipe_end_transaction(twopence_conn_t *, twopence_transaction_t *);
-
-static twopence_conn_pool_t *		twopence_pipe_connection_pool;
+static int				__twopence_pipe_doio(struct twopence_pipe_target *);
+static void				__twopence_pipe_enter(struct twopence_pipe_target *);
+static void				__twopence_pipe_leave(struct twopence_pipe_target *);
 
 static twopence_conn_semantics_t	twopence_client_semantics = {
 	.end_transaction	= __twopence_pipe_end_transaction,
@@ -50,6 +58,7 @@ twopence_pipe_target_init(struct twopence_pipe_target *target, int plugin_type,
   target->base.plugin_type = plugin_type;
   target->base.ops = plugin_ops;
   target->keepalive = -1;
+  target->nlinks = 1;
   target->link_ops = link_ops;
 }
 
@@ -73,60 +82,258 @@ _twopence_invalid_username(const char *username)
   return false;
 }
 
+/* When reconnecting, we start probing the link every 10 msec, and back off
+ * exponentially to at most 500 msec between attempts. When keeping the
+ * link warm, the I/O thread gives up after this many failed attempts. */
+#define TWOPENCE_PIPE_RECONNECT_MIN_DELAY	10
+#define TWOPENCE_PIPE_RECONNECT_MAX_DELAY	500
+#define TWOPENCE_PIPE_RECONNECT_MAX_ATTEMPTS	32
+
 /*
  * Wrap the link functions
+ *
+ * Open link @index and perform the HELLO handshake.
  */
-static int
-__twopence_pipe_open_link(struct twopence_pipe_target *handle)
+static twopence_sock_t *
+__twopence_pipe_connect_link(struct twopence_pipe_target *handle, unsigned int index, int timeout_ms,
+		unsigned int *client_id, unsigned int *keepalive, unsigned int *heartbeat)
 {
-  if (handle->connection && twopence_conn_is_closed(handle->connection))
-    return TWOPENCE_TRANSPORT_ERROR;
+  twopence_sock_t *sock;
+
+  /* The socket we are given should be set up for blocking I/O */
+  sock = handle->link_ops->open(handle, index);
+  if (sock == NULL)
+    return NULL;
+
+  *client_id = 0;
+  *heartbeat = handle->heartbeat;
+  if (handle->keepalive < 0)
+    *keepalive = 0xFFFF;		/* request keepalive but accept server's pick */
+  else
+    *keepalive = handle->keepalive;
+  twopence_debug("using keepalive=%u", (int) *keepalive);
+
+  if (__twopence_pipe_handshake(sock, client_id, keepalive, heartbeat, timeout_ms) < 0) {
+    twopence_sock_free(sock);
+    return NULL;
+  }
 
-  if (handle->connection == NULL) {
-    unsigned int client_id = 0;
-    unsigned int keepalive = 0;
+  twopence_debug("link %u: handshake complete, my client id is %d, keepalive is %u", index, *client_id, *keepalive);
+  twopence_sock_set_ratelimit(sock, &handle->xmit_limit, &handle->recv_limit);
+  return sock;
+}
+
+/*
+ * Apply the negotiated liveness settings to a connection, and hand it to the event loop
+ */
+static void
+__twopence_pipe_setup_link(struct twopence_pipe_target *handle, twopence_conn_t *conn, unsigned int keepalive, unsigned int heartbeat)
+{
+  /* If keepalive is -2, ignore the result of the keepalive negotiation and
+   * force them to off.
+   * This only exists so that we can test that keepalives work */
+  if (handle->keepalive == -2)
+    keepalive = 0;
+
+  twopence_conn_set_keepalive(conn, keepalive);
+
+  /* Older servers do not know about heartbeats and will not send any */
+  if (handle->heartbeat && heartbeat == 0)
+    twopence_debug("server does not support heartbeats, using regular keepalives");
+  twopence_conn_expect_heartbeats(conn, heartbeat);
+
+  if (handle->pool == NULL) {
+    handle->pool = twopence_conn_pool_new();
+    twopence_conn_pool_set_callback_close_connection(handle->pool, NULL);
+  }
+
+  twopence_conn_pool_add_connection(handle->pool, conn);
+}
+
+/*
+ * Bring up those secondary links that are not up yet. A link that
+ * cannot be opened is not fatal; we simply carry on with fewer links.
+ */
+static void
+__twopence_pipe_open_secondary_links(struct twopence_pipe_target *handle, int timeout_ms)
+{
+  unsigned int index;
+
+  for (index = 1; index < handle->nlinks; ++index) {
+    twopence_conn_t **linkp = &handle->secondary[index - 1];
+    unsigned int client_id, keepalive, heartbeat;
     twopence_sock_t *sock;
 
-    /* The socket we are given should be set up for blocking I/O */
-    sock = handle->link_ops->open(handle);
-    if (sock == NULL)
-      return TWOPENCE_OPEN_SESSION_ERROR;
+    if (*linkp && !twopence_conn_is_closed(*linkp))
+      continue;
 
-    if (handle->keepalive < 0)
-      keepalive = 0xFFFF;		/* request keepalive but accept server's pick */
-    else
-      keepalive = handle->keepalive;
-    twopence_debug("using keepalive=%u", (int) keepalive);
+    sock = __twopence_pipe_connect_link(handle, index, timeout_ms, &client_id, &keepalive, &heartbeat);
+    if (sock == NULL) {
+      twopence_log_error("unable to open link %u to the server, not using it", index);
+      continue;
+    }
 
-    if (__twopence_pipe_handshake(sock, &client_id, &keepalive) < 0) {
-      twopence_sock_free(sock);
-      return TWOPENCE_OPEN_SESSION_ERROR;
+    if (*linkp == NULL) {
+      *linkp = twopence_conn_new(&twopence_client_semantics, sock, client_id);
+      twopence_conn_set_owner(*linkp, handle->connection);
+    } else {
+      twopence_conn_unlink(*linkp);
+      twopence_conn_reconnect(*linkp, sock, client_id);
     }
 
-    twopence_debug("handshake complete, my client id is %d, keepalive is %u", client_id, keepalive);
+    __twopence_pipe_setup_link(handle, *linkp, keepalive, heartbeat);
+  }
+}
+
+/*
+ * Open the primary link. This doubles as our readiness probe: once
+ * the handshake succeeds, the server is up and talking to us.
+ */
+static int
+__twopence_pipe_probe_link(struct twopence_pipe_target *handle, int timeout_ms)
+{
+  unsigned int client_id, keepalive, heartbeat;
+  twopence_sock_t *sock;
+
+  sock = __twopence_pipe_connect_link(handle, 0, timeout_ms, &client_id, &keepalive, &heartbeat);
+  if (sock == NULL)
+    return TWOPENCE_OPEN_SESSION_ERROR;
+
+  if (handle->connection == NULL) {
     handle->connection = twopence_conn_new(&twopence_client_semantics, sock, client_id);
-    handle->ps.cid = client_id;
-    handle->ps.xid = 1;
+  } else {
+    /* We're reconnecting. Keep the connection object, so that the
+     * application can still reap the status of transactions that
+     * completed (or failed) before the link went down. */
+    twopence_conn_cancel_transactions(handle->connection, TWOPENCE_TRANSPORT_ERROR);
+    twopence_conn_unlink(handle->connection);
+    twopence_conn_reconnect(handle->connection, sock, client_id);
+  }
+  handle->ps.cid = client_id;
+  handle->disconnected = false;
+
+  __twopence_pipe_setup_link(handle, handle->connection, keepalive, heartbeat);
+
+  if (handle->nlinks > 1)
+    __twopence_pipe_open_secondary_links(handle, timeout_ms);
+  return 0;
+}
+
+static inline bool
+__twopence_pipe_link_is_up(const struct twopence_pipe_target *handle)
+{
+  return handle->connection && !twopence_conn_is_closed(handle->connection);
+}
+
+/*
+ * Probe the link until the server answers, backing off exponentially
+ * between attempts. A negative timeout waits forever.
+ */
+static int
+__twopence_pipe_wait_ready(struct twopence_pipe_target *handle, int timeout_ms)
+{
+  unsigned int delay = TWOPENCE_PIPE_RECONNECT_MIN_DELAY;
+  twopence_timer_t *timer = NULL;
+  int rc;
+
+  if (__twopence_pipe_link_is_up(handle))
+    return 0;
+
+  if (timeout_ms >= 0) {
+    if ((rc = twopence_timer_create(timeout_ms, &timer)) < 0)
+      return rc;
+    twopence_timer_hold(timer);
+  }
 
-    /* If keepalive is -2, ignore the result of the keepalive negotiation and
-     * force them to off.
-     * This only exists so that we can test that keepalives work */
-    if (handle->keepalive == -2)
-      keepalive = 0;
+  while (true) {
+    int remaining = -1;
+
+    if (timer)
+      remaining = twopence_timer_remaining(timer);
 
-    twopence_conn_set_keepalive(handle->connection, keepalive);
+    if ((rc = __twopence_pipe_probe_link(handle, remaining)) == 0)
+      break;
 
-    if (twopence_pipe_connection_pool == NULL) {
-      twopence_pipe_connection_pool = twopence_conn_pool_new();
-      twopence_conn_pool_set_callback_close_connection(twopence_pipe_connection_pool, NULL);
+    if (timer) {
+      remaining = twopence_timer_remaining(timer);
+      if (remaining == 0)
+        break;
+      if (delay > (unsigned int) remaining)
+        delay = remaining;
     }
 
-    twopence_conn_pool_add_connection(twopence_pipe_connection_pool, handle->connection);
+    twopence_debug("link not ready, retrying in %u msec", delay);
+    poll(NULL, 0, delay);
+
+    delay *= 2;
+    if (delay > TWOPENCE_PIPE_RECONNECT_MAX_DELAY)
+      delay = TWOPENCE_PIPE_RECONNECT_MAX_DELAY;
   }
 
+  if (timer) {
+    twopence_timer_cancel(timer);
+    twopence_timer_release(timer);
+  }
+  return rc;
+}
+
+/*
+ * Make a single attempt at bringing up the link, including any
+ * secondary links that are missing.
+ */
+static int
+__twopence_pipe_connect(struct twopence_pipe_target *handle, int timeout_ms)
+{
+  if (!__twopence_pipe_link_is_up(handle))
+    return __twopence_pipe_probe_link(handle, timeout_ms);
+
+  if (handle->nlinks > 1)
+    __twopence_pipe_open_secondary_links(handle, timeout_ms);
   return 0;
 }
 
+/*
+ * Process whatever is pending on the link, without blocking.
+ * This is how we notice a link that was closed while nobody was
+ * looking, before we try to send anything down the drain.
+ */
+static void
+__twopence_pipe_check_link(struct twopence_pipe_target *handle)
+{
+  twopence_timer_t *timer;
+  int rc;
+
+  if (twopence_timer_create(0, &timer) < 0)
+    return;
+  twopence_timer_hold(timer);
+
+  if ((rc = __twopence_pipe_doio(handle)) < 0)
+    twopence_conn_cancel_transactions(handle->connection, rc);
+
+  twopence_timer_cancel(timer);
+  twopence_timer_release(timer);
+}
+
+static int
+__twopence_pipe_open_link(struct twopence_pipe_target *handle)
+{
+  if (handle->reconnect != 0 && __twopence_pipe_link_is_up(handle))
+    __twopence_pipe_check_link(handle);
+
+  if (__twopence_pipe_link_is_up(handle))
+    return 0;
+
+  /* Unless the application asked us to reconnect, a link that went
+   * down stays down */
+  if (handle->reconnect == 0) {
+    if (handle->connection != NULL)
+      return TWOPENCE_TRANSPORT_ERROR;
+    return __twopence_pipe_probe_link(handle, -1);
+  }
+
+  return __twopence_pipe_wait_ready(handle, handle->reconnect);
+}
+
 /*
  * Transmit a single buffer.
  * This is synchronous for now
@@ -154,21 +361,43 @@ __twopence_pipe_send(struct twopence_pipe_target *handle, twopence_buf_t *bp)
  * Read a chunk (normally called a packet or frame) from the link
  */
 static twopence_buf_t *
-__twopence_pipe_read_packet(twopence_sock_t *sock)
+__twopence_pipe_read_packet(twopence_sock_t *sock, int timeout_ms)
 {
+  struct timeval deadline;
   twopence_buf_t *bp;
 
   bp = twopence_sock_get_recvbuf(sock);
 
+  /* The timeout applies to the packet as a whole, not to each read */
+  timerclear(&deadline);
+  if (timeout_ms >= 0) {
+    struct timeval delta;
+
+    gettimeofday(&deadline, NULL);
+    delta.tv_sec = timeout_ms / 1000;
+    delta.tv_usec = (timeout_ms % 1000) * 1000;
+    timeradd(&deadline, &delta, &deadline);
+  }
+
   /* Receive more data from the link until we have at least one
    * complete packet.
    * Note: we may receive more data than that.
    */
   while (!twopence_protocol_buffer_complete(bp)) {
-    int count;
+    int count, remaining = -1;
 
-    /* FIXME: heed the link timeout */
-    count = twopence_sock_recv_buffer_blocking(sock, bp);
+    if (timerisset(&deadline)) {
+      twopence_timeout_t tmo;
+
+      twopence_timeout_init(&tmo);
+      if (!twopence_timeout_update(&tmo, &deadline)) {
+        twopence_log_error("timed out waiting for packet on link");
+        return NULL;
+      }
+      remaining = twopence_timeout_msec(&tmo);
+    }
+
+    count = twopence_sock_recv_buffer_timeout(sock, bp, remaining);
     if (count == 0) {
       twopence_log_error("unexpected EOF on link");
       return NULL;
@@ -186,31 +415,31 @@ __twopence_pipe_read_packet(twopence_sock_t *sock)
  * Perform the initial exchange of HELLO packets
  */
 static int
-__twopence_pipe_handshake(twopence_sock_t *sock, unsigned int *client_id, unsigned int *line_timeout)
+__twopence_pipe_handshake(twopence_sock_t *sock, unsigned int *client_id, unsigned int *line_timeout, unsigned int *heartbeat, int timeout_ms)
 {
   twopence_buf_t *bp, payload;
   const twopence_hdr_t *hdr;
   twopence_protocol_state_t ps;
   unsigned char server_version[2];
-  unsigned int server_keepalive;
+  unsigned int server_keepalive, server_heartbeat;
   int rc = 0;
 
   /* Transmit and free the buffer */
-  rc = twopence_sock_xmit(sock, twopence_protocol_build_hello_packet(0, *line_timeout));
+  rc = twopence_sock_xmit(sock, twopence_protocol_build_hello_packet(0, *line_timeout, *heartbeat));
   if (rc < 0)
     return rc;
 
   twopence_sock_post_recvbuf_if_needed(sock, 4 * TWOPENCE_PROTO_MAX_PACKET);
 
-  if ((bp = __twopence_pipe_read_packet(sock)) == NULL)
+  if ((bp = __twopence_pipe_read_packet(sock, timeout_ms)) == NULL)
     return TWOPENCE_PROTOCOL_ERROR;
 
   memset(&ps, 0, sizeof(ps));
   if ((hdr = twopence_protocol_dissect_ps(bp, &payload, &ps)) != NULL
    && hdr->type == TWOPENCE_PROTO_TYPE_HELLO
-   && twopence_protocol_dissect_hello_packet(&payload, server_version, &server_keepalive)) {
-    twopence_debug("received server HELLO reply: version %u.%u, keepalive=%u",
-		    server_version[0], server_version[1], server_keepalive);
+   && twopence_protocol_dissect_hello_packet(&payload, server_version, &server_keepalive, &server_heartbeat)) {
+    twopence_debug("received server HELLO reply: version %u.%u, keepalive=%u, heartbeat=%u",
+		    server_version[0], server_version[1], server_keepalive, server_heartbeat);
     if (server_version[0] != TWOPENCE_PROTOCOL_VERSMAJOR
      || server_version[1] < TWOPENCE_PROTOCOL_VERSMINOR) {
       twopence_log_error("Protocol version not compatible. We use %u.%u, server uses %u.%u",
@@ -220,6 +449,7 @@ __twopence_pipe_handshake(twopence_sock_t *sock, unsigned int *client_id, unsign
     *client_id = ps.cid;
     if (*line_timeout == 0 || server_keepalive < *line_timeout)
       *line_timeout = server_keepalive;
+    *heartbeat = (*heartbeat != 0)? server_heartbeat : 0;
     rc = 0;
   } else {
     rc = TWOPENCE_PROTOCOL_ERROR;
@@ -228,9 +458,66 @@ __twopence_pipe_handshake(twopence_sock_t *sock, unsigned int *client_id, unsign
   return rc;
 }
 
+/*
+ * When there are several links to the server, pick the one a new
+ * transaction should go over.
+ *
+ * File transfers move large amounts of data in one direction, and
+ * would make any command sharing the link wait for its turn. So we
+ * keep them off the primary link whenever there is another one, and
+ * weigh them heavier than commands when looking for the least busy
+ * link. On a tie, we stay with the lower link number.
+ */
+#define TWOPENCE_PIPE_BULK_WEIGHT	8
+
+static inline bool
+__twopence_pipe_is_bulk_transfer(unsigned int type)
+{
+  return type == TWOPENCE_PROTO_TYPE_INJECT || type == TWOPENCE_PROTO_TYPE_EXTRACT;
+}
+
+static void
+__twopence_pipe_schedule_transaction(struct twopence_pipe_target *handle, twopence_transaction_t *trans)
+{
+  twopence_conn_t *best = NULL, *conn = handle->connection;
+  unsigned int index, best_load = ~0U;
+
+  for (index = 0; index < handle->nlinks; ++index) {
+    twopence_conn_t *link;
+    unsigned int load;
+
+    link = index? handle->secondary[index - 1] : conn;
+    if (link == NULL || twopence_conn_is_closed(link))
+      continue;
+
+    load = twopence_conn_count_transactions(conn, link, 0)
+         + (TWOPENCE_PIPE_BULK_WEIGHT - 1) * twopence_conn_count_transactions(conn, link, TWOPENCE_PROTO_TYPE_INJECT)
+         + (TWOPENCE_PIPE_BULK_WEIGHT - 1) * twopence_conn_count_transactions(conn, link, TWOPENCE_PROTO_TYPE_EXTRACT);
+
+    if (index == 0 && __twopence_pipe_is_bulk_transfer(trans->type)) {
+      /* Only use the primary link for this if nothing else is up */
+      best = link;
+      continue;
+    }
+
+    if (load < best_load) {
+      best = link;
+      best_load = load;
+    }
+  }
+
+  if (best != NULL && best != conn) {
+    twopence_debug("%s: using secondary link", twopence_transaction_describe(trans));
+    twopence_conn_assign_transaction(best, trans);
+  }
+}
+
 /*
  * Wrap command transaction state into a struct.
  * We may want to reuse the server side transaction code here, at some point.
+ *
+ * The connection assigns the transaction ID; it makes sure we never reuse an
+ * ID that belongs to a transaction that is still in flight.
  */
 static twopence_transaction_t *
 twopence_pipe_transaction_new(struct twopence_pipe_target *handle, unsigned int type)
@@ -238,11 +525,29 @@ twopence_pipe_transaction_new(struct twopence_pipe_target *handle, unsigned int
   twopence_transaction_t *trans;
 
   trans = twopence_conn_transaction_new(handle->connection, type, &handle->ps);
-  if (trans)
-	  handle->ps.xid++;
+  if (trans && handle->nlinks > 1)
+    __twopence_pipe_schedule_transaction(handle, trans);
   return trans;
 }
 
+/*
+ * Detached jobs only exist in the server process that started them, and
+ * every link of a multi-link target talks to a server of its own. Keep
+ * starting, listing and reattaching to jobs on the primary link, so that
+ * they all see the same jobs.
+ */
+static twopence_transaction_t *
+twopence_pipe_primary_transaction_new(struct twopence_pipe_target *handle, unsigned int type)
+{
+  return twopence_conn_transaction_new(handle->connection, type, &handle->ps);
+}
+
+static void
+twopence_pipe_transaction_free(struct twopence_pipe_target *handle, twopence_transaction_t *trans)
+{
+  twopence_conn_transaction_free(handle->connection, trans);
+}
+
 /*
  * A local source has hit EOF; send the EOF indication to the remote.
  */
@@ -320,16 +625,33 @@ __twopence_pipe_transaction_add_running(struct twopence_pipe_target *handle, two
   twopence_conn_add_transaction(handle->connection, trans);
 }
 
+/*
+ * An open file handle is a transaction that lasts until the application
+ * closes it. Waiting for any or all transactions leaves these alone;
+ * a handle that failed stays around until twopence_file_close() reaps it.
+ */
 static twopence_transaction_t *
 __twopence_pipe_get_completed_transaction(struct twopence_pipe_target *handle, int xid)
 {
+  if (xid == 0)
+    return twopence_conn_reap_transaction_except(handle->connection, TWOPENCE_PROTO_TYPE_FILE_OPEN);
   return twopence_conn_reap_transaction(handle->connection, xid);
 }
 
-int
+static bool
+__twopence_pipe_has_pending_transactions(struct twopence_pipe_target *handle)
+{
+  return twopence_conn_has_pending_transactions_except(handle->connection, TWOPENCE_PROTO_TYPE_FILE_OPEN);
+}
+
+static int
 __twopence_pipe_doio(struct twopence_pipe_target *handle)
 {
-  twopence_conn_pool_poll(twopence_pipe_connection_pool);
+  /* Any poll set handed out to the application refers to the
+   * socket state we're about to change */
+  handle->external_poll.valid = false;
+
+  twopence_conn_pool_poll(handle->pool);
   if (twopence_conn_is_closed(handle->connection))
     return TWOPENCE_TRANSPORT_ERROR;
 
@@ -402,6 +724,28 @@ receive_results_error:
   return true;
 }
 
+/*
+ * Callback function for transactions that report detached jobs:
+ * starting a job, and listing them.
+ */
+static bool
+__twopence_pipe_job_recv(twopence_transaction_t *trans, const twopence_hdr_t *hdr, twopence_buf_t *payload)
+{
+  twopence_detached_job_t job;
+
+  if (hdr->type != TWOPENCE_PROTO_TYPE_JOB)
+    return __twopence_pipe_command_recv(trans, hdr, payload);
+
+  if (!twopence_protocol_dissect_job_packet(payload, &job)) {
+    twopence_transaction_set_error(trans, TWOPENCE_RECEIVE_RESULTS_ERROR);
+    return true;
+  }
+
+  trans->client.jobs = twopence_realloc(trans->client.jobs, (trans->client.njobs + 1) * sizeof(job));
+  trans->client.jobs[trans->client.njobs++] = job;
+  return true;
+}
+
 /*
  * Callback function that handles incoming packets for a sendfile transaction.
  */
@@ -421,6 +765,7 @@ __twopence_pipe_inject_recv(twopence_transaction_t *trans, const twopence_hdr_t
     /* Unplug the local source file so that we can start the transfer */
     if ((source = trans->local_source) != NULL)
       twopence_transaction_channel_set_plugged(source, false);
+    trans->client.inject_ready = true;
     break;
 
   case TWOPENCE_PROTO_TYPE_MINOR:
@@ -444,9 +789,28 @@ __twopence_pipe_extract_recv(twopence_transaction_t *trans, const twopence_hdr_t
 {
   switch (hdr->type) {
   case TWOPENCE_PROTO_TYPE_MAJOR:
+    if (!twopence_protocol_dissect_major_packet(payload, &trans->client.status_ret.major))
+      goto recv_file_error;
+
+    /* A major status of 0 means we asked for a conditional
+     * transfer, and our copy of the file is still current */
+    if (trans->client.status_ret.major == 0) {
+      if (trans->client.extract_xfer == NULL || !trans->client.extract_xfer->if_changed)
+        goto recv_file_error;
+      twopence_debug("%s: remote file not modified", twopence_transaction_describe(trans));
+      trans->client.extract_xfer->not_modified = true;
+      trans->done = true;
+      break;
+    }
+
     /* Remote error occurred, usually when trying to open the file */
-    (void) twopence_protocol_dissect_major_packet(payload, &trans->client.status_ret.major);
-    twopence_transaction_set_error(trans, TWOPENCE_RECEIVE_FILE_ERROR);
+    goto recv_file_error;
+
+  case TWOPENCE_PROTO_TYPE_MTIME:
+    /* The server tells us the mtime of the file it is sending */
+    if (trans->client.extract_xfer == NULL
+     || !twopence_protocol_dissect_mtime_packet(payload, &trans->client.extract_xfer->remote_mtime))
+      goto recv_file_error;
     break;
 
   case TWOPENCE_PROTO_TYPE_CHAN_EOF:
@@ -455,10 +819,13 @@ __twopence_pipe_extract_recv(twopence_transaction_t *trans, const twopence_hdr_t
     break;
 
   default:
-    twopence_transaction_set_error(trans, TWOPENCE_RECEIVE_FILE_ERROR);
-    break;
+    goto recv_file_error;
   }
   return true;
+
+recv_file_error:
+  twopence_transaction_set_error(trans, TWOPENCE_RECEIVE_FILE_ERROR);
+  return true;
 }
 
 static void
@@ -491,15 +858,42 @@ __twopence_pipe_command(struct twopence_pipe_target *handle, twopence_command_t
   if (__twopence_pipe_open_link(handle) < 0)
     return TWOPENCE_OPEN_SESSION_ERROR;
 
-  trans = twopence_pipe_transaction_new(handle, TWOPENCE_PROTO_TYPE_COMMAND);
+  if (cmd->detach)
+    trans = twopence_pipe_primary_transaction_new(handle, TWOPENCE_PROTO_TYPE_COMMAND);
+  else
+    trans = twopence_pipe_transaction_new(handle, TWOPENCE_PROTO_TYPE_COMMAND);
+  if (trans == NULL)
+    return TWOPENCE_INVALID_TRANSACTION;
   trans->recv = __twopence_pipe_command_recv;
 
   // Send command packet
   if ((rc = twopence_transaction_send_command(trans, cmd)) < 0)
     goto out;
 
+  if (cmd->detach) {
+    /* The server answers right away, with the ID of the job
+     * it started. The job's output is spooled on the server. */
+    trans->recv = __twopence_pipe_job_recv;
+    __twopence_pipe_transaction_add_running(handle, trans);
+
+    handle->current_transaction = trans;
+    rc = __twopence_transaction_run(handle, trans, status_ret);
+    handle->current_transaction = NULL;
+
+    if (rc == 0 && status_ret->major == 0) {
+      /* A server that does not know about detached jobs
+       * runs the command to completion instead */
+      if (trans->client.njobs != 1)
+        rc = TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+      else
+        rc = trans->client.jobs[0].id;
+    }
+    goto out;
+  }
+
   if (cmd->timeout)
     twopence_transaction_set_timeout(trans, cmd->timeout);
+  trans->client.chat = cmd->keepopen_stdin;
 
   twopence_pipe_transaction_attach_stdin(trans, cmd);
   twopence_pipe_transaction_attach_stdout(trans, cmd);
@@ -520,15 +914,15 @@ __twopence_pipe_command(struct twopence_pipe_target *handle, twopence_command_t
   handle->current_transaction = NULL;
 
 out:
-  twopence_transaction_free(trans);
+  twopence_pipe_transaction_free(handle, trans);
   return rc;
 }
 
 /*
  * Chat scripting: send some data
  */
-int
-twopence_pipe_chat_send(twopence_target_t *opaque_handle, int xid, twopence_iostream_t *stream)
+static int
+__twopence_pipe_chat_send(twopence_target_t *opaque_handle, int xid, twopence_iostream_t *stream)
 {
   struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
   twopence_trans_channel_t *channel;
@@ -556,7 +950,19 @@ twopence_pipe_chat_send(twopence_target_t *opaque_handle, int xid, twopence_iost
 }
 
 int
-twopence_pipe_chat_recv(twopence_target_t *opaque_handle, int xid, const struct timeval *deadline)
+twopence_pipe_chat_send(twopence_target_t *opaque_handle, int xid, twopence_iostream_t *stream)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc;
+
+  __twopence_pipe_enter(handle);
+  rc = __twopence_pipe_chat_send(opaque_handle, xid, stream);
+  __twopence_pipe_leave(handle);
+  return rc;
+}
+
+static int
+__twopence_pipe_chat_recv(twopence_target_t *opaque_handle, int xid, const struct timeval *deadline)
 {
   struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
   twopence_transaction_t *trans;
@@ -588,6 +994,69 @@ twopence_pipe_chat_recv(twopence_target_t *opaque_handle, int xid, const struct
   return trans->stats.nbytes_received - nreceived;
 }
 
+int
+twopence_pipe_chat_recv(twopence_target_t *opaque_handle, int xid, const struct timeval *deadline)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc;
+
+  __twopence_pipe_enter(handle);
+  rc = __twopence_pipe_chat_recv(opaque_handle, xid, deadline);
+  __twopence_pipe_leave(handle);
+  return rc;
+}
+
+/*
+ * Check whether a chat command will produce any more output
+ */
+static int
+__twopence_pipe_chat_eof(twopence_target_t *opaque_handle, int xid)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  twopence_transaction_t *trans;
+
+  if (handle->connection == NULL)
+    return TWOPENCE_TRANSPORT_ERROR;
+
+  trans = twopence_conn_find_transaction(handle->connection, xid);
+  if (trans == NULL) {
+    /* The command exited and is waiting to be reaped */
+    if (twopence_conn_has_completed_transaction(handle->connection, xid))
+      return 1;
+    return TWOPENCE_INVALID_TRANSACTION;
+  }
+
+  return trans->done || trans->local_sink == NULL;
+}
+
+int
+twopence_pipe_chat_eof(twopence_target_t *opaque_handle, int xid)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc;
+
+  __twopence_pipe_enter(handle);
+  rc = __twopence_pipe_chat_eof(opaque_handle, xid);
+  __twopence_pipe_leave(handle);
+  return rc;
+}
+
+/*
+ * The I/O thread appends to a chat's receive buffer; keep it away while
+ * the application looks at the buffer
+ */
+void
+twopence_pipe_chat_lock(twopence_target_t *opaque_handle)
+{
+  __twopence_pipe_enter((struct twopence_pipe_target *) opaque_handle);
+}
+
+void
+twopence_pipe_chat_unlock(twopence_target_t *opaque_handle)
+{
+  __twopence_pipe_leave((struct twopence_pipe_target *) opaque_handle);
+}
+
 // Inject a file into the remote host
 //
 // Returns 0 if everything went fine
@@ -609,6 +1078,8 @@ __twopence_pipe_inject_file(struct twopence_pipe_target *handle, twopence_file_x
     return TWOPENCE_OPEN_SESSION_ERROR;
 
   trans = twopence_pipe_transaction_new(handle, TWOPENCE_PROTO_TYPE_INJECT);
+  if (trans == NULL)
+    return TWOPENCE_INVALID_TRANSACTION;
   trans->recv = __twopence_pipe_inject_recv;
 
   // Send inject command packet
@@ -625,38 +1096,458 @@ __twopence_pipe_inject_file(struct twopence_pipe_target *handle, twopence_file_x
 
   __twopence_pipe_transaction_add_running(handle, trans);
 
+  /* If we've been asked to do the transfer in the background,
+   * return its XID now. */
+  if (xfer->background) {
+    twopence_debug("backgrounding transaction %s", twopence_transaction_describe(trans));
+    return trans->id;
+  }
+
   rc = __twopence_transaction_run(handle, trans, status);
 
 out:
-  twopence_transaction_free(trans);
+  twopence_pipe_transaction_free(handle, trans);
   return rc;
 }
 
-// Extract a file from the remote host
-//
-// Returns 0 if everything went fine, or a negative error code if failed
+/*
+ * Start an inject transaction whose data is handed to us chunk by chunk
+ * through __twopence_pipe_inject_write(), rather than read from a local
+ * source. Returns the transaction ID.
+ */
 static int
-__twopence_pipe_extract_file(struct twopence_pipe_target *handle, twopence_file_xfer_t *xfer,
-				twopence_status_t *status)
+__twopence_pipe_inject_begin(struct twopence_pipe_target *handle, twopence_file_xfer_t *xfer)
 {
   twopence_transaction_t *trans;
-  twopence_trans_channel_t *sink;
   int rc;
 
-  // Check that the username is valid
   if (_twopence_invalid_username(xfer->user))
     return TWOPENCE_PARAMETER_ERROR;
-  if (xfer->remote.name == NULL)
-    return TWOPENCE_PARAMETER_ERROR;
 
-  // Open link for transmitting the command
   if (__twopence_pipe_open_link(handle) < 0)
     return TWOPENCE_OPEN_SESSION_ERROR;
 
-  trans = twopence_pipe_transaction_new(handle, TWOPENCE_PROTO_TYPE_EXTRACT);
-  trans->recv = __twopence_pipe_extract_recv;
+  trans = twopence_pipe_transaction_new(handle, TWOPENCE_PROTO_TYPE_INJECT);
+  if (trans == NULL)
+    return TWOPENCE_INVALID_TRANSACTION;
+  trans->recv = __twopence_pipe_inject_recv;
 
-  // Send command packet
+  if ((rc = twopence_transaction_send_inject(trans, xfer)) < 0) {
+    twopence_pipe_transaction_free(handle, trans);
+    return rc;
+  }
+
+  __twopence_pipe_transaction_add_running(handle, trans);
+  return trans->id;
+}
+
+/*
+ * Queue a chunk of data for an inject transaction. We do not copy it,
+ * but queue a reference. A NULL chunk ends the file.
+ *
+ * Returns 1 if the chunk was queued, 0 if we cannot take it yet, because
+ * the server has not accepted the transfer or the send queue is full.
+ */
+static int
+__twopence_pipe_inject_write(struct twopence_pipe_target *handle, int xid, twopence_buf_t *chunk)
+{
+  twopence_transaction_t *trans;
+  twopence_buf_t *bp;
+
+  if (handle->connection == NULL)
+    return TWOPENCE_TRANSPORT_ERROR;
+
+  trans = twopence_conn_find_transaction(handle->connection, xid);
+  if (trans == NULL || trans->type != TWOPENCE_PROTO_TYPE_INJECT)
+    return TWOPENCE_INVALID_TRANSACTION;
+
+  /* The transfer failed; the caller will learn why when collecting its status */
+  if (trans->done || trans->client.exception < 0)
+    return 1;
+
+  if (!trans->client.inject_ready || !twopence_sock_xmit_queue_allowed(trans->socket))
+    return 0;
+
+  if (chunk == NULL) {
+    twopence_transaction_send_client(trans, twopence_protocol_build_eof_packet(&trans->ps, 0));
+    return 1;
+  }
+
+  if (twopence_buf_count(chunk) == 0)
+    return 1;
+
+  bp = twopence_protocol_build_data_header_only(&trans->ps, 0, twopence_buf_count(chunk));
+  twopence_sock_queue_xmit(trans->socket, bp);
+  twopence_sock_xmit_ref(trans->socket, chunk);
+  return 1;
+}
+
+/*
+ * Callback function that handles incoming packets for a remote file handle
+ */
+static bool
+__twopence_pipe_file_recv(twopence_transaction_t *trans, const twopence_hdr_t *hdr, twopence_buf_t *payload)
+{
+  twopence_file_io_t *io;
+  uint32_t tag, result;
+  int status;
+
+  switch (hdr->type) {
+  case TWOPENCE_PROTO_TYPE_MAJOR:
+    if (!twopence_protocol_dissect_major_packet(payload, &trans->client.status_ret.major))
+      goto protocol_error;
+
+    /* A major status of 0 means the file is open */
+    if (trans->client.status_ret.major == 0 && !trans->client.file_ready) {
+      trans->client.file_ready = true;
+      break;
+    }
+
+    twopence_transaction_set_error(trans, TWOPENCE_REMOTE_FILE_ERROR);
+    break;
+
+  case TWOPENCE_PROTO_TYPE_MINOR:
+    /* The server closed the file */
+    if (!twopence_protocol_dissect_minor_packet(payload, &trans->client.status_ret.minor))
+      goto protocol_error;
+    trans->done = true;
+    break;
+
+  case TWOPENCE_PROTO_TYPE_FILE_REPLY:
+    if (!twopence_protocol_dissect_file_reply_packet(payload, &tag, &status, &result)
+     || tag >= trans->client.file_io_count)
+      goto protocol_error;
+
+    io = &trans->client.file_io[tag];
+    if (status != 0) {
+      io->result = TWOPENCE_REMOTE_FILE_ERROR;
+      io->remote_errno = status;
+    } else
+    if (io->op == TWOPENCE_FILE_PREAD) {
+      if (result > io->count || result != twopence_buf_count(payload))
+        goto protocol_error;
+      memcpy(io->data, twopence_buf_head(payload), result);
+      io->result = result;
+    } else
+    if (io->op == TWOPENCE_FILE_FSTAT) {
+      if (!twopence_protocol_dissect_file_stat(payload, (twopence_file_stat_t *) io->data))
+        goto protocol_error;
+      io->result = 0;
+    } else {
+      io->result = result;
+    }
+
+    if (trans->client.file_io_pending)
+      trans->client.file_io_pending--;
+    break;
+
+  default:
+    goto protocol_error;
+  }
+  return true;
+
+protocol_error:
+  twopence_transaction_set_error(trans, TWOPENCE_PROTOCOL_ERROR);
+  return true;
+}
+
+static twopence_transaction_t *
+__twopence_pipe_find_file_handle(struct twopence_pipe_target *handle, int fh)
+{
+  twopence_transaction_t *trans;
+
+  if (handle->connection == NULL)
+    return NULL;
+
+  trans = twopence_conn_find_transaction(handle->connection, fh);
+  if (trans == NULL || trans->type != TWOPENCE_PROTO_TYPE_FILE_OPEN)
+    return NULL;
+  return trans;
+}
+
+/*
+ * Each request on a remote file handle must be answered within this many
+ * seconds, same as the default command timeout. An open handle that is
+ * idle does not time out.
+ */
+#define TWOPENCE_PIPE_FILE_TIMEOUT	60
+
+/*
+ * Open a remote file, and wait for the server to tell us it has done so.
+ * The transaction stays around until the handle is closed.
+ */
+static int
+__twopence_pipe_file_open(struct twopence_pipe_target *handle, const char *username, const char *path,
+			unsigned int flags, unsigned int mode, int *remote_rc)
+{
+  twopence_transaction_t *trans;
+  int xid, rc;
+
+  if (_twopence_invalid_username(username))
+    return TWOPENCE_PARAMETER_ERROR;
+
+  if (__twopence_pipe_open_link(handle) < 0)
+    return TWOPENCE_OPEN_SESSION_ERROR;
+
+  trans = twopence_pipe_transaction_new(handle, TWOPENCE_PROTO_TYPE_FILE_OPEN);
+  if (trans == NULL)
+    return TWOPENCE_INVALID_TRANSACTION;
+  trans->recv = __twopence_pipe_file_recv;
+  twopence_transaction_set_timeout(trans, TWOPENCE_PIPE_FILE_TIMEOUT);
+
+  twopence_transaction_send_client(trans,
+		  twopence_protocol_build_file_open_packet(&trans->ps, username, path, flags, mode));
+
+  __twopence_pipe_transaction_add_running(handle, trans);
+
+  xid = trans->id;
+  while ((trans = __twopence_pipe_find_file_handle(handle, xid)) != NULL) {
+    if (trans->client.file_ready) {
+      timerclear(&trans->client.deadline);
+      return xid;
+    }
+
+    if ((rc = __twopence_pipe_doio(handle)) < 0)
+      twopence_conn_cancel_transactions(handle->connection, rc);
+  }
+
+  /* The open failed */
+  if (handle->connection == NULL
+   || (trans = twopence_conn_reap_transaction(handle->connection, xid)) == NULL)
+    return TWOPENCE_TRANSPORT_ERROR;
+
+  *remote_rc = trans->client.status_ret.major;
+  rc = trans->client.exception;
+  if (rc == 0)
+    rc = TWOPENCE_REMOTE_FILE_ERROR;
+
+  twopence_pipe_transaction_free(handle, trans);
+  return rc;
+}
+
+/*
+ * Send a batch of requests on a remote file handle, and wait for all replies.
+ * The server answers every request right away, so we only keep a few of them
+ * in flight at any time; otherwise a large batch would pile up all of its
+ * replies in the server's send queue.
+ */
+#define TWOPENCE_PIPE_FILE_IO_WINDOW	16
+
+static int
+__twopence_pipe_file_io(struct twopence_pipe_target *handle, int fh, twopence_file_io_t *io, unsigned int count)
+{
+  twopence_transaction_t *trans, *failed;
+  unsigned int i, next = 0;
+  int rc;
+
+  if ((trans = __twopence_pipe_find_file_handle(handle, fh)) == NULL)
+    return TWOPENCE_INVALID_TRANSACTION;
+
+  if (trans->client.file_io_pending)
+    return TWOPENCE_INVALID_TRANSACTION;
+
+  for (i = 0; i < count; ++i)
+    io[i].result = TWOPENCE_TRANSPORT_ERROR;
+
+  trans->client.file_io = io;
+  trans->client.file_io_count = count;
+  trans->client.file_io_pending = 0;
+  twopence_transaction_set_timeout(trans, TWOPENCE_PIPE_FILE_TIMEOUT);
+
+  while (true) {
+    failed = trans;
+    if ((trans = __twopence_pipe_find_file_handle(handle, fh)) == NULL) {
+      /* The handle failed. Whatever we did not get a reply for
+       * keeps its error code. A failed handle stays on the list of
+       * completed transactions until it is closed. */
+      if (handle->connection != NULL
+       && twopence_conn_has_completed_transaction(handle->connection, fh)
+       && failed->client.exception < 0)
+        return failed->client.exception;
+      return TWOPENCE_TRANSPORT_ERROR;
+    }
+
+    /* Refill the window. The tag of each request is its index in the batch */
+    while (next < count && trans->client.file_io_pending < TWOPENCE_PIPE_FILE_IO_WINDOW) {
+      twopence_buf_t *bp;
+
+      bp = twopence_protocol_build_file_request_packet(&trans->ps, &io[next], next);
+      if (bp == NULL) {
+        /* We cannot tell the replies to a partial batch apart from
+         * the next one; give up on the handle. */
+        twopence_transaction_set_error(trans, TWOPENCE_INTERNAL_ERROR);
+        return TWOPENCE_INTERNAL_ERROR;
+      }
+      twopence_transaction_send_client(trans, bp);
+      trans->client.file_io_pending++;
+      next++;
+    }
+
+    if (trans->client.file_io_pending == 0)
+      break;
+
+    if ((rc = __twopence_pipe_doio(handle)) < 0)
+      twopence_conn_cancel_transactions(handle->connection, rc);
+  }
+
+  trans->client.file_io = NULL;
+  trans->client.file_io_count = 0;
+  timerclear(&trans->client.deadline);
+  return 0;
+}
+
+/*
+ * Close a remote file handle. If the handle has failed already,
+ * just dispose of it.
+ */
+static int
+__twopence_pipe_file_close(struct twopence_pipe_target *handle, int fh)
+{
+  twopence_transaction_t *trans;
+  twopence_status_t status;
+  int rc;
+
+  if (handle->connection == NULL)
+    return TWOPENCE_INVALID_TRANSACTION;
+
+  if ((trans = __twopence_pipe_find_file_handle(handle, fh)) == NULL) {
+    if (!twopence_conn_has_completed_transaction(handle->connection, fh))
+      return TWOPENCE_INVALID_TRANSACTION;
+
+    trans = twopence_conn_reap_transaction(handle->connection, fh);
+    if (trans->type != TWOPENCE_PROTO_TYPE_FILE_OPEN) {
+      twopence_conn_add_transaction_done(handle->connection, trans);
+      return TWOPENCE_INVALID_TRANSACTION;
+    }
+
+    rc = trans->client.exception;
+    twopence_pipe_transaction_free(handle, trans);
+    return rc < 0? rc : TWOPENCE_TRANSPORT_ERROR;
+  }
+
+  twopence_transaction_send_client(trans,
+		  twopence_protocol_build_simple_packet_ps(&trans->ps, TWOPENCE_PROTO_TYPE_FILE_CLOSE));
+  twopence_transaction_set_timeout(trans, TWOPENCE_PIPE_FILE_TIMEOUT);
+
+  rc = __twopence_transaction_run(handle, trans, &status);
+  twopence_pipe_transaction_free(handle, trans);
+
+  if (rc == 0 && status.minor != 0)
+    rc = TWOPENCE_REMOTE_FILE_ERROR;
+  return rc;
+}
+
+/*
+ * Ask the server for the detached jobs it holds
+ */
+static int
+__twopence_pipe_list_jobs(struct twopence_pipe_target *handle, twopence_detached_job_t **jobs_ret, unsigned int *count_ret)
+{
+  twopence_transaction_t *trans;
+  twopence_status_t status;
+  int rc;
+
+  if (__twopence_pipe_open_link(handle) < 0)
+    return TWOPENCE_OPEN_SESSION_ERROR;
+
+  trans = twopence_pipe_primary_transaction_new(handle, TWOPENCE_PROTO_TYPE_JOB_LIST);
+  if (trans == NULL)
+    return TWOPENCE_INVALID_TRANSACTION;
+  trans->recv = __twopence_pipe_job_recv;
+
+  twopence_transaction_send_client(trans,
+		  twopence_protocol_build_simple_packet_ps(&trans->ps, TWOPENCE_PROTO_TYPE_JOB_LIST));
+  __twopence_pipe_transaction_add_running(handle, trans);
+
+  handle->current_transaction = trans;
+  rc = __twopence_transaction_run(handle, trans, &status);
+  handle->current_transaction = NULL;
+
+  if (rc == 0 && status.major != 0)
+    rc = TWOPENCE_RECEIVE_RESULTS_ERROR;
+
+  if (rc == 0) {
+    *jobs_ret = trans->client.jobs;
+    *count_ret = trans->client.njobs;
+    trans->client.jobs = NULL;
+    trans->client.njobs = 0;
+  }
+
+  twopence_pipe_transaction_free(handle, trans);
+  return rc;
+}
+
+/*
+ * Reattach to a detached job: receive all of its output, and its exit status
+ */
+static int
+__twopence_pipe_reattach(struct twopence_pipe_target *handle, unsigned int job_id, twopence_command_t *cmd,
+			twopence_status_t *status_ret)
+{
+  twopence_transaction_t *trans;
+  int rc;
+
+  if (__twopence_pipe_open_link(handle) < 0)
+    return TWOPENCE_OPEN_SESSION_ERROR;
+
+  trans = twopence_pipe_primary_transaction_new(handle, TWOPENCE_PROTO_TYPE_REATTACH);
+  if (trans == NULL)
+    return TWOPENCE_INVALID_TRANSACTION;
+  trans->recv = __twopence_pipe_command_recv;
+
+  twopence_transaction_send_client(trans,
+		  twopence_protocol_build_reattach_packet(&trans->ps, job_id,
+			  cmd? 0 : TWOPENCE_PROTO_REATTACH_NO_OUTPUT));
+
+  if (cmd) {
+    if (cmd->timeout)
+      twopence_transaction_set_timeout(trans, cmd->timeout);
+
+    twopence_pipe_transaction_attach_stdout(trans, cmd);
+    twopence_pipe_transaction_attach_stderr(trans, cmd);
+  }
+
+  __twopence_pipe_transaction_add_running(handle, trans);
+
+  if (cmd && cmd->background)
+    return trans->id;
+
+  handle->current_transaction = trans;
+  rc = __twopence_transaction_run(handle, trans, status_ret);
+  handle->current_transaction = NULL;
+
+  twopence_pipe_transaction_free(handle, trans);
+  return rc;
+}
+
+// Extract a file from the remote host
+//
+// Returns 0 if everything went fine, or a negative error code if failed
+static int
+__twopence_pipe_extract_file(struct twopence_pipe_target *handle, twopence_file_xfer_t *xfer,
+				twopence_status_t *status)
+{
+  twopence_transaction_t *trans;
+  twopence_trans_channel_t *sink;
+  int rc;
+
+  // Check that the username is valid
+  if (_twopence_invalid_username(xfer->user))
+    return TWOPENCE_PARAMETER_ERROR;
+  if (xfer->remote.name == NULL)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  // Open link for transmitting the command
+  if (__twopence_pipe_open_link(handle) < 0)
+    return TWOPENCE_OPEN_SESSION_ERROR;
+
+  trans = twopence_pipe_transaction_new(handle, TWOPENCE_PROTO_TYPE_EXTRACT);
+  if (trans == NULL)
+    return TWOPENCE_INVALID_TRANSACTION;
+  trans->recv = __twopence_pipe_extract_recv;
+  trans->client.extract_xfer = xfer;
+
+  // Send command packet
   if ((rc = twopence_transaction_send_extract(trans, xfer)) < 0)
     goto out;
 
@@ -669,10 +1560,17 @@ __twopence_pipe_extract_file(struct twopence_pipe_target *handle, twopence_file_
 
   __twopence_pipe_transaction_add_running(handle, trans);
 
+  /* If we've been asked to do the transfer in the background,
+   * return its XID now. */
+  if (xfer->background) {
+    twopence_debug("backgrounding transaction %s", twopence_transaction_describe(trans));
+    return trans->id;
+  }
+
   rc = __twopence_transaction_run(handle, trans, status);
 
 out:
-  twopence_transaction_free(trans);
+  twopence_pipe_transaction_free(handle, trans);
   return rc;
 }
 
@@ -680,10 +1578,18 @@ out:
 static int
 __twopence_pipe_disconnect(struct twopence_pipe_target *handle)
 {
+  unsigned int i;
+
+  for (i = 0; i + 1 < handle->nlinks; ++i) {
+    if (handle->secondary[i])
+      twopence_conn_close(handle->secondary[i]);
+  }
+
   if (handle->connection) {
     twopence_conn_close(handle->connection);
     twopence_conn_cancel_transactions(handle->connection, TWOPENCE_TRANSPORT_ERROR);
   }
+  handle->disconnected = true;
   return 0;
 }
 
@@ -709,6 +1615,25 @@ __twopence_pipe_exit_remote(struct twopence_pipe_target *handle)
   if (__twopence_pipe_send(handle, twopence_protocol_build_simple_packet(TWOPENCE_PROTO_TYPE_QUIT)) < 0)
     return TWOPENCE_INTERRUPT_COMMAND_ERROR;
 
+  // The server is going away; don't let the I/O thread bring it back
+  handle->disconnected = true;
+  return 0;
+}
+
+// Send an interrupt for the given transaction
+//
+// Returns 0 if everything went fine, or a negative error code if failed
+static int
+__twopence_pipe_interrupt_transaction(struct twopence_pipe_target *handle, twopence_transaction_t *trans)
+{
+  /* If the link is not open, there's nothing to interrupt */
+  if (handle->connection == NULL)
+    return TWOPENCE_OPEN_SESSION_ERROR;
+
+  /* Send the interrupt down the link the transaction is using */
+  if (twopence_transaction_send_interrupt(trans) < 0)
+    return TWOPENCE_INTERRUPT_COMMAND_ERROR;
+
   return 0;
 }
 
@@ -723,31 +1648,494 @@ __twopence_pipe_interrupt_command(struct twopence_pipe_target *handle)
   if ((trans = handle->current_transaction) == NULL)
     return 0;
 
-  /* If the link is not open, there's nothing to interrupt */
+  return __twopence_pipe_interrupt_transaction(handle, trans);
+}
+
+// Interrupt a (backgrounded) command, given its pid.
+// The server kills the command, and reports its exit status as usual;
+// the transaction still needs to be reaped using twopence_wait().
+static int
+__twopence_pipe_interrupt_pid(struct twopence_pipe_target *handle, int pid)
+{
+  twopence_transaction_t *trans;
+
   if (handle->connection == NULL)
     return TWOPENCE_OPEN_SESSION_ERROR;
 
-  if (__twopence_pipe_send(handle, twopence_protocol_build_simple_packet_ps(&trans->ps, TWOPENCE_PROTO_TYPE_INTR)) < 0)
-    return TWOPENCE_INTERRUPT_COMMAND_ERROR;
+  if (pid <= 0 || pid > 0xFFFF)
+    return TWOPENCE_INVALID_TRANSACTION;
+
+  trans = twopence_conn_find_transaction(handle->connection, pid);
+  if (trans == NULL) {
+    /* Nothing to do if the command completed already */
+    if (twopence_conn_has_completed_transaction(handle->connection, pid))
+      return 0;
+    return TWOPENCE_INVALID_TRANSACTION;
+  }
 
+  if (trans->type != TWOPENCE_PROTO_TYPE_COMMAND
+   && trans->type != TWOPENCE_PROTO_TYPE_REATTACH)
+    return TWOPENCE_INVALID_TRANSACTION;
+
+  return __twopence_pipe_interrupt_transaction(handle, trans);
+}
+
+/*
+ * Optional I/O thread.
+ *
+ * When enabled, a library-owned thread runs the target's event loop while
+ * the application is not inside a twopence call, so that keepalives are
+ * sent, queued data is drained and output of background commands is
+ * received even if the application is busy elsewhere for a long time.
+ *
+ * The event loop is only ever run by one thread at a time. When the
+ * application enters a twopence call, it kicks the I/O thread out of
+ * poll() and takes over the loop; when it returns, the I/O thread
+ * resumes. Completed transactions are left on the connection's done
+ * list, as usual, and the notify eventfd is readable for as long as there
+ * are any waiting to be reaped.
+ */
+struct twopence_pipe_io_thread {
+  pthread_t			thread;
+  pthread_mutex_t		lock;
+  pthread_cond_t		cond;
+
+  int				wake_fd;
+  int				notify_fd;
+  bool				notified;
+
+  /* Chat output arrived since the application last looked */
+  bool				chat_data;
+
+  /* Number of application calls waiting to take over the event loop */
+  int				app_waiting;
+  bool				app_active;
+  bool				stop;
+
+  /* Link setup requested by twopence_target_connect() */
+  bool				connect_pending;
+  int				connect_timeout;
+
+  /* Current back-off when keeping the link warm, and the number of
+   * attempts that failed in a row */
+  unsigned int			reconnect_delay;
+  unsigned int			reconnect_attempts;
+
+  struct pollfd *		pfd;
+  unsigned int			pfd_size;
+};
+
+#ifndef __APPLE__
+static void
+__twopence_pipe_update_notify(struct twopence_pipe_target *handle)
+{
+  struct twopence_pipe_io_thread *io = handle->io_thread;
+  eventfd_t value;
+  bool pending;
+
+  pending = io->chat_data
+	 || (handle->connection != NULL
+	     && twopence_conn_has_completed_transactions(handle->connection));
+
+  if (pending && !io->notified) {
+    eventfd_write(io->notify_fd, 1);
+    io->notified = true;
+  } else
+  if (!pending && io->notified) {
+    eventfd_read(io->notify_fd, &value);
+    io->notified = false;
+  }
+}
+
+/*
+ * The link went down while the application was idle. Try to bring it
+ * back once, and back off before the next attempt. We keep an eye on the
+ * wake_fd while waiting, so that the application can take over the
+ * event loop at any time. After too many failed attempts, we leave it
+ * to the application to reconnect.
+ */
+static void
+__twopence_pipe_io_thread_reconnect(struct twopence_pipe_target *handle)
+{
+  struct twopence_pipe_io_thread *io = handle->io_thread;
+  struct pollfd pfd;
+  eventfd_t value;
+
+  if (__twopence_pipe_probe_link(handle, TWOPENCE_PIPE_RECONNECT_MAX_DELAY) == 0) {
+    twopence_debug("%s: link re-established", handle->base.ops->name);
+    io->reconnect_delay = 0;
+    io->reconnect_attempts = 0;
+    return;
+  }
+
+  if (++(io->reconnect_attempts) >= TWOPENCE_PIPE_RECONNECT_MAX_ATTEMPTS) {
+    twopence_log_error("%s: unable to re-establish link, giving up", handle->base.ops->name);
+    return;
+  }
+
+  if (io->reconnect_delay == 0)
+    io->reconnect_delay = TWOPENCE_PIPE_RECONNECT_MIN_DELAY;
+
+  pfd.fd = io->wake_fd;
+  pfd.events = POLLIN;
+  (void) poll(&pfd, 1, io->reconnect_delay);
+  eventfd_read(io->wake_fd, &value);
+
+  io->reconnect_delay *= 2;
+  if (io->reconnect_delay > TWOPENCE_PIPE_RECONNECT_MAX_DELAY)
+    io->reconnect_delay = TWOPENCE_PIPE_RECONNECT_MAX_DELAY;
+}
+
+static void *
+__twopence_pipe_io_thread_main(void *arg)
+{
+  struct twopence_pipe_target *handle = arg;
+  struct twopence_pipe_io_thread *io = handle->io_thread;
+  twopence_pollinfo_t poll_info;
+  sigset_t mask;
+
+  /* Leave all signal handling to the application */
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  pthread_mutex_lock(&io->lock);
+  while (!io->stop) {
+    unsigned int maxfds, chat_bytes;
+    eventfd_t value;
+
+    if (io->app_active
+     || __sync_fetch_and_add(&io->app_waiting, 0) != 0) {
+      pthread_cond_wait(&io->cond, &io->lock);
+      continue;
+    }
+
+    if (io->connect_pending) {
+      io->connect_pending = false;
+      if (__twopence_pipe_connect(handle, io->connect_timeout) < 0)
+        twopence_log_error("%s: unable to connect to server", handle->base.ops->name);
+      continue;
+    }
+
+    if (handle->keep_warm
+     && !handle->disconnected
+     && io->reconnect_attempts < TWOPENCE_PIPE_RECONNECT_MAX_ATTEMPTS
+     && handle->connection != NULL
+     && twopence_conn_is_closed(handle->connection)) {
+      __twopence_pipe_io_thread_reconnect(handle);
+      __twopence_pipe_update_notify(handle);
+      continue;
+    }
+
+    if (handle->pool == NULL
+     || handle->connection == NULL
+     || twopence_conn_is_closed(handle->connection)) {
+      pthread_cond_wait(&io->cond, &io->lock);
+      continue;
+    }
+
+    /* The link is up; should it go down again, start over */
+    io->reconnect_attempts = 0;
+
+    /* One extra slot for the wake_fd */
+    maxfds = twopence_conn_pool_max_fds(handle->pool) + 1;
+    if (maxfds > io->pfd_size) {
+      io->pfd = twopence_realloc(io->pfd, maxfds * sizeof(struct pollfd));
+      io->pfd_size = maxfds;
+    }
+    twopence_pollinfo_init(&poll_info, io->pfd, io->pfd_size);
+
+    if (!twopence_conn_pool_fill_poll(handle->pool, &poll_info))
+      continue;
+    twopence_pollinfo_update(&poll_info, io->wake_fd, POLLIN, NULL);
+
+    (void) twopence_pollinfo_poll(&poll_info);
+    eventfd_read(io->wake_fd, &value);
+
+    chat_bytes = twopence_conn_chat_bytes_received(handle->connection);
+    twopence_conn_pool_doio(handle->pool);
+    if (twopence_conn_chat_bytes_received(handle->connection) != chat_bytes)
+      io->chat_data = true;
+    __twopence_pipe_update_notify(handle);
+  }
+  pthread_mutex_unlock(&io->lock);
+
+  return NULL;
+}
+#endif
+
+static int
+__twopence_pipe_start_io_thread(struct twopence_pipe_target *handle)
+{
+#ifdef __APPLE__
+  return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+#else
+  struct twopence_pipe_io_thread *io;
+
+  if (handle->io_thread != NULL)
+    return 0;
+
+  io = twopence_calloc(1, sizeof(*io));
+  pthread_mutex_init(&io->lock, NULL);
+  pthread_cond_init(&io->cond, NULL);
+  io->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  io->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (io->wake_fd < 0 || io->notify_fd < 0)
+    goto failed;
+
+  handle->io_thread = io;
+  if (pthread_create(&io->thread, NULL, __twopence_pipe_io_thread_main, handle) != 0) {
+    handle->io_thread = NULL;
+    goto failed;
+  }
+
+  twopence_debug("%s: started I/O thread", handle->base.ops->name);
   return 0;
+
+failed:
+  twopence_log_error("%s: unable to start I/O thread: %m", handle->base.ops->name);
+  if (io->wake_fd >= 0)
+    close(io->wake_fd);
+  if (io->notify_fd >= 0)
+    close(io->notify_fd);
+  pthread_cond_destroy(&io->cond);
+  pthread_mutex_destroy(&io->lock);
+  free(io);
+  return TWOPENCE_INTERNAL_ERROR;
+#endif
+}
+
+static void
+__twopence_pipe_stop_io_thread(struct twopence_pipe_target *handle)
+{
+#ifndef __APPLE__
+  struct twopence_pipe_io_thread *io;
+
+  if ((io = handle->io_thread) == NULL)
+    return;
+
+  __sync_fetch_and_add(&io->app_waiting, 1);
+  eventfd_write(io->wake_fd, 1);
+  pthread_mutex_lock(&io->lock);
+  __sync_fetch_and_sub(&io->app_waiting, 1);
+  io->stop = true;
+  pthread_cond_signal(&io->cond);
+  pthread_mutex_unlock(&io->lock);
+
+  pthread_join(io->thread, NULL);
+  handle->io_thread = NULL;
+
+  close(io->wake_fd);
+  close(io->notify_fd);
+  pthread_cond_destroy(&io->cond);
+  pthread_mutex_destroy(&io->lock);
+  free(io->pfd);
+  free(io);
+
+  twopence_debug("%s: stopped I/O thread", handle->base.ops->name);
+#endif
+}
+
+/*
+ * Take the event loop away from the I/O thread while the application is
+ * inside a twopence call, and hand it back on return. These calls nest.
+ */
+static void
+__twopence_pipe_enter(struct twopence_pipe_target *handle)
+{
+#ifndef __APPLE__
+  struct twopence_pipe_io_thread *io = handle->io_thread;
+
+  if (io == NULL || handle->io_depth++ != 0)
+    return;
+
+  __sync_fetch_and_add(&io->app_waiting, 1);
+  eventfd_write(io->wake_fd, 1);
+  pthread_mutex_lock(&io->lock);
+  __sync_fetch_and_sub(&io->app_waiting, 1);
+  io->app_active = true;
+  io->chat_data = false;
+#endif
+}
+
+static void
+__twopence_pipe_leave(struct twopence_pipe_target *handle)
+{
+#ifndef __APPLE__
+  struct twopence_pipe_io_thread *io = handle->io_thread;
+
+  if (io == NULL || --(handle->io_depth) != 0)
+    return;
+
+  __twopence_pipe_update_notify(handle);
+  io->app_active = false;
+  pthread_cond_signal(&io->cond);
+  pthread_mutex_unlock(&io->lock);
+#endif
+}
+
+/*
+ * Change one of the bandwidth limits. All links share the same buckets,
+ * so this takes effect immediately, even on links that are already open.
+ */
+static void
+__twopence_pipe_set_ratelimit(struct twopence_pipe_target *handle, int option, unsigned int value)
+{
+  twopence_sock_ratelimit_t *rl;
+
+  switch (option) {
+  case TWOPENCE_TARGET_OPTION_XMIT_RATE:
+  case TWOPENCE_TARGET_OPTION_XMIT_BURST:
+    rl = &handle->xmit_limit;
+    break;
+
+  default:
+    rl = &handle->recv_limit;
+    break;
+  }
+
+  if (option == TWOPENCE_TARGET_OPTION_XMIT_RATE || option == TWOPENCE_TARGET_OPTION_RECV_RATE)
+    twopence_sock_ratelimit_set(rl, value, rl->burst);
+  else
+    twopence_sock_ratelimit_set(rl, rl->rate, value);
 }
 
-///////////////////////////// Public interface //////////////////////////////////
+///////////////////////////// Public interface //////////////////////////////////
+
+int
+twopence_pipe_set_option(struct twopence_target *opaque_handle, int option, const void *value_p)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+
+  switch (option) {
+  case TWOPENCE_TARGET_OPTION_KEEPALIVE:
+    if (handle->connection != NULL) {
+      twopence_log_error("%s: cannot set keepalive option; connection already established", handle->base.ops->name);
+      return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR; /* not quite */
+    }
+
+    handle->keepalive = *(const int *) value_p;
+    break;
+
+  case TWOPENCE_TARGET_OPTION_HEARTBEAT:
+    if (handle->connection != NULL) {
+      twopence_log_error("%s: cannot set heartbeat option; connection already established", handle->base.ops->name);
+      return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR; /* not quite */
+    }
+
+    if (*(const int *) value_p < 0 || *(const int *) value_p > 0xFFFF)
+      return TWOPENCE_PARAMETER_ERROR;
+    handle->heartbeat = *(const int *) value_p;
+    break;
+
+  case TWOPENCE_TARGET_OPTION_RECONNECT:
+    handle->reconnect = *(const int *) value_p;
+    break;
+
+  case TWOPENCE_TARGET_OPTION_IO_THREAD:
+    if (*(const int *) value_p)
+      return __twopence_pipe_start_io_thread(handle);
+    __twopence_pipe_stop_io_thread(handle);
+    break;
+
+  case TWOPENCE_TARGET_OPTION_KEEP_WARM:
+    /* Only the I/O thread can keep the link serviced while we're idle */
+    if (*(const int *) value_p) {
+      int rc;
+
+      if ((rc = __twopence_pipe_start_io_thread(handle)) < 0)
+        return rc;
+    }
+    __twopence_pipe_enter(handle);
+    handle->keep_warm = !!*(const int *) value_p;
+    __twopence_pipe_leave(handle);
+    break;
+
+  case TWOPENCE_TARGET_OPTION_XMIT_RATE:
+  case TWOPENCE_TARGET_OPTION_XMIT_BURST:
+  case TWOPENCE_TARGET_OPTION_RECV_RATE:
+  case TWOPENCE_TARGET_OPTION_RECV_BURST:
+    if (*(const int *) value_p < 0)
+      return TWOPENCE_PARAMETER_ERROR;
+    __twopence_pipe_enter(handle);
+    __twopence_pipe_set_ratelimit(handle, option, *(const int *) value_p);
+    __twopence_pipe_leave(handle);
+    break;
+
+  default:
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  }
+
+  return 0;
+}
+
+int
+twopence_pipe_get_option(struct twopence_target *opaque_handle, int option, void *value_p)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+
+  switch (option) {
+  case TWOPENCE_TARGET_OPTION_KEEPALIVE:
+    *(int *) value_p = handle->keepalive;
+    break;
+
+  case TWOPENCE_TARGET_OPTION_HEARTBEAT:
+    *(int *) value_p = handle->heartbeat;
+    break;
+
+  case TWOPENCE_TARGET_OPTION_RECONNECT:
+    *(int *) value_p = handle->reconnect;
+    break;
+
+  case TWOPENCE_TARGET_OPTION_IO_THREAD:
+    *(int *) value_p = (handle->io_thread != NULL);
+    break;
+
+  case TWOPENCE_TARGET_OPTION_KEEP_WARM:
+    *(int *) value_p = handle->keep_warm;
+    break;
+
+  case TWOPENCE_TARGET_OPTION_COMPLETION_FD:
+    if (handle->io_thread == NULL)
+      return TWOPENCE_OPEN_SESSION_ERROR;
+    *(int *) value_p = handle->io_thread->notify_fd;
+    break;
+
+  case TWOPENCE_TARGET_OPTION_DEAD_PEER_TIMEOUT:
+    /* Before we're connected, we do not know what the server will agree to */
+    if (handle->connection == NULL)
+      return TWOPENCE_OPEN_SESSION_ERROR;
+    __twopence_pipe_enter(handle);
+    *(int *) value_p = twopence_conn_get_dead_peer_timeout(handle->connection);
+    __twopence_pipe_leave(handle);
+    break;
+
+  case TWOPENCE_TARGET_OPTION_XMIT_RATE:
+    *(int *) value_p = handle->xmit_limit.rate;
+    break;
+
+  case TWOPENCE_TARGET_OPTION_XMIT_BURST:
+    *(int *) value_p = handle->xmit_limit.burst;
+    break;
+
+  case TWOPENCE_TARGET_OPTION_XMIT_THROTTLED:
+    __twopence_pipe_enter(handle);
+    *(int *) value_p = twopence_sock_ratelimit_throttled(&handle->xmit_limit);
+    __twopence_pipe_leave(handle);
+    break;
 
-int
-twopence_pipe_set_option(struct twopence_target *opaque_handle, int option, const void *value_p)
-{
-  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  case TWOPENCE_TARGET_OPTION_RECV_RATE:
+    *(int *) value_p = handle->recv_limit.rate;
+    break;
 
-  switch (option) {
-  case TWOPENCE_TARGET_OPTION_KEEPALIVE:
-    if (handle->connection != NULL) {
-      twopence_log_error("%s: cannot set keepalive option; connection already established", handle->base.ops->name);
-      return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR; /* not quite */
-    }
+  case TWOPENCE_TARGET_OPTION_RECV_BURST:
+    *(int *) value_p = handle->recv_limit.burst;
+    break;
 
-    handle->keepalive = *(const int *) value_p;
+  case TWOPENCE_TARGET_OPTION_RECV_THROTTLED:
+    __twopence_pipe_enter(handle);
+    *(int *) value_p = twopence_sock_ratelimit_throttled(&handle->recv_limit);
+    __twopence_pipe_leave(handle);
     break;
 
   default:
@@ -767,15 +2155,42 @@ twopence_pipe_run_test(struct twopence_target *opaque_handle, twopence_command_t
 			twopence_status_t *status_ret)
 {
   struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc;
+
+  __twopence_pipe_enter(handle);
+  rc = __twopence_pipe_command(handle, cmd, status_ret);
+  __twopence_pipe_leave(handle);
+  return rc;
+}
+
+/*
+ * Copy the status of a completed transaction to @status, and free the transaction.
+ * Returns the transaction's xid, or a negative error code if the transaction failed.
+ */
+static int
+__twopence_pipe_collect_status(struct twopence_pipe_target *handle, twopence_transaction_t *trans, twopence_status_t *status)
+{
+  int rc;
+
+  twopence_debug("%s: returning status for transaction %s", __func__, twopence_transaction_describe(trans));
+  if (trans->client.exception < 0) {
+    rc = trans->client.exception;
+  } else {
+    status->major = trans->client.status_ret.major;
+    status->minor = trans->client.status_ret.minor;
+    rc = trans->id;
+  }
 
-  return __twopence_pipe_command(handle, cmd, status_ret);
+  status->pid = trans->id;
+  twopence_pipe_transaction_free(handle, trans);
+  return rc;
 }
 
 /*
  * Wait for a remote command to finish
  */
-int
-twopence_pipe_wait(struct twopence_target *opaque_handle, int want_pid, twopence_status_t *status)
+static int
+__twopence_pipe_wait(struct twopence_target *opaque_handle, int want_pid, twopence_status_t *status)
 {
   struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
   twopence_transaction_t *trans = NULL;
@@ -790,7 +2205,7 @@ twopence_pipe_wait(struct twopence_target *opaque_handle, int want_pid, twopence
     if (trans != NULL)
       break;
 
-    if (!twopence_conn_has_pending_transactions(handle->connection))
+    if (!__twopence_pipe_has_pending_transactions(handle))
       break;
 
     rc = __twopence_pipe_doio(handle);
@@ -801,19 +2216,95 @@ twopence_pipe_wait(struct twopence_target *opaque_handle, int want_pid, twopence
   if (trans == NULL)
     return 0;
 
-  status->pid = trans->id;
+  return __twopence_pipe_collect_status(handle, trans, status);
+}
 
-  twopence_debug("%s: returning status for transaction %s", __func__, twopence_transaction_describe(trans));
-  if (trans->client.exception < 0) {
-    rc = trans->client.exception;
-  } else {
-    status->major = trans->client.status_ret.major;
-    status->minor = trans->client.status_ret.minor;
-    rc = trans->id;
+int
+twopence_pipe_wait(struct twopence_target *opaque_handle, int want_pid, twopence_status_t *status)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc;
+
+  __twopence_pipe_enter(handle);
+  rc = __twopence_pipe_wait(opaque_handle, want_pid, status);
+  __twopence_pipe_leave(handle);
+  return rc;
+}
+
+/*
+ * Collect the status of all completed transactions, up to @max.
+ * If none have completed yet, do I/O until at least one transaction
+ * completes, or until @timeout_ms expires.
+ *
+ * A transaction that failed locally is reported as the only status
+ * of a call, with its error code as the return value. If we have already
+ * collected other statuses, it is left for the next call to pick up.
+ */
+static int
+__twopence_pipe_wait_many(struct twopence_target *opaque_handle, unsigned int max, int timeout_ms, twopence_status_t *statuses)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  twopence_transaction_t *trans;
+  twopence_timer_t *timer = NULL;
+  unsigned int count = 0;
+  bool polled = false;
+  int rc = 0;
+
+  if (handle->connection == NULL)
+    return 0;
+
+  /* The timer makes sure that twopence_conn_pool_poll() returns in time */
+  if (timeout_ms >= 0) {
+    if ((rc = twopence_timer_create(timeout_ms, &timer)) < 0)
+      return rc;
+    twopence_timer_hold(timer);
   }
 
-  status->pid = trans->id;
-  twopence_transaction_free(trans);
+  while (count < max) {
+    trans = __twopence_pipe_get_completed_transaction(handle, 0);
+    if (trans == NULL) {
+      if (count != 0
+       || !__twopence_pipe_has_pending_transactions(handle)
+       || (polled && timer && twopence_timer_remaining(timer) == 0))
+        break;
+
+      if ((rc = __twopence_pipe_doio(handle)) < 0)
+        break;
+      polled = true;
+      continue;
+    }
+
+    if (trans->client.exception < 0 && count != 0) {
+      /* Put it back; we'll report it on the next call */
+      twopence_conn_add_transaction_done(handle->connection, trans);
+      break;
+    }
+
+    rc = __twopence_pipe_collect_status(handle, trans, &statuses[count]);
+    if (rc < 0)
+      break;
+    count++;
+  }
+
+  if (timer) {
+    twopence_timer_cancel(timer);
+    twopence_timer_release(timer);
+  }
+
+  if (rc < 0)
+    return rc;
+  return count;
+}
+
+int
+twopence_pipe_wait_many(struct twopence_target *opaque_handle, unsigned int max, int timeout_ms, twopence_status_t *statuses)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc;
+
+  __twopence_pipe_enter(handle);
+  rc = __twopence_pipe_wait_many(opaque_handle, max, timeout_ms, statuses);
+  __twopence_pipe_leave(handle);
   return rc;
 }
 
@@ -829,13 +2320,104 @@ twopence_pipe_inject_file(struct twopence_target *opaque_handle,
   struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
   int rc;
 
+  __twopence_pipe_enter(handle);
   rc = __twopence_pipe_inject_file(handle, xfer, status);
+  __twopence_pipe_leave(handle);
   if (rc == 0 && (status->major != 0 || status->minor != 0))
     rc = TWOPENCE_REMOTE_FILE_ERROR;
 
   return rc;
 }
 
+/*
+ * Inject a file whose data is supplied by the caller
+ */
+int
+twopence_pipe_inject_begin(struct twopence_target *opaque_handle, twopence_file_xfer_t *xfer)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc;
+
+  __twopence_pipe_enter(handle);
+  rc = __twopence_pipe_inject_begin(handle, xfer);
+  __twopence_pipe_leave(handle);
+  return rc;
+}
+
+int
+twopence_pipe_inject_write(struct twopence_target *opaque_handle, int xid, twopence_buf_t *chunk)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc;
+
+  __twopence_pipe_enter(handle);
+  rc = __twopence_pipe_inject_write(handle, xid, chunk);
+  __twopence_pipe_leave(handle);
+  return rc;
+}
+
+int
+twopence_pipe_file_open(struct twopence_target *opaque_handle, const char *username, const char *path,
+			unsigned int flags, unsigned int mode, int *remote_rc)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc;
+
+  __twopence_pipe_enter(handle);
+  rc = __twopence_pipe_file_open(handle, username, path, flags, mode, remote_rc);
+  __twopence_pipe_leave(handle);
+  return rc;
+}
+
+int
+twopence_pipe_file_io(struct twopence_target *opaque_handle, int fh, twopence_file_io_t *io, unsigned int count)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc;
+
+  __twopence_pipe_enter(handle);
+  rc = __twopence_pipe_file_io(handle, fh, io, count);
+  __twopence_pipe_leave(handle);
+  return rc;
+}
+
+int
+twopence_pipe_file_close(struct twopence_target *opaque_handle, int fh)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc;
+
+  __twopence_pipe_enter(handle);
+  rc = __twopence_pipe_file_close(handle, fh);
+  __twopence_pipe_leave(handle);
+  return rc;
+}
+
+int
+twopence_pipe_list_jobs(struct twopence_target *opaque_handle, twopence_detached_job_t **jobs_ret, unsigned int *count_ret)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc;
+
+  __twopence_pipe_enter(handle);
+  rc = __twopence_pipe_list_jobs(handle, jobs_ret, count_ret);
+  __twopence_pipe_leave(handle);
+  return rc;
+}
+
+int
+twopence_pipe_reattach(struct twopence_target *opaque_handle, unsigned int job_id, twopence_command_t *cmd,
+			twopence_status_t *status_ret)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc;
+
+  __twopence_pipe_enter(handle);
+  rc = __twopence_pipe_reattach(handle, job_id, cmd, status_ret);
+  __twopence_pipe_leave(handle);
+  return rc;
+}
+
 // Extract a file from the Virtual Machine
 //
 // Returns 0 if everything went fine
@@ -847,7 +2429,9 @@ twopence_pipe_extract_file(struct twopence_target *opaque_handle,
   int rc;
 
   // Extract it
+  __twopence_pipe_enter(handle);
   rc = __twopence_pipe_extract_file(handle, xfer, status);
+  __twopence_pipe_leave(handle);
   if (rc == 0 && (status->major != 0 || status->minor != 0))
     rc = TWOPENCE_REMOTE_FILE_ERROR;
 
@@ -861,8 +2445,197 @@ int
 twopence_pipe_interrupt_command(struct twopence_target *opaque_handle)
 {
   struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc;
+
+  __twopence_pipe_enter(handle);
+  rc = __twopence_pipe_interrupt_command(handle);
+  __twopence_pipe_leave(handle);
+  return rc;
+}
+
+// Interrupt a specific command
+//
+// Returns 0 if everything went fine
+int
+twopence_pipe_interrupt_pid(struct twopence_target *opaque_handle, int pid)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc;
+
+  __twopence_pipe_enter(handle);
+  rc = __twopence_pipe_interrupt_pid(handle, pid);
+  __twopence_pipe_leave(handle);
+  return rc;
+}
+
+/*
+ * Wait for the server to become reachable
+ */
+int
+twopence_pipe_wait_ready(struct twopence_target *opaque_handle, int timeout_ms)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc;
+
+  __twopence_pipe_enter(handle);
+  rc = __twopence_pipe_wait_ready(handle, timeout_ms);
+  __twopence_pipe_leave(handle);
+  return rc;
+}
+
+/*
+ * Open the link and handshake now, rather than on first use
+ */
+int
+twopence_pipe_connect(struct twopence_target *opaque_handle, int timeout_ms)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc = 0;
+
+  __twopence_pipe_enter(handle);
+#ifndef __APPLE__
+  if (handle->io_thread && !__twopence_pipe_link_is_up(handle)) {
+    /* Let the I/O thread do this once we return. Anybody who needs
+     * the link in the meantime has to wait for it to finish. */
+    handle->io_thread->connect_pending = true;
+    handle->io_thread->connect_timeout = timeout_ms;
+  } else
+#endif
+    rc = __twopence_pipe_connect(handle, timeout_ms);
+  __twopence_pipe_leave(handle);
+  return rc;
+}
+
+/*
+ * Export the fds and the timeout our event loop is waiting for, so that
+ * the application can wait for them in its own event loop.
+ *
+ * Returns the number of fds we want to poll. If this is larger than @max,
+ * only the first @max entries have been filled in, and the caller should
+ * retry with a larger array.
+ */
+static int
+__twopence_pipe_get_pollfds(struct twopence_target *opaque_handle, struct pollfd *pfds, unsigned int max, int *timeout_ms)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  twopence_pollinfo_t *pinfo = &handle->external_poll.info;
+  unsigned int maxfds, i;
+  long msec;
+
+  handle->external_poll.valid = false;
+  *timeout_ms = -1;
+
+  if (handle->pool == NULL || handle->connection == NULL)
+    return 0;
+
+  maxfds = twopence_conn_pool_max_fds(handle->pool);
+  if (maxfds > handle->external_poll.size) {
+    pinfo->pfd = twopence_realloc(pinfo->pfd, maxfds * sizeof(struct pollfd));
+    handle->external_poll.size = maxfds;
+  }
+  twopence_pollinfo_init(pinfo, pinfo->pfd, handle->external_poll.size);
+
+  if (!twopence_conn_pool_fill_poll(handle->pool, pinfo))
+    return 0;
+
+  for (i = 0; i < pinfo->num_fds && i < max; ++i) {
+    pfds[i].fd = pinfo->pfd[i].fd;
+    pfds[i].events = pinfo->pfd[i].events;
+    pfds[i].revents = 0;
+  }
+
+  msec = twopence_timeout_msec(&pinfo->timeout);
+  if (msec >= 0)
+    *timeout_ms = msec;
+
+  handle->external_poll.valid = true;
+  return pinfo->num_fds;
+}
+
+/*
+ * Process the poll results for the fds handed out by the most recent
+ * call to twopence_pipe_get_pollfds(). The application may pass back
+ * the fds in any order, and may include fds of its own; these are ignored.
+ */
+static int
+__twopence_pipe_dispatch(struct twopence_target *opaque_handle, const struct pollfd *pfds, unsigned int count)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  twopence_pollinfo_t *pinfo = &handle->external_poll.info;
+  unsigned int i, j;
+
+  if (handle->connection == NULL)
+    return TWOPENCE_TRANSPORT_ERROR;
+
+  /* If someone else did I/O on this target since the poll set was
+   * handed out, it is stale. Nothing lost - the application will
+   * simply fetch a fresh one. */
+  if (!handle->external_poll.valid)
+    return 0;
+  handle->external_poll.valid = false;
+
+  for (i = 0; i < pinfo->num_fds; ++i) {
+    struct pollfd *pfd = &pinfo->pfd[i];
+
+    pfd->revents = 0;
+    for (j = 0; j < count; ++j) {
+      if (pfds[j].fd == pfd->fd)
+        pfd->revents |= pfds[j].revents;
+    }
+  }
+
+  twopence_conn_pool_doio(handle->pool);
+  if (twopence_conn_is_closed(handle->connection))
+    return TWOPENCE_TRANSPORT_ERROR;
+
+  return 0;
+}
+
+int
+twopence_pipe_get_pollfds(struct twopence_target *opaque_handle, struct pollfd *pfds, unsigned int max, int *timeout_ms)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+
+#ifndef __APPLE__
+  /* The I/O thread runs the event loop; all the application needs to
+   * wait for is completions. Timers are per thread, though, so the
+   * timeout is that of the calling thread's timers. */
+  if (handle->io_thread != NULL) {
+    twopence_timeout_t tmo;
+
+    twopence_timeout_init(&tmo);
+    twopence_timers_update_timeout(&tmo);
+    *timeout_ms = twopence_timeout_msec(&tmo);
+    if (*timeout_ms < 0)
+      *timeout_ms = -1;
+
+    if (max != 0) {
+      pfds[0].fd = handle->io_thread->notify_fd;
+      pfds[0].events = POLLIN;
+      pfds[0].revents = 0;
+    }
+    return 1;
+  }
+#endif
+
+  return __twopence_pipe_get_pollfds(opaque_handle, pfds, max, timeout_ms);
+}
+
+int
+twopence_pipe_dispatch(struct twopence_target *opaque_handle, const struct pollfd *pfds, unsigned int count)
+{
+  struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+
+  /* The I/O thread does the I/O; all that is left for us are the
+   * timers of the calling thread */
+  if (handle->io_thread != NULL) {
+    __twopence_pipe_enter(handle);
+    twopence_timers_run();
+    __twopence_pipe_leave(handle);
+    return 0;
+  }
 
-  return __twopence_pipe_interrupt_command(handle);
+  return __twopence_pipe_dispatch(opaque_handle, pfds, count);
 }
 
 /*
@@ -872,8 +2645,12 @@ int
 twopence_pipe_cancel_transactions(twopence_target_t *opaque_handle)
 {
   struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc;
 
-  return __twopence_pipe_cancel_transactions(handle);
+  __twopence_pipe_enter(handle);
+  rc = __twopence_pipe_cancel_transactions(handle);
+  __twopence_pipe_leave(handle);
+  return rc;
 }
 
 /*
@@ -883,8 +2660,12 @@ int
 twopence_pipe_disconnect(twopence_target_t *opaque_handle)
 {
   struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc;
 
-  return __twopence_pipe_disconnect(handle);
+  __twopence_pipe_enter(handle);
+  rc = __twopence_pipe_disconnect(handle);
+  __twopence_pipe_leave(handle);
+  return rc;
 }
 
 // Tell the remote test server to exit
@@ -894,8 +2675,12 @@ int
 twopence_pipe_exit_remote(struct twopence_target *opaque_handle)
 {
   struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  int rc;
 
-  return __twopence_pipe_exit_remote(handle);
+  __twopence_pipe_enter(handle);
+  rc = __twopence_pipe_exit_remote(handle);
+  __twopence_pipe_leave(handle);
+  return rc;
 }
 
 // Close the library
@@ -903,15 +2688,32 @@ void
 twopence_pipe_end(struct twopence_target *opaque_handle)
 {
   struct twopence_pipe_target *handle = (struct twopence_pipe_target *) opaque_handle;
+  unsigned int i;
 
   twopence_debug("%s()", __func__);
+  __twopence_pipe_stop_io_thread(handle);
+
+  /* Secondary links refer to the primary connection, so they go first */
+  for (i = 0; i + 1 < handle->nlinks; ++i) {
+    if (handle->secondary[i] != NULL) {
+      twopence_conn_free(handle->secondary[i]);
+      handle->secondary[i] = NULL;
+    }
+  }
+
   if (handle->connection != NULL) {
-    /* The connection may still be attached to twopence_pipe_connection_pool,
+    /* The connection may still be attached to our pool,
      * but fortunately, twopence_conn_free() takes care of this.
      */
     twopence_conn_free(handle->connection);
     handle->connection = NULL;
   }
 
+  if (handle->pool != NULL) {
+    twopence_conn_pool_free(handle->pool);
+    handle->pool = NULL;
+  }
+
+  free(handle->external_poll.info.pfd);
   free(handle);
 }
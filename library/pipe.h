@@ -25,6 +25,8 @@
 #include "transaction.h"
 #include "connection.h"
 
+#define TWOPENCE_PIPE_MAX_LINKS	8
+
 /* Base class for all targets using the twopence pipe protocol */
 struct twopence_pipe_target {
   struct twopence_target base;
@@ -34,12 +36,56 @@ struct twopence_pipe_target {
   /* Timeout for keepalives. Set to 0 to disable; -1 to use the default settings */
   int				keepalive;
 
+  /* Heartbeat interval in msec we ask the server for. 0 disables heartbeats */
+  int				heartbeat;
+
+  /* How long (in msec) to keep trying to reestablish a link that went
+   * down. 0 disables reconnects, a negative value retries forever. */
+  int				reconnect;
+
+  /* Re-establish the link in the background if it goes down while
+   * the application is idle */
+  bool				keep_warm;
+
+  /* The application took the link down on purpose; do not bring it
+   * back until it asks for it */
+  bool				disconnected;
+
+  /* Bandwidth limits, shared by all links */
+  twopence_sock_ratelimit_t	xmit_limit;
+  twopence_sock_ratelimit_t	recv_limit;
+
   /* This holds the fd of the serial port/the socket or whatever else we use to
    * communicate with the server. */
   twopence_conn_t *		connection;
 
+  /* Some transports can offer several links to the same server (eg
+   * several virtio channels). Link 0 is the connection above, which
+   * keeps track of all transactions. Additional links only carry
+   * traffic on its behalf, so that a bulk transfer does not hold up
+   * everything else. */
+  unsigned int			nlinks;
+  twopence_conn_t *		secondary[TWOPENCE_PIPE_MAX_LINKS - 1];
+
+  /* Each target has its own event loop, so that different targets can be
+   * driven from different threads. */
+  twopence_conn_pool_t *	pool;
+
+  /* Poll set handed out by twopence_target_get_pollfds(), and
+   * consumed by twopence_target_dispatch() */
+  struct {
+    twopence_pollinfo_t		info;
+    unsigned int		size;
+    bool			valid;
+  } external_poll;
+
   twopence_protocol_state_t	ps;
 
+  /* Optional library-owned thread that runs the event loop while the
+   * application is busy elsewhere. */
+  struct twopence_pipe_io_thread *io_thread;
+  unsigned int			io_depth;
+
   /* "foreground" transaction. This is the transaction that gets
    * cancelled when twopence_interrupt() is called. */
   twopence_transaction_t *	current_transaction;
@@ -47,20 +93,37 @@ struct twopence_pipe_target {
 
 
 struct twopence_pipe_ops {
-  twopence_sock_t *		(*open)(struct twopence_pipe_target *);
+  twopence_sock_t *		(*open)(struct twopence_pipe_target *, unsigned int link);
 };
 
 extern void	twopence_pipe_target_init(struct twopence_pipe_target *, int plugin_type, const struct twopence_plugin *,
 			const struct twopence_pipe_ops *);
 
 extern int	twopence_pipe_set_option(struct twopence_target *target, int option, const void *value_p);
+extern int	twopence_pipe_get_option(struct twopence_target *target, int option, void *value_p);
 extern int	twopence_pipe_run_test(struct twopence_target *, twopence_command_t *, twopence_status_t *);
 extern int	twopence_pipe_wait(struct twopence_target *, int, twopence_status_t *);
+extern int	twopence_pipe_wait_many(struct twopence_target *, unsigned int, int, twopence_status_t *);
 extern int	twopence_pipe_chat_send(twopence_target_t *opaque_handle, int xid, twopence_iostream_t *stream);
 extern int	twopence_pipe_chat_recv(twopence_target_t *opaque_handle, int xid, const struct timeval *deadline);
+extern int	twopence_pipe_chat_eof(twopence_target_t *opaque_handle, int xid);
+extern void	twopence_pipe_chat_lock(twopence_target_t *opaque_handle);
+extern void	twopence_pipe_chat_unlock(twopence_target_t *opaque_handle);
 extern int	twopence_pipe_inject_file (struct twopence_target *, twopence_file_xfer_t *, twopence_status_t *);
+extern int	twopence_pipe_inject_begin(struct twopence_target *, twopence_file_xfer_t *);
+extern int	twopence_pipe_inject_write(struct twopence_target *, int, twopence_buf_t *);
+extern int	twopence_pipe_file_open(struct twopence_target *, const char *, const char *, unsigned int, unsigned int, int *);
+extern int	twopence_pipe_file_io(struct twopence_target *, int, twopence_file_io_t *, unsigned int);
+extern int	twopence_pipe_file_close(struct twopence_target *, int);
+extern int	twopence_pipe_list_jobs(struct twopence_target *, twopence_detached_job_t **, unsigned int *);
+extern int	twopence_pipe_reattach(struct twopence_target *, unsigned int, twopence_command_t *, twopence_status_t *);
 extern int	twopence_pipe_extract_file (struct twopence_target *, twopence_file_xfer_t *, twopence_status_t *);
 extern int	twopence_pipe_interrupt_command(struct twopence_target *);
+extern int	twopence_pipe_interrupt_pid(struct twopence_target *, int);
+extern int	twopence_pipe_wait_ready(struct twopence_target *, int);
+extern int	twopence_pipe_connect(struct twopence_target *, int);
+extern int	twopence_pipe_get_pollfds(struct twopence_target *, struct pollfd *, unsigned int, int *);
+extern int	twopence_pipe_dispatch(struct twopence_target *, const struct pollfd *, unsigned int);
 extern int	twopence_pipe_exit_remote(struct twopence_target *);
 extern int	twopence_pipe_disconnect(twopence_target_t *);
 extern int	twopence_pipe_cancel_transactions(twopence_target_t *);
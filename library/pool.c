@@ -0,0 +1,393 @@
+/*
+Distributing independent commands across a pool of equivalent targets.
+
+Every target has a queue of its own, holding the jobs that were submitted
+with an affinity for it; all other jobs go to a shared queue. A target that
+becomes idle takes the oldest job from its own queue, then from the shared
+queue. When both are empty, it steals the newest job from the target with
+the longest queue, so that one slow target does not hold up jobs the others
+could be running.
+
+
+Copyright (C) 2014-2015 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "twopence.h"
+#include "utils.h"
+
+#define TWOPENCE_POOL_SHARED_QUEUE	-1
+
+enum {
+  TWOPENCE_POOL_JOB_QUEUED,
+  TWOPENCE_POOL_JOB_RUNNING,
+  TWOPENCE_POOL_JOB_DONE,
+};
+
+struct twopence_pool_job {
+  twopence_command_t *		cmd;
+  int				state;
+
+  /* The queue the job is waiting in, and the target that ran it */
+  int				queue;
+  int				target;
+
+  int				pid;
+  int				rc;
+  twopence_status_t		status;
+};
+
+struct twopence_pool_member {
+  twopence_target_t *		target;
+
+  /* Index of the job currently running, or -1 */
+  int				job;
+  struct timeval		job_started;
+
+  /* A target that fails with a transport error is not given any more work */
+  bool				down;
+
+  twopence_target_stats_t	stats;
+  twopence_target_pollslice_t	poll;
+};
+
+struct twopence_target_pool {
+  unsigned int			count;
+  struct twopence_pool_member *	member;
+
+  unsigned int			njobs;
+  struct twopence_pool_job *	jobs;
+
+  twopence_target_pollset_t	pollset;
+};
+
+twopence_target_pool_t *
+twopence_target_pool_new(void)
+{
+  return twopence_calloc(1, sizeof(twopence_target_pool_t));
+}
+
+void
+twopence_target_pool_free(twopence_target_pool_t *pool)
+{
+  free(pool->member);
+  free(pool->jobs);
+  twopence_target_pollset_destroy(&pool->pollset);
+  free(pool);
+}
+
+/*
+ * Add a target to the pool, and return its index. The pool does
+ * not take ownership of the target.
+ */
+int
+twopence_target_pool_add_target(twopence_target_pool_t *pool, twopence_target_t *target)
+{
+  struct twopence_pool_member *m;
+
+  if (target == NULL)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  pool->member = twopence_realloc(pool->member, (pool->count + 1) * sizeof(pool->member[0]));
+  m = &pool->member[pool->count];
+  memset(m, 0, sizeof(*m));
+  m->target = target;
+  m->job = -1;
+  return pool->count++;
+}
+
+/*
+ * Queue a command, and return its job ID. If @affinity is a valid target
+ * index, that target will run the job, unless another target runs out of
+ * work first. A negative @affinity means any target will do.
+ *
+ * The command is not copied; it must stay around until the pool has run.
+ */
+int
+twopence_target_pool_submit(twopence_target_pool_t *pool, twopence_command_t *cmd, int affinity)
+{
+  struct twopence_pool_job *job;
+
+  if (cmd == NULL || affinity >= (int) pool->count)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  pool->jobs = twopence_realloc(pool->jobs, (pool->njobs + 1) * sizeof(pool->jobs[0]));
+  job = &pool->jobs[pool->njobs];
+  memset(job, 0, sizeof(*job));
+  job->cmd = cmd;
+  job->state = TWOPENCE_POOL_JOB_QUEUED;
+  job->queue = affinity < 0? TWOPENCE_POOL_SHARED_QUEUE : affinity;
+  job->target = -1;
+  return pool->njobs++;
+}
+
+/*
+ * Return the outcome of a job: 0 if it ran, in which case its exit status
+ * is in @status, or a negative error code. The index of the target that ran
+ * it is returned in @target_index.
+ */
+int
+twopence_target_pool_job_status(const twopence_target_pool_t *pool, int id, twopence_status_t *status, int *target_index)
+{
+  const struct twopence_pool_job *job;
+
+  if (id < 0 || id >= (int) pool->njobs)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  job = &pool->jobs[id];
+  if (job->state != TWOPENCE_POOL_JOB_DONE)
+    return TWOPENCE_INVALID_TRANSACTION;
+
+  if (status)
+    *status = job->status;
+  if (target_index)
+    *target_index = job->target;
+  return job->rc;
+}
+
+int
+twopence_target_pool_get_stats(const twopence_target_pool_t *pool, unsigned int index, twopence_target_stats_t *stats)
+{
+  if (index >= pool->count)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  *stats = pool->member[index].stats;
+  return 0;
+}
+
+/*
+ * Find the oldest (or newest) job waiting in a queue
+ */
+static int
+__twopence_pool_find_queued(const twopence_target_pool_t *pool, int queue, bool newest)
+{
+  int i, found = -1;
+
+  for (i = 0; i < (int) pool->njobs; ++i) {
+    const struct twopence_pool_job *job = &pool->jobs[i];
+
+    if (job->state == TWOPENCE_POOL_JOB_QUEUED && job->queue == queue) {
+      found = i;
+      if (!newest)
+        break;
+    }
+  }
+  return found;
+}
+
+static unsigned int
+__twopence_pool_queue_length(const twopence_target_pool_t *pool, int queue)
+{
+  unsigned int i, count = 0;
+
+  for (i = 0; i < pool->njobs; ++i) {
+    if (pool->jobs[i].state == TWOPENCE_POOL_JOB_QUEUED && pool->jobs[i].queue == queue)
+      count++;
+  }
+  return count;
+}
+
+/*
+ * Pick the next job for an idle target
+ */
+static int
+__twopence_pool_next_job(twopence_target_pool_t *pool, unsigned int index)
+{
+  unsigned int i, victim, longest = 0;
+  int id;
+
+  if ((id = __twopence_pool_find_queued(pool, index, false)) >= 0)
+    return id;
+
+  if ((id = __twopence_pool_find_queued(pool, TWOPENCE_POOL_SHARED_QUEUE, false)) >= 0)
+    return id;
+
+  for (i = 0, victim = index; i < pool->count; ++i) {
+    unsigned int len;
+
+    if (i != index && (len = __twopence_pool_queue_length(pool, i)) > longest) {
+      longest = len;
+      victim = i;
+    }
+  }
+
+  if (victim == index)
+    return -1;
+
+  id = __twopence_pool_find_queued(pool, victim, true);
+  pool->member[index].stats.stolen++;
+  return id;
+}
+
+static inline bool
+__twopence_pool_is_link_error(int rc)
+{
+  return rc == TWOPENCE_OPEN_SESSION_ERROR || rc == TWOPENCE_TRANSPORT_ERROR;
+}
+
+static void
+__twopence_pool_job_done(twopence_target_pool_t *pool, unsigned int index, int rc, const twopence_status_t *status)
+{
+  struct twopence_pool_member *m = &pool->member[index];
+  struct twopence_pool_job *job = &pool->jobs[m->job];
+  struct timeval now, delta;
+
+  gettimeofday(&now, NULL);
+  timersub(&now, &m->job_started, &delta);
+  m->stats.busy_ms += delta.tv_sec * 1000 + delta.tv_usec / 1000;
+  m->job = -1;
+
+  /* The target is gone. Put the job back, so that somebody else can run it */
+  if (__twopence_pool_is_link_error(rc)) {
+    twopence_log_error("target %u of pool failed (%s), not using it any longer", index, twopence_strerror(rc));
+    m->down = true;
+    job->state = TWOPENCE_POOL_JOB_QUEUED;
+    job->queue = TWOPENCE_POOL_SHARED_QUEUE;
+    job->rc = rc;
+    return;
+  }
+
+  job->rc = rc;
+  job->status = *status;
+  job->state = TWOPENCE_POOL_JOB_DONE;
+
+  m->stats.jobs++;
+  if (rc < 0 || status->major != 0 || status->minor != 0)
+    m->stats.failed++;
+}
+
+static void
+__twopence_pool_start(twopence_target_pool_t *pool, unsigned int index, int id)
+{
+  struct twopence_pool_member *m = &pool->member[index];
+  struct twopence_pool_job *job = &pool->jobs[id];
+  twopence_status_t status;
+  bool background;
+  int rc;
+
+  job->state = TWOPENCE_POOL_JOB_RUNNING;
+  job->target = index;
+  m->job = id;
+  gettimeofday(&m->job_started, NULL);
+
+  background = job->cmd->background;
+  job->cmd->background = true;
+  rc = twopence_run_test(m->target, job->cmd, &status);
+  job->cmd->background = background;
+
+  if (rc <= 0) {
+    memset(&status, 0, sizeof(status));
+    __twopence_pool_job_done(pool, index, rc? rc : TWOPENCE_INTERNAL_ERROR, &status);
+    return;
+  }
+
+  job->pid = rc;
+}
+
+/*
+ * Run all queued jobs to completion. Each target runs one job at a time.
+ *
+ * Returns the number of jobs that failed.
+ */
+int
+twopence_target_pool_run(twopence_target_pool_t *pool)
+{
+  unsigned int i, first, running, failed = 0;
+  int id;
+
+  /* Jobs from earlier runs have all completed; count only the new ones */
+  for (first = 0; first < pool->njobs; ++first) {
+    if (pool->jobs[first].state != TWOPENCE_POOL_JOB_DONE)
+      break;
+  }
+
+  while (true) {
+    bool progress = true;
+
+    /* Hand out work to idle targets. Starting a job may fail right away,
+     * leaving the target idle again, so keep going until nothing changes. */
+    while (progress) {
+      progress = false;
+      for (i = 0; i < pool->count; ++i) {
+        struct twopence_pool_member *m = &pool->member[i];
+
+        if (m->down || m->job >= 0)
+          continue;
+        if ((id = __twopence_pool_next_job(pool, i)) < 0)
+          continue;
+
+        __twopence_pool_start(pool, i, id);
+        progress = true;
+      }
+    }
+
+    running = 0;
+    for (i = 0; i < pool->count; ++i) {
+      if (pool->member[i].job >= 0)
+        running++;
+    }
+
+    if (running == 0)
+      break;
+
+    twopence_target_pollset_reset(&pool->pollset);
+    for (i = 0; i < pool->count; ++i) {
+      struct twopence_pool_member *m = &pool->member[i];
+
+      if (m->job >= 0)
+        twopence_target_pollset_add(&pool->pollset, m->target, &m->poll);
+    }
+
+    if (twopence_target_pollset_wait(&pool->pollset) < 0)
+      return TWOPENCE_INTERNAL_ERROR;
+
+    for (i = 0; i < pool->count; ++i) {
+      struct twopence_pool_member *m = &pool->member[i];
+      twopence_status_t status;
+      int rc;
+
+      if (m->job < 0)
+        continue;
+
+      twopence_target_pollset_dispatch(&pool->pollset, m->target, &m->poll);
+
+      /* Each target runs only one job, so whatever completes is ours */
+      rc = twopence_wait_many(m->target, 1, 0, &status);
+      if (rc != 0)
+        __twopence_pool_job_done(pool, i, rc < 0? rc : 0, &status);
+    }
+  }
+
+  /* If all targets went down, whatever is left fails with the error
+   * that took down the last target it was tried on */
+  for (i = first; i < pool->njobs; ++i) {
+    struct twopence_pool_job *job = &pool->jobs[i];
+
+    if (job->state == TWOPENCE_POOL_JOB_QUEUED) {
+      job->state = TWOPENCE_POOL_JOB_DONE;
+      if (job->rc == 0)
+        job->rc = TWOPENCE_OPEN_SESSION_ERROR;
+    }
+    if (job->state == TWOPENCE_POOL_JOB_DONE
+     && (job->rc < 0 || job->status.major != 0 || job->status.minor != 0))
+      failed++;
+  }
+
+  return failed;
+}
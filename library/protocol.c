@@ -46,6 +46,7 @@
 #include <limits.h>
 
 #include "protocol.h"
+#include "utils.h"
 
 
 /*
@@ -54,7 +55,7 @@
 const char *
 twopence_protocol_packet_type_to_string(unsigned int type)
 {
-	static char descbuf[64];
+	static __thread char descbuf[64];
 
 	switch (type) {
 	case TWOPENCE_PROTO_TYPE_HELLO:
@@ -81,6 +82,26 @@ twopence_protocol_packet_type_to_string(unsigned int type)
 		return "timeout";
 	case TWOPENCE_PROTO_TYPE_KEEPALIVE:
 		return "keepalive";
+	case TWOPENCE_PROTO_TYPE_FILE_OPEN:
+		return "open";
+	case TWOPENCE_PROTO_TYPE_FILE_READ:
+		return "pread";
+	case TWOPENCE_PROTO_TYPE_FILE_WRITE:
+		return "pwrite";
+	case TWOPENCE_PROTO_TYPE_FILE_STAT:
+		return "fstat";
+	case TWOPENCE_PROTO_TYPE_FILE_CLOSE:
+		return "close";
+	case TWOPENCE_PROTO_TYPE_FILE_REPLY:
+		return "file-reply";
+	case TWOPENCE_PROTO_TYPE_JOB_LIST:
+		return "job-list";
+	case TWOPENCE_PROTO_TYPE_REATTACH:
+		return "reattach";
+	case TWOPENCE_PROTO_TYPE_JOB:
+		return "job";
+	case TWOPENCE_PROTO_TYPE_MTIME:
+		return "mtime";
 	default:
 		snprintf(descbuf, sizeof(descbuf), "trans-type-%d", type);
 		return descbuf;
@@ -200,6 +221,23 @@ __decode_u32(twopence_buf_t *bp, uint32_t *word)
 	return true;
 }
 
+static inline bool
+__encode_u64(twopence_buf_t *bp, uint64_t word)
+{
+	return __encode_u32(bp, word >> 32) && __encode_u32(bp, word);
+}
+
+static inline bool
+__decode_u64(twopence_buf_t *bp, uint64_t *word)
+{
+	uint32_t hi, lo;
+
+	if (!__decode_u32(bp, &hi) || !__decode_u32(bp, &lo))
+		return false;
+	*word = ((uint64_t) hi << 32) | lo;
+	return true;
+}
+
 static inline bool
 __encode_string(twopence_buf_t *bp, const char *s)
 {
@@ -236,6 +274,33 @@ twopence_protocol_build_data_header(twopence_buf_t *bp, twopence_protocol_state_
 	return bp;
 }
 
+/*
+ * Build just the header of a data packet carrying @count bytes. The data
+ * itself is sent right after it, from a buffer that may be shared with
+ * other transactions (see twopence_sock_xmit_ref).
+ */
+twopence_buf_t *
+twopence_protocol_build_data_header_only(twopence_protocol_state_t *ps, uint16_t channel_id, unsigned int count)
+{
+	twopence_buf_t *bp;
+	twopence_hdr_t hdr;
+
+	assert(count <= TWOPENCE_PROTO_MAX_PAYLOAD - 2);
+
+	hdr.type = TWOPENCE_PROTO_TYPE_CHAN_DATA;
+	hdr.pad = 0;
+	hdr.cid = htons(ps->cid);
+	hdr.xid = htons(ps->xid);
+	hdr.len = htons(TWOPENCE_PROTO_HEADER_SIZE + 2 + count);
+
+	channel_id = htons(channel_id);
+
+	bp = twopence_buf_new(TWOPENCE_PROTO_HEADER_SIZE + 2);
+	twopence_buf_append(bp, &hdr, TWOPENCE_PROTO_HEADER_SIZE);
+	twopence_buf_append(bp, &channel_id, 2);
+	return bp;
+}
+
 static inline twopence_buf_t *
 twopence_protocol_build_uint32_packet(twopence_protocol_state_t *ps, unsigned char type, uint32_t value)
 {
@@ -273,6 +338,34 @@ twopence_protocol_dissect_major_packet(twopence_buf_t *payload, int *status_ret)
 	return true;
 }
 
+/*
+ * Tell the client the modification time of the file it is extracting
+ */
+twopence_buf_t *
+twopence_protocol_build_mtime_packet(twopence_protocol_state_t *ps, time_t mtime)
+{
+	twopence_buf_t *bp;
+
+	bp = twopence_protocol_command_buffer_new();
+	if (!__encode_u64(bp, mtime)) {
+		twopence_buf_free(bp);
+		return NULL;
+	}
+	twopence_protocol_push_header_ps(bp, ps, TWOPENCE_PROTO_TYPE_MTIME);
+	return bp;
+}
+
+bool
+twopence_protocol_dissect_mtime_packet(twopence_buf_t *payload, time_t *mtime_ret)
+{
+	uint64_t mtime;
+
+	if (!__decode_u64(payload, &mtime))
+		return false;
+	*mtime_ret = mtime;
+	return true;
+}
+
 twopence_buf_t *
 twopence_protocol_build_minor_packet(twopence_protocol_state_t *ps, int status)
 {
@@ -338,9 +431,10 @@ twopence_protocol_build_uint_packet_ps(const twopence_protocol_state_t *ps, unsi
 }
 
 twopence_buf_t *
-twopence_protocol_build_hello_packet(unsigned int cid, unsigned int keepalive_timeout)
+twopence_protocol_build_hello_packet(unsigned int cid, unsigned int keepalive_timeout, unsigned int heartbeat_ms)
 {
 	struct twopence_protocol_hello_pkt data;
+	uint16_t heartbeat;
 	twopence_buf_t *bp;
 
 	/* Allocate a large buffer with space reserved for the header */
@@ -353,15 +447,19 @@ twopence_protocol_build_hello_packet(unsigned int cid, unsigned int keepalive_ti
 
 	twopence_buf_append(bp, &data, sizeof(data));
 
+	heartbeat = htons(heartbeat_ms);
+	twopence_buf_append(bp, &heartbeat, sizeof(heartbeat));
+
 	/* Finalize the header */
 	__twopence_protocol_push_header(bp, TWOPENCE_PROTO_TYPE_HELLO, cid, 0);
 	return bp;
 }
 
 bool
-twopence_protocol_dissect_hello_packet(twopence_buf_t *payload, unsigned char *version, unsigned int *keepalive)
+twopence_protocol_dissect_hello_packet(twopence_buf_t *payload, unsigned char *version, unsigned int *keepalive, unsigned int *heartbeat_ms)
 {
 	struct twopence_protocol_hello_pkt data;
+	uint16_t heartbeat;
 
 	if (!twopence_buf_get(payload, &data, sizeof(data)))
 		return false;
@@ -369,6 +467,11 @@ twopence_protocol_dissect_hello_packet(twopence_buf_t *payload, unsigned char *v
 	version[0] = data.vers_major;
 	version[1] = data.vers_minor;
 	*keepalive = ntohs(data.keepalive);
+
+	/* The heartbeat field is optional */
+	*heartbeat_ms = 0;
+	if (twopence_buf_get(payload, &heartbeat, sizeof(heartbeat)))
+		*heartbeat_ms = ntohs(heartbeat);
 	return true;
 }
 
@@ -409,52 +512,96 @@ twopence_protocol_dissect_inject_packet(twopence_buf_t *payload, twopence_file_x
 	return true;
 }
 
-twopence_buf_t *
-twopence_protocol_build_command_packet(const twopence_protocol_state_t *ps, const twopence_command_t *cmd)
+static bool
+__twopence_protocol_encode_command(twopence_buf_t *bp, const twopence_command_t *cmd)
 {
-	twopence_buf_t *bp;
 	unsigned int i;
 
-	/* Allocate a large buffer with space reserved for the header */
-	bp = twopence_protocol_command_buffer_new();
-
 	if (!__encode_string(bp, cmd->user)
 	 || !__encode_string(bp, cmd->command)
 	 || !__encode_u32(bp, cmd->timeout)
 	 || !__encode_u32(bp, cmd->request_tty)
-	 /* reserve two words for future extensions */
-	 || !__encode_u32(bp, 0)
+	 || !__encode_u32(bp, cmd->detach? TWOPENCE_PROTO_COMMAND_DETACH : 0)
+	 /* reserve one word for future extensions */
 	 || !__encode_u32(bp, 0))
-		goto failed;
+		return false;
 
 	for (i = 0; i < cmd->env.count; ++i) {
 		const char *var = cmd->env.array[i];
 
 		twopence_debug("send env var %s", var);
 		if (!__encode_string(bp, var))
-			goto failed;
+			return false;
+	}
+
+	return true;
+}
+
+twopence_buf_t *
+twopence_protocol_build_command_packet(const twopence_protocol_state_t *ps, const twopence_command_t *cmd)
+{
+	twopence_buf_t *bp;
+
+	/* The command was encoded by twopence_command_prepare() */
+	if (cmd->prepared)
+		return twopence_protocol_build_prepared_packet(ps, TWOPENCE_PROTO_TYPE_COMMAND, cmd->prepared);
+
+	/* Allocate a large buffer with space reserved for the header */
+	bp = twopence_protocol_command_buffer_new();
+
+	if (!__twopence_protocol_encode_command(bp, cmd)) {
+		twopence_buf_free(bp);
+		return NULL;
 	}
 
 	/* Finalize the header */
 	twopence_protocol_push_header_ps(bp, ps, TWOPENCE_PROTO_TYPE_COMMAND);
 	return bp;
+}
+
+/*
+ * Encode the payload of a command packet once, so that it can be sent
+ * any number of times using twopence_protocol_build_prepared_packet().
+ * The buffer returned is only as large as it needs to be.
+ */
+twopence_buf_t *
+twopence_protocol_build_command_payload(const twopence_command_t *cmd)
+{
+	twopence_buf_t *bp, *payload = NULL;
+
+	bp = twopence_protocol_command_buffer_new();
+	if (__twopence_protocol_encode_command(bp, cmd))
+		payload = twopence_buf_clone(bp);
 
-failed:
 	twopence_buf_free(bp);
-	return NULL;
+	return payload;
+}
+
+twopence_buf_t *
+twopence_protocol_build_prepared_packet(const twopence_protocol_state_t *ps, unsigned char type, const twopence_buf_t *payload)
+{
+	unsigned int count = twopence_buf_count(payload);
+	twopence_buf_t *bp;
+
+	bp = twopence_buf_new(TWOPENCE_PROTO_HEADER_SIZE + count);
+	bp->head = bp->tail = TWOPENCE_PROTO_HEADER_SIZE;
+	twopence_buf_append(bp, twopence_buf_head(payload), count);
+
+	twopence_protocol_push_header_ps(bp, ps, type);
+	return bp;
 }
 
 bool
 twopence_protocol_dissect_command_packet(twopence_buf_t *payload, twopence_command_t *cmd)
 {
 	const char *user, *command, *envar;
-	uint32_t timeout, request_tty, reserved;
+	uint32_t timeout, request_tty, flags, reserved;
 
 	if (!(user = __decode_string(payload))
 	 || !(command = __decode_string(payload))
 	 || !__decode_u32(payload, &timeout)
 	 || !__decode_u32(payload, &request_tty)
-	 || !__decode_u32(payload, &reserved)
+	 || !__decode_u32(payload, &flags)
 	 || !__decode_u32(payload, &reserved))
 		return false;
 
@@ -473,6 +620,7 @@ twopence_protocol_dissect_command_packet(twopence_buf_t *payload, twopence_comma
 	cmd->command = command;
 	cmd->timeout = timeout;
 	cmd->request_tty = !!request_tty;
+	cmd->detach = !!(flags & TWOPENCE_PROTO_COMMAND_DETACH);
 	return true;
 }
 
@@ -491,6 +639,14 @@ twopence_protocol_build_extract_packet(const twopence_protocol_state_t *ps, cons
 		return NULL;
 	}
 
+	/* The condition is optional; older servers ignore it */
+	if (xfer->if_changed
+	 && !(__encode_u64(bp, xfer->known_size)
+	   && __encode_u64(bp, xfer->known_mtime))) {
+		twopence_buf_free(bp);
+		return NULL;
+	}
+
 	/* Finalize the header */
 	twopence_protocol_push_header_ps(bp, ps, TWOPENCE_PROTO_TYPE_EXTRACT);
 	return bp;
@@ -507,6 +663,222 @@ twopence_protocol_dissect_extract_packet(twopence_buf_t *payload, twopence_file_
 
 	xfer->user = user;
 	xfer->remote.name = file;
+
+	if (twopence_buf_count(payload) != 0) {
+		uint64_t size, mtime;
+
+		if (!__decode_u64(payload, &size)
+		 || !__decode_u64(payload, &mtime))
+			return false;
+		xfer->if_changed = true;
+		xfer->known_size = size;
+		xfer->known_mtime = mtime;
+	}
+	return true;
+}
+
+/*
+ * Remote file handles.
+ *  FILE_OPEN:	opens a file, and starts a transaction that lasts until FILE_CLOSE
+ *  FILE_READ, FILE_WRITE, FILE_STAT:
+ *		requests on the open file. Each carries a tag chosen by the client,
+ *		which the server copies to its FILE_REPLY.
+ */
+twopence_buf_t *
+twopence_protocol_build_file_open_packet(const twopence_protocol_state_t *ps, const char *user, const char *path,
+				unsigned int flags, unsigned int mode)
+{
+	twopence_buf_t *bp;
+
+	bp = twopence_protocol_command_buffer_new();
+	if (!__encode_string(bp, user)
+	 || !__encode_string(bp, path)
+	 || !__encode_u32(bp, flags)
+	 || !__encode_u32(bp, mode)) {
+		twopence_buf_free(bp);
+		return NULL;
+	}
+
+	twopence_protocol_push_header_ps(bp, ps, TWOPENCE_PROTO_TYPE_FILE_OPEN);
+	return bp;
+}
+
+bool
+twopence_protocol_dissect_file_open_packet(twopence_buf_t *payload, const char **user, const char **path,
+				unsigned int *flags, unsigned int *mode)
+{
+	uint32_t flags32, mode32;
+
+	if (!(*user = __decode_string(payload))
+	 || !(*path = __decode_string(payload))
+	 || !__decode_u32(payload, &flags32)
+	 || !__decode_u32(payload, &mode32))
+		return false;
+
+	*flags = flags32;
+	*mode = mode32;
+	return true;
+}
+
+twopence_buf_t *
+twopence_protocol_build_file_request_packet(const twopence_protocol_state_t *ps, const twopence_file_io_t *io, uint32_t tag)
+{
+	twopence_buf_t *bp;
+	unsigned char type;
+	unsigned int size;
+	bool ok;
+
+	/* Requests are small, except for the data of a write; size the buffer
+	 * to fit rather than allocating a full packet for each of them */
+	size = TWOPENCE_PROTO_HEADER_SIZE + 4 + 8 + 4;
+	if (io->op == TWOPENCE_FILE_PWRITE)
+		size += io->count;
+
+	bp = twopence_buf_new(size);
+	bp->head = bp->tail = TWOPENCE_PROTO_HEADER_SIZE;
+
+	switch (io->op) {
+	case TWOPENCE_FILE_PREAD:
+		type = TWOPENCE_PROTO_TYPE_FILE_READ;
+		ok = __encode_u32(bp, tag)
+		  && __encode_u64(bp, io->offset)
+		  && __encode_u32(bp, io->count);
+		break;
+
+	case TWOPENCE_FILE_PWRITE:
+		type = TWOPENCE_PROTO_TYPE_FILE_WRITE;
+		ok = __encode_u32(bp, tag)
+		  && __encode_u64(bp, io->offset)
+		  && twopence_buf_append(bp, io->data, io->count);
+		break;
+
+	case TWOPENCE_FILE_FSTAT:
+		type = TWOPENCE_PROTO_TYPE_FILE_STAT;
+		ok = __encode_u32(bp, tag);
+		break;
+
+	default:
+		ok = false;
+	}
+
+	if (!ok) {
+		twopence_buf_free(bp);
+		return NULL;
+	}
+
+	twopence_protocol_push_header_ps(bp, ps, type);
+	return bp;
+}
+
+/*
+ * For FILE_WRITE, the data to be written is left in the payload buffer,
+ * and its size is returned in @count.
+ */
+bool
+twopence_protocol_dissect_file_request_packet(twopence_buf_t *payload, unsigned int type,
+				uint32_t *tag, uint64_t *offset, uint32_t *count)
+{
+	*offset = 0;
+	*count = 0;
+
+	if (!__decode_u32(payload, tag))
+		return false;
+
+	switch (type) {
+	case TWOPENCE_PROTO_TYPE_FILE_READ:
+		return __decode_u64(payload, offset)
+		    && __decode_u32(payload, count);
+
+	case TWOPENCE_PROTO_TYPE_FILE_WRITE:
+		if (!__decode_u64(payload, offset))
+			return false;
+		*count = twopence_buf_count(payload);
+		return true;
+
+	case TWOPENCE_PROTO_TYPE_FILE_STAT:
+		return true;
+	}
+
+	return false;
+}
+
+twopence_buf_t *
+twopence_protocol_build_file_reply_packet(const twopence_protocol_state_t *ps, uint32_t tag, int status,
+				uint32_t result, const void *data, unsigned int count)
+{
+	twopence_buf_t *bp;
+
+	bp = twopence_protocol_command_buffer_new();
+	if (!__encode_u32(bp, tag)
+	 || !__encode_u32(bp, status)
+	 || !__encode_u32(bp, result)
+	 || (count && !twopence_buf_append(bp, data, count))) {
+		twopence_buf_free(bp);
+		return NULL;
+	}
+
+	twopence_protocol_push_header_ps(bp, ps, TWOPENCE_PROTO_TYPE_FILE_REPLY);
+	return bp;
+}
+
+twopence_buf_t *
+twopence_protocol_build_file_stat_reply_packet(const twopence_protocol_state_t *ps, uint32_t tag,
+				const twopence_file_stat_t *st)
+{
+	twopence_buf_t *bp;
+
+	bp = twopence_protocol_command_buffer_new();
+	if (!__encode_u32(bp, tag)
+	 || !__encode_u32(bp, 0)
+	 || !__encode_u32(bp, 0)
+	 || !__encode_u64(bp, st->size)
+	 || !__encode_u32(bp, st->mode)
+	 || !__encode_u32(bp, st->uid)
+	 || !__encode_u32(bp, st->gid)
+	 || !__encode_u64(bp, st->mtime)) {
+		twopence_buf_free(bp);
+		return NULL;
+	}
+
+	twopence_protocol_push_header_ps(bp, ps, TWOPENCE_PROTO_TYPE_FILE_REPLY);
+	return bp;
+}
+
+/*
+ * Any data that comes with the reply is left in the payload buffer
+ */
+bool
+twopence_protocol_dissect_file_reply_packet(twopence_buf_t *payload, uint32_t *tag, int *status, uint32_t *result)
+{
+	uint32_t status32;
+
+	if (!__decode_u32(payload, tag)
+	 || !__decode_u32(payload, &status32)
+	 || !__decode_u32(payload, result))
+		return false;
+
+	*status = status32;
+	return true;
+}
+
+bool
+twopence_protocol_dissect_file_stat(twopence_buf_t *payload, twopence_file_stat_t *st)
+{
+	uint64_t size, mtime;
+	uint32_t mode, uid, gid;
+
+	if (!__decode_u64(payload, &size)
+	 || !__decode_u32(payload, &mode)
+	 || !__decode_u32(payload, &uid)
+	 || !__decode_u32(payload, &gid)
+	 || !__decode_u64(payload, &mtime))
+		return false;
+
+	st->size = size;
+	st->mode = mode;
+	st->uid = uid;
+	st->gid = gid;
+	st->mtime = mtime;
 	return true;
 }
 
@@ -586,3 +958,81 @@ twopence_protocol_dissect_ps(twopence_buf_t *bp, twopence_buf_t *payload, twopen
 	ps->xid = ntohs(hdr->xid);
 	return hdr;
 }
+
+/*
+ * Detached jobs
+ */
+twopence_buf_t *
+twopence_protocol_build_job_packet(const twopence_protocol_state_t *ps, const twopence_detached_job_t *job)
+{
+	twopence_buf_t *bp;
+
+	bp = twopence_protocol_command_buffer_new();
+	if (!__encode_u32(bp, job->id)
+	 || !__encode_u32(bp, job->running? TWOPENCE_PROTO_JOB_RUNNING : 0)
+	 || !__encode_u32(bp, job->status.major)
+	 || !__encode_u32(bp, job->status.minor)
+	 || !__encode_u64(bp, job->nbytes)
+	 || !__encode_string(bp, job->command)) {
+		twopence_buf_free(bp);
+		return NULL;
+	}
+
+	twopence_protocol_push_header_ps(bp, ps, TWOPENCE_PROTO_TYPE_JOB);
+	return bp;
+}
+
+bool
+twopence_protocol_dissect_job_packet(twopence_buf_t *payload, twopence_detached_job_t *job)
+{
+	uint32_t id, flags, major, minor;
+	uint64_t nbytes;
+	const char *command;
+
+	if (!__decode_u32(payload, &id)
+	 || !__decode_u32(payload, &flags)
+	 || !__decode_u32(payload, &major)
+	 || !__decode_u32(payload, &minor)
+	 || !__decode_u64(payload, &nbytes)
+	 || !(command = __decode_string(payload)))
+		return false;
+
+	memset(job, 0, sizeof(*job));
+	job->id = id;
+	job->running = !!(flags & TWOPENCE_PROTO_JOB_RUNNING);
+	job->status.major = major;
+	job->status.minor = minor;
+	job->nbytes = nbytes;
+	job->command = twopence_strdup(command);
+	return true;
+}
+
+twopence_buf_t *
+twopence_protocol_build_reattach_packet(const twopence_protocol_state_t *ps, unsigned int job_id, unsigned int flags)
+{
+	twopence_buf_t *bp;
+
+	bp = twopence_protocol_command_buffer_new();
+	if (!__encode_u32(bp, job_id)
+	 || !__encode_u32(bp, flags)) {
+		twopence_buf_free(bp);
+		return NULL;
+	}
+
+	twopence_protocol_push_header_ps(bp, ps, TWOPENCE_PROTO_TYPE_REATTACH);
+	return bp;
+}
+
+bool
+twopence_protocol_dissect_reattach_packet(twopence_buf_t *payload, unsigned int *job_id, unsigned int *flags)
+{
+	uint32_t id32, flags32;
+
+	if (!__decode_u32(payload, &id32)
+	 || !__decode_u32(payload, &flags32))
+		return false;
+
+	*job_id = id32;
+	*flags = flags32;
+	return true;
+}
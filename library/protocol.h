@@ -60,6 +60,25 @@ struct header {
 #define TWOPENCE_PROTO_TYPE_MINOR	'm'
 #define TWOPENCE_PROTO_TYPE_TIMEOUT	'T'
 #define TWOPENCE_PROTO_TYPE_KEEPALIVE	'K'
+#define TWOPENCE_PROTO_TYPE_FILE_OPEN	'o'
+#define TWOPENCE_PROTO_TYPE_FILE_READ	'r'
+#define TWOPENCE_PROTO_TYPE_FILE_WRITE	'w'
+#define TWOPENCE_PROTO_TYPE_FILE_STAT	's'
+#define TWOPENCE_PROTO_TYPE_FILE_CLOSE	'x'
+#define TWOPENCE_PROTO_TYPE_FILE_REPLY	'R'
+#define TWOPENCE_PROTO_TYPE_JOB_LIST	'j'
+#define TWOPENCE_PROTO_TYPE_REATTACH	'a'
+#define TWOPENCE_PROTO_TYPE_JOB		'J'
+#define TWOPENCE_PROTO_TYPE_MTIME	't'
+
+/* Flags in the command packet */
+#define TWOPENCE_PROTO_COMMAND_DETACH	0x0001
+
+/* Flags in the reattach packet */
+#define TWOPENCE_PROTO_REATTACH_NO_OUTPUT 0x0001
+
+/* Flags in the job packet */
+#define TWOPENCE_PROTO_JOB_RUNNING	0x0001
 
 typedef struct twopence_protocol_state {
 	uint16_t	cid;
@@ -68,10 +87,17 @@ typedef struct twopence_protocol_state {
 
 #define TWOPENCE_PROTO_DEFAULT_KEEPALIVE 60
 
+/* Heartbeat intervals are given in milliseconds; we refuse to go below
+ * this value */
+#define TWOPENCE_PROTO_MIN_HEARTBEAT	10
+
 struct twopence_protocol_hello_pkt {
 	unsigned char	vers_major;
 	unsigned char	vers_minor;
 	uint16_t	keepalive;
+	/* Optionally followed by
+	 *	uint16_t heartbeat;
+	 * Older peers do not send it, and ignore it when receiving. */
 } __attribute((packed));
 
 extern const char *	twopence_protocol_packet_type_to_string(unsigned int type);
@@ -83,22 +109,45 @@ extern twopence_buf_t *	twopence_protocol_build_simple_packet(unsigned char type
 extern twopence_buf_t *	twopence_protocol_build_simple_packet_ps(twopence_protocol_state_t *, unsigned char);
 extern twopence_buf_t *	twopence_protocol_build_major_packet(twopence_protocol_state_t *ps, int status);
 extern twopence_buf_t *	twopence_protocol_build_minor_packet(twopence_protocol_state_t *ps, int status);
-extern twopence_buf_t *	twopence_protocol_build_hello_packet(unsigned int cid, unsigned int keepalive_interval);
+extern twopence_buf_t *	twopence_protocol_build_hello_packet(unsigned int cid, unsigned int keepalive_interval, unsigned int heartbeat_ms);
 extern twopence_buf_t *	twopence_protocol_build_data_header(twopence_buf_t *, twopence_protocol_state_t *, uint16_t);
+extern twopence_buf_t *	twopence_protocol_build_data_header_only(twopence_protocol_state_t *, uint16_t, unsigned int);
 extern twopence_buf_t *	twopence_protocol_build_eof_packet(twopence_protocol_state_t *, uint16_t);
 extern twopence_buf_t *	twopence_protocol_build_inject_packet(const twopence_protocol_state_t *ps, const twopence_file_xfer_t *);
 extern twopence_buf_t *	twopence_protocol_build_extract_packet(const twopence_protocol_state_t *ps, const twopence_file_xfer_t *);
 extern twopence_buf_t *	twopence_protocol_build_command_packet(const twopence_protocol_state_t *ps, const twopence_command_t *);
+extern twopence_buf_t *	twopence_protocol_build_command_payload(const twopence_command_t *);
+extern twopence_buf_t *	twopence_protocol_build_file_open_packet(const twopence_protocol_state_t *ps, const char *user, const char *path,
+				unsigned int flags, unsigned int mode);
+extern twopence_buf_t *	twopence_protocol_build_file_request_packet(const twopence_protocol_state_t *ps, const twopence_file_io_t *io, uint32_t tag);
+extern twopence_buf_t *	twopence_protocol_build_file_reply_packet(const twopence_protocol_state_t *ps, uint32_t tag, int status,
+				uint32_t result, const void *data, unsigned int count);
+extern twopence_buf_t *	twopence_protocol_build_file_stat_reply_packet(const twopence_protocol_state_t *ps, uint32_t tag,
+				const twopence_file_stat_t *st);
+extern twopence_buf_t *	twopence_protocol_build_job_packet(const twopence_protocol_state_t *ps, const twopence_detached_job_t *job);
+extern twopence_buf_t *	twopence_protocol_build_reattach_packet(const twopence_protocol_state_t *ps, unsigned int job_id, unsigned int flags);
+extern twopence_buf_t *	twopence_protocol_build_prepared_packet(const twopence_protocol_state_t *ps, unsigned char type,
+				const twopence_buf_t *payload);
 extern twopence_buf_t *	twopence_protocol_recv_buffer_new(void);
 extern int		twopence_protocol_buffer_need_to_recv(const twopence_buf_t *bp);
 extern bool		twopence_protocol_buffer_complete(const twopence_buf_t *bp);
 extern const twopence_hdr_t *twopence_protocol_dissect(twopence_buf_t *bp, twopence_buf_t *payload);
 extern const twopence_hdr_t *twopence_protocol_dissect_ps(twopence_buf_t *bp, twopence_buf_t *payload, twopence_protocol_state_t *ps);
+extern twopence_buf_t *	twopence_protocol_build_mtime_packet(twopence_protocol_state_t *ps, time_t mtime);
 extern bool		twopence_protocol_dissect_major_packet(twopence_buf_t *payload, int *status_ret);
+extern bool		twopence_protocol_dissect_mtime_packet(twopence_buf_t *payload, time_t *mtime_ret);
 extern bool		twopence_protocol_dissect_minor_packet(twopence_buf_t *payload, int *status_ret);
-extern bool		twopence_protocol_dissect_hello_packet(twopence_buf_t *payload, unsigned char version[2], unsigned int *keepalive);
+extern bool		twopence_protocol_dissect_hello_packet(twopence_buf_t *payload, unsigned char version[2], unsigned int *keepalive, unsigned int *heartbeat_ms);
 extern bool		twopence_protocol_dissect_inject_packet(twopence_buf_t *payload, twopence_file_xfer_t *xfer);
 extern bool		twopence_protocol_dissect_extract_packet(twopence_buf_t *payload, twopence_file_xfer_t *xfer);
 extern bool		twopence_protocol_dissect_command_packet(twopence_buf_t *payload, twopence_command_t *cmd);
+extern bool		twopence_protocol_dissect_file_open_packet(twopence_buf_t *payload, const char **user, const char **path,
+				unsigned int *flags, unsigned int *mode);
+extern bool		twopence_protocol_dissect_file_request_packet(twopence_buf_t *payload, unsigned int type,
+				uint32_t *tag, uint64_t *offset, uint32_t *count);
+extern bool		twopence_protocol_dissect_file_reply_packet(twopence_buf_t *payload, uint32_t *tag, int *status, uint32_t *result);
+extern bool		twopence_protocol_dissect_file_stat(twopence_buf_t *payload, twopence_file_stat_t *st);
+extern bool		twopence_protocol_dissect_job_packet(twopence_buf_t *payload, twopence_detached_job_t *job);
+extern bool		twopence_protocol_dissect_reattach_packet(twopence_buf_t *payload, unsigned int *job_id, unsigned int *flags);
 
 #endif /* PROTOCOL_H */
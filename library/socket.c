@@ -64,6 +64,10 @@ struct twopence_socket {
 
 	twopence_buf_t *	recv_buf;
 
+	/* Optional bandwidth limits; owned by whoever set them */
+	twopence_sock_ratelimit_t *xmit_limit;
+	twopence_sock_ratelimit_t *recv_limit;
+
 	bool			read_eof;
 	unsigned char		write_eof;
 
@@ -76,11 +80,18 @@ struct twopence_packet {
 	unsigned int		seq;
 	unsigned int		bytes;
 	twopence_buf_t *	buffer;
+
+	/* If set, buffer is just a view of this one, which
+	 * we hold a reference on. */
+	twopence_buf_t *	shared;
 };
 
 #define SHUTDOWN_WANTED		1
 #define SHUTDOWN_SENT		2
 
+/* When rate limited, do not bother waking up for less than this */
+#define RATELIMIT_MIN_CHUNK	1024
+
 static twopence_packet_t *
 twopence_packet_new(twopence_buf_t *bp)
 {
@@ -97,6 +108,8 @@ twopence_packet_free(twopence_packet_t *pkt)
 {
 	if (pkt->buffer)
 		twopence_buf_free(pkt->buffer);
+	if (pkt->shared)
+		twopence_buf_free(pkt->shared);
 	free(pkt);
 }
 
@@ -221,6 +234,135 @@ twopence_sock_set_noclose(twopence_sock_t *sock)
 	sock->closeit = false;
 }
 
+/*
+ * Token bucket handling
+ */
+/* Unless set explicitly, the bucket holds one second's worth of data */
+static inline long
+__socket_ratelimit_size(const twopence_sock_ratelimit_t *rl)
+{
+	return rl->burst? rl->burst : rl->rate;
+}
+
+void
+twopence_sock_ratelimit_set(twopence_sock_ratelimit_t *rl, unsigned int rate, unsigned int burst)
+{
+	rl->rate = rate;
+	rl->burst = burst;
+
+	/* Start out with a full bucket */
+	rl->tokens = __socket_ratelimit_size(rl);
+	gettimeofday(&rl->refilled, NULL);
+}
+
+unsigned long
+twopence_sock_ratelimit_throttled(const twopence_sock_ratelimit_t *rl)
+{
+	unsigned long msec = rl->throttled_ms;
+
+	if (timerisset(&rl->throttled_since)) {
+		struct timeval now, delta;
+
+		gettimeofday(&now, NULL);
+		timersub(&now, &rl->throttled_since, &delta);
+		msec += delta.tv_sec * 1000 + delta.tv_usec / 1000;
+	}
+	return msec;
+}
+
+static void
+__socket_ratelimit_refill(twopence_sock_ratelimit_t *rl, const struct timeval *now)
+{
+	struct timeval delta;
+	unsigned long long add;
+
+	timersub(now, &rl->refilled, &delta);
+	if (delta.tv_sec < 0) {
+		/* Clock went backwards */
+		rl->refilled = *now;
+		return;
+	}
+
+	add = (delta.tv_sec * 1000000ULL + delta.tv_usec) * rl->rate / 1000000;
+	if (add == 0)
+		return;
+
+	rl->refilled = *now;
+	if (rl->tokens + (long long) add > __socket_ratelimit_size(rl))
+		rl->tokens = __socket_ratelimit_size(rl);
+	else
+		rl->tokens += add;
+}
+
+/*
+ * Return how many of @count bytes we may transfer right now.
+ * If the bucket does not hold enough tokens, return 0, and set
+ * *retry to the time when it will.
+ */
+static unsigned int
+__socket_ratelimit_allow(twopence_sock_ratelimit_t *rl, unsigned int count, struct timeval *retry)
+{
+	struct timeval now, delta;
+	unsigned int want;
+
+	if (rl == NULL || rl->rate == 0 || count == 0)
+		return count;
+
+	gettimeofday(&now, NULL);
+	__socket_ratelimit_refill(rl, &now);
+
+	want = count;
+	if (want > RATELIMIT_MIN_CHUNK)
+		want = RATELIMIT_MIN_CHUNK;
+	if (want > __socket_ratelimit_size(rl))
+		want = __socket_ratelimit_size(rl);
+
+	if (rl->tokens < (long) want) {
+		if (!timerisset(&rl->throttled_since))
+			rl->throttled_since = now;
+
+		if (retry) {
+			unsigned long long usec;
+
+			usec = (want - rl->tokens) * 1000000ULL / rl->rate + 1;
+			delta.tv_sec = usec / 1000000;
+			delta.tv_usec = usec % 1000000;
+			timeradd(&rl->refilled, &delta, retry);
+		}
+		return 0;
+	}
+
+	if (timerisset(&rl->throttled_since)) {
+		timersub(&now, &rl->throttled_since, &delta);
+		rl->throttled_ms += delta.tv_sec * 1000 + delta.tv_usec / 1000;
+		timerclear(&rl->throttled_since);
+	}
+
+	if ((long) count > rl->tokens)
+		count = rl->tokens;
+	return count;
+}
+
+static inline void
+__socket_ratelimit_consume(twopence_sock_ratelimit_t *rl, unsigned int count)
+{
+	if (rl != NULL && rl->rate != 0)
+		rl->tokens -= count;
+}
+
+/*
+ * Limit the bandwidth of this socket. Data queued for transmission is held
+ * back, and the socket is not polled for input, while the respective bucket
+ * is empty. Synchronous transfers are not delayed if nothing is queued,
+ * but they are charged to the bucket, too.
+ */
+void
+twopence_sock_set_ratelimit(twopence_sock_t *sock, twopence_sock_ratelimit_t *xmit, twopence_sock_ratelimit_t *recv)
+{
+	sock->xmit_limit = xmit;
+	sock->recv_limit = recv;
+}
+
 void
 twopence_sock_free(twopence_sock_t *sock)
 {
@@ -253,6 +395,16 @@ twopence_sock_recv_buffer(twopence_sock_t *sock, twopence_buf_t *bp)
 		return -1;
 	}
 
+	/* If we're called although the bucket is empty, do not
+	 * hold up the caller; we'll just make up for it later. */
+	if (sock->recv_limit) {
+		unsigned int allowed;
+
+		allowed = __socket_ratelimit_allow(sock->recv_limit, count, NULL);
+		if (allowed != 0)
+			count = allowed;
+	}
+
 #if 0
 	/* Testing: simulate serial pipe behavior - large packets get chopped
 	 * up into 4k chunks */
@@ -261,9 +413,10 @@ twopence_sock_recv_buffer(twopence_sock_t *sock, twopence_buf_t *bp)
 #endif
 
 	n = read(sock->fd, twopence_buf_tail(bp), count);
-	if (n > 0)
+	if (n > 0) {
 		twopence_buf_advance_tail(bp, n);
-	else if (n < 0)
+		__socket_ratelimit_consume(sock->recv_limit, n);
+	} else if (n < 0)
 		twopence_debug("%s: recv() returns error: %m", __func__);
 	return n;
 }
@@ -282,6 +435,36 @@ twopence_sock_recv_buffer_blocking(twopence_sock_t *sock, twopence_buf_t *bp)
 	return n;
 }
 
+/*
+ * Like twopence_sock_recv_buffer_blocking, but give up after timeout_ms.
+ * A negative timeout waits forever. The timeout covers this one read only;
+ * callers that need several reads must pass in the time that is left.
+ */
+int
+twopence_sock_recv_buffer_timeout(twopence_sock_t *sock, twopence_buf_t *bp, int timeout_ms)
+{
+	struct pollfd pfd;
+	int n;
+
+	if (timeout_ms < 0)
+		return twopence_sock_recv_buffer_blocking(sock, bp);
+
+	pfd.fd = sock->fd;
+	pfd.events = POLLIN;
+	do {
+		n = poll(&pfd, 1, timeout_ms);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0)
+		return -1;
+	if (n == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	return twopence_sock_recv_buffer(sock, bp);
+}
+
 twopence_buf_t *
 twopence_sock_take_recvbuf(twopence_sock_t *sock)
 {
@@ -341,6 +524,7 @@ twopence_sock_write(twopence_sock_t *sock, twopence_buf_t *bp, unsigned int coun
 		if (sock->xmit_ts.enabled)
 			gettimeofday(&sock->xmit_ts.when, NULL);
 		sock->bytes_sent += n;
+		__socket_ratelimit_consume(sock->xmit_limit, n);
 	}
 	return n;
 }
@@ -358,6 +542,27 @@ twopence_sock_send_buffer(twopence_sock_t *sock, twopence_buf_t *bp)
 	return n;
 }
 
+/*
+ * Send as much of the buffer as the rate limit allows
+ */
+static int
+__socket_send_buffer_limited(twopence_sock_t *sock, twopence_buf_t *bp)
+{
+	unsigned int count;
+	int n;
+
+	count = __socket_ratelimit_allow(sock->xmit_limit, twopence_buf_count(bp), NULL);
+	if (count == 0)
+		return 0;
+
+	n = twopence_sock_write(sock, bp, count);
+	if (n > 0) {
+		twopence_debug2("%s(%d): wrote %u bytes\n", __func__, sock->fd, n);
+		twopence_buf_advance_head(bp, n);
+	}
+	return n;
+}
+
 int
 twopence_sock_xmit_queue_flush(twopence_sock_t *sock)
 {
@@ -384,16 +589,35 @@ twopence_sock_xmit_queue_flush(twopence_sock_t *sock)
  *
  * Independent of the above
  *  unshare:     create a clone of the buffer object before queuing it
+ *  reference:   queue a reference to the buffer rather than a copy
  */
 #define TWOPENCE_SOCK_XMIT_TRYTOWRITE	0x0001
 #define TWOPENCE_SOCK_XMIT_SYNCHRONOUS	0x0002
 #define TWOPENCE_SOCK_XMIT_CLONEBUF	0x0004
+#define TWOPENCE_SOCK_XMIT_REFBUF	0x0008
 
 static int
 __socket_queue_xmit(twopence_sock_t *sock, twopence_buf_t *bp, int flags)
 {
+	twopence_buf_t *shared = NULL;
+	twopence_packet_t *pkt;
 	int n = 0, f;
 
+	/* The buffer may be queued to other sockets, too, so we must not
+	 * touch its head. Send from a private view of its data instead. */
+	if (flags & TWOPENCE_SOCK_XMIT_REFBUF) {
+		shared = bp;
+		bp = twopence_calloc(1, sizeof(*bp));
+		twopence_buf_init_static(bp, (void *) twopence_buf_head(shared), twopence_buf_count(shared));
+	}
+
+	/* Do not bypass the rate limit by flushing out data that is being
+	 * held back; rather, queue this buffer behind it. */
+	if ((flags & TWOPENCE_SOCK_XMIT_SYNCHRONOUS)
+	 && sock->xmit_limit && sock->xmit_limit->rate
+	 && !twopence_queue_empty(&sock->xmit_queue))
+		flags &= ~TWOPENCE_SOCK_XMIT_SYNCHRONOUS;
+
 	f = fcntl(sock->fd, F_GETFL);
 	if (flags & TWOPENCE_SOCK_XMIT_SYNCHRONOUS)
 		fcntl(sock->fd, F_SETFL, f & ~O_NONBLOCK);
@@ -425,7 +649,7 @@ __socket_queue_xmit(twopence_sock_t *sock, twopence_buf_t *bp, int flags)
 		} else
 		if (flags & TWOPENCE_SOCK_XMIT_TRYTOWRITE) {
 			/* opportunistic - write some */
-			(void) twopence_sock_send_buffer(sock, bp);
+			(void) __socket_send_buffer_limited(sock, bp);
 		}
 	}
 
@@ -433,7 +657,10 @@ __socket_queue_xmit(twopence_sock_t *sock, twopence_buf_t *bp, int flags)
 	if (twopence_buf_count(bp) != 0) {
 		if (flags & TWOPENCE_SOCK_XMIT_CLONEBUF)
 			bp = twopence_buf_clone(bp);
-		twopence_queue_append(&sock->xmit_queue, twopence_packet_new(bp));
+		pkt = twopence_packet_new(bp);
+		if (shared)
+			pkt->shared = twopence_buf_hold(shared);
+		twopence_queue_append(&sock->xmit_queue, pkt);
 		goto out;
 	}
 
@@ -458,14 +685,27 @@ twopence_sock_xmit_shared(twopence_sock_t *sock, twopence_buf_t *bp)
 	return __socket_queue_xmit(sock, bp, TWOPENCE_SOCK_XMIT_TRYTOWRITE | TWOPENCE_SOCK_XMIT_CLONEBUF);
 }
 
+/*
+ * Queue a buffer that is sent to several sockets, such as a chunk of a file
+ * that goes to many targets. Unlike twopence_sock_xmit_shared, this does
+ * not copy the data; the socket holds a reference on the buffer until it
+ * has been sent. The caller keeps its own reference, and drops it using
+ * twopence_buf_free() as usual.
+ */
+int
+twopence_sock_xmit_ref(twopence_sock_t *sock, twopence_buf_t *bp)
+{
+	return __socket_queue_xmit(sock, bp, TWOPENCE_SOCK_XMIT_TRYTOWRITE | TWOPENCE_SOCK_XMIT_REFBUF);
+}
+
 int
 twopence_sock_xmit(twopence_sock_t *sock, twopence_buf_t *bp)
 {
 	return __socket_queue_xmit(sock, bp, TWOPENCE_SOCK_XMIT_SYNCHRONOUS);
 }
 
-int
-twopence_sock_send_queued(twopence_sock_t *sock)
+static int
+__socket_send_queued(twopence_sock_t *sock, bool limited)
 {
 	twopence_packet_t *pkt;
 	int n;
@@ -473,7 +713,10 @@ twopence_sock_send_queued(twopence_sock_t *sock)
 	if ((pkt = twopence_queue_head(&sock->xmit_queue)) == NULL)
 		return 0;
 
-	n = twopence_sock_send_buffer(sock, pkt->buffer);
+	if (limited)
+		n = __socket_send_buffer_limited(sock, pkt->buffer);
+	else
+		n = twopence_sock_send_buffer(sock, pkt->buffer);
 	if (twopence_buf_count(pkt->buffer) == 0) {
 		/* Sent the complete buffer */
 		twopence_queue_dequeue(&sock->xmit_queue);
@@ -483,6 +726,12 @@ twopence_sock_send_queued(twopence_sock_t *sock)
 	return n;
 }
 
+int
+twopence_sock_send_queued(twopence_sock_t *sock)
+{
+	return __socket_send_queued(sock, false);
+}
+
 unsigned int
 twopence_sock_xmit_queue_bytes(twopence_sock_t *sock)
 {
@@ -578,6 +827,19 @@ twopence_sock_is_dead(twopence_sock_t *sock)
 	return sock->read_eof && sock->write_eof == SHUTDOWN_SENT;
 }
 
+/*
+ * Check whether the peer has sent anything we have not read yet
+ */
+bool
+twopence_sock_has_pending_input(const twopence_sock_t *sock)
+{
+	struct pollfd pfd = { .fd = sock->fd, .events = POLLIN };
+
+	if (sock->read_eof)
+		return false;
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
 void
 twopence_sock_enable_xmit_ts(twopence_sock_t *sock)
 {
@@ -621,7 +883,7 @@ twopence_sock_state_desc(const twopence_sock_t *sock)
 static const char *
 twopence_sock_queue_desc(const twopence_sock_t *sock)
 {
-	static char buffer[60];
+	static __thread char buffer[60];
 	unsigned int recv_bytes = sock->recv_buf? twopence_buf_count(sock->recv_buf) : 0;
 	unsigned int send_bytes = sock->xmit_queue.bytes;
 
@@ -651,7 +913,7 @@ poll_bit_string(int events)
 		{ POLLNVAL, "POLLNVAL" },
 		{ 0, NULL }
 	};
-	static char buffer[60];
+	static __thread char buffer[60];
 	char sepa = '<';
 	int k, len = 0;
 
@@ -678,6 +940,8 @@ twopence_sock_prepare_poll(twopence_sock_t *sock)
 bool
 twopence_sock_fill_poll(twopence_sock_t *sock, twopence_pollinfo_t *pinfo)
 {
+	twopence_packet_t *pkt;
+	struct timeval retry;
 	int events = 0;
 
 	sock->poll_data = NULL;
@@ -685,13 +949,23 @@ twopence_sock_fill_poll(twopence_sock_t *sock, twopence_pollinfo_t *pinfo)
 	if (sock->fd < 0)
 		return false;
 
+	/* While the rate limit holds us back, we do not poll for the
+	 * respective event, but wake up when the bucket has refilled. */
 	if (sock->write_eof != SHUTDOWN_SENT) {
-		if (!twopence_queue_empty(&sock->xmit_queue))
-			events |= POLLOUT;
+		if ((pkt = twopence_queue_head(&sock->xmit_queue)) != NULL) {
+			if (__socket_ratelimit_allow(sock->xmit_limit, twopence_buf_count(pkt->buffer), &retry))
+				events |= POLLOUT;
+			else
+				twopence_timeout_update(&pinfo->timeout, &retry);
+		}
 	}
 	if (!sock->read_eof) {
-		if (sock->recv_buf != NULL && twopence_buf_tailroom_max(sock->recv_buf) != 0)
-			events |= POLLIN | POLLHUP;
+		if (sock->recv_buf != NULL && twopence_buf_tailroom_max(sock->recv_buf) != 0) {
+			if (__socket_ratelimit_allow(sock->recv_limit, twopence_buf_tailroom_max(sock->recv_buf), &retry))
+				events |= POLLIN | POLLHUP;
+			else
+				twopence_timeout_update(&pinfo->timeout, &retry);
+		}
 	}
 
 	if (events == 0)
@@ -724,7 +998,7 @@ twopence_sock_doio(twopence_sock_t *sock)
 	}
 
 	if (pfd->revents & POLLOUT) {
-		if ((n = twopence_sock_send_queued(sock)) < 0)
+		if ((n = __socket_send_queued(sock, true)) < 0)
 			return n;
 	}
 
@@ -27,6 +27,22 @@
 
 typedef struct twopence_socket twopence_sock_t;
 
+/*
+ * Token bucket limiting the bandwidth in one direction.
+ * Several sockets (eg all links of a target) may share one bucket.
+ */
+typedef struct twopence_sock_ratelimit {
+	unsigned int		rate;		/* bytes per second; 0 means no limit */
+	unsigned int		burst;		/* size of the bucket in bytes; 0 means rate */
+
+	long			tokens;		/* may go negative, see twopence_sock_xmit */
+	struct timeval		refilled;
+
+	/* Time spent with data waiting for tokens */
+	struct timeval		throttled_since;
+	unsigned long		throttled_ms;
+} twopence_sock_ratelimit_t;
+
 extern twopence_sock_t *twopence_sock_new(int fd);
 extern twopence_sock_t *twopence_sock_new_flags(int fd, int oflags);
 extern void		twopence_sock_set_noclose(twopence_sock_t *);
@@ -34,11 +50,13 @@ extern void		twopence_sock_free(twopence_sock_t *sock);
 extern int		twopence_sock_id(const twopence_sock_t *sock);
 extern int		twopence_sock_recv_buffer(twopence_sock_t *sock, twopence_buf_t *bp);
 extern int		twopence_sock_recv_buffer_blocking(twopence_sock_t *sock, twopence_buf_t *bp);
+extern int		twopence_sock_recv_buffer_timeout(twopence_sock_t *sock, twopence_buf_t *bp, int timeout_ms);
 extern int		twopence_sock_write(twopence_sock_t *sock, twopence_buf_t *bp, unsigned int count);
 extern int		twopence_sock_send_buffer(twopence_sock_t *sock, twopence_buf_t *bp);
 extern void		twopence_sock_queue_xmit(twopence_sock_t *sock, twopence_buf_t *bp);
 extern int		twopence_sock_xmit(twopence_sock_t *sock, twopence_buf_t *bp);
 extern int		twopence_sock_xmit_shared(twopence_sock_t *sock, twopence_buf_t *bp);
+extern int		twopence_sock_xmit_ref(twopence_sock_t *sock, twopence_buf_t *bp);
 extern int		twopence_sock_send_queued(twopence_sock_t *sock);
 extern unsigned int	twopence_sock_xmit_queue_bytes(twopence_sock_t *sock);
 extern bool		twopence_sock_xmit_queue_allowed(const twopence_sock_t *sock);
@@ -49,6 +67,7 @@ extern void		twopence_sock_mark_dead(twopence_sock_t *sock);
 extern bool		twopence_sock_is_read_eof(const twopence_sock_t *);
 extern bool		twopence_sock_is_write_eof(const twopence_sock_t *);
 extern bool		twopence_sock_is_dead(twopence_sock_t *sock);
+extern bool		twopence_sock_has_pending_input(const twopence_sock_t *sock);
 extern void		twopence_sock_prepare_poll(twopence_sock_t *);
 extern bool		twopence_sock_fill_poll(twopence_sock_t *sock, twopence_pollinfo_t *);
 extern int		twopence_sock_doio(twopence_sock_t *sock);
@@ -57,6 +76,10 @@ extern void		twopence_sock_post_recvbuf(twopence_sock_t *sock, twopence_buf_t *b
 extern twopence_buf_t *	twopence_sock_take_recvbuf(twopence_sock_t *);
 extern twopence_buf_t *	twopence_sock_get_recvbuf(twopence_sock_t *);
 
+extern void		twopence_sock_set_ratelimit(twopence_sock_t *, twopence_sock_ratelimit_t *xmit, twopence_sock_ratelimit_t *recv);
+extern void		twopence_sock_ratelimit_set(twopence_sock_ratelimit_t *, unsigned int rate, unsigned int burst);
+extern unsigned long	twopence_sock_ratelimit_throttled(const twopence_sock_ratelimit_t *);
+
 extern void		twopence_sock_enable_xmit_ts(twopence_sock_t *);
 extern bool		twopence_sock_get_xmit_ts(const twopence_sock_t *, struct timeval *);
 
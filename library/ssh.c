@@ -68,6 +68,12 @@ struct twopence_ssh_target
 
     unsigned int next_pid;
   } transactions;
+
+  /* If set, __twopence_ssh_poll() returns once this deadline has passed */
+  const struct timeval *poll_deadline;
+
+  /* Set when we interrupted a command; see __twopence_ssh_interrupt_transaction */
+  volatile bool interrupted;
 };
 
 struct twopence_ssh_transaction {
@@ -150,11 +156,11 @@ struct twopence_scp_transaction {
 
 extern const struct twopence_plugin twopence_ssh_ops;
 
-static bool		__twopence_ssh_interrupted;
 
 static ssh_session	__twopence_ssh_open_session(const struct twopence_ssh_target *, const char *);
 static void		__twopence_ssh_transaction_detach_stdin(twopence_ssh_transaction_t *trans);
 static int		__twopence_ssh_interrupt_ssh(struct twopence_ssh_target *);
+static int		__twopence_ssh_interrupt_transaction(twopence_ssh_transaction_t *);
 
 ///////////////////////////// Lower layer ///////////////////////////////////////
 
@@ -379,7 +385,7 @@ __twopence_ssh_data_callback(ssh_session session, ssh_channel channel, void *dat
   twopence_debug("%d: channel received %u bytes on %s", trans->pid, len, is_stderr? "stderr" : "stdout");
   out = is_stderr? &trans->stderr : &trans->stdout;
   if (len > 0 && out->stream) {
-    if (twopence_iostream_write(out->stream, data, len) < 0) {
+    if (twopence_iostream_write_channel(out->stream, is_stderr? TWOPENCE_STDERR : TWOPENCE_STDOUT, data, len) < 0) {
       __twopence_ssh_transaction_fail(trans, TWOPENCE_RECEIVE_RESULTS_ERROR);
       return SSH_ERROR;
     }
@@ -715,14 +721,19 @@ __twopence_ssh_poll(struct twopence_ssh_target *handle)
       }
     }
 
+    /* If the deadline has expired, we still do one round of I/O
+     * (with a timeout of 0) below. */
+    if (handle->poll_deadline)
+      twopence_timeout_update(&timeout, handle->poll_deadline);
+
     twopence_timers_update_timeout(&timeout);
 
     twopence_debug("polling for events; timeout=%ld\n", twopence_timeout_msec(&timeout));
     rc = ssh_event_dopoll(event, twopence_timeout_msec(&timeout));
 
-    if (__twopence_ssh_interrupted) {
+    if (handle->interrupted) {
       twopence_debug("ssh_event_dopoll() interrupted by signal");
-      __twopence_ssh_interrupted = false;
+      handle->interrupted = false;
       continue;
     }
 
@@ -735,6 +746,11 @@ __twopence_ssh_poll(struct twopence_ssh_target *handle)
      * risk of harmful user behavior */
     twopence_timers_run();
 
+    if (handle->poll_deadline) {
+      twopence_timeout_init(&timeout);
+      if (!twopence_timeout_update(&timeout, handle->poll_deadline))
+	return TWOPENCE_COMMAND_TIMEOUT_ERROR;
+    }
   } while (true);
 
   return 0;
@@ -1196,10 +1212,40 @@ static int
 __twopence_ssh_interrupt_ssh(struct twopence_ssh_target *handle)
 {
   twopence_ssh_transaction_t *trans;
-  ssh_channel channel = NULL;
 
-  if ((trans = handle->transactions.foreground) == NULL
-   || (channel = trans->channel) == NULL)
+  if ((trans = handle->transactions.foreground) == NULL)
+    return TWOPENCE_OPEN_SESSION_ERROR;
+
+  return __twopence_ssh_interrupt_transaction(trans);
+}
+
+// Interrupt a backgrounded command, given its pid
+//
+// Returns 0 if everything went fine, or a negative error code if failed
+static int
+__twopence_ssh_interrupt_pid(struct twopence_ssh_target *handle, int pid)
+{
+  twopence_ssh_transaction_t *trans;
+
+  if (pid <= 0)
+    return TWOPENCE_INVALID_TRANSACTION;
+
+  if ((trans = __twopence_ssh_transaction_by_pid(handle, pid)) == NULL)
+    return TWOPENCE_INVALID_TRANSACTION;
+
+  /* Nothing to do if the command completed already */
+  if (trans->done)
+    return 0;
+
+  return __twopence_ssh_interrupt_transaction(trans);
+}
+
+static int
+__twopence_ssh_interrupt_transaction(twopence_ssh_transaction_t *trans)
+{
+  ssh_channel channel;
+
+  if ((channel = trans->channel) == NULL)
     return TWOPENCE_OPEN_SESSION_ERROR;
 
 #if 0
@@ -1227,7 +1273,7 @@ __twopence_ssh_interrupt_ssh(struct twopence_ssh_target *handle)
    * Nevertheless, work around that by telling __twopence_ssh_poll to ignore
    * that error.
    */
-  __twopence_ssh_interrupted = true;
+  trans->handle->interrupted = true;
   return 0;
 }
 
@@ -1393,6 +1439,166 @@ twopence_ssh_wait(struct twopence_target *opaque_handle, int want_pid, twopence_
   return rc;
 }
 
+/*
+ * Collect the status of all completed commands, waiting for at most
+ * timeout_ms if none have completed yet.
+ */
+static int
+twopence_ssh_wait_many(struct twopence_target *opaque_handle, unsigned int max, int timeout_ms, twopence_status_t *statuses)
+{
+  struct twopence_ssh_target *handle = (struct twopence_ssh_target *) opaque_handle;
+  twopence_ssh_transaction_t *trans;
+  struct timeval deadline;
+  unsigned int count = 0;
+  int rc = 0;
+
+  twopence_debug2("%s(max=%u, timeout=%d)", __func__, max, timeout_ms);
+  if (timeout_ms >= 0) {
+    struct timeval now, delta;
+
+    gettimeofday(&now, NULL);
+    delta.tv_sec = timeout_ms / 1000;
+    delta.tv_usec = (timeout_ms % 1000) * 1000;
+    timeradd(&now, &delta, &deadline);
+    handle->poll_deadline = &deadline;
+  }
+
+  while (count < max) {
+    trans = __twopence_ssh_get_completed_transaction(handle, 0);
+    if (trans == NULL) {
+      if (count != 0 || !handle->transactions.running || rc == TWOPENCE_COMMAND_TIMEOUT_ERROR)
+	break;
+
+      rc = __twopence_ssh_poll(handle);
+      if (rc < 0 && rc != TWOPENCE_COMMAND_TIMEOUT_ERROR)
+	break;
+
+      __twopence_ssh_reap_completed(handle);
+      continue;
+    }
+
+    assert(trans->done);
+
+    if (trans->exception < 0 && count != 0) {
+      /* Put it back; we'll report it on the next call */
+      trans->next = handle->transactions.done;
+      handle->transactions.done = trans;
+      break;
+    }
+
+    statuses[count].pid = trans->pid;
+    if (trans->exception < 0) {
+      rc = trans->exception;
+      __twopence_ssh_transaction_free(trans);
+      break;
+    }
+
+    statuses[count].major = trans->status.major;
+    statuses[count].minor = trans->status.minor;
+    __twopence_ssh_transaction_free(trans);
+    count++;
+  }
+
+  handle->poll_deadline = NULL;
+
+  if (rc < 0 && rc != TWOPENCE_COMMAND_TIMEOUT_ERROR)
+    return rc;
+  return count;
+}
+
+/*
+ * Event loop integration.
+ *
+ * Every command runs in a session of its own, so we hand out the socket of
+ * each session, plus the local fd we're reading its standard input from.
+ * libssh does its own polling, so dispatch just runs one round of
+ * ssh_event_dopoll() without waiting, and does not look at the revents.
+ */
+static int
+twopence_ssh_get_pollfds(struct twopence_target *opaque_handle, struct pollfd *pfds, unsigned int max, int *timeout_ms)
+{
+  struct twopence_ssh_target *handle = (struct twopence_ssh_target *) opaque_handle;
+  twopence_ssh_transaction_t *trans;
+  twopence_timeout_t timeout;
+  unsigned int count = 0;
+  bool ready = false;
+
+  twopence_timeout_init(&timeout);
+  for (trans = handle->transactions.running; trans; trans = trans->next) {
+    int fd;
+
+    /* Completed, but not reaped yet. Have dispatch come back right away. */
+    if (trans->done || (trans->eof_seen && trans->have_exit_status))
+      ready = true;
+
+    twopence_timeout_update(&timeout, &trans->command_timeout);
+
+    if ((fd = ssh_get_fd(trans->session)) >= 0) {
+      if (count < max) {
+        pfds[count].fd = fd;
+        pfds[count].events = POLLIN;
+        if (ssh_get_poll_flags(trans->session) & SSH_WRITE_PENDING)
+          pfds[count].events |= POLLOUT;
+        pfds[count].revents = 0;
+      }
+      count++;
+    }
+
+    if (trans->stdin.fd >= 0) {
+      if (count < max) {
+        pfds[count].fd = trans->stdin.fd;
+        pfds[count].events = POLLIN;
+        pfds[count].revents = 0;
+      }
+      count++;
+    }
+  }
+
+  /* Commands that were reaped, but not collected yet */
+  if (handle->transactions.done)
+    ready = true;
+
+  twopence_timers_update_timeout(&timeout);
+  *timeout_ms = ready? 0 : twopence_timeout_msec(&timeout);
+  return count;
+}
+
+static int
+twopence_ssh_dispatch(struct twopence_target *opaque_handle, const struct pollfd *pfds, unsigned int count)
+{
+  struct twopence_ssh_target *handle = (struct twopence_ssh_target *) opaque_handle;
+  twopence_ssh_transaction_t *trans;
+  twopence_timeout_t timeout;
+
+  if (handle->transactions.running == NULL)
+    return 0;
+
+  if (ssh_event_dopoll(handle->event, 0) == SSH_ERROR && !handle->interrupted) {
+    twopence_debug("ssh_event_dopoll() returns error");
+    return TWOPENCE_INTERNAL_ERROR;
+  }
+  handle->interrupted = false;
+
+  twopence_timeout_init(&timeout);
+  for (trans = handle->transactions.running; trans; trans = trans->next) {
+    if (trans->eof_seen && trans->have_exit_status)
+      trans->done = true;
+
+    if (trans->done)
+      (void) __twopence_ssh_transaction_get_exit_status(trans);
+    else
+    if (!twopence_timeout_update(&timeout, &trans->command_timeout))
+      __twopence_ssh_transaction_fail(trans, TWOPENCE_COMMAND_TIMEOUT_ERROR);
+  }
+
+  /* Completed commands are moved to the done list, where
+   * twopence_wait_many() will find them without polling */
+  __twopence_ssh_reap_completed(handle);
+
+  twopence_timers_run();
+  return 0;
+}
+
 static int
 twopence_ssh_chat_send(twopence_target_t *opaque_handle, int pid, twopence_iostream_t *stream)
 {
@@ -1456,6 +1662,19 @@ twopence_ssh_chat_recv(twopence_target_t *opaque_handle, int pid, const struct t
   return trans->chat.nreceived;
 }
 
+static int
+twopence_ssh_chat_eof(twopence_target_t *opaque_handle, int pid)
+{
+  struct twopence_ssh_target *handle = (struct twopence_ssh_target *) opaque_handle;
+  twopence_ssh_transaction_t *trans = NULL;
+
+  trans = __twopence_ssh_transaction_by_pid(handle, pid);
+  if (trans == NULL)
+    return TWOPENCE_INVALID_TRANSACTION;
+
+  return trans->done || trans->eof_seen;
+}
+
 // Inject a file into the remote host
 //
 // Returns 0 if everything went fine
@@ -1469,6 +1688,10 @@ twopence_ssh_inject_file(struct twopence_target *opaque_handle,
   long filesize;
   int rc;
 
+  /* scp transfers are synchronous */
+  if (xfer->background)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
   // Connect to the remote host
   twopence_scp_transfer_init(&state, handle);
   if ((rc = twopence_scp_transfer_open_session(&state, xfer->user)) < 0)
@@ -1527,6 +1750,10 @@ twopence_ssh_extract_file(struct twopence_target *opaque_handle,
   twopence_scp_transaction_t state;
   int rc;
 
+  /* scp transfers are synchronous */
+  if (xfer->background)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
   // Connect to the remote host
   twopence_scp_transfer_init(&state, handle);
   if ((rc = twopence_scp_transfer_open_session(&state, xfer->user)) < 0)
@@ -1554,6 +1781,17 @@ twopence_ssh_interrupt_command(struct twopence_target *opaque_handle)
   return __twopence_ssh_interrupt_ssh(handle);
 }
 
+// Interrupt a specific command
+//
+// Returns 0 if everything went fine
+static int
+twopence_ssh_interrupt_pid(struct twopence_target *opaque_handle, int pid)
+{
+  struct twopence_ssh_target *handle = (struct twopence_ssh_target *) opaque_handle;
+
+  return __twopence_ssh_interrupt_pid(handle, pid);
+}
+
 // Cancel all pending transactions
 //
 // Returns 0 if everything went fine
@@ -1613,13 +1851,18 @@ const struct twopence_plugin twopence_ssh_ops = {
 	.init = twopence_ssh_init,
 	.run_test = twopence_ssh_run_test,
 	.wait = twopence_ssh_wait,
+	.wait_many = twopence_ssh_wait_many,
 	.chat_recv = twopence_ssh_chat_recv,
 	.chat_send = twopence_ssh_chat_send,
+	.chat_eof = twopence_ssh_chat_eof,
 	.inject_file = twopence_ssh_inject_file,
 	.extract_file = twopence_ssh_extract_file,
 	.exit_remote = twopence_ssh_exit_remote,
 	.interrupt_command = twopence_ssh_interrupt_command,
+	.interrupt_pid = twopence_ssh_interrupt_pid,
 	.cancel_transactions = twopence_ssh_cancel_transactions,
 	.disconnect = twopence_ssh_disconnect,
+	.get_pollfds = twopence_ssh_get_pollfds,
+	.dispatch = twopence_ssh_dispatch,
 	.end = twopence_ssh_end,
 };
@@ -33,8 +33,11 @@
 #include "utils.h"
 #include "twopence.h"
 
+/* Timers belong to the thread that created them, and fire while that
+ * thread waits for I/O. This lets different threads drive different
+ * targets without stepping on each other's toes. */
 static unsigned int		__global_timer_id = 1;
-static twopence_timer_list_t	__global_timer_list;
+static __thread twopence_timer_list_t __global_timer_list;
 
 /*
  * List helper functions
@@ -44,6 +47,8 @@ __twopence_timer_insert(twopence_timer_t **pos, twopence_timer_t *timer)
 {
 	timer->next = *pos;
 	timer->prev = pos;
+	if (timer->next)
+		timer->next->prev = &timer->next;
 	*pos = timer;
 }
 
@@ -72,7 +77,7 @@ twopence_timer_create(unsigned long timeout_ms, twopence_timer_t **timer_ret)
 
 	timer = twopence_calloc(1, sizeof(*timer));
 	timer->refcount = 1;
-	timer->id = __global_timer_id++;
+	timer->id = __sync_fetch_and_add(&__global_timer_id, 1);
 
 	gettimeofday(&now, NULL);
 	timer->runtime.tv_sec = timeout_ms / 1000;
@@ -123,8 +128,9 @@ twopence_timer_cancel(twopence_timer_t *timer)
 	if (timer->state == TWOPENCE_TIMER_STATE_ACTIVE
 	 || timer->state == TWOPENCE_TIMER_STATE_PAUSED
 	 || timer->state == TWOPENCE_TIMER_STATE_CANCELLED) {
+		/* Leave the timer on the list; twopence_timers_run() will
+		 * reap it and drop the list's reference. */
 		timer->state = TWOPENCE_TIMER_STATE_CANCELLED;
-		__twopence_timer_unlink(timer);
 	}
 }
 
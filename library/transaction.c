@@ -109,7 +109,7 @@ twopence_transaction_channel_set_name(twopence_trans_channel_t *channel, const c
 static const char *
 __twopence_transaction_channel_name(uint16_t id)
 {
-	static char namebuf[16];
+	static __thread char namebuf[16];
 
 	if (id == TWOPENCE_TRANSACTION_CHANNEL_ID_ALL)
 		return "all";
@@ -213,6 +213,8 @@ twopence_transaction_new(twopence_sock_t *transport, unsigned int type, const tw
 	trans->id = ps->xid;
 	trans->type = type;
 	trans->socket = transport;
+	trans->file_fd = -1;
+	trans->job_fd[0] = trans->job_fd[1] = -1;
 
 	twopence_debug("%s: created new transaction", twopence_transaction_describe(trans));
 	return trans;
@@ -230,6 +232,19 @@ twopence_transaction_free(twopence_transaction_t *trans)
 	twopence_transaction_channel_list_close(&trans->local_sink, TWOPENCE_TRANSACTION_CHANNEL_ID_ALL);
 	twopence_transaction_channel_list_close(&trans->local_source, TWOPENCE_TRANSACTION_CHANNEL_ID_ALL);
 
+	if (trans->file_fd >= 0)
+		close(trans->file_fd);
+	if (trans->job_fd[0] >= 0)
+		close(trans->job_fd[0]);
+	if (trans->job_fd[1] >= 0)
+		close(trans->job_fd[1]);
+	if (trans->job_timer) {
+		twopence_timer_cancel(trans->job_timer);
+		twopence_timer_release(trans->job_timer);
+	}
+
+	twopence_detached_jobs_free(trans->client.jobs, trans->client.njobs);
+
 	memset(trans, 0, sizeof(*trans));
 	free(trans);
 }
@@ -237,7 +252,7 @@ twopence_transaction_free(twopence_transaction_t *trans)
 const char *
 twopence_transaction_describe(const twopence_transaction_t *trans)
 {
-	static char descbuf[64];
+	static __thread char descbuf[64];
 
 	snprintf(descbuf, sizeof(descbuf), "%s/%u",
 			twopence_protocol_packet_type_to_string(trans->type), trans->ps.xid);
@@ -453,7 +468,7 @@ twopence_transaction_channel_write_data(twopence_transaction_t *trans, twopence_
 			return false;
 	} else
 	if ((stream = sink->stream) != NULL) {
-		twopence_iostream_write(stream, twopence_buf_head(payload), count);
+		twopence_iostream_write_channel(stream, sink->id, twopence_buf_head(payload), count);
 		twopence_buf_advance_head(payload, count);
 	}
 
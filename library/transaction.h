@@ -51,6 +51,16 @@ struct twopence_transaction {
 	pid_t			pid;
 	int			status;
 
+	/* Server side only: the file behind a remote file handle */
+	int			file_fd;
+
+	/* Server side only: the detached job we are reattached to,
+	 * its spooled stdout and stderr, and a timer to check back
+	 * for more output while it is still running */
+	unsigned int		job_id;
+	int			job_fd[2];
+	twopence_timer_t *	job_timer;
+
 	twopence_trans_channel_t *local_sink;
 	twopence_trans_channel_t *local_source;
 
@@ -63,6 +73,27 @@ struct twopence_transaction {
 
 		bool			print_dots;
 		unsigned int		dots_printed;
+
+		/* Set once the server is ready to receive an injected file */
+		bool			inject_ready;
+
+		/* The file being extracted, so we can tell it was not modified */
+		twopence_file_xfer_t *	extract_xfer;
+
+		/* Remote file handles: set once the server has opened the file,
+		 * and the batch of requests we are waiting for */
+		bool			file_ready;
+		twopence_file_io_t *	file_io;
+		unsigned int		file_io_count;
+		unsigned int		file_io_pending;
+
+		/* Detached jobs reported by the server */
+		twopence_detached_job_t *jobs;
+		unsigned int		njobs;
+
+		/* The output goes to a chat; the I/O thread tells the
+		 * application when some arrives */
+		bool			chat;
 	} client;
 
 	struct {
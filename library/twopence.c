@@ -23,13 +23,16 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #ifndef __APPLE__
 #include <malloc.h>
 #endif
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <limits.h>
 
 #include "twopence.h"
+#include "protocol.h"
 #include "utils.h"
 
 int
@@ -188,6 +191,78 @@ twopence_target_set_option(struct twopence_target *target, int option, const voi
   return target->ops->set_option(target, option, value_p);
 }
 
+void
+twopence_target_set_capture_budget(struct twopence_target *target, size_t bytes)
+{
+  target->capture_budget.limit = bytes;
+}
+
+/*
+ * Wait for the target to become reachable
+ */
+int
+twopence_target_wait_ready(struct twopence_target *target, int timeout_ms)
+{
+  if (target->ops->wait_ready == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  return target->ops->wait_ready(target, timeout_ms);
+}
+
+/*
+ * Set up the link to the target now rather than on first use
+ */
+int
+twopence_target_connect(struct twopence_target *target, int timeout_ms)
+{
+  if (target->ops->connect == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  return target->ops->connect(target, timeout_ms);
+}
+
+/*
+ * Event loop integration
+ */
+int
+twopence_target_get_pollfds(struct twopence_target *target, struct pollfd *pfds, unsigned int max, int *timeout_ms)
+{
+  if (target->ops->get_pollfds == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  if (timeout_ms == NULL || (pfds == NULL && max != 0))
+    return TWOPENCE_PARAMETER_ERROR;
+
+  return target->ops->get_pollfds(target, pfds, max, timeout_ms);
+}
+
+int
+twopence_target_dispatch(struct twopence_target *target, const struct pollfd *pfds, unsigned int count)
+{
+  if (target->ops->dispatch == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  if (pfds == NULL && count != 0)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  return target->ops->dispatch(target, pfds, count);
+}
+
+/*
+ * Query target specific options
+ */
+int
+twopence_target_get_option(struct twopence_target *target, int option, void *value_p)
+{
+  if (target->ops->get_option == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  if (value_p == NULL)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  return target->ops->get_option(target, option, value_p);
+}
+
 /*
  * Manipulate the default environment of a target.
  * This default environment is passed to every command execution.
@@ -209,6 +284,38 @@ twopence_target_passenv(twopence_target_t *target, const char *name)
 /*
  * General API
  */
+static void
+__twopence_command_apply_defaults(struct twopence_target *target, twopence_command_t *cmd)
+{
+  /* Populate defaults. Instead of hard-coding them, we could also set
+   * default values for a given target. */
+  if (cmd->timeout == 0)
+    cmd->timeout = 60;
+  if (cmd->user == NULL)
+    cmd->user = "root";
+
+  /* The environment of a prepared command has been merged already */
+  if (cmd->prepared == NULL)
+    twopence_command_merge_default_env(cmd, &target->env);
+}
+
+/*
+ * Account the output of the command against the command's or the target's budget
+ */
+static void
+__twopence_command_apply_budget(struct twopence_target *target, twopence_command_t *cmd)
+{
+  twopence_buf_budget_t *budget = cmd->capture_budget;
+
+  /* Without any budget, buffers reused from an earlier command
+   * are detached from the budget they were charged to then */
+  if (budget == NULL && target->capture_budget.limit != 0)
+    budget = &target->capture_budget;
+
+  twopence_iostream_set_budget(&cmd->iostream[TWOPENCE_STDOUT], budget);
+  twopence_iostream_set_budget(&cmd->iostream[TWOPENCE_STDERR], budget);
+}
+
 int
 twopence_run_test(struct twopence_target *target, twopence_command_t *cmd, twopence_status_t *status)
 {
@@ -217,14 +324,20 @@ twopence_run_test(struct twopence_target *target, twopence_command_t *cmd, twope
   if (target->ops->run_test == NULL)
     return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
 
-  /* Populate defaults. Instead of hard-coding them, we could also set
-   * default values for a given target. */
-  if (cmd->timeout == 0)
-    cmd->timeout = 60;
-  if (cmd->user == NULL)
-    cmd->user = "root";
+  if (cmd->detach) {
+    /* A plugin that does not know about detached jobs would
+     * simply run the command */
+    if (target->ops->reattach == NULL)
+      return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+    /* Nobody would be there to talk to the tty */
+    if (cmd->request_tty)
+      return TWOPENCE_PARAMETER_ERROR;
+  }
 
-  twopence_command_merge_default_env(cmd, &target->env);
+  __twopence_command_apply_defaults(target, cmd);
+
+  __twopence_command_apply_budget(target, cmd);
 
   return target->ops->run_test(target, cmd, status);
 }
@@ -240,6 +353,20 @@ twopence_wait(struct twopence_target *target, int pid, twopence_status_t *status
   return target->ops->wait(target, pid, status);
 }
 
+int
+twopence_wait_many(struct twopence_target *target, unsigned int max, int timeout_ms, twopence_status_t *statuses)
+{
+  if (max == 0)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  memset(statuses, 0, max * sizeof(statuses[0]));
+
+  if (target->ops->wait_many == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  return target->ops->wait_many(target, max, timeout_ms, statuses);
+}
+
 /*
  * Chat script support
  */
@@ -252,9 +379,21 @@ twopence_chat_init(twopence_chat_t *chat, twopence_buf_t *sendbuf, twopence_buf_
   twopence_buf_init(&chat->consumed);
 }
 
+static void
+__twopence_chat_cancel_expect(twopence_chat_t *chat)
+{
+  if (chat->expect_timer) {
+    twopence_timer_cancel(chat->expect_timer);
+    twopence_timer_release(chat->expect_timer);
+    chat->expect_timer = NULL;
+  }
+  chat->expect_pending = false;
+}
+
 void
 twopence_chat_destroy(twopence_chat_t *chat)
 {
+  __twopence_chat_cancel_expect(chat);
   twopence_buf_destroy(&chat->consumed);
   twopence_strfree(&chat->found);
 }
@@ -293,10 +432,67 @@ twopence_chat_begin(twopence_target_t *target, twopence_command_t *cmd, twopence
   }
 
   chat->pid = rv;
+  chat->target = target;
 
   return chat->pid;
 }
 
+/*
+ * A backend with an I/O thread may append to the receive buffer at
+ * any time, unless we hold it off while looking at the buffer.
+ */
+static inline void
+__twopence_chat_lock(twopence_target_t *target)
+{
+  if (target->ops->chat_lock)
+    target->ops->chat_lock(target);
+}
+
+static inline void
+__twopence_chat_unlock(twopence_target_t *target)
+{
+  if (target->ops->chat_unlock)
+    target->ops->chat_unlock(target);
+}
+
+/*
+ * Look for any of the expected strings in the receive buffer.
+ * If one is found, consume everything up to and including the string,
+ * and return the number of bytes consumed. Otherwise, return -1.
+ */
+static int
+__twopence_chat_match(twopence_chat_t *chat, const twopence_expect_t *args)
+{
+  twopence_buf_t *bp = chat->recvbuf;
+  const char *string = NULL;
+  int k, nbytes, pos;
+
+  for (k = 0, pos = -1; k < args->nstrings; ++k) {
+    const char *s = args->strings[k];
+    int at;
+
+    at = twopence_buf_index(bp, s);
+    if (at >= 0 && (pos < 0 || at < pos || (at == pos && strlen(s) > strlen(string)))) {
+      string = s;
+      pos = at;
+    }
+  }
+
+  if (pos < 0)
+    return -1;
+
+  /* Consume everything up to and including the string we waited for.
+   * We return the data we skipped over in chat->consumed.
+   */
+  chat->found = twopence_strdup(string);
+
+  nbytes = pos + strlen(string);
+  twopence_buf_ensure_tailroom(&chat->consumed, nbytes);
+  twopence_buf_append(&chat->consumed, twopence_buf_head(bp), nbytes);
+  twopence_buf_pull(bp, nbytes);
+  return nbytes;
+}
+
 /*
  * Wait for the remote command to output the expected string.
  *
@@ -304,11 +500,10 @@ twopence_chat_begin(twopence_target_t *target, twopence_command_t *cmd, twopence
  * If the string is not received within this amount of time, the backend's chat()
  * function will return TWOPENCE_COMMAND_TIMEOUT_ERROR.
  */
-int
-twopence_chat_expect(twopence_target_t *target, twopence_chat_t *chat, const twopence_expect_t *args)
+static int
+__twopence_chat_expect(twopence_target_t *target, twopence_chat_t *chat, const twopence_expect_t *args)
 {
   struct timeval __deadline, *deadline;
-  twopence_buf_t *bp = chat->recvbuf;
 
   twopence_buf_destroy(&chat->consumed);
   twopence_strfree(&chat->found);
@@ -321,32 +516,10 @@ twopence_chat_expect(twopence_target_t *target, twopence_chat_t *chat, const two
   }
 
   while (true) {
-    const char *string = NULL;
-    int k, nbytes, pos;
-
-    for (k = 0, pos = -1; k < args->nstrings; ++k) {
-      const char *s = args->strings[k];
-      int at;
+    int nbytes;
 
-      at = twopence_buf_index(bp, s);
-      if (at >= 0 && (pos < 0 || at < pos || (at == pos && strlen(s) > strlen(string)))) {
-	string = s;
-	pos = at;
-      }
-    }
-
-    if (pos >= 0) {
-      /* Consume everything up to and including the string we waited for.
-       * We return the data we skipped over in chat->consumed.
-       */
-      chat->found = twopence_strdup(string);
-
-      nbytes = pos + strlen(string);
-      twopence_buf_ensure_tailroom(&chat->consumed, nbytes);
-      twopence_buf_append(&chat->consumed, twopence_buf_head(bp), nbytes);
-      twopence_buf_pull(bp, nbytes);
+    if ((nbytes = __twopence_chat_match(chat, args)) >= 0)
       return nbytes;
-    }
 
     nbytes = target->ops->chat_recv(target, chat->pid, deadline);
     if (nbytes <= 0) {
@@ -362,6 +535,167 @@ twopence_chat_expect(twopence_target_t *target, twopence_chat_t *chat, const two
   }
 }
 
+int
+twopence_chat_expect(twopence_target_t *target, twopence_chat_t *chat, const twopence_expect_t *args)
+{
+  int rc;
+
+  __twopence_chat_lock(target);
+  rc = __twopence_chat_expect(target, chat, args);
+  __twopence_chat_unlock(target);
+  return rc;
+}
+
+/*
+ * Non-blocking expect.
+ *
+ * Rather than waiting for the remote command's output, these functions
+ * only inspect what has been received so far. This allows an application to
+ * drive many chats from one event loop, see twopence_chat_poll() below.
+ *
+ * Note that unlike the blocking version, a timeout is handled here rather
+ * than by the backend, and leaves the command running.
+ */
+int
+twopence_chat_expect_start(twopence_target_t *target, twopence_chat_t *chat, const twopence_expect_t *args)
+{
+  int rc;
+
+  if (args->nstrings > TWOPENCE_EXPECT_MAX_STRINGS)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  if (target->ops->chat_eof == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  __twopence_chat_cancel_expect(chat);
+  twopence_buf_destroy(&chat->consumed);
+  twopence_strfree(&chat->found);
+
+  if (args->timeout) {
+    /* The timer is not only our deadline; it also makes sure that poll
+     * loops wake up in time to notice that the deadline has passed. */
+    if ((rc = twopence_timer_create(args->timeout * 1000, &chat->expect_timer)) < 0)
+      return rc;
+    twopence_timer_hold(chat->expect_timer);
+  }
+
+  chat->target = target;
+  chat->expect = *args;
+  chat->expect_status = 0;
+  chat->expect_pending = true;
+  return 0;
+}
+
+int
+twopence_chat_expect_check(twopence_target_t *target, twopence_chat_t *chat)
+{
+  int rc;
+
+  if (!chat->expect_pending)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  __twopence_chat_lock(target);
+  if ((rc = __twopence_chat_match(chat, &chat->expect)) < 0) {
+    /* No match yet. See whether we can still hope for one */
+    rc = target->ops->chat_eof(target, chat->pid);
+    if (rc == 0) {
+      if (chat->expect_timer == NULL || twopence_timer_remaining(chat->expect_timer) > 0) {
+	__twopence_chat_unlock(target);
+	return 0;
+      }
+      rc = TWOPENCE_COMMAND_TIMEOUT_ERROR;
+    } else if (rc > 0) {
+      /* Output ended without the string showing up */
+      rc = 0;
+    }
+  }
+  __twopence_chat_unlock(target);
+
+  __twopence_chat_cancel_expect(chat);
+  chat->expect_status = rc;
+  return 1;
+}
+
+/*
+ * Several chats may run on the same target; poll each target only once
+ */
+static bool
+__twopence_chat_first_on_target(twopence_chat_t **chats, unsigned int index)
+{
+  unsigned int i;
+
+  for (i = 0; i < index; ++i) {
+    if (chats[i] && chats[i]->expect_pending && chats[i]->target == chats[index]->target)
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Drive several chats until at least one of their pending expects has been
+ * resolved. The chats may live on the same target, or on different ones.
+ */
+int
+twopence_chat_poll(twopence_chat_t **chats, unsigned int count)
+{
+  twopence_target_pollset_t pollset;
+  twopence_target_pollslice_t *slices;
+  unsigned int i, pending, resolved = 0;
+  int rc = 0;
+
+  memset(&pollset, 0, sizeof(pollset));
+  slices = twopence_calloc(count, sizeof(slices[0]));
+
+  while (true) {
+    for (i = pending = 0; i < count; ++i) {
+      twopence_chat_t *chat = chats[i];
+
+      if (chat == NULL || !chat->expect_pending)
+	continue;
+
+      if (twopence_chat_expect_check(chat->target, chat) != 0)
+	resolved++;
+      else
+	pending++;
+    }
+
+    if (resolved || pending == 0)
+      break;
+
+    twopence_target_pollset_reset(&pollset);
+    for (i = 0; i < count; ++i) {
+      twopence_chat_t *chat = chats[i];
+
+      memset(&slices[i], 0, sizeof(slices[i]));
+      if (chat == NULL || !chat->expect_pending)
+	continue;
+
+      if (__twopence_chat_first_on_target(chats, i))
+	twopence_target_pollset_add(&pollset, chat->target, &slices[i]);
+    }
+
+    if (twopence_target_pollset_wait(&pollset) < 0) {
+      rc = TWOPENCE_INTERNAL_ERROR;
+      break;
+    }
+
+    for (i = 0; i < count; ++i) {
+      twopence_chat_t *chat = chats[i];
+
+      if (chat == NULL || !chat->expect_pending)
+	continue;
+
+      if (__twopence_chat_first_on_target(chats, i))
+	twopence_target_pollset_dispatch(&pollset, chat->target, &slices[i]);
+    }
+  }
+
+  twopence_target_pollset_destroy(&pollset);
+  free(slices);
+
+  return rc < 0? rc : (int) resolved;
+}
+
 /*
  * Write a string to the remote command's stdin
  */
@@ -387,8 +721,8 @@ twopence_chat_puts(twopence_target_t *target, twopence_chat_t *chat, const char
  * Read a string from the remote output, up to the next newline.
  * This tries to mimick the behavior of fgets()
  */
-char *
-twopence_chat_gets(twopence_target_t *target, twopence_chat_t *chat, char *buf, size_t size, int timeout)
+static char *
+__twopence_chat_gets(twopence_target_t *target, twopence_chat_t *chat, char *buf, size_t size, int timeout)
 {
   twopence_buf_t *bp = chat->recvbuf;
   unsigned int i, j, count;
@@ -458,6 +792,17 @@ twopence_chat_gets(twopence_target_t *target, twopence_chat_t *chat, char *buf,
   return buf;
 }
 
+char *
+twopence_chat_gets(twopence_target_t *target, twopence_chat_t *chat, char *buf, size_t size, int timeout)
+{
+  char *rv;
+
+  __twopence_chat_lock(target);
+  rv = __twopence_chat_gets(target, chat, buf, size, timeout);
+  __twopence_chat_unlock(target);
+  return rv;
+}
+
 int
 twopence_test_and_print_results
   (struct twopence_target *target, const char *username, long timeout, const char *command, twopence_status_t *status)
@@ -599,6 +944,35 @@ twopence_send_file(struct twopence_target *target, twopence_file_xfer_t *xfer, t
   return target->ops->inject_file(target, xfer, status);
 }
 
+int
+twopence_inject_begin(struct twopence_target *target, twopence_file_xfer_t *xfer)
+{
+  if (target->ops->inject_begin == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  if (xfer->remote.name == NULL)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  if (xfer->user == NULL)
+    xfer->user = "root";
+  if (xfer->remote.mode == 0)
+    xfer->remote.mode = 0644;
+
+  return target->ops->inject_begin(target, xfer);
+}
+
+int
+twopence_inject_write(struct twopence_target *target, int xid, twopence_buf_t *chunk)
+{
+  if (target->ops->inject_write == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  if (chunk && twopence_buf_count(chunk) > TWOPENCE_INJECT_CHUNK_MAX)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  return target->ops->inject_write(target, xid, chunk);
+}
+
 int
 twopence_extract_file
   (struct twopence_target *target, const char *username,
@@ -628,6 +1002,91 @@ twopence_extract_file
   return rv;
 }
 
+/*
+ * Extract a file unless the local copy is still current. The data is
+ * received into a temporary file next to the local copy, which replaces
+ * the local copy only once the transfer has succeeded.
+ */
+int
+twopence_extract_file_if_changed
+  (struct twopence_target *target, const char *username,
+   const char *remote_path, const char *local_path,
+   int *remote_rc, bool *not_modified)
+{
+  twopence_status_t status;
+  twopence_file_xfer_t xfer;
+  char temp_path[PATH_MAX];
+  struct stat stb;
+  mode_t mode;
+  int fd, rv;
+
+  twopence_file_xfer_init(&xfer);
+
+  rv = twopence_file_xfer_set_known_file(&xfer, local_path);
+  if (rv < 0)
+    return rv;
+
+  /* Without a local copy, ask for the transfer anyway, so that the server
+   * tells us the remote mtime. No file has this size. */
+  if (!xfer.if_changed) {
+    xfer.if_changed = true;
+    xfer.known_size = ~(uint64_t) 0;
+    xfer.known_mtime = 0;
+  }
+
+  /* Keep the mode of an existing local copy */
+  if (stat(local_path, &stb) == 0) {
+    mode = stb.st_mode & 07777;
+  } else {
+    mode_t mask = umask(0);
+
+    umask(mask);
+    mode = 0666 & ~mask;
+  }
+
+  if (snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", local_path) >= (int) sizeof(temp_path))
+    return TWOPENCE_PARAMETER_ERROR;
+
+  fd = mkstemp(temp_path);
+  if (fd < 0)
+    return TWOPENCE_LOCAL_FILE_ERROR;
+  fchmod(fd, mode);
+  twopence_iostream_wrap_fd(fd, false, &xfer.local_stream);
+
+  xfer.user = username;
+  xfer.remote.name = remote_path;
+  xfer.remote.mode = 0660;
+
+  rv = twopence_recv_file(target, &xfer, &status);
+  *remote_rc = status.major;
+  *not_modified = xfer.not_modified;
+
+  /* Stamp our copy with the remote mtime, which is what the server
+   * compares against next time */
+  if (rv == 0 && !xfer.not_modified && xfer.remote_mtime != 0) {
+    struct timespec times[2];
+
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = xfer.remote_mtime;
+    times[1].tv_nsec = 0;
+    if (futimens(fd, times) < 0)
+      rv = TWOPENCE_LOCAL_FILE_ERROR;
+  }
+
+  twopence_file_xfer_destroy(&xfer);
+  if (close(fd) < 0 && rv == 0)
+    rv = TWOPENCE_LOCAL_FILE_ERROR;
+
+  if (rv == 0 && !xfer.not_modified) {
+    if (rename(temp_path, local_path) < 0)
+      rv = TWOPENCE_LOCAL_FILE_ERROR;
+  }
+  if (rv < 0 || xfer.not_modified)
+    unlink(temp_path);
+  return rv;
+}
+
 int
 twopence_recv_file(struct twopence_target *target, twopence_file_xfer_t *xfer, twopence_status_t *status)
 {
@@ -643,10 +1102,195 @@ twopence_recv_file(struct twopence_target *target, twopence_file_xfer_t *xfer, t
     xfer->user = "root";
   if (xfer->remote.mode == 0)
     xfer->remote.mode = 0644;
+  xfer->not_modified = false;
+  xfer->remote_mtime = 0;
 
   return target->ops->extract_file(target, xfer, status);
 }
 
+int
+twopence_file_open(struct twopence_target *target, const char *username, const char *path,
+		unsigned int flags, unsigned int mode, int *remote_rc)
+{
+  *remote_rc = 0;
+
+  if (target->ops->file_open == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  if (path == NULL || !(flags & (TWOPENCE_OPEN_READ|TWOPENCE_OPEN_WRITE)))
+    return TWOPENCE_PARAMETER_ERROR;
+
+  /* Truncating a file we only open for reading is undefined */
+  if ((flags & TWOPENCE_OPEN_TRUNCATE) && !(flags & TWOPENCE_OPEN_WRITE))
+    return TWOPENCE_PARAMETER_ERROR;
+
+  if (username == NULL)
+    username = "root";
+  if ((flags & TWOPENCE_OPEN_CREATE) && mode == 0)
+    mode = 0644;
+
+  return target->ops->file_open(target, username, path, flags, mode, remote_rc);
+}
+
+int
+twopence_file_batch(struct twopence_target *target, int fh, twopence_file_io_t *io, unsigned int count)
+{
+  unsigned int i;
+
+  if (target->ops->file_io == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  for (i = 0; i < count; ++i) {
+    twopence_file_io_t *req = &io[i];
+
+    if (req->data == NULL)
+      return TWOPENCE_PARAMETER_ERROR;
+    switch (req->op) {
+    case TWOPENCE_FILE_PREAD:
+    case TWOPENCE_FILE_PWRITE:
+      if (req->count > TWOPENCE_FILE_IO_MAX)
+        return TWOPENCE_PARAMETER_ERROR;
+      break;
+    case TWOPENCE_FILE_FSTAT:
+      break;
+    default:
+      return TWOPENCE_PARAMETER_ERROR;
+    }
+    req->result = 0;
+    req->remote_errno = 0;
+  }
+
+  if (count == 0)
+    return 0;
+
+  return target->ops->file_io(target, fh, io, count);
+}
+
+/*
+ * Split a read or write into requests the server can handle, and send them
+ * all at once. Returns the number of bytes transferred up to the first
+ * short or failed request.
+ */
+static int
+__twopence_file_transfer(struct twopence_target *target, int fh, int op, void *data, size_t count, uint64_t offset)
+{
+  twopence_file_io_t *io;
+  unsigned int i, n;
+  size_t done = 0;
+  int rc;
+
+  if (count == 0)
+    return 0;
+  if (count > INT_MAX)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  n = (count + TWOPENCE_FILE_IO_MAX - 1) / TWOPENCE_FILE_IO_MAX;
+  io = twopence_calloc(n, sizeof(io[0]));
+  for (i = 0; i < n; ++i) {
+    size_t pos = (size_t) i * TWOPENCE_FILE_IO_MAX;
+
+    io[i].op = op;
+    io[i].data = (char *) data + pos;
+    io[i].offset = offset + pos;
+    io[i].count = count - pos;
+    if (io[i].count > TWOPENCE_FILE_IO_MAX)
+      io[i].count = TWOPENCE_FILE_IO_MAX;
+  }
+
+  rc = twopence_file_batch(target, fh, io, n);
+  for (i = 0; rc == 0 && i < n; ++i) {
+    if (io[i].result < 0) {
+      if (done == 0)
+        rc = io[i].result;
+      break;
+    }
+    done += io[i].result;
+    if ((size_t) io[i].result < io[i].count)
+      break;
+  }
+
+  free(io);
+  return rc < 0? rc : (int) done;
+}
+
+int
+twopence_file_pread(struct twopence_target *target, int fh, void *data, size_t count, uint64_t offset)
+{
+  return __twopence_file_transfer(target, fh, TWOPENCE_FILE_PREAD, data, count, offset);
+}
+
+int
+twopence_file_pwrite(struct twopence_target *target, int fh, const void *data, size_t count, uint64_t offset)
+{
+  return __twopence_file_transfer(target, fh, TWOPENCE_FILE_PWRITE, (void *) data, count, offset);
+}
+
+int
+twopence_file_fstat(struct twopence_target *target, int fh, twopence_file_stat_t *st)
+{
+  twopence_file_io_t io;
+  int rc;
+
+  memset(&io, 0, sizeof(io));
+  io.op = TWOPENCE_FILE_FSTAT;
+  io.data = st;
+
+  if ((rc = twopence_file_batch(target, fh, &io, 1)) < 0)
+    return rc;
+  return io.result < 0? io.result : 0;
+}
+
+int
+twopence_file_close(struct twopence_target *target, int fh)
+{
+  if (target->ops->file_close == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  return target->ops->file_close(target, fh);
+}
+
+/*
+ * Detached jobs
+ */
+int
+twopence_list_detached_jobs(struct twopence_target *target, twopence_detached_job_t **jobs_ret, unsigned int *count_ret)
+{
+  *jobs_ret = NULL;
+  *count_ret = 0;
+
+  if (target->ops->list_jobs == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  return target->ops->list_jobs(target, jobs_ret, count_ret);
+}
+
+void
+twopence_detached_jobs_free(twopence_detached_job_t *jobs, unsigned int count)
+{
+  unsigned int i;
+
+  for (i = 0; i < count; ++i)
+    free(jobs[i].command);
+  free(jobs);
+}
+
+int
+twopence_reattach(struct twopence_target *target, unsigned int job_id, twopence_command_t *cmd, twopence_status_t *status)
+{
+  memset(status, 0, sizeof(*status));
+
+  if (target->ops->reattach == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  if (job_id == 0)
+    return TWOPENCE_PARAMETER_ERROR;
+
+  if (cmd)
+    __twopence_command_apply_budget(target, cmd);
+
+  return target->ops->reattach(target, job_id, cmd, status);
+}
+
 int
 twopence_exit_remote(struct twopence_target *target)
 {
@@ -683,6 +1327,15 @@ twopence_interrupt_command(struct twopence_target *target)
   return target->ops->interrupt_command(target);
 }
 
+int
+twopence_interrupt_pid(struct twopence_target *target, int pid)
+{
+  if (target->ops->interrupt_pid == NULL)
+    return TWOPENCE_UNSUPPORTED_FUNCTION_ERROR;
+
+  return target->ops->interrupt_pid(target, pid);
+}
+
 
 /*
  * Convert twopence error code to string message
@@ -769,6 +1422,13 @@ __twopence_command_buffer(twopence_command_t *cmd, twopence_iofd_t dst)
   return NULL;
 }
 
+static inline void
+__twopence_command_buffer_reset(twopence_buf_t *bp)
+{
+  twopence_buf_truncate(bp, 0);
+  twopence_buf_compact(bp);
+}
+
 twopence_buf_t *
 twopence_command_alloc_buffer(twopence_command_t *cmd, twopence_iofd_t dst, size_t size)
 {
@@ -777,12 +1437,31 @@ twopence_command_alloc_buffer(twopence_command_t *cmd, twopence_iofd_t dst, size
   if ((bp = __twopence_command_buffer(cmd, dst)) == NULL)
     return NULL;
 
+  /* When running the same command over and over, hang on to the
+   * buffer we allocated last time. */
+  if (bp->dynamic && bp->size >= size) {
+    __twopence_command_buffer_reset(bp);
+    return bp;
+  }
+
   twopence_buf_destroy(bp);
   if (size)
     twopence_buf_resize(bp, size);
   return bp;
 }
 
+/*
+ * Discard any output captured by a previous run, but keep the memory
+ */
+void
+twopence_command_reset_buffers(twopence_command_t *cmd)
+{
+  unsigned int i;
+
+  for (i = 0; i < __TWOPENCE_IO_MAX; ++i)
+    __twopence_command_buffer_reset(&cmd->buffer[i]);
+}
+
 static inline twopence_iostream_t *
 __twopence_command_ostream(twopence_command_t *cmd, twopence_iofd_t dst)
 {
@@ -827,15 +1506,44 @@ twopence_command_iostream_redirect(twopence_command_t *cmd, twopence_iofd_t dst,
     twopence_iostream_add_substream(stream, twopence_substream_new_fd(fd, closeit));
 }
 
+void
+twopence_command_ostream_callback(twopence_command_t *cmd, twopence_iofd_t dst, twopence_iostream_callback_t *fn, void *user_data)
+{
+  twopence_iostream_t *stream;
+
+  if ((stream = __twopence_command_ostream(cmd, dst)) != NULL)
+    twopence_iostream_add_substream(stream, twopence_substream_new_callback(fn, user_data));
+}
+
+/*
+ * Generate the command's standard input on demand
+ */
+void
+twopence_command_istream_producer(twopence_command_t *cmd, twopence_iostream_producer_t *fn, void *user_data)
+{
+  twopence_iostream_add_substream(&cmd->iostream[TWOPENCE_STDIN], twopence_substream_new_producer(fn, user_data));
+}
+
+static inline void
+__twopence_command_unprepare(twopence_command_t *cmd)
+{
+  if (cmd->prepared) {
+    twopence_buf_free(cmd->prepared);
+    cmd->prepared = NULL;
+  }
+}
+
 void
 twopence_command_setenv(twopence_command_t *cmd, const char *name, const char *value)
 {
+	__twopence_command_unprepare(cmd);
 	twopence_env_set(&cmd->env, name, value);
 }
 
 void
 twopence_command_passenv(twopence_command_t *cmd, const char *name)
 {
+	__twopence_command_unprepare(cmd);
 	twopence_env_unset(&cmd->env, name);
 }
 
@@ -845,6 +1553,30 @@ twopence_command_merge_default_env(twopence_command_t *cmd, const twopence_env_t
 	twopence_env_merge_inferior(&cmd->env, def_env);
 }
 
+/*
+ * Fill in the defaults for @target and encode the request once, so that the
+ * command can be run many times without doing this work over and over.
+ *
+ * The command line, user, timeout, tty flag and environment must not be
+ * changed afterwards, except through twopence_command_setenv() and
+ * twopence_command_passenv(), which drop the prepared request. The command
+ * should only be run on @target, or targets with the same environment.
+ */
+int
+twopence_command_prepare(struct twopence_target *target, twopence_command_t *cmd)
+{
+  if (cmd->command == NULL || *cmd->command == '\0')
+    return TWOPENCE_PARAMETER_ERROR;
+
+  __twopence_command_unprepare(cmd);
+  __twopence_command_apply_defaults(target, cmd);
+
+  cmd->prepared = twopence_protocol_build_command_payload(cmd);
+  if (cmd->prepared == NULL)
+    return TWOPENCE_PARAMETER_ERROR;
+  return 0;
+}
+
 void
 twopence_command_destroy(twopence_command_t *cmd)
 {
@@ -855,6 +1587,7 @@ twopence_command_destroy(twopence_command_t *cmd)
     twopence_iostream_destroy(&cmd->iostream[i]);
   }
   twopence_env_destroy(&cmd->env);
+  __twopence_command_unprepare(cmd);
 }
 
 /*
@@ -994,3 +1727,29 @@ twopence_file_xfer_destroy(twopence_file_xfer_t *xfer)
     xfer->local_stream = NULL;
   }
 }
+
+/*
+ * Make the extract conditional on the remote file being different from
+ * the local copy at @local_path. If there is no local copy, the file is
+ * transferred unconditionally.
+ */
+int
+twopence_file_xfer_set_known_file(twopence_file_xfer_t *xfer, const char *local_path)
+{
+  struct stat stb;
+
+  xfer->if_changed = false;
+  if (stat(local_path, &stb) < 0) {
+    if (errno == ENOENT)
+      return 0;
+    return TWOPENCE_LOCAL_FILE_ERROR;
+  }
+
+  if (!S_ISREG(stb.st_mode))
+    return TWOPENCE_LOCAL_FILE_ERROR;
+
+  xfer->if_changed = true;
+  xfer->known_size = stb.st_size;
+  xfer->known_mtime = stb.st_mtime;
+  return 0;
+}
@@ -93,22 +93,46 @@ typedef struct twopence_file_xfer twopence_file_xfer_t;
 typedef struct twopence_chat twopence_chat_t;
 typedef struct twopence_expect twopence_expect_t;
 typedef struct twopence_timer twopence_timer_t;
+typedef struct twopence_group twopence_group_t;
+typedef struct twopence_group_result twopence_group_result_t;
+typedef struct twopence_jobq twopence_jobq_t;
+typedef struct twopence_job twopence_job_t;
+typedef struct twopence_target_pool twopence_target_pool_t;
+typedef struct twopence_file_io twopence_file_io_t;
+typedef struct twopence_detached_job twopence_detached_job_t;
 
 struct twopence_plugin {
 	const char *		name;
 
 	struct twopence_target *(*init)(const char *);
 	int			(*set_option)(struct twopence_target *, int, const void *);
+	int			(*get_option)(struct twopence_target *, int, void *);
 
 	int			(*run_test)(struct twopence_target *, struct twopence_command *, twopence_status_t *);
 	int			(*wait)(struct twopence_target *, int, twopence_status_t *);
+	int			(*wait_many)(struct twopence_target *, unsigned int, int, twopence_status_t *);
 	int			(*chat_recv)(twopence_target_t *, int, const struct timeval *);
 	int			(*chat_send)(twopence_target_t *, int, twopence_iostream_t *);
+	int			(*chat_eof)(twopence_target_t *, int);
+	void			(*chat_lock)(twopence_target_t *);
+	void			(*chat_unlock)(twopence_target_t *);
 
 	int			(*inject_file)(struct twopence_target *, twopence_file_xfer_t *, twopence_status_t *);
 	int			(*extract_file)(struct twopence_target *, twopence_file_xfer_t *, twopence_status_t *);
+	int			(*inject_begin)(struct twopence_target *, twopence_file_xfer_t *);
+	int			(*inject_write)(struct twopence_target *, int, twopence_buf_t *);
+	int			(*file_open)(struct twopence_target *, const char *, const char *, unsigned int, unsigned int, int *);
+	int			(*file_io)(struct twopence_target *, int, twopence_file_io_t *, unsigned int);
+	int			(*file_close)(struct twopence_target *, int);
+	int			(*list_jobs)(struct twopence_target *, twopence_detached_job_t **, unsigned int *);
+	int			(*reattach)(struct twopence_target *, unsigned int, twopence_command_t *, twopence_status_t *);
 	int			(*exit_remote)(struct twopence_target *);
 	int			(*interrupt_command)(struct twopence_target *);
+	int			(*interrupt_pid)(struct twopence_target *, int);
+	int			(*wait_ready)(struct twopence_target *, int);
+	int			(*connect)(struct twopence_target *, int);
+	int			(*get_pollfds)(struct twopence_target *, struct pollfd *, unsigned int, int *);
+	int			(*dispatch)(struct twopence_target *, const struct pollfd *, unsigned int);
 	int			(*cancel_transactions)(twopence_target_t *);
 	int			(*disconnect)(twopence_target_t *);
 	void			(*end)(struct twopence_target *);
@@ -148,6 +172,22 @@ typedef enum {
 
 typedef struct twopence_substream twopence_substream_t;
 
+/*
+ * Callback for streaming output. Invoked for every chunk of data received,
+ * with the channel it arrived on (TWOPENCE_STDOUT or TWOPENCE_STDERR for
+ * commands, 0 for file transfers) and the time of arrival.
+ */
+typedef void		twopence_iostream_callback_t(void *user_data, unsigned int channel,
+					const struct timeval *when, const void *data, size_t len);
+
+/*
+ * Callback for generating input on demand. It is called whenever the
+ * transport has room for more data, and should store at most @len bytes
+ * in @data. It returns the number of bytes stored, 0 at end of file,
+ * or a negative value on error.
+ */
+typedef int		twopence_iostream_producer_t(void *user_data, void *data, size_t len);
+
 
 #define TWOPENCE_IOSTREAM_MAX_SUBSTREAMS	4
 struct twopence_iostream {
@@ -188,6 +228,12 @@ struct twopence_command {
 	 */
 	bool			keepopen_stdin;
 
+	/* Run the command as a job that the server keeps running, and
+	 * spools the output of, even after we have disconnected.
+	 * See twopence_reattach().
+	 */
+	bool			detach;
+
 	/* This is the set of environment variables being
 	 * passed from the client to the server.
 	 */
@@ -200,6 +246,13 @@ struct twopence_command {
 	twopence_iostream_t	iostream[__TWOPENCE_IO_MAX];
 
 	twopence_buf_t		buffer[__TWOPENCE_IO_MAX];
+
+	/* The request packet, encoded once by twopence_command_prepare() */
+	twopence_buf_t *	prepared;
+
+	/* If set, output captured in buffers is accounted here rather
+	 * than against the target's budget */
+	twopence_buf_budget_t *	capture_budget;
 };
 
 typedef struct twopence_remote_file twopence_remote_file_t;
@@ -218,6 +271,109 @@ struct twopence_file_xfer {
 
 	/* if true, print dots for every chunk of data transferred */
 	bool			print_dots;
+
+	/* if true, start the transfer and return its transaction ID right
+	 * away. Use twopence_wait() to collect its status; the xfer and its
+	 * local_stream must stay around until then. */
+	bool			background;
+
+	/* Conditional extract: if if_changed is set, the server skips the
+	 * transfer when the remote file still has known_size bytes and an
+	 * mtime of known_mtime. not_modified is set when this happens;
+	 * nothing is written to local_stream in that case. Otherwise, the
+	 * server reports the mtime of the file it sends in remote_mtime.
+	 * Servers that do not support this always transfer the file, and
+	 * leave remote_mtime at 0. */
+	bool			if_changed;
+	uint64_t		known_size;
+	time_t			known_mtime;
+	bool			not_modified;
+	time_t			remote_mtime;
+};
+
+/*
+ * Remote file handles
+ */
+enum {
+	TWOPENCE_OPEN_READ	= 0x0001,
+	TWOPENCE_OPEN_WRITE	= 0x0002,
+	TWOPENCE_OPEN_CREATE	= 0x0004,
+	TWOPENCE_OPEN_TRUNCATE	= 0x0008,
+	TWOPENCE_OPEN_EXCLUSIVE	= 0x0010,
+};
+
+enum {
+	TWOPENCE_FILE_PREAD,
+	TWOPENCE_FILE_PWRITE,
+	TWOPENCE_FILE_FSTAT,
+};
+
+typedef struct twopence_file_stat {
+	uint64_t		size;
+	unsigned int		mode;
+	unsigned int		uid;
+	unsigned int		gid;
+	time_t			mtime;
+} twopence_file_stat_t;
+
+/*
+ * One request on a remote file handle. For FSTAT, data points to
+ * a twopence_file_stat_t, and offset and count are ignored.
+ */
+struct twopence_file_io {
+	int			op;
+	void *			data;
+	size_t			count;
+	uint64_t		offset;
+
+	/* Set on completion: the number of bytes read or written, or
+	 * a negative error code. If the server failed the request,
+	 * result is TWOPENCE_REMOTE_FILE_ERROR and remote_errno tells why. */
+	int			result;
+	int			remote_errno;
+};
+
+/*
+ * A command the server runs detached from any connection.
+ * status is valid once the job is no longer running.
+ */
+struct twopence_detached_job {
+	unsigned int		id;
+	bool			running;
+	twopence_status_t	status;
+	uint64_t		nbytes;		/* output spooled so far */
+	char *			command;
+};
+
+/*
+ * Outcome of running a command on one target of a group.
+ * rc is 0 if the command ran and its exit status is in status;
+ * otherwise it is a negative error code.
+ */
+struct twopence_group_result {
+	twopence_target_t *	target;
+	int			rc;
+	twopence_status_t	status;
+	twopence_buf_t		stdout_buf;
+	twopence_buf_t		stderr_buf;
+};
+
+/*
+ * Per-target statistics of a target pool
+ */
+typedef struct twopence_target_stats {
+	unsigned int		jobs;		/* jobs completed */
+	unsigned int		failed;		/* ... of which failed */
+	unsigned int		stolen;		/* jobs taken from another target's queue */
+	unsigned long		busy_ms;	/* time spent running jobs */
+} twopence_target_stats_t;
+
+#define TWOPENCE_EXPECT_MAX_STRINGS	16
+struct twopence_expect {
+	unsigned int		timeout;
+
+	unsigned int		nstrings;
+	const char *		strings[TWOPENCE_EXPECT_MAX_STRINGS];
 };
 
 struct twopence_chat {
@@ -236,14 +392,13 @@ struct twopence_chat {
 	 * string we matched.
 	 */
 	char *			found;
-};
 
-#define TWOPENCE_EXPECT_MAX_STRINGS	16
-struct twopence_expect {
-	unsigned int		timeout;
-
-	unsigned int		nstrings;
-	const char *		strings[TWOPENCE_EXPECT_MAX_STRINGS];
+	/* State of a non-blocking expect, see twopence_chat_expect_start() */
+	twopence_target_t *	target;
+	twopence_expect_t	expect;
+	bool			expect_pending;
+	int			expect_status;
+	twopence_timer_t *	expect_timer;
 };
 
 /*
@@ -288,6 +443,9 @@ struct twopence_target {
 	 * being passed to the server on all
 	 * remote command executions. */
 	twopence_env_t		env;
+
+	/* Memory budget for output captured by commands */
+	twopence_buf_budget_t	capture_budget;
 };
 
 /*
@@ -314,20 +472,94 @@ extern int		twopence_target_new(const char *target_spec, struct twopence_target
  * values; and the only reason we want to do this is to test keepalive :-)
  * Not sure whether this warrant a first-class interface, but I had
  * no better idea.
+ *
+ * Setting TWOPENCE_TARGET_OPTION_HEARTBEAT to a non-zero number of
+ * milliseconds before connecting asks the server to send heartbeats at
+ * that interval, so that a dead server is detected quickly. Once
+ * connected, TWOPENCE_TARGET_OPTION_DEAD_PEER_TIMEOUT returns the
+ * negotiated time after which an idle link is declared dead.
+ *
+ * Setting TWOPENCE_TARGET_OPTION_IO_THREAD to 1 starts a thread that keeps
+ * the link serviced while the application is not inside a twopence call.
+ * TWOPENCE_TARGET_OPTION_COMPLETION_FD then returns an fd that is readable
+ * while completed commands are waiting to be collected.
+ *
+ * Setting TWOPENCE_TARGET_OPTION_KEEP_WARM to 1 starts the I/O thread as well,
+ * and makes it re-establish a link that goes down while the application is
+ * idle, rather than waiting for the next call that needs it. It gives up
+ * after a number of failed attempts, and leaves a link alone that was shut
+ * down with twopence_disconnect() or twopence_exit_remote().
+ *
+ * TWOPENCE_TARGET_OPTION_XMIT_RATE and TWOPENCE_TARGET_OPTION_RECV_RATE limit
+ * the bandwidth of the link to and from the target, in bytes per second
+ * (0 means no limit). The respective BURST option sets how many bytes may
+ * be sent in one go after the link was idle; it defaults to one second's
+ * worth. The THROTTLED options return how long data was held back.
  */
 extern int		twopence_target_set_option(struct twopence_target *,
 					int option, const void *value_p);
+extern int		twopence_target_get_option(struct twopence_target *,
+					int option, void *value_p);
 
 enum {
 	TWOPENCE_TARGET_OPTION_KEEPALIVE = 0,	/* value_p is an int pointer */
+	TWOPENCE_TARGET_OPTION_HEARTBEAT,	/* value_p is an int pointer (msec) */
+	TWOPENCE_TARGET_OPTION_DEAD_PEER_TIMEOUT,/* value_p is an int pointer (msec), read-only */
+	TWOPENCE_TARGET_OPTION_RECONNECT,	/* value_p is an int pointer (msec) */
+	TWOPENCE_TARGET_OPTION_IO_THREAD,	/* value_p is an int pointer (bool) */
+	TWOPENCE_TARGET_OPTION_COMPLETION_FD,	/* value_p is an int pointer, read-only */
+	TWOPENCE_TARGET_OPTION_KEEP_WARM,	/* value_p is an int pointer (bool) */
+	TWOPENCE_TARGET_OPTION_XMIT_RATE,	/* value_p is an int pointer (bytes/sec) */
+	TWOPENCE_TARGET_OPTION_XMIT_BURST,	/* value_p is an int pointer (bytes) */
+	TWOPENCE_TARGET_OPTION_XMIT_THROTTLED,	/* value_p is an int pointer (msec), read-only */
+	TWOPENCE_TARGET_OPTION_RECV_RATE,	/* value_p is an int pointer (bytes/sec) */
+	TWOPENCE_TARGET_OPTION_RECV_BURST,	/* value_p is an int pointer (bytes) */
+	TWOPENCE_TARGET_OPTION_RECV_THROTTLED,	/* value_p is an int pointer (msec), read-only */
 };
 
+/*
+ * Wait for the SUT to become reachable, for at most @timeout_ms milliseconds.
+ * A negative timeout waits forever.
+ *
+ * The link is probed with a HELLO round trip, backing off exponentially
+ * between attempts (from 10 msec up to 500 msec). Returns 0 once the link
+ * is up, or a negative error code.
+ *
+ * By default, once the link to the SUT goes down (eg because it was
+ * rebooted), all further calls fail with TWOPENCE_TRANSPORT_ERROR.
+ * Setting TWOPENCE_TARGET_OPTION_RECONNECT to a non-zero number of
+ * milliseconds makes the library do this implicitly whenever it
+ * needs the link; a negative value retries forever.
+ */
+extern int		twopence_target_wait_ready(struct twopence_target *, int timeout_ms);
+
+/*
+ * Open the link to the SUT and perform the handshake right away, rather
+ * than on the first command. Unlike twopence_target_wait_ready(), this
+ * makes a single attempt, which must complete within @timeout_ms
+ * milliseconds (a negative value means no limit).
+ *
+ * If the I/O thread is enabled, the link is set up by that thread, and the
+ * call returns immediately. The next call that needs the link waits for
+ * the handshake to complete.
+ */
+extern int		twopence_target_connect(struct twopence_target *, int timeout_ms);
+
 /*
  * Set default environment variables passed to each command executed
  */
 extern void		twopence_target_setenv(twopence_target_t *target,
 					const char *name, const char *value);
 
+/*
+ * Limit the heap memory used for capturing command output in buffers
+ * to @bytes, across all commands running on this target. Buffers that
+ * would take the total over the limit move their data to a temporary
+ * file, which is mapped into memory, so they can be read as usual.
+ * 0 means no limit. Buffers must be destroyed before the target is.
+ */
+extern void		twopence_target_set_capture_budget(twopence_target_t *target, size_t bytes);
+
 /*
  * Specify environment variables to be passed from the applications
  * environment to each command being executed.
@@ -360,6 +592,134 @@ extern int		twopence_run_test(struct twopence_target *, twopence_command_t *, tw
  */
 extern int		twopence_wait(struct twopence_target *, int, twopence_status_t *);
 
+/*
+ * Collect the status of backgrounded commands in bulk.
+ *
+ * This returns the status of all commands that have completed so far,
+ * up to @max entries. If none have completed yet, this will wait for at most
+ * @timeout_ms milliseconds for a command to complete. A timeout of 0 makes
+ * this function process pending I/O once without blocking; a negative timeout
+ * waits indefinitely.
+ *
+ * Returns:
+ *  < 0:	an error occured. statuses[0].pid tells you which command
+ *		failed.
+ *  0:		no command completed within the timeout, or no more processes
+ * otherwise the number of entries in @statuses that have been filled in.
+ */
+extern int		twopence_wait_many(struct twopence_target *, unsigned int max, int timeout_ms, twopence_status_t *statuses);
+
+/*
+ * Integrate a target into the application's own event loop.
+ *
+ * twopence_target_get_pollfds() fills in up to @max pollfd entries
+ * describing the fds the target wants to wait for, and sets *timeout_ms
+ * to the time until its next deadline (-1 if there is none). It returns
+ * the number of fds wanted; if that is larger than @max, retry with
+ * a larger array.
+ *
+ * Once the application's poll/epoll/etc has returned, pass the results to
+ * twopence_target_dispatch(). Order does not matter, and fds not belonging
+ * to the target are ignored. Call it when the timeout expires, too, even
+ * if no fd is ready. Completed commands can then be collected without
+ * blocking by calling twopence_wait_many() with a timeout of 0.
+ *
+ * Every call to twopence_target_dispatch() must be preceded by a call to
+ * twopence_target_get_pollfds(). Calling a blocking function on the target
+ * in between makes the poll set stale; dispatch then does nothing.
+ */
+extern int		twopence_target_get_pollfds(struct twopence_target *, struct pollfd *pfds, unsigned int max, int *timeout_ms);
+extern int		twopence_target_dispatch(struct twopence_target *, const struct pollfd *pfds, unsigned int count);
+
+/*
+ * Run the same command on many targets at once.
+ *
+ * Add the targets with twopence_group_add_target(); the group does not own
+ * them. twopence_group_run() starts the command on all targets in the
+ * background, and drives all of them from a single event loop until every
+ * command has finished. The command line, user, timeout, tty flag and
+ * environment are taken from @cmd; stdin is not connected, and each
+ * target's output is captured in its twopence_group_result_t. The targets
+ * should not have any other backgrounded commands pending.
+ *
+ * With a concurrency limit, at most that many commands run at the same time.
+ * With cancel_on_failure, the first failure interrupts all running commands
+ * and skips the remaining targets; these report TWOPENCE_COMMAND_CANCELED_ERROR.
+ *
+ * Returns the number of targets on which the command failed, or a negative
+ * error code. The results stay valid until the next run, or until the group
+ * is freed.
+ *
+ * twopence_group_inject_file() sends the same file to all targets. The local
+ * stream is read only once; each chunk is shared by the send queues of all
+ * targets rather than copied. Reading stops while any target cannot take
+ * more data, so the slowest target sets the pace. The status of each
+ * transfer is reported in the target's result; the output buffers stay
+ * empty. The concurrency limit does not apply.
+ */
+extern twopence_group_t *twopence_group_new(void);
+extern void		twopence_group_free(twopence_group_t *);
+extern void		twopence_group_add_target(twopence_group_t *, twopence_target_t *);
+extern unsigned int	twopence_group_count(const twopence_group_t *);
+extern void		twopence_group_set_concurrency(twopence_group_t *, unsigned int max);
+extern void		twopence_group_set_cancel_on_failure(twopence_group_t *, bool);
+extern int		twopence_group_run(twopence_group_t *, const twopence_command_t *cmd);
+extern int		twopence_group_inject_file(twopence_group_t *, twopence_file_xfer_t *xfer);
+extern const twopence_group_result_t *twopence_group_result(const twopence_group_t *, unsigned int index);
+
+/*
+ * Client side job queue.
+ *
+ * Commands and file transfers are queued with twopence_jobq_add_*(), possibly
+ * on different targets. twopence_job_depends_on() makes a job wait for
+ * another one to succeed; if that one fails, the dependent job is skipped and
+ * reports TWOPENCE_COMMAND_CANCELED_ERROR. A job can only depend on jobs
+ * queued before it.
+ *
+ * twopence_jobq_run() runs all pending jobs in the background, in queue order
+ * as far as dependencies and the per-target concurrency limit allow, and
+ * returns once all of them have completed. It returns the number of jobs that
+ * failed or were skipped. Afterwards, twopence_job_status() returns the
+ * outcome of each job; the job handles remain valid until the queue is freed.
+ *
+ * The commands and xfers are not copied, and must stay around until the
+ * queue has run. The targets should not have any other backgrounded
+ * commands pending.
+ */
+extern twopence_jobq_t *twopence_jobq_new(void);
+extern void		twopence_jobq_free(twopence_jobq_t *);
+extern void		twopence_jobq_set_concurrency(twopence_jobq_t *, unsigned int max_per_target);
+extern twopence_job_t *	twopence_jobq_add_command(twopence_jobq_t *, twopence_target_t *, twopence_command_t *);
+extern twopence_job_t *	twopence_jobq_add_inject(twopence_jobq_t *, twopence_target_t *, twopence_file_xfer_t *);
+extern twopence_job_t *	twopence_jobq_add_extract(twopence_jobq_t *, twopence_target_t *, twopence_file_xfer_t *);
+extern int		twopence_job_depends_on(twopence_job_t *job, twopence_job_t *dep);
+extern int		twopence_jobq_run(twopence_jobq_t *);
+extern int		twopence_job_status(const twopence_job_t *, twopence_status_t *);
+
+/*
+ * Distribute independent commands across a pool of equivalent targets.
+ *
+ * Commands submitted with an affinity go to the queue of that target,
+ * all others to a shared queue. Whenever a target is idle, it takes the next
+ * job from its own queue, then from the shared one; if both are empty, it
+ * steals the most recently queued job of the target with the longest queue.
+ * Each target runs one job at a time. A target that fails with a transport
+ * error is taken out of the pool, and its job is queued again.
+ *
+ * twopence_target_pool_run() returns once all jobs have completed, and
+ * returns the number of jobs that failed. The commands are not copied, and
+ * must stay around until then.
+ */
+extern twopence_target_pool_t *twopence_target_pool_new(void);
+extern void		twopence_target_pool_free(twopence_target_pool_t *);
+extern int		twopence_target_pool_add_target(twopence_target_pool_t *, twopence_target_t *);
+extern int		twopence_target_pool_submit(twopence_target_pool_t *, twopence_command_t *, int affinity);
+extern int		twopence_target_pool_run(twopence_target_pool_t *);
+extern int		twopence_target_pool_job_status(const twopence_target_pool_t *, int job,
+				twopence_status_t *status, int *target_index);
+extern int		twopence_target_pool_get_stats(const twopence_target_pool_t *, unsigned int index,
+				twopence_target_stats_t *stats);
+
 /*
  * Initialize a chat object
  */
@@ -394,6 +754,25 @@ extern int		twopence_chat_begin(twopence_target_t *, twopence_command_t *cmd, tw
  */
 extern int		twopence_chat_expect(twopence_target_t *, twopence_chat_t *chat, const twopence_expect_t *args);
 
+/*
+ * Non-blocking variant of twopence_chat_expect().
+ *
+ * twopence_chat_expect_start() arms the chat to wait for any of the given strings,
+ * and returns right away. A timeout of 0 means no timeout.
+ *
+ * twopence_chat_expect_check() tries to resolve a pending expect from the data that
+ * has been received so far, without doing any I/O. It returns 0 if the expect is still
+ * pending, and 1 if it has been resolved; in the latter case, chat->expect_status holds
+ * what twopence_chat_expect() would have returned. A timeout does not kill the command.
+ *
+ * twopence_chat_poll() drives any number of chats, on one or several targets, until at
+ * least one of their pending expects has been resolved, and returns the number of chats
+ * that were resolved. It returns 0 if none of the chats had an expect pending.
+ */
+extern int		twopence_chat_expect_start(twopence_target_t *, twopence_chat_t *chat, const twopence_expect_t *args);
+extern int		twopence_chat_expect_check(twopence_target_t *, twopence_chat_t *chat);
+extern int		twopence_chat_poll(twopence_chat_t **chats, unsigned int count);
+
 /*
  * Send the given string to the command's standard input
  */
@@ -514,6 +893,95 @@ extern int		twopence_extract_file(struct twopence_target *target,
 extern int		twopence_recv_file(struct twopence_target *target,
 					twopence_file_xfer_t *xfer, twopence_status_t *status);
 
+/*
+ * Like twopence_extract_file, but if local_path exists already, only
+ * transfer the remote file if it differs in size or mtime from the local
+ * copy. The local copy is given the mtime of the remote file, so that the
+ * comparison does not depend on the clocks of both hosts.
+ * *not_modified tells whether the transfer was skipped.
+ */
+extern int		twopence_extract_file_if_changed(struct twopence_target *target,
+					const char *username, const char *remote_path, const char *local_path,
+					int *remote_rc, bool *not_modified);
+
+/*
+ * Send a file whose contents are supplied piecemeal by the caller, rather
+ * than read from xfer->local_stream, which is ignored.
+ *
+ * twopence_inject_begin() starts the transfer in the background, and
+ * returns its transaction ID. twopence_inject_write() then queues one
+ * chunk of at most TWOPENCE_INJECT_CHUNK_MAX bytes. The data is not copied;
+ * the target takes a reference on the buffer (see twopence_buf_hold) until
+ * it has been sent, so the same buffer can be queued to many targets.
+ * Passing a NULL chunk ends the file.
+ *
+ * twopence_inject_write() returns 1 if the chunk was queued, or 0 if the
+ * target cannot take it yet; in that case, service the target (eg through
+ * twopence_target_dispatch) and try again. The status of the transfer is
+ * collected with twopence_wait() or twopence_wait_many().
+ */
+#define TWOPENCE_INJECT_CHUNK_MAX	32000
+
+extern int		twopence_inject_begin(struct twopence_target *target, twopence_file_xfer_t *xfer);
+extern int		twopence_inject_write(struct twopence_target *target, int xid, twopence_buf_t *chunk);
+
+/*
+ * Random access to a remote file, without transferring all of it.
+ *
+ * twopence_file_open() opens the file on the server, which keeps it open
+ * until twopence_file_close() is called or the connection goes away. It
+ * returns a handle (a positive transaction ID), or a negative error code;
+ * if the server failed to open the file, its errno is stored in *remote_rc.
+ * flags are a combination of TWOPENCE_OPEN_*; mode is only used when
+ * creating the file.
+ *
+ * twopence_file_batch() pipelines the @count requests, keeping a bounded
+ * number of them in flight, and waits for all of them to complete; each
+ * request carries at most TWOPENCE_FILE_IO_MAX bytes. It returns 0 if the server answered all requests, in which case
+ * the outcome of each is in its result field, or a negative error code if
+ * the handle failed; the handle should then be closed.
+ *
+ * twopence_file_pread() and twopence_file_pwrite() split a single transfer
+ * of any size into pipelined requests, and return the number of bytes
+ * transferred. A short read means that the end of the file was reached.
+ *
+ * Open handles are not reported by twopence_wait() or twopence_wait_many()
+ * when waiting for any transaction; they only go away when closed.
+ */
+#define TWOPENCE_FILE_IO_MAX		32000
+
+extern int		twopence_file_open(struct twopence_target *target, const char *username, const char *path,
+					unsigned int flags, unsigned int mode, int *remote_rc);
+extern int		twopence_file_batch(struct twopence_target *target, int fh, twopence_file_io_t *io, unsigned int count);
+extern int		twopence_file_pread(struct twopence_target *target, int fh, void *data, size_t count, uint64_t offset);
+extern int		twopence_file_pwrite(struct twopence_target *target, int fh, const void *data, size_t count, uint64_t offset);
+extern int		twopence_file_fstat(struct twopence_target *target, int fh, twopence_file_stat_t *st);
+extern int		twopence_file_close(struct twopence_target *target, int fh);
+
+/*
+ * Detached jobs.
+ *
+ * Running a command with command->detach set makes the server keep it
+ * running, and spool its output, when the connection goes away.
+ * twopence_run_test() then returns the job's ID right away, or 0 if the
+ * server failed to start it, in which case the status tells why.
+ *
+ * twopence_list_detached_jobs() returns the jobs the server holds in an
+ * array, which the caller frees with twopence_detached_jobs_free().
+ *
+ * twopence_reattach() sends all output of the job to the iostreams of
+ * @cmd, waits for the job to exit, and collects its status; the server then
+ * forgets about the job. Only the iostreams, timeout and background flag
+ * of @cmd are used; if @cmd is NULL, the output is discarded. As with
+ * twopence_run_test(), a backgrounded reattach returns a pid to wait for.
+ * If the job does not exist, status->major is set to ESRCH.
+ */
+extern int		twopence_list_detached_jobs(struct twopence_target *target,
+				twopence_detached_job_t **jobs_ret, unsigned int *count_ret);
+extern void		twopence_detached_jobs_free(twopence_detached_job_t *jobs, unsigned int count);
+extern int		twopence_reattach(struct twopence_target *target, unsigned int job_id,
+				twopence_command_t *cmd, twopence_status_t *status);
+
 /*
  * Tell the remote test server to exit
  * WARNING: you won't be able to run further tests after that,
@@ -566,6 +1034,20 @@ extern int		twopence_disconnect(twopence_target_t *target);
  */
 extern int		twopence_interrupt_command(struct twopence_target *target);
 
+/*
+ * Interrupt a backgrounded command
+ *
+ * Input:
+ *   handle: the handle returned by the initialization function
+ *   pid: the "pid" returned by twopence_run_test() when backgrounding the command
+ *
+ * Output:
+ *   Returns 0 if everything went fine.
+ *   Note that you still need to collect the command's status using
+ *   twopence_wait().
+ */
+extern int		twopence_interrupt_pid(struct twopence_target *target, int pid);
+
 
 /*
  * Create a global timer.
@@ -594,11 +1076,17 @@ extern void		twopence_command_destroy(twopence_command_t *cmd);
 extern void		twopence_command_setenv(twopence_command_t *cmd, const char *name, const char *value);
 extern void		twopence_command_passenv(twopence_command_t *cmd, const char *name);
 extern void		twopence_command_merge_default_env(twopence_command_t *cmd, const twopence_env_t *def_env);
+extern int		twopence_command_prepare(struct twopence_target *, twopence_command_t *);
+extern void		twopence_command_reset_buffers(twopence_command_t *);
 extern twopence_buf_t *	twopence_command_alloc_buffer(twopence_command_t *, twopence_iofd_t, size_t);
 extern void		twopence_command_ostreams_reset(twopence_command_t *);
 extern void		twopence_command_ostream_reset(twopence_command_t *, twopence_iofd_t);
 extern void		twopence_command_ostream_capture(twopence_command_t *, twopence_iofd_t, twopence_buf_t *);
 extern void		twopence_command_iostream_redirect(twopence_command_t *, twopence_iofd_t, int, bool closeit);
+extern void		twopence_command_ostream_callback(twopence_command_t *, twopence_iofd_t,
+					twopence_iostream_callback_t *fn, void *user_data);
+extern void		twopence_command_istream_producer(twopence_command_t *,
+					twopence_iostream_producer_t *fn, void *user_data);
 
 extern void		twopence_env_init(twopence_env_t *env);
 extern void		twopence_env_set(twopence_env_t *, const char *name, const char *value);
@@ -613,6 +1101,7 @@ extern void		twopence_env_destroy(twopence_env_t *);
  */
 extern void		twopence_file_xfer_init(twopence_file_xfer_t *xfer);
 extern void		twopence_file_xfer_destroy(twopence_file_xfer_t *xfer);
+extern int		twopence_file_xfer_set_known_file(twopence_file_xfer_t *xfer, const char *local_path);
 
 /*
  * Output handling functions
@@ -621,12 +1110,15 @@ extern int		twopence_iostream_open_file(const char *filename, twopence_iostream_
 extern int		twopence_iostream_create_file(const char *filename, unsigned int permissions, twopence_iostream_t **ret);
 extern int		twopence_iostream_wrap_fd(int fd, bool closeit, twopence_iostream_t **ret);
 extern int		twopence_iostream_wrap_buffer(twopence_buf_t *bp, bool resizable, twopence_iostream_t **ret);
+extern int		twopence_iostream_wrap_callback(twopence_iostream_callback_t *fn, void *user_data, twopence_iostream_t **ret);
+extern int		twopence_iostream_wrap_producer(twopence_iostream_producer_t *fn, void *user_data, twopence_iostream_t **ret);
 extern void		twopence_iostream_free(twopence_iostream_t *);
 extern void		twopence_iostream_add_substream(twopence_iostream_t *, twopence_substream_t *);
 extern void		twopence_iostream_destroy(twopence_iostream_t *);
 extern bool		twopence_iostream_eof(const twopence_iostream_t *);
 extern int		twopence_iostream_putc(twopence_iostream_t *, char);
 extern int		twopence_iostream_write(twopence_iostream_t *, const char *, size_t);
+extern int		twopence_iostream_write_channel(twopence_iostream_t *, unsigned int channel, const char *, size_t);
 extern int		twopence_iostream_getc(twopence_iostream_t *);
 extern int		twopence_iostream_read(twopence_iostream_t *, char *, size_t);
 extern twopence_buf_t *	twopence_iostream_read_all(twopence_iostream_t *);
@@ -634,9 +1126,12 @@ extern int		twopence_iostream_set_blocking(twopence_iostream_t *, bool);
 extern int		twopence_iostream_poll(twopence_iostream_t *, struct pollfd *, int mask);
 extern long		twopence_iostream_filesize(twopence_iostream_t *);
 extern int		twopence_iostream_getfd(twopence_iostream_t *);
+extern void		twopence_iostream_set_budget(twopence_iostream_t *, twopence_buf_budget_t *);
 
 extern twopence_substream_t *twopence_substream_new_buffer(twopence_buf_t *, bool resizable);
 extern twopence_substream_t *twopence_substream_new_fd(int fd, bool closeit);
+extern twopence_substream_t *twopence_substream_new_callback(twopence_iostream_callback_t *fn, void *user_data);
+extern twopence_substream_t *twopence_substream_new_producer(twopence_iostream_producer_t *fn, void *user_data);
 extern void		twopence_substream_close(twopence_substream_t *);
 
 /*
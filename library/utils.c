@@ -92,19 +92,18 @@ twopence_timeout_msec(const twopence_timeout_t *tmo)
 }
 
 struct timespec *
-twopence_timeout_timespec(const twopence_timeout_t *tmo)
+twopence_timeout_timespec(const twopence_timeout_t *tmo, struct timespec *value)
 {
-	static struct timespec value;
 	struct timeval delta;
 
 	if (!timerisset(&tmo->until))
 		return NULL;
 
 	timersub(&tmo->until, &tmo->now, &delta);
-	value.tv_sec = delta.tv_sec;
-	value.tv_nsec = delta.tv_usec * 1000;
+	value->tv_sec = delta.tv_sec;
+	value->tv_nsec = delta.tv_usec * 1000;
 
-	return &value;
+	return value;
 }
 
 void
@@ -147,9 +146,11 @@ twopence_pollinfo_poll(const twopence_pollinfo_t *pinfo)
 int
 twopence_pollinfo_ppoll(const twopence_pollinfo_t *pinfo, const sigset_t *mask)
 {
+	struct timespec ts;
+
 	if (pinfo->num_fds == 0)
 		twopence_debug("No events to wait for?!\n");
-	return ppoll(pinfo->pfd, pinfo->num_fds, twopence_timeout_timespec(&pinfo->timeout), mask);
+	return ppoll(pinfo->pfd, pinfo->num_fds, twopence_timeout_timespec(&pinfo->timeout, &ts), mask);
 }
 
 /*
@@ -38,6 +38,17 @@ typedef struct twopence_pollinfo {
 	twopence_timeout_t	timeout;
 } twopence_pollinfo_t;
 
+/* Waiting for the fds of several targets at once (see group.c) */
+typedef struct twopence_target_pollset {
+	struct pollfd *		pfd;
+	unsigned int		size, count;
+	int			timeout_ms;
+} twopence_target_pollset_t;
+
+typedef struct twopence_target_pollslice {
+	unsigned int		offset, count;
+} twopence_target_pollslice_t;
+
 typedef struct twopence_timer_list {
 	struct twopence_timer *		head;
 } twopence_timer_list_t;
@@ -49,12 +60,20 @@ extern int      ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *ts
 extern void		twopence_timeout_init(twopence_timeout_t *);
 extern bool		twopence_timeout_update(twopence_timeout_t *, const struct timeval *deadline);
 extern long		twopence_timeout_msec(const twopence_timeout_t *);
+extern struct timespec *twopence_timeout_timespec(const twopence_timeout_t *, struct timespec *);
 
 extern void		twopence_pollinfo_init(twopence_pollinfo_t *, struct pollfd *, unsigned int);
 extern struct pollfd *	twopence_pollinfo_update(twopence_pollinfo_t *, int fd, int events, const struct timeval *deadline);
 extern int		twopence_pollinfo_poll(const twopence_pollinfo_t *);
 extern int		twopence_pollinfo_ppoll(const twopence_pollinfo_t *, const sigset_t *);
 
+struct twopence_target;
+extern void		twopence_target_pollset_reset(twopence_target_pollset_t *);
+extern void		twopence_target_pollset_add(twopence_target_pollset_t *, struct twopence_target *, twopence_target_pollslice_t *);
+extern int		twopence_target_pollset_wait(twopence_target_pollset_t *);
+extern void		twopence_target_pollset_dispatch(twopence_target_pollset_t *, struct twopence_target *, const twopence_target_pollslice_t *);
+extern void		twopence_target_pollset_destroy(twopence_target_pollset_t *);
+
 extern int		twopence_name_to_signal(const char *signal_name);
 
 extern void *		twopence_malloc(size_t size);
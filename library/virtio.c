@@ -35,7 +35,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 struct twopence_virtio_target {
   struct twopence_pipe_target pipe;
 
-  struct sockaddr_un address;
+  /* One UNIX socket per virtio channel */
+  struct sockaddr_un address[TWOPENCE_PIPE_MAX_LINKS];
 };
 
 extern const struct twopence_plugin twopence_virtio_ops;
@@ -45,18 +46,43 @@ extern const struct twopence_pipe_ops twopence_virtio_link_ops;
 
 // Initialize the handle
 //
+// The target may list several sockets, separated by commas, if the
+// guest has been given more than one channel. Each of them becomes
+// a separate link to the server.
+//
 // Returns 0 if everything went fine, or -1 in case of error
 static int
 __twopence_virtio_init(struct twopence_virtio_target *handle, const char *sockname)
 {
+  unsigned int n = 0;
+  const char *end;
+
   twopence_pipe_target_init(&handle->pipe, TWOPENCE_PLUGIN_VIRTIO, &twopence_virtio_ops, &twopence_virtio_link_ops);
 
-  // Initialize the socket address
-  handle->address.sun_family = AF_LOCAL;
-  if (strlen(sockname) >= sizeof(handle->address.sun_path))
-    return -1;
-  strcpy(handle->address.sun_path, sockname);
+  do {
+    struct sockaddr_un *address;
+    size_t len;
+
+    if (n >= TWOPENCE_PIPE_MAX_LINKS)
+      return -1;
+
+    if ((end = strchr(sockname, ',')) != NULL)
+      len = end - sockname;
+    else
+      len = strlen(sockname);
+
+    // Initialize the socket address
+    address = &handle->address[n++];
+    address->sun_family = AF_LOCAL;
+    if (len == 0 || len >= sizeof(address->sun_path))
+      return -1;
+    memcpy(address->sun_path, sockname, len);
+    address->sun_path[len] = '\0';
+
+    sockname = end + 1;
+  } while (end != NULL);
 
+  handle->pipe.nlinks = n;
   return 0;
 }
 
@@ -66,7 +92,7 @@ __twopence_virtio_init(struct twopence_virtio_target *handle, const char *sockna
  * Returns the file descriptor if successful, or -1 if failed
  */
 static twopence_sock_t *
-__twopence_virtio_open(struct twopence_pipe_target *pipe_handle)
+__twopence_virtio_open(struct twopence_pipe_target *pipe_handle, unsigned int link)
 {
   struct twopence_virtio_target *handle = (struct twopence_virtio_target *) pipe_handle;
   int socket_fd;
@@ -78,7 +104,7 @@ __twopence_virtio_open(struct twopence_pipe_target *pipe_handle)
 
   // Open the connection
   if (connect(socket_fd,
-              (const struct sockaddr *) &handle->address,
+              (const struct sockaddr *) &handle->address[link],
               sizeof(struct sockaddr_un)))
   {
     close(socket_fd);
@@ -97,7 +123,8 @@ const struct twopence_pipe_ops twopence_virtio_link_ops = {
 
 // Initialize the library
 //
-// This specific plugin takes the filename of a UNIX domain socket as argument
+// This specific plugin takes the filename of a UNIX domain socket as argument,
+// or a comma separated list of them
 //
 // Returns a "handle" that must be passed to subsequent function calls,
 // or NULL in case of a problem
@@ -128,14 +155,31 @@ const struct twopence_plugin twopence_virtio_ops = {
 
 	.init = twopence_virtio_init,
 	.set_option = twopence_pipe_set_option,
+	.get_option = twopence_pipe_get_option,
 	.run_test = twopence_pipe_run_test,
 	.wait = twopence_pipe_wait,
+	.wait_many = twopence_pipe_wait_many,
 	.chat_send = twopence_pipe_chat_send,
 	.chat_recv = twopence_pipe_chat_recv,
+	.chat_eof = twopence_pipe_chat_eof,
+	.chat_lock = twopence_pipe_chat_lock,
+	.chat_unlock = twopence_pipe_chat_unlock,
 	.inject_file = twopence_pipe_inject_file,
+	.inject_begin = twopence_pipe_inject_begin,
+	.inject_write = twopence_pipe_inject_write,
+	.file_open = twopence_pipe_file_open,
+	.file_io = twopence_pipe_file_io,
+	.file_close = twopence_pipe_file_close,
+	.list_jobs = twopence_pipe_list_jobs,
+	.reattach = twopence_pipe_reattach,
 	.extract_file = twopence_pipe_extract_file,
 	.exit_remote = twopence_pipe_exit_remote,
 	.interrupt_command = twopence_pipe_interrupt_command,
+	.interrupt_pid = twopence_pipe_interrupt_pid,
+	.wait_ready = twopence_pipe_wait_ready,
+	.connect = twopence_pipe_connect,
+	.get_pollfds = twopence_pipe_get_pollfds,
+	.dispatch = twopence_pipe_dispatch,
 	.cancel_transactions = twopence_pipe_cancel_transactions,
 	.disconnect = twopence_pipe_disconnect,
 	.end = twopence_pipe_end,
@@ -29,6 +29,8 @@ static void		Chat_dealloc(twopence_Chat *self);
 static PyObject *	Chat_new(PyTypeObject *type, PyObject *args, PyObject *kwds);
 static int		Chat_init(twopence_Chat *self, PyObject *args, PyObject *kwds);
 static PyObject *	Chat_expect(PyObject *self, PyObject *args, PyObject *kwds);
+static PyObject *	Chat_expectStart(PyObject *self, PyObject *args, PyObject *kwds);
+static PyObject *	Chat_expectCheck(PyObject *self, PyObject *args, PyObject *kwds);
 static PyObject *	Chat_send(PyObject *self, PyObject *args, PyObject *kwds);
 static PyObject *	Chat_recvline(PyObject *self, PyObject *args, PyObject *kwds);
 static PyObject *	Chat_wait(PyObject *self, PyObject *args, PyObject *kwds);
@@ -43,6 +45,12 @@ static PyMethodDef twopence_chatMethods[] = {
       {	"expect", (PyCFunction) Chat_expect, METH_VARARGS | METH_KEYWORDS,
 	"Wait for the command to print a given string"
       },
+      {	"expectStart", (PyCFunction) Chat_expectStart, METH_VARARGS | METH_KEYWORDS,
+	"Start waiting for the command to print a given string, and return right away"
+      },
+      {	"expectCheck", (PyCFunction) Chat_expectCheck, METH_VARARGS | METH_KEYWORDS,
+	"Check whether a pending expect has been resolved"
+      },
       {	"send", (PyCFunction) Chat_send, METH_VARARGS | METH_KEYWORDS,
 	"Send a string to the command's standard input"
       },
@@ -87,6 +95,7 @@ Chat_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 	self->pid = 0;
 	self->target = NULL;
 	self->command = NULL;
+	self->expectStrings = NULL;
 	memset(&self->chat, 0, sizeof(self->chat));
 
 	return (PyObject *)self;
@@ -120,6 +129,7 @@ Chat_dealloc(twopence_Chat *self)
 	twopence_chat_destroy(&self->chat);
 	drop_object((PyObject **) &self->target);
 	drop_object((PyObject **) &self->command);
+	drop_object(&self->expectStrings);
 }
 
 int
@@ -155,6 +165,8 @@ Chat_getattr(twopence_Chat *self, char *name)
 
 		return PyString_FromString(self->chat.found);
 	}
+	if (!strcmp(name, "pending"))
+		return return_bool(self->chat.expect_pending);
 
 	return Py_FindMethod(twopence_chatMethods, (PyObject *) self, name);
 }
@@ -243,7 +255,9 @@ Chat_expect(PyObject *self, PyObject *args, PyObject *kwds)
 	if (!Chat_expect_set_strings(&expect, expectObj))
 		return NULL;
 
+	Py_BEGIN_ALLOW_THREADS
 	rv = twopence_chat_expect(chatObject->target->handle, &chatObject->chat, &expect);
+	Py_END_ALLOW_THREADS
 	if (rv <= 0) {
 		/* There are a number of reasons for getting here:
 		 *  - command exited without producing further output (nbytes is 0 in this case)
@@ -260,6 +274,163 @@ Chat_expect(PyObject *self, PyObject *args, PyObject *kwds)
 	return result;
 }
 
+/*
+ * Start waiting for the command to produce a given output, without
+ * blocking. Use expectCheck() or twopence.pollChats() to find out
+ * when it has been resolved.
+ */
+static PyObject *
+Chat_expectStart(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	twopence_Chat *chatObject = (twopence_Chat *) self;
+	static char *kwlist[] = {
+		"expect",
+		"timeout",
+		NULL
+	};
+	PyObject *expectObj, *strings;
+	twopence_expect_t expect;
+	int timeout = 0;
+	int rv;
+
+	memset(&expect, 0, sizeof(expect));
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|i", kwlist, &expectObj, &timeout))
+		return NULL;
+
+	if (chatObject->target == NULL) {
+		PyErr_SetString(PyExc_TypeError, "chat.expectStart(): invalid chat object (no target attr set)");
+		return NULL;
+	}
+
+	/* The library hangs on to the strings until the expect is resolved,
+	 * so keep a copy the caller cannot modify. */
+	if (PyString_Check(expectObj)) {
+		strings = expectObj;
+		Py_INCREF(strings);
+	} else
+	if (PySequence_Check(expectObj)) {
+		if ((strings = PySequence_Tuple(expectObj)) == NULL)
+			return NULL;
+	} else {
+		PyErr_SetString(PyExc_TypeError, "chat.expectStart(): invalid <expect> argument");
+		return NULL;
+	}
+
+	expect.timeout = timeout;
+	if (!Chat_expect_set_strings(&expect, strings)) {
+		Py_DECREF(strings);
+		return NULL;
+	}
+
+	rv = twopence_chat_expect_start(chatObject->target->handle, &chatObject->chat, &expect);
+	if (rv < 0) {
+		Py_DECREF(strings);
+		return twopence_Exception("chat.expectStart()", rv);
+	}
+
+	drop_object(&chatObject->expectStrings);
+	chatObject->expectStrings = strings;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/*
+ * Returns True once the expect started with expectStart() has been
+ * resolved, and False while it is pending. This does no I/O.
+ * When resolved, chat.found holds the string that was matched, or
+ * None if the command ended or the timeout expired.
+ */
+static PyObject *
+Chat_expectCheck(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	twopence_Chat *chatObject = (twopence_Chat *) self;
+	static char *kwlist[] = {
+		NULL
+	};
+	int rv;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist))
+		return NULL;
+
+	if (chatObject->target == NULL) {
+		PyErr_SetString(PyExc_TypeError, "chat.expectCheck(): invalid chat object (no target attr set)");
+		return NULL;
+	}
+
+	/* Nothing pending, nothing to wait for */
+	if (!chatObject->chat.expect_pending)
+		return return_bool(true);
+
+	rv = twopence_chat_expect_check(chatObject->target->handle, &chatObject->chat);
+	if (rv < 0)
+		return twopence_Exception("chat.expectCheck()", rv);
+
+	return return_bool(rv > 0);
+}
+
+/*
+ * twopence.pollChats([chat1, chat2, ...])
+ *
+ * Drive the given chats, on one or several targets, until at least one
+ * of their pending expects has been resolved. Returns the list of chats
+ * resolved by this call.
+ */
+PyObject *
+Chat_poll(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"chats",
+		NULL
+	};
+	PyObject *chatsObject, *list, *result = NULL;
+	twopence_chat_t **chats;
+	bool *pending;
+	Py_ssize_t i, count;
+	int rv;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &chatsObject))
+		return NULL;
+
+	if (!(list = PySequence_List(chatsObject)))
+		return NULL;
+
+	count = PyList_Size(list);
+	chats = twopence_calloc(count + 1, sizeof(chats[0]));
+	pending = twopence_calloc(count + 1, sizeof(pending[0]));
+	for (i = 0; i < count; ++i) {
+		PyObject *item = PyList_GetItem(list, i);
+
+		if (!Chat_Check(item)) {
+			PyErr_SetString(PyExc_TypeError, "twopence.pollChats(): argument must be a list of Chat objects");
+			goto out;
+		}
+		chats[i] = &((twopence_Chat *) item)->chat;
+		pending[i] = chats[i]->expect_pending;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	rv = twopence_chat_poll(chats, count);
+	Py_END_ALLOW_THREADS
+	if (rv < 0) {
+		twopence_Exception("twopence.pollChats()", rv);
+		goto out;
+	}
+
+	result = PyList_New(0);
+	for (i = 0; i < count; ++i) {
+		if (pending[i] && !chats[i]->expect_pending)
+			PyList_Append(result, PyList_GetItem(list, i));
+	}
+
+out:
+	free(chats);
+	free(pending);
+	Py_DECREF(list);
+	return result;
+}
+
 static PyObject *
 Chat_send(PyObject *self, PyObject *args, PyObject *kwds)
 {
@@ -278,7 +449,9 @@ Chat_send(PyObject *self, PyObject *args, PyObject *kwds)
 		return NULL;
 	}
 
+	Py_BEGIN_ALLOW_THREADS
 	twopence_chat_puts(chatObject->target->handle, &chatObject->chat, string);
+	Py_END_ALLOW_THREADS
 
 	Py_INCREF(Py_None);
 	return Py_None;
@@ -294,6 +467,7 @@ Chat_recvline(PyObject *self, PyObject *args, PyObject *kwds)
 	};
 	int timeout = -1;
 	char buffer[512];
+	char *line;
 
 	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &timeout))
 		return NULL;
@@ -303,7 +477,11 @@ Chat_recvline(PyObject *self, PyObject *args, PyObject *kwds)
 		return NULL;
 	}
 
-	if (!twopence_chat_gets(chatObject->target->handle, &chatObject->chat, buffer, sizeof(buffer), timeout)) {
+	Py_BEGIN_ALLOW_THREADS
+	line = twopence_chat_gets(chatObject->target->handle, &chatObject->chat, buffer, sizeof(buffer), timeout);
+	Py_END_ALLOW_THREADS
+
+	if (line == NULL) {
 		Py_INCREF(Py_None);
 		return Py_None;
 	}
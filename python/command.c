@@ -32,6 +32,8 @@ static int		Command_setattr(twopence_Command *self, char *name, PyObject *);
 static PyObject *	Command_suppressOutput(twopence_Command *, PyObject *, PyObject *);
 static PyObject *	Command_setenv(twopence_Command *, PyObject *, PyObject *);
 static PyObject *	Command_unsetenv(twopence_Command *, PyObject *, PyObject *);
+static PyObject *	Command_interrupt(twopence_Command *, PyObject *, PyObject *);
+static PyObject *	Command_prepare(twopence_Command *, PyObject *, PyObject *);
 
 /*
  * Define the python bindings of class "Command"
@@ -59,6 +61,8 @@ static PyObject *	Command_unsetenv(twopence_Command *, PyObject *, PyObject *);
  *	Pass the None object to suppress output.
  *	If you just specify stdout but not stderr, the two output streams
  *	are combined into one and buffered together.
+ *	A callable is invoked as callback(channel, timestamp, data) for
+ *	every chunk of output as it arrives.
  *
  * To run this command on the SUT, use
  *   target.run(cmd)
@@ -73,6 +77,12 @@ static PyMethodDef twopence_commandMethods[] = {
       {	"unsetenv", (PyCFunction) Command_unsetenv, METH_VARARGS | METH_KEYWORDS,
 	"Unset an environment variable"
       },
+      {	"interrupt", (PyCFunction) Command_interrupt, METH_VARARGS | METH_KEYWORDS,
+	"Interrupt the command while it is running in the background"
+      },
+      {	"prepare", (PyCFunction) Command_prepare, METH_VARARGS | METH_KEYWORDS,
+	"Encode the request once, for running the command on a target over and over"
+      },
       {	NULL }
 };
 
@@ -117,7 +127,11 @@ Command_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 	self->useTty = 0;
 	self->background = false;
 	self->softfail = false;
+	self->detach = false;
 	self->pid = 0;
+	self->target = NULL;
+	self->prepared = NULL;
+	self->preparedTarget = NULL;
 
 	twopence_env_init(&self->environ);
 
@@ -146,6 +160,7 @@ Command_init(twopence_Command *self, PyObject *args, PyObject *kwds)
 		"quiet",
 		"background",
 		"softfail",
+		"detach",
 		NULL
 	};
 	PyObject *stdinObject = NULL, *stdoutObject = NULL, *stderrObject = NULL;
@@ -154,11 +169,12 @@ Command_init(twopence_Command *self, PyObject *args, PyObject *kwds)
 	int quiet = 0;
 	int background = 0;
 	int softfail = 0;
+	int detach = 0;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|slOOOiiii", kwlist,
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|slOOOiiiii", kwlist,
 				&command, &user, &timeout, &stdinObject, &stdoutObject, &stderrObject,
 				&quiet, &quiet,
-				&background, &softfail))
+				&background, &softfail, &detach))
 		return -1;
 
 	self->command = twopence_strdup(command);
@@ -171,6 +187,7 @@ Command_init(twopence_Command *self, PyObject *args, PyObject *kwds)
 	self->quiet = quiet;
 	self->background = background;
 	self->softfail = softfail;
+	self->detach = detach;
 
 	if (stdoutObject == NULL) {
 		stdoutObject = twopence_callType(&PyByteArray_Type, NULL, NULL);
@@ -203,12 +220,26 @@ Command_init(twopence_Command *self, PyObject *args, PyObject *kwds)
 	return 0;
 }
 
+/*
+ * Discard the request encoded by prepare()
+ */
+static void
+Command_unprepare(twopence_Command *self)
+{
+	if (self->prepared) {
+		twopence_buf_free(self->prepared);
+		self->prepared = NULL;
+	}
+	drop_object(&self->preparedTarget);
+}
+
 /*
  * Destructor: clean any state inside the Command object
  */
 static void
 Command_dealloc(twopence_Command *self)
 {
+	Command_unprepare(self);
 	twopence_env_destroy(&self->environ);
 	drop_string(&self->command);
 	drop_string(&self->user);
@@ -216,6 +247,7 @@ Command_dealloc(twopence_Command *self)
 	drop_object(&self->stdout);
 	drop_object(&self->stderr);
 	drop_object(&self->stdin);
+	drop_object(&self->target);
 }
 
 int
@@ -224,6 +256,84 @@ Command_Check(PyObject *self)
 	return PyType_IsSubtype(Py_TYPE(self), &twopence_CommandType);
 }
 
+/*
+ * Invoked for every chunk of output when stdout or stderr is a callable
+ */
+static void
+__Command_output_callback(void *user_data, unsigned int channel, const struct timeval *when, const void *data, size_t len)
+{
+	PyObject *callback = (PyObject *) user_data;
+	PyGILState_STATE gstate;
+	PyObject *args, *v;
+
+	/* We're called from deep inside the library, which runs
+	 * without holding the interpreter lock. */
+	gstate = PyGILState_Ensure();
+
+	args = Py_BuildValue("(ids#)", channel, when->tv_sec + when->tv_usec / 1e6, (const char *) data, (int) len);
+	v = twopence_callObject(callback, args, NULL);
+	if (v == NULL) {
+		twopence_log_error("Exception in twopence.Command output callback");
+	} else {
+		Py_DECREF(v);
+	}
+	Py_XDECREF(args);
+
+	PyGILState_Release(gstate);
+}
+
+/*
+ * Invoked whenever we have room for more input when stdin is a callable.
+ * It is passed the maximum number of bytes it may return, and returns
+ * a string; an empty string (or None) signals EOF.
+ */
+static int
+__Command_input_callback(void *user_data, void *data, size_t len)
+{
+	PyObject *callback = (PyObject *) user_data;
+	PyGILState_STATE gstate;
+	PyObject *args, *v;
+	int count = -1;
+
+	gstate = PyGILState_Ensure();
+
+	args = Py_BuildValue("(i)", (int) len);
+	v = twopence_callObject(callback, args, NULL);
+	if (v == NULL) {
+		twopence_log_error("Exception in twopence.Command input callback");
+	} else {
+		char *s;
+		Py_ssize_t n;
+
+		if (v == Py_None) {
+			count = 0;
+		} else if (PyString_AsStringAndSize(v, &s, &n) < 0) {
+			twopence_log_error("twopence.Command input callback must return a string");
+			PyErr_Clear();
+		} else {
+			if ((size_t) n > len)
+				n = len;
+			memcpy(data, s, n);
+			count = n;
+		}
+		Py_DECREF(v);
+	}
+	Py_XDECREF(args);
+
+	PyGILState_Release(gstate);
+	return count;
+}
+
+/*
+ * Capture output in a buffer that grows as needed. Its memory use is
+ * bounded by the target's capture budget, if one was set.
+ */
+static void
+Command_capture(twopence_command_t *cmd, twopence_iofd_t dst, twopence_buf_t *buffer)
+{
+	twopence_iostream_add_substream(&cmd->iostream[dst], twopence_substream_new_buffer(buffer, true));
+}
+
 static bool
 Command_redirect_iostream(twopence_command_t *cmd, twopence_iofd_t dst, PyObject *object, twopence_buf_t **buf_ret)
 {
@@ -235,7 +345,7 @@ Command_redirect_iostream(twopence_command_t *cmd, twopence_iofd_t dst, PyObject
 
 		/* Capture command output in a buffer */
 		buffer = twopence_command_alloc_buffer(cmd, dst, 65536);
-		twopence_command_ostream_capture(cmd, dst, buffer);
+		Command_capture(cmd, dst, buffer);
 		if (dst == TWOPENCE_STDIN) {
 			unsigned int count = PyByteArray_Size(object);
 
@@ -260,6 +370,15 @@ Command_redirect_iostream(twopence_command_t *cmd, twopence_iofd_t dst, PyObject
 	} else
 	if (object == Py_None) {
 		/* Nothing */
+	} else
+	if (dst == TWOPENCE_STDIN && PyCallable_Check(object)) {
+		/* Ask the callable for input whenever we can send more */
+		twopence_command_istream_producer(cmd, __Command_input_callback, object);
+	} else
+	if (PyCallable_Check(object)) {
+		/* Hand output to the callable as it arrives. The command
+		 * object holds a reference to it for as long as we need it. */
+		twopence_command_ostream_callback(cmd, dst, __Command_output_callback, object);
 	} else {
 		/* FIXME: we could check for a string type, and in that case interpret that as
 		 * the name of a file to write to. */
@@ -281,6 +400,7 @@ Command_build(twopence_Command *self, twopence_command_t *cmd)
 	cmd->timeout = self->timeout;
 	cmd->request_tty = self->useTty;
 	cmd->background = self->background;
+	cmd->detach = self->detach;
 
 	twopence_command_ostreams_reset(cmd);
 	if (self->quiet || self->stdout == Py_None) {
@@ -303,7 +423,7 @@ Command_build(twopence_Command *self, twopence_command_t *cmd)
 	/* If cmd.stdout and cmd.stderr are both NULL, or both refer to the same
 	 * bytearray object, send the remote stdout and stderr to a shared buffer */
 	if (buffer && self->stderr == self->stdout) {
-		twopence_command_ostream_capture(cmd, TWOPENCE_STDERR, buffer);
+		Command_capture(cmd, TWOPENCE_STDERR, buffer);
 	} else
 	if (!Command_redirect_iostream(cmd, TWOPENCE_STDERR, self->stderr, NULL)) {
 		return -1;
@@ -362,6 +482,7 @@ Command_setenv(twopence_Command *self, PyObject *args, PyObject *kwds)
 	if (!PyArg_ParseTupleAndKeywords(args, kwds, "ss", kwlist, &variable, &value))
 		return NULL;
 
+	Command_unprepare(self);
 	twopence_env_set(&self->environ, variable, value);
 
 	Py_INCREF(Py_None);
@@ -380,12 +501,100 @@ Command_unsetenv(twopence_Command *self, PyObject *args, PyObject *kwds)
 	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &variable))
 		return NULL;
 
+	Command_unprepare(self);
 	twopence_env_unset(&self->environ, variable);
 
 	Py_INCREF(Py_None);
 	return Py_None;
 }
 
+/*
+ * Interrupt a backgrounded command.
+ * You still need to call target.wait() to collect its status.
+ */
+static PyObject *
+Command_interrupt(twopence_Command *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		NULL
+	};
+	twopence_Target *tgtObject;
+	int rc;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist))
+		return NULL;
+
+	if (self->pid == 0 || (tgtObject = (twopence_Target *) self->target) == NULL) {
+		PyErr_SetString(PyExc_ValueError, "command.interrupt(): command is not running in the background");
+		return NULL;
+	}
+
+	rc = twopence_interrupt_pid(tgtObject->handle, self->pid);
+	if (rc < 0)
+		return twopence_Exception("interrupt", rc);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/*
+ * Encode the request for running this command on the given target, so
+ * that target.run() does not have to do it every time. Changing the
+ * user, timeout, tty flag or environment of the command discards it.
+ */
+static PyObject *
+Command_prepare(twopence_Command *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"target",
+		NULL
+	};
+	twopence_Target *tgtObject;
+	twopence_command_t cmd;
+	int rc;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!", kwlist, &twopence_TargetType, &tgtObject))
+		return NULL;
+
+	if (tgtObject->handle == NULL) {
+		PyErr_SetString(PyExc_SystemError, "command.prepare(): target without handle");
+		return NULL;
+	}
+
+	memset(&cmd, 0, sizeof(cmd));
+	if (Command_build(self, &cmd) < 0) {
+		twopence_command_destroy(&cmd);
+		return NULL;
+	}
+
+	rc = twopence_command_prepare(tgtObject->handle, &cmd);
+	if (rc < 0) {
+		twopence_command_destroy(&cmd);
+		return twopence_Exception("prepare", rc);
+	}
+
+	Command_unprepare(self);
+	self->prepared = cmd.prepared;
+	cmd.prepared = NULL;
+	assign_object(&self->preparedTarget, (PyObject *) tgtObject);
+
+	twopence_command_destroy(&cmd);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/*
+ * If the command was prepared for this target, have the library
+ * use the encoded request rather than build a new one.
+ */
+void
+Command_usePrepared(twopence_Command *self, twopence_Target *tgtObject, twopence_command_t *cmd)
+{
+	if (self->prepared && self->preparedTarget == (PyObject *) tgtObject)
+		cmd->prepared = twopence_buf_hold(self->prepared);
+}
+
 static PyObject *
 Command_suppressOutput(twopence_Command *self, PyObject *args, PyObject *kwds)
 {
@@ -447,6 +656,10 @@ Command_getattr(twopence_Command *self, char *name)
 		return return_bool(self->background);
 	if (!strcmp(name, "softfail"))
 		return return_bool(self->softfail);
+	if (!strcmp(name, "detach"))
+		return return_bool(self->detach);
+	if (!strcmp(name, "prepared"))
+		return return_bool(self->prepared != NULL);
 	if (!strcmp(name, "environ")) {
 		twopence_env_t *env = &self->environ;
 		PyObject *rv = PyTuple_New(env->count);
@@ -495,6 +708,7 @@ Command_setattr(twopence_Command *self, char *name, PyObject *v)
 		if (!PyString_Check(v) || (s = PyString_AsString(v)) == NULL)
 			goto bad_attr;
 		assign_string(&self->user, s);
+		Command_unprepare(self);
 		return 0;
 	}
 	if (!strcmp(name, "timeout")) {
@@ -504,6 +718,7 @@ Command_setattr(twopence_Command *self, char *name, PyObject *v)
 			self->timeout = PyLong_AsLongLong(v);
 		else
 			goto bad_attr;
+		Command_unprepare(self);
 		return 0;
 	}
 	if (!strcmp(name, "quiet")) {
@@ -512,6 +727,7 @@ Command_setattr(twopence_Command *self, char *name, PyObject *v)
 	}
 	if (!strcmp(name, "useTty")) {
 		self->useTty = !!(PyObject_IsTrue(v));
+		Command_unprepare(self);
 		return 0;
 	}
 	if (!strcmp(name, "background")) {
@@ -522,6 +738,11 @@ Command_setattr(twopence_Command *self, char *name, PyObject *v)
 		self->softfail = !!(PyObject_IsTrue(v));
 		return 0;
 	}
+	if (!strcmp(name, "detach")) {
+		self->detach = !!(PyObject_IsTrue(v));
+		Command_unprepare(self);
+		return 0;
+	}
 
 	(void) PyErr_Format(PyExc_AttributeError, "Unknown attribute: %s", name);
 	return -1;
@@ -35,6 +35,9 @@ static PyMethodDef twopence_methods[] = {
       {	"setDebugLevel", (PyCFunction) twopence_setDebugLevel, METH_VARARGS | METH_KEYWORDS,
 	"Set the debug level (0 is no debugging)"
       },
+      {	"pollChats", (PyCFunction) Chat_poll, METH_VARARGS | METH_KEYWORDS,
+	"Wait until the pending expect of at least one of the given chats is resolved"
+      },
       {	NULL }
 };
 
@@ -150,6 +153,9 @@ inittwopence(void)
 {
 	PyObject* m;
 
+	/* We drop the interpreter lock while waiting for the SUT */
+	PyEval_InitThreads();
+
 	m = Py_InitModule3("twopence", twopence_methods, "Module for twopence based testing");
 
 	twopence_registerType(m, "Target", &twopence_TargetType);
@@ -158,6 +164,10 @@ inittwopence(void)
 	twopence_registerType(m, "Status", &twopence_StatusType);
 	twopence_registerType(m, "Chat", &twopence_ChatType);
 	twopence_registerType(m, "Timer", &twopence_TimerType);
+	twopence_registerType(m, "Pool", &twopence_PoolType);
+	twopence_registerType(m, "Group", &twopence_GroupType);
+	twopence_registerType(m, "JobQueue", &twopence_JobQueueType);
+	twopence_registerType(m, "File", &twopence_FileType);
 
 	twopence_registerErrorConstants(m);
 }
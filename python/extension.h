@@ -54,10 +54,16 @@ typedef struct {
 	bool		useTty;
 	bool		background;
 	bool		softfail;
+	bool		detach;
 
 	twopence_env_t	environ;
 
 	unsigned int	pid;
+	PyObject *	target;		/* set while running in the background */
+
+	/* Request encoded by cmd.prepare() */
+	twopence_buf_t *prepared;
+	PyObject *	preparedTarget;
 } twopence_Command;
 
 struct backgroundedCommand {
@@ -66,9 +72,14 @@ struct backgroundedCommand {
 	unsigned int	pid;
 	twopence_command_t cmd;
 	twopence_Command *object;
+
+	/* For backgrounded file transfers, object is NULL */
+	twopence_file_xfer_t xfer;
+	struct twopence_Transfer *xferObject;
+	bool		recvfile;
 };
 
-typedef struct {
+typedef struct twopence_Transfer {
 	PyObject_HEAD
 
 	char *		remote_filename;
@@ -77,8 +88,12 @@ typedef struct {
 	long		timeout;
 	char *		local_filename;
 	PyObject *	buffer;
+	bool		background;
 
 	twopence_buf_t	databuf;
+
+	unsigned int	pid;
+	PyObject *	target;		/* set while running in the background */
 } twopence_Transfer;
 
 typedef struct {
@@ -104,6 +119,9 @@ typedef struct {
 	twopence_Command *command;
 	twopence_chat_t	chat;
 	unsigned int	pid;
+
+	/* Strings of a pending expectStart() */
+	PyObject *	expectStrings;
 } twopence_Chat;
 
 typedef struct {
@@ -113,6 +131,57 @@ typedef struct {
 	PyObject *	callback;
 } twopence_Timer;
 
+struct poolJob {
+	twopence_Command *object;
+	twopence_command_t cmd;
+};
+
+typedef struct {
+	PyObject_HEAD
+
+	twopence_target_pool_t *pool;
+	PyObject *	targets;	/* list of Target objects */
+
+	unsigned int	njobs;
+	unsigned int	ndone;		/* jobs collected by earlier calls to run() */
+	struct poolJob **jobs;
+} twopence_Pool;
+
+typedef struct {
+	PyObject_HEAD
+
+	twopence_group_t *group;
+	PyObject *	targets;	/* list of Target objects */
+} twopence_Group;
+
+struct jobqJob {
+	twopence_job_t *job;
+	PyObject *	object;		/* Command or Transfer object */
+	bool		transfer;
+	bool		recvfile;
+	twopence_command_t cmd;
+	twopence_file_xfer_t xfer;
+};
+
+typedef struct {
+	PyObject_HEAD
+
+	twopence_jobq_t *jobq;
+	PyObject *	targets;	/* Target objects the jobs run on */
+
+	unsigned int	njobs;
+	unsigned int	ndone;		/* jobs collected by earlier calls to run() */
+	struct jobqJob **jobs;
+} twopence_JobQueue;
+
+typedef struct {
+	PyObject_HEAD
+
+	twopence_Target *target;
+	char *		path;
+	int		fh;		/* 0 once closed */
+} twopence_File;
+
 
 
 extern PyTypeObject	twopence_TargetType;
@@ -121,15 +190,24 @@ extern PyTypeObject	twopence_TransferType;
 extern PyTypeObject	twopence_StatusType;
 extern PyTypeObject	twopence_ChatType;
 extern PyTypeObject	twopence_TimerType;
+extern PyTypeObject	twopence_PoolType;
+extern PyTypeObject	twopence_GroupType;
+extern PyTypeObject	twopence_JobQueueType;
+extern PyTypeObject	twopence_FileType;
 
 extern int		Command_init(twopence_Command *self, PyObject *args, PyObject *kwds);
 extern int		Command_Check(PyObject *);
 extern int		Command_build(twopence_Command *, twopence_command_t *);
+extern PyObject *	Command_buildStatus(twopence_Command *, twopence_command_t *, twopence_status_t *, int rc);
+extern void		Command_usePrepared(twopence_Command *, twopence_Target *, twopence_command_t *);
 extern PyObject *	Target_wait_common(twopence_Target *tgtObject, int pid);
 extern int		Transfer_init(twopence_Transfer *self, PyObject *args, PyObject *kwds);
 extern int		Transfer_Check(PyObject *);
 extern int		Transfer_build_send(twopence_Transfer *, twopence_file_xfer_t *);
 extern int		Transfer_build_recv(twopence_Transfer *, twopence_file_xfer_t *);
+extern PyObject *	Transfer_buildStatus(twopence_Transfer *, twopence_status_t *, bool recvfile);
+extern int		File_parseMode(const char *, unsigned int *);
+extern PyObject *	Chat_poll(PyObject *, PyObject *, PyObject *);
 extern PyObject *	twopence_Exception(const char *msg, int rc);
 extern PyObject *	twopence_callObject(PyObject *callable, PyObject *args, PyObject *kwds);
 extern PyObject *	twopence_callType(PyTypeObject *typeObject, PyObject *args, PyObject *kwds);
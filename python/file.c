@@ -0,0 +1,295 @@
+/*
+Twopence python bindings - class File
+
+Copyright (C) 2015 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "extension.h"
+
+#include "twopence.h"
+
+static void		File_dealloc(twopence_File *self);
+static PyObject *	File_new(PyTypeObject *type, PyObject *args, PyObject *kwds);
+static int		File_init(twopence_File *self, PyObject *args, PyObject *kwds);
+static PyObject *	File_getattr(twopence_File *self, char *name);
+static PyObject *	File_pread(twopence_File *, PyObject *, PyObject *);
+static PyObject *	File_pwrite(twopence_File *, PyObject *, PyObject *);
+static PyObject *	File_fstat(twopence_File *, PyObject *, PyObject *);
+static PyObject *	File_close(twopence_File *, PyObject *, PyObject *);
+
+/*
+ * Define the python bindings of class "File"
+ * Normally, you do not create File objects yourself;
+ * Usually, these are created as the return value of Target.open()
+ */
+static PyMethodDef twopence_fileMethods[] = {
+      {	"pread", (PyCFunction) File_pread, METH_VARARGS | METH_KEYWORDS,
+	"Read from the remote file at the given offset"
+      },
+      {	"pwrite", (PyCFunction) File_pwrite, METH_VARARGS | METH_KEYWORDS,
+	"Write to the remote file at the given offset"
+      },
+      {	"fstat", (PyCFunction) File_fstat, METH_VARARGS | METH_KEYWORDS,
+	"Return size, mode, owner and mtime of the remote file"
+      },
+      {	"close", (PyCFunction) File_close, METH_VARARGS | METH_KEYWORDS,
+	"Close the remote file"
+      },
+      {	NULL }
+};
+
+PyTypeObject twopence_FileType = {
+	PyObject_HEAD_INIT(NULL)
+
+	.tp_name	= "twopence.File",
+	.tp_basicsize	= sizeof(twopence_File),
+	.tp_flags	= Py_TPFLAGS_DEFAULT,
+	.tp_doc		= "File on the SUT, opened for random access",
+
+	.tp_methods	= twopence_fileMethods,
+	.tp_init	= (initproc) File_init,
+	.tp_new		= File_new,
+	.tp_dealloc	= (destructor) File_dealloc,
+
+	.tp_getattr	= (getattrfunc) File_getattr,
+};
+
+/*
+ * Constructor: allocate empty File object, and set its members.
+ */
+static PyObject *
+File_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	twopence_File *self;
+
+	self = (twopence_File *) type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+
+	/* init members */
+	self->target = NULL;
+	self->path = NULL;
+	self->fh = 0;
+
+	return (PyObject *)self;
+}
+
+/*
+ * Initialize the file object
+ */
+static int
+File_init(twopence_File *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		NULL
+	};
+
+	if (args == Py_None)
+		return 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Destructor: close the remote file if the script did not
+ */
+static void
+File_dealloc(twopence_File *self)
+{
+	if (self->fh > 0 && self->target)
+		twopence_file_close(self->target->handle, self->fh);
+	self->fh = 0;
+
+	drop_object((PyObject **) &self->target);
+	drop_string(&self->path);
+}
+
+static PyObject *
+File_getattr(twopence_File *self, char *name)
+{
+	if (!strcmp(name, "path"))
+		return return_string_or_none(self->path);
+	if (!strcmp(name, "closed"))
+		return return_bool(self->fh <= 0);
+
+	return Py_FindMethod(twopence_fileMethods, (PyObject *) self, name);
+}
+
+/*
+ * Translate a python style mode string into TWOPENCE_OPEN_* flags
+ */
+int
+File_parseMode(const char *mode, unsigned int *flags)
+{
+	if (!strcmp(mode, "r"))
+		*flags = TWOPENCE_OPEN_READ;
+	else if (!strcmp(mode, "r+"))
+		*flags = TWOPENCE_OPEN_READ | TWOPENCE_OPEN_WRITE;
+	else if (!strcmp(mode, "w"))
+		*flags = TWOPENCE_OPEN_WRITE | TWOPENCE_OPEN_CREATE | TWOPENCE_OPEN_TRUNCATE;
+	else if (!strcmp(mode, "w+"))
+		*flags = TWOPENCE_OPEN_READ | TWOPENCE_OPEN_WRITE | TWOPENCE_OPEN_CREATE | TWOPENCE_OPEN_TRUNCATE;
+	else
+		return -1;
+	return 0;
+}
+
+static bool
+File_checkOpen(twopence_File *self, const char *method)
+{
+	if (self->fh <= 0 || self->target == NULL) {
+		PyErr_Format(PyExc_ValueError, "file.%s(): file is not open", method);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * data = file.pread(count, offset)
+ *
+ * Returns a bytearray. If it is shorter than count, the end of the file
+ * was reached.
+ */
+static PyObject *
+File_pread(twopence_File *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"count",
+		"offset",
+		NULL
+	};
+	unsigned int count;
+	unsigned long long offset;
+	PyObject *result;
+	int rc;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "IK", kwlist, &count, &offset))
+		return NULL;
+
+	if (!File_checkOpen(self, "pread"))
+		return NULL;
+
+	result = PyByteArray_FromStringAndSize(NULL, count);
+	if (result == NULL)
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	rc = twopence_file_pread(self->target->handle, self->fh, PyByteArray_AsString(result), count, offset);
+	Py_END_ALLOW_THREADS
+	if (rc < 0) {
+		Py_DECREF(result);
+		return twopence_Exception("file.pread()", rc);
+	}
+
+	PyByteArray_Resize(result, rc);
+	return result;
+}
+
+/*
+ * count = file.pwrite(data, offset)
+ */
+static PyObject *
+File_pwrite(twopence_File *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"data",
+		"offset",
+		NULL
+	};
+	unsigned long long offset;
+	Py_buffer data;
+	int rc;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s*K", kwlist, &data, &offset))
+		return NULL;
+
+	if (!File_checkOpen(self, "pwrite")) {
+		PyBuffer_Release(&data);
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	rc = twopence_file_pwrite(self->target->handle, self->fh, data.buf, data.len, offset);
+	Py_END_ALLOW_THREADS
+
+	PyBuffer_Release(&data);
+	if (rc < 0)
+		return twopence_Exception("file.pwrite()", rc);
+
+	return PyInt_FromLong(rc);
+}
+
+/*
+ * Returns a dict with keys size, mode, uid, gid and mtime
+ */
+static PyObject *
+File_fstat(twopence_File *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		NULL
+	};
+	twopence_file_stat_t st;
+	int rc;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist))
+		return NULL;
+
+	if (!File_checkOpen(self, "fstat"))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	rc = twopence_file_fstat(self->target->handle, self->fh, &st);
+	Py_END_ALLOW_THREADS
+	if (rc < 0)
+		return twopence_Exception("file.fstat()", rc);
+
+	return Py_BuildValue("{s:K,s:I,s:I,s:I,s:l}",
+			"size", (unsigned long long) st.size,
+			"mode", st.mode,
+			"uid", st.uid,
+			"gid", st.gid,
+			"mtime", (long) st.mtime);
+}
+
+static PyObject *
+File_close(twopence_File *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		NULL
+	};
+	int rc = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist))
+		return NULL;
+
+	/* Closing a file twice is harmless, like with python's own files */
+	if (self->fh > 0 && self->target) {
+		Py_BEGIN_ALLOW_THREADS
+		rc = twopence_file_close(self->target->handle, self->fh);
+		Py_END_ALLOW_THREADS
+	}
+	self->fh = 0;
+
+	if (rc < 0)
+		return twopence_Exception("file.close()", rc);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
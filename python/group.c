@@ -0,0 +1,315 @@
+/*
+Twopence python bindings - class Group
+
+Copyright (C) 2014-2015 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "extension.h"
+
+#include "twopence.h"
+
+static void		Group_dealloc(twopence_Group *self);
+static PyObject *	Group_new(PyTypeObject *type, PyObject *args, PyObject *kwds);
+static int		Group_init(twopence_Group *self, PyObject *args, PyObject *kwds);
+static PyObject *	Group_run(twopence_Group *self, PyObject *args, PyObject *kwds);
+static PyObject *	Group_sendfile(twopence_Group *self, PyObject *args, PyObject *kwds);
+
+/*
+ * Define the python bindings of class "Group"
+ */
+static PyMethodDef twopence_groupMethods[] = {
+      {	"run", (PyCFunction) Group_run, METH_VARARGS | METH_KEYWORDS,
+	"Run a command on all targets of the group, and return a list of (target, status) tuples"
+      },
+      {	"sendfile", (PyCFunction) Group_sendfile, METH_VARARGS | METH_KEYWORDS,
+	"Send a file to all targets of the group, and return a list of (target, status) tuples"
+      },
+      {	NULL }
+};
+
+PyTypeObject twopence_GroupType = {
+	PyObject_HEAD_INIT(NULL)
+
+	.tp_name	= "twopence.Group",
+	.tp_basicsize	= sizeof(twopence_Group),
+	.tp_flags	= Py_TPFLAGS_DEFAULT,
+	.tp_doc		= "Group of targets that run the same command at once",
+
+	.tp_methods	= twopence_groupMethods,
+	.tp_init	= (initproc) Group_init,
+	.tp_new		= Group_new,
+	.tp_dealloc	= (destructor) Group_dealloc,
+};
+
+/*
+ * Constructor: allocate empty Group object, and set its members.
+ */
+static PyObject *
+Group_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	twopence_Group *self;
+
+	self = (twopence_Group *) type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+
+	/* init members */
+	self->group = NULL;
+	self->targets = NULL;
+
+	return (PyObject *)self;
+}
+
+/*
+ * Initialize the group object
+ *
+ * group = twopence.Group([target1, target2, ...], concurrency = 0, cancelOnFailure = False)
+ */
+static int
+Group_init(twopence_Group *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"targets",
+		"concurrency",
+		"cancelOnFailure",
+		NULL
+	};
+	PyObject *targetsObject, *list;
+	unsigned int concurrency = 0;
+	int cancelOnFailure = 0;
+	Py_ssize_t i, count;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|Ii", kwlist, &targetsObject, &concurrency, &cancelOnFailure))
+		return -1;
+
+	if (!(list = PySequence_List(targetsObject)))
+		return -1;
+
+	self->group = twopence_group_new();
+	twopence_group_set_concurrency(self->group, concurrency);
+	twopence_group_set_cancel_on_failure(self->group, !!cancelOnFailure);
+
+	count = PyList_Size(list);
+	for (i = 0; i < count; ++i) {
+		PyObject *item = PyList_GetItem(list, i);
+
+		if (!PyType_IsSubtype(Py_TYPE(item), &twopence_TargetType)) {
+			PyErr_SetString(PyExc_TypeError, "Group: targets must be a list of Target objects");
+			Py_DECREF(list);
+			return -1;
+		}
+		twopence_group_add_target(self->group, ((twopence_Target *) item)->handle);
+	}
+
+	self->targets = list;
+	return 0;
+}
+
+/*
+ * Destructor: clean any state inside the Group object
+ */
+static void
+Group_dealloc(twopence_Group *self)
+{
+	if (self->group)
+		twopence_group_free(self->group);
+	self->group = NULL;
+
+	drop_object(&self->targets);
+}
+
+/*
+ * Build the status object for one target of the group.
+ * For commands, each target gets its own stdout and stderr buffers.
+ */
+static PyObject *
+Group_buildStatus(PyObject *object, const twopence_group_result_t *res)
+{
+	twopence_Status *statusObject;
+
+	statusObject = (twopence_Status *) twopence_callType(&twopence_StatusType, NULL, NULL);
+	if (statusObject == NULL)
+		return NULL;
+
+	if (res->rc < 0) {
+		statusObject->localError = res->rc;
+		return (PyObject *) statusObject;
+	}
+
+	if (!Command_Check(object)) {
+		/* File transfer */
+		statusObject->remoteStatus = res->status.major ?: res->status.minor;
+		return (PyObject *) statusObject;
+	}
+
+	if (res->status.major == EFAULT) {
+		statusObject->exitSignal = res->status.minor;
+	} else {
+		statusObject->remoteStatus = res->status.minor;
+	}
+
+	statusObject->stdout = twopence_callType(&PyByteArray_Type, NULL, NULL);
+	statusObject->stderr = twopence_callType(&PyByteArray_Type, NULL, NULL);
+	if (twopence_AppendBuffer(statusObject->stdout, &res->stdout_buf) < 0
+	 || twopence_AppendBuffer(statusObject->stderr, &res->stderr_buf) < 0) {
+		Py_DECREF(statusObject);
+		return NULL;
+	}
+
+	statusObject->command = object;
+	Py_INCREF(object);
+
+	return (PyObject *) statusObject;
+}
+
+/*
+ * Build the list of (target, status) tuples, in the order the targets
+ * were given to the constructor.
+ */
+static PyObject *
+Group_buildResults(twopence_Group *self, PyObject *object)
+{
+	PyObject *result;
+	unsigned int i, count;
+
+	count = twopence_group_count(self->group);
+	result = PyList_New(0);
+	for (i = 0; i < count; ++i) {
+		PyObject *statusObject, *tuple;
+
+		statusObject = Group_buildStatus(object, twopence_group_result(self->group, i));
+		if (statusObject == NULL) {
+			Py_DECREF(result);
+			return NULL;
+		}
+
+		tuple = Py_BuildValue("(OO)", PyList_GetItem(self->targets, i), statusObject);
+		Py_DECREF(statusObject);
+		PyList_Append(result, tuple);
+		Py_DECREF(tuple);
+	}
+
+	return result;
+}
+
+/*
+ * group.run(command)
+ *
+ * command can be a Command object or a command line. Its output is
+ * not copied to the interpreter's stdout, but returned in the status
+ * objects. Returns a list of (target, status) tuples.
+ */
+static PyObject *
+Group_run(twopence_Group *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"command",
+		NULL
+	};
+	PyObject *commandObject, *result;
+	twopence_Command *cmdObject;
+	twopence_command_t cmd;
+	int rc;
+
+	if (self->group == NULL) {
+		PyErr_SetString(PyExc_SystemError, "Group not initialized");
+		return NULL;
+	}
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &commandObject))
+		return NULL;
+
+	if (Command_Check(commandObject)) {
+		cmdObject = (twopence_Command *) commandObject;
+		Py_INCREF(cmdObject);
+	} else {
+		PyObject *cmdArgs = Py_BuildValue("(O)", commandObject);
+
+		cmdObject = (twopence_Command *) twopence_callType(&twopence_CommandType, cmdArgs, NULL);
+		Py_DECREF(cmdArgs);
+		if (cmdObject == NULL)
+			return NULL;
+	}
+
+	if (Command_build(cmdObject, &cmd) < 0) {
+		twopence_command_destroy(&cmd);
+		Py_DECREF(cmdObject);
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	rc = twopence_group_run(self->group, &cmd);
+	Py_END_ALLOW_THREADS
+
+	twopence_command_destroy(&cmd);
+	if (rc < 0) {
+		Py_DECREF(cmdObject);
+		return twopence_Exception("Group.run()", rc);
+	}
+
+	result = Group_buildResults(self, (PyObject *) cmdObject);
+	Py_DECREF(cmdObject);
+	return result;
+}
+
+/*
+ * group.sendfile(transfer)
+ *
+ * Send the same file to all targets. The local file or buffer is read
+ * only once. Like target.sendfile(), this also accepts the arguments of
+ * the Transfer constructor. Returns a list of (target, status) tuples.
+ */
+static PyObject *
+Group_sendfile(twopence_Group *self, PyObject *args, PyObject *kwds)
+{
+	PyObject *xferObject = NULL, *result = NULL;
+	twopence_file_xfer_t xfer;
+	int rc;
+
+	if (self->group == NULL) {
+		PyErr_SetString(PyExc_SystemError, "Group not initialized");
+		return NULL;
+	}
+
+	if (PyTuple_Size(args) == 1 && Transfer_Check(PyTuple_GetItem(args, 0))) {
+		xferObject = PyTuple_GetItem(args, 0);
+		Py_INCREF(xferObject);
+	} else {
+		xferObject = twopence_callType(&twopence_TransferType, args, kwds);
+		if (xferObject == NULL)
+			return NULL;
+	}
+
+	if (Transfer_build_send((twopence_Transfer *) xferObject, &xfer) < 0)
+		goto out;
+
+	Py_BEGIN_ALLOW_THREADS
+	rc = twopence_group_inject_file(self->group, &xfer);
+	Py_END_ALLOW_THREADS
+
+	if (rc < 0) {
+		twopence_Exception("Group.sendfile()", rc);
+		goto out;
+	}
+
+	result = Group_buildResults(self, xferObject);
+
+out:
+	twopence_file_xfer_destroy(&xfer);
+	Py_DECREF(xferObject);
+	return result;
+}
@@ -0,0 +1,417 @@
+/*
+Twopence python bindings - class JobQueue
+
+Copyright (C) 2014-2015 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "extension.h"
+
+#include "twopence.h"
+
+static void		JobQueue_dealloc(twopence_JobQueue *self);
+static PyObject *	JobQueue_new(PyTypeObject *type, PyObject *args, PyObject *kwds);
+static int		JobQueue_init(twopence_JobQueue *self, PyObject *args, PyObject *kwds);
+static PyObject *	JobQueue_command(twopence_JobQueue *self, PyObject *args, PyObject *kwds);
+static PyObject *	JobQueue_sendfile(twopence_JobQueue *self, PyObject *args, PyObject *kwds);
+static PyObject *	JobQueue_recvfile(twopence_JobQueue *self, PyObject *args, PyObject *kwds);
+static PyObject *	JobQueue_run(twopence_JobQueue *self, PyObject *args, PyObject *kwds);
+
+/*
+ * Define the python bindings of class "JobQueue"
+ */
+static PyMethodDef twopence_jobQueueMethods[] = {
+      {	"command", (PyCFunction) JobQueue_command, METH_VARARGS | METH_KEYWORDS,
+	"Queue a command for execution on a target"
+      },
+      {	"sendfile", (PyCFunction) JobQueue_sendfile, METH_VARARGS | METH_KEYWORDS,
+	"Queue a file transfer to a target"
+      },
+      {	"recvfile", (PyCFunction) JobQueue_recvfile, METH_VARARGS | METH_KEYWORDS,
+	"Queue a file transfer from a target"
+      },
+      {	"run", (PyCFunction) JobQueue_run, METH_VARARGS | METH_KEYWORDS,
+	"Run all queued jobs, and return a list of their status objects"
+      },
+      {	NULL }
+};
+
+PyTypeObject twopence_JobQueueType = {
+	PyObject_HEAD_INIT(NULL)
+
+	.tp_name	= "twopence.JobQueue",
+	.tp_basicsize	= sizeof(twopence_JobQueue),
+	.tp_flags	= Py_TPFLAGS_DEFAULT,
+	.tp_doc		= "Queue of commands and file transfers, with dependencies",
+
+	.tp_methods	= twopence_jobQueueMethods,
+	.tp_init	= (initproc) JobQueue_init,
+	.tp_new		= JobQueue_new,
+	.tp_dealloc	= (destructor) JobQueue_dealloc,
+};
+
+/*
+ * Constructor: allocate empty JobQueue object, and set its members.
+ */
+static PyObject *
+JobQueue_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	twopence_JobQueue *self;
+
+	self = (twopence_JobQueue *) type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+
+	/* init members */
+	self->jobq = NULL;
+	self->targets = NULL;
+	self->njobs = 0;
+	self->ndone = 0;
+	self->jobs = NULL;
+
+	return (PyObject *)self;
+}
+
+/*
+ * Initialize the queue object
+ *
+ * queue = twopence.JobQueue(concurrency = 0)
+ */
+static int
+JobQueue_init(twopence_JobQueue *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"concurrency",
+		NULL
+	};
+	unsigned int concurrency = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|I", kwlist, &concurrency))
+		return -1;
+
+	self->jobq = twopence_jobq_new();
+	twopence_jobq_set_concurrency(self->jobq, concurrency);
+	self->targets = PyList_New(0);
+	return 0;
+}
+
+static void
+JobQueue_dropJob(struct jobqJob *job)
+{
+	if (job->object) {
+		if (job->transfer)
+			twopence_file_xfer_destroy(&job->xfer);
+		else
+			twopence_command_destroy(&job->cmd);
+		drop_object(&job->object);
+	}
+}
+
+/*
+ * Destructor: clean any state inside the JobQueue object
+ */
+static void
+JobQueue_dealloc(twopence_JobQueue *self)
+{
+	unsigned int i;
+
+	for (i = 0; i < self->njobs; ++i) {
+		JobQueue_dropJob(self->jobs[i]);
+		free(self->jobs[i]);
+	}
+	free(self->jobs);
+	self->jobs = NULL;
+	self->njobs = 0;
+
+	if (self->jobq)
+		twopence_jobq_free(self->jobq);
+	self->jobq = NULL;
+
+	drop_object(&self->targets);
+}
+
+/*
+ * Check the target of a new job, and keep a reference to it
+ * until the queue goes away.
+ */
+static twopence_Target *
+JobQueue_getTarget(twopence_JobQueue *self, PyObject *targetObject)
+{
+	if (self->jobq == NULL) {
+		PyErr_SetString(PyExc_SystemError, "JobQueue not initialized");
+		return NULL;
+	}
+
+	if (!PyType_IsSubtype(Py_TYPE(targetObject), &twopence_TargetType)
+	 || ((twopence_Target *) targetObject)->handle == NULL) {
+		PyErr_SetString(PyExc_TypeError, "JobQueue: target must be a Target object");
+		return NULL;
+	}
+
+	if (!PySequence_Contains(self->targets, targetObject))
+		PyList_Append(self->targets, targetObject);
+
+	return (twopence_Target *) targetObject;
+}
+
+/*
+ * Convert the "after" argument, which can be a job ID or a list of
+ * job IDs, into a sequence of valid job IDs.
+ */
+static PyObject *
+JobQueue_getDependencies(twopence_JobQueue *self, PyObject *afterObject)
+{
+	PyObject *seq;
+	Py_ssize_t i, count;
+
+	if (afterObject == NULL || afterObject == Py_None)
+		return PyTuple_New(0);
+
+	if (PyInt_Check(afterObject))
+		seq = Py_BuildValue("(O)", afterObject);
+	else if (!(seq = PySequence_Fast(afterObject, "JobQueue: after must be a job ID or a list of job IDs")))
+		return NULL;
+
+	count = PySequence_Fast_GET_SIZE(seq);
+	for (i = 0; i < count; ++i) {
+		long id = PyInt_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+
+		if (id < 0 || id >= self->njobs) {
+			Py_DECREF(seq);
+			if (!PyErr_Occurred())
+				PyErr_SetString(PyExc_ValueError, "JobQueue: a job can only depend on jobs queued before it");
+			return NULL;
+		}
+	}
+	return seq;
+}
+
+/*
+ * Record a job that was added to the queue, and make it depend
+ * on the jobs in @deps. Returns the job ID.
+ */
+static PyObject *
+JobQueue_addJob(twopence_JobQueue *self, struct jobqJob *job, PyObject *deps)
+{
+	Py_ssize_t i, count;
+
+	if (job->job == NULL) {
+		JobQueue_dropJob(job);
+		free(job);
+		Py_DECREF(deps);
+		return twopence_Exception("JobQueue", TWOPENCE_PARAMETER_ERROR);
+	}
+
+	count = PySequence_Fast_GET_SIZE(deps);
+	for (i = 0; i < count; ++i) {
+		long id = PyInt_AsLong(PySequence_Fast_GET_ITEM(deps, i));
+
+		twopence_job_depends_on(job->job, self->jobs[id]->job);
+	}
+	Py_DECREF(deps);
+
+	self->jobs = twopence_realloc(self->jobs, (self->njobs + 1) * sizeof(self->jobs[0]));
+	self->jobs[self->njobs++] = job;
+
+	return PyInt_FromLong(self->njobs - 1);
+}
+
+/*
+ * queue.command(target, command, after = None)
+ *
+ * command can be a Command object or a command line.
+ * Returns the job ID.
+ */
+static PyObject *
+JobQueue_command(twopence_JobQueue *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"target",
+		"command",
+		"after",
+		NULL
+	};
+	PyObject *targetObject, *commandObject, *afterObject = NULL, *deps;
+	twopence_Command *cmdObject;
+	twopence_Target *tgtObject;
+	struct jobqJob *job;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|O", kwlist, &targetObject, &commandObject, &afterObject))
+		return NULL;
+
+	if (!(tgtObject = JobQueue_getTarget(self, targetObject))
+	 || !(deps = JobQueue_getDependencies(self, afterObject)))
+		return NULL;
+
+	if (Command_Check(commandObject)) {
+		cmdObject = (twopence_Command *) commandObject;
+		Py_INCREF(cmdObject);
+	} else {
+		PyObject *cmdArgs = Py_BuildValue("(O)", commandObject);
+
+		cmdObject = (twopence_Command *) twopence_callType(&twopence_CommandType, cmdArgs, NULL);
+		Py_DECREF(cmdArgs);
+		if (cmdObject == NULL) {
+			Py_DECREF(deps);
+			return NULL;
+		}
+	}
+
+	job = twopence_calloc(1, sizeof(*job));
+	job->object = (PyObject *) cmdObject;
+	if (Command_build(cmdObject, &job->cmd) < 0) {
+		JobQueue_dropJob(job);
+		free(job);
+		Py_DECREF(deps);
+		return NULL;
+	}
+
+	job->job = twopence_jobq_add_command(self->jobq, tgtObject->handle, &job->cmd);
+	return JobQueue_addJob(self, job, deps);
+}
+
+static PyObject *
+JobQueue_transfer(twopence_JobQueue *self, PyObject *args, PyObject *kwds, bool recvfile)
+{
+	static char *kwlist[] = {
+		"target",
+		"transfer",
+		"after",
+		NULL
+	};
+	PyObject *targetObject, *xferObject, *afterObject = NULL, *deps;
+	twopence_Target *tgtObject;
+	struct jobqJob *job;
+	int rc;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|O", kwlist, &targetObject, &xferObject, &afterObject))
+		return NULL;
+
+	if (!Transfer_Check(xferObject)) {
+		PyErr_SetString(PyExc_TypeError, "JobQueue: transfer must be a Transfer object");
+		return NULL;
+	}
+
+	if (!(tgtObject = JobQueue_getTarget(self, targetObject))
+	 || !(deps = JobQueue_getDependencies(self, afterObject)))
+		return NULL;
+
+	job = twopence_calloc(1, sizeof(*job));
+	job->object = xferObject;
+	job->transfer = true;
+	job->recvfile = recvfile;
+	Py_INCREF(xferObject);
+
+	if (recvfile)
+		rc = Transfer_build_recv((twopence_Transfer *) xferObject, &job->xfer);
+	else
+		rc = Transfer_build_send((twopence_Transfer *) xferObject, &job->xfer);
+	if (rc < 0) {
+		JobQueue_dropJob(job);
+		free(job);
+		Py_DECREF(deps);
+		return NULL;
+	}
+
+	if (recvfile)
+		job->job = twopence_jobq_add_extract(self->jobq, tgtObject->handle, &job->xfer);
+	else
+		job->job = twopence_jobq_add_inject(self->jobq, tgtObject->handle, &job->xfer);
+	return JobQueue_addJob(self, job, deps);
+}
+
+/*
+ * queue.sendfile(target, transfer, after = None)
+ * queue.recvfile(target, transfer, after = None)
+ *
+ * Returns the job ID.
+ */
+static PyObject *
+JobQueue_sendfile(twopence_JobQueue *self, PyObject *args, PyObject *kwds)
+{
+	return JobQueue_transfer(self, args, kwds, false);
+}
+
+static PyObject *
+JobQueue_recvfile(twopence_JobQueue *self, PyObject *args, PyObject *kwds)
+{
+	return JobQueue_transfer(self, args, kwds, true);
+}
+
+/*
+ * queue.run()
+ *
+ * Returns a list of status objects, one for each job that was queued since
+ * the last call to run(), in queue order. Jobs that were skipped because a
+ * job they depend on failed report COMMAND_CANCELED_ERROR as local error.
+ */
+static PyObject *
+JobQueue_run(twopence_JobQueue *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		NULL
+	};
+	PyObject *result;
+	unsigned int i;
+	int rc;
+
+	if (self->jobq == NULL) {
+		PyErr_SetString(PyExc_SystemError, "JobQueue not initialized");
+		return NULL;
+	}
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	rc = twopence_jobq_run(self->jobq);
+	Py_END_ALLOW_THREADS
+
+	if (rc < 0)
+		return twopence_Exception("JobQueue.run()", rc);
+
+	result = PyList_New(0);
+	for (i = self->ndone; i < self->njobs; ++i) {
+		struct jobqJob *job = self->jobs[i];
+		twopence_status_t status;
+		PyObject *statusObject;
+
+		memset(&status, 0, sizeof(status));
+		rc = twopence_job_status(job->job, &status);
+		if (!job->transfer) {
+			statusObject = Command_buildStatus((twopence_Command *) job->object, &job->cmd, &status, rc);
+		} else if (rc < 0) {
+			statusObject = twopence_callType(&twopence_StatusType, NULL, NULL);
+			if (statusObject)
+				((twopence_Status *) statusObject)->localError = rc;
+		} else {
+			statusObject = Transfer_buildStatus((twopence_Transfer *) job->object, &status, job->recvfile);
+		}
+
+		if (statusObject == NULL) {
+			Py_DECREF(result);
+			return NULL;
+		}
+
+		PyList_Append(result, statusObject);
+		Py_DECREF(statusObject);
+
+		JobQueue_dropJob(job);
+	}
+	self->ndone = self->njobs;
+
+	return result;
+}
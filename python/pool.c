@@ -0,0 +1,335 @@
+/*
+Twopence python bindings - class Pool
+
+Copyright (C) 2014-2015 SUSE
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "extension.h"
+
+#include "twopence.h"
+
+static void		Pool_dealloc(twopence_Pool *self);
+static PyObject *	Pool_new(PyTypeObject *type, PyObject *args, PyObject *kwds);
+static int		Pool_init(twopence_Pool *self, PyObject *args, PyObject *kwds);
+static PyObject *	Pool_submit(twopence_Pool *self, PyObject *args, PyObject *kwds);
+static PyObject *	Pool_run(twopence_Pool *self, PyObject *args, PyObject *kwds);
+static PyObject *	Pool_stats(twopence_Pool *self, PyObject *args, PyObject *kwds);
+
+/*
+ * Define the python bindings of class "Pool"
+ */
+static PyMethodDef twopence_poolMethods[] = {
+      {	"submit", (PyCFunction) Pool_submit, METH_VARARGS | METH_KEYWORDS,
+	"Queue a command for execution on any target of the pool"
+      },
+      {	"run", (PyCFunction) Pool_run, METH_VARARGS | METH_KEYWORDS,
+	"Run all queued commands, and return a list of (target, status) tuples"
+      },
+      {	"stats", (PyCFunction) Pool_stats, METH_VARARGS | METH_KEYWORDS,
+	"Return per-target statistics"
+      },
+      {	NULL }
+};
+
+PyTypeObject twopence_PoolType = {
+	PyObject_HEAD_INIT(NULL)
+
+	.tp_name	= "twopence.Pool",
+	.tp_basicsize	= sizeof(twopence_Pool),
+	.tp_flags	= Py_TPFLAGS_DEFAULT,
+	.tp_doc		= "Pool of equivalent targets sharing a queue of commands",
+
+	.tp_methods	= twopence_poolMethods,
+	.tp_init	= (initproc) Pool_init,
+	.tp_new		= Pool_new,
+	.tp_dealloc	= (destructor) Pool_dealloc,
+};
+
+/*
+ * Constructor: allocate empty Pool object, and set its members.
+ */
+static PyObject *
+Pool_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	twopence_Pool *self;
+
+	self = (twopence_Pool *) type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+
+	/* init members */
+	self->pool = NULL;
+	self->targets = NULL;
+	self->njobs = 0;
+	self->ndone = 0;
+	self->jobs = NULL;
+
+	return (PyObject *)self;
+}
+
+/*
+ * Initialize the pool object
+ *
+ * pool = twopence.Pool([target1, target2, ...])
+ */
+static int
+Pool_init(twopence_Pool *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"targets",
+		NULL
+	};
+	PyObject *targetsObject, *list;
+	Py_ssize_t i, count;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &targetsObject))
+		return -1;
+
+	if (!(list = PySequence_List(targetsObject)))
+		return -1;
+
+	self->pool = twopence_target_pool_new();
+
+	count = PyList_Size(list);
+	for (i = 0; i < count; ++i) {
+		PyObject *item = PyList_GetItem(list, i);
+
+		if (!PyType_IsSubtype(Py_TYPE(item), &twopence_TargetType)) {
+			PyErr_SetString(PyExc_TypeError, "Pool: targets must be a list of Target objects");
+			Py_DECREF(list);
+			return -1;
+		}
+		twopence_target_pool_add_target(self->pool, ((twopence_Target *) item)->handle);
+	}
+
+	self->targets = list;
+	return 0;
+}
+
+static void
+Pool_dropJob(struct poolJob *job)
+{
+	if (job->object) {
+		twopence_command_destroy(&job->cmd);
+		drop_object((PyObject **) &job->object);
+	}
+}
+
+/*
+ * Destructor: clean any state inside the Pool object
+ */
+static void
+Pool_dealloc(twopence_Pool *self)
+{
+	unsigned int i;
+
+	for (i = 0; i < self->njobs; ++i) {
+		Pool_dropJob(self->jobs[i]);
+		free(self->jobs[i]);
+	}
+	free(self->jobs);
+	self->jobs = NULL;
+	self->njobs = 0;
+
+	if (self->pool)
+		twopence_target_pool_free(self->pool);
+	self->pool = NULL;
+
+	drop_object(&self->targets);
+}
+
+/*
+ * pool.submit(command, affinity=None)
+ *
+ * command can be a Command object or a command line.
+ * affinity can be a Target object of the pool, or its index.
+ */
+static PyObject *
+Pool_submit(twopence_Pool *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"command",
+		"affinity",
+		NULL
+	};
+	PyObject *commandObject, *affinityObject = Py_None;
+	twopence_Command *cmdObject;
+	struct poolJob *job;
+	int affinity = -1, id;
+
+	if (self->pool == NULL) {
+		PyErr_SetString(PyExc_SystemError, "Pool not initialized");
+		return NULL;
+	}
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &commandObject, &affinityObject))
+		return NULL;
+
+	if (affinityObject == Py_None) {
+		affinity = -1;
+	} else if (PyInt_Check(affinityObject)) {
+		affinity = PyInt_AsLong(affinityObject);
+	} else {
+		Py_ssize_t i, count = PyList_Size(self->targets);
+
+		for (i = 0; i < count; ++i) {
+			if (PyList_GetItem(self->targets, i) == affinityObject)
+				break;
+		}
+		if (i >= count) {
+			PyErr_SetString(PyExc_ValueError, "Pool.submit: affinity is not a target of this pool");
+			return NULL;
+		}
+		affinity = i;
+	}
+
+	if (Command_Check(commandObject)) {
+		cmdObject = (twopence_Command *) commandObject;
+		Py_INCREF(cmdObject);
+	} else {
+		PyObject *cmdArgs = Py_BuildValue("(O)", commandObject);
+
+		cmdObject = (twopence_Command *) twopence_callType(&twopence_CommandType, cmdArgs, NULL);
+		Py_DECREF(cmdArgs);
+		if (cmdObject == NULL)
+			return NULL;
+	}
+
+	job = twopence_calloc(1, sizeof(*job));
+	job->object = cmdObject;
+	if (Command_build(cmdObject, &job->cmd) < 0) {
+		Pool_dropJob(job);
+		free(job);
+		return NULL;
+	}
+
+	id = twopence_target_pool_submit(self->pool, &job->cmd, affinity);
+	if (id < 0) {
+		Pool_dropJob(job);
+		free(job);
+		return twopence_Exception("Pool.submit()", id);
+	}
+
+	/* Job IDs are handed out sequentially, so they index our array */
+	self->jobs = twopence_realloc(self->jobs, (self->njobs + 1) * sizeof(self->jobs[0]));
+	self->jobs[self->njobs++] = job;
+
+	return PyInt_FromLong(id);
+}
+
+/*
+ * pool.run()
+ *
+ * Returns a list of (target, status) tuples, one for each command that was
+ * submitted since the last call to run(), in the order they were submitted.
+ */
+static PyObject *
+Pool_run(twopence_Pool *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		NULL
+	};
+	PyObject *result;
+	unsigned int i;
+	int rc;
+
+	if (self->pool == NULL) {
+		PyErr_SetString(PyExc_SystemError, "Pool not initialized");
+		return NULL;
+	}
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	rc = twopence_target_pool_run(self->pool);
+	Py_END_ALLOW_THREADS
+
+	if (rc < 0)
+		return twopence_Exception("Pool.run()", rc);
+
+	result = PyList_New(0);
+	for (i = self->ndone; i < self->njobs; ++i) {
+		struct poolJob *job = self->jobs[i];
+		PyObject *targetObject, *statusObject, *tuple;
+		twopence_status_t status;
+		int index = -1;
+
+		rc = twopence_target_pool_job_status(self->pool, i, &status, &index);
+		statusObject = Command_buildStatus(job->object, &job->cmd, &status, rc);
+		if (statusObject == NULL) {
+			Py_DECREF(result);
+			return NULL;
+		}
+
+		if (index >= 0)
+			targetObject = PyList_GetItem(self->targets, index);
+		else
+			targetObject = Py_None;
+
+		tuple = Py_BuildValue("(OO)", targetObject, statusObject);
+		Py_DECREF(statusObject);
+		PyList_Append(result, tuple);
+		Py_DECREF(tuple);
+
+		Pool_dropJob(job);
+	}
+	self->ndone = self->njobs;
+
+	return result;
+}
+
+/*
+ * pool.stats()
+ *
+ * Returns a list of dicts, one per target.
+ */
+static PyObject *
+Pool_stats(twopence_Pool *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		NULL
+	};
+	PyObject *result;
+	Py_ssize_t i, count;
+
+	if (self->pool == NULL) {
+		PyErr_SetString(PyExc_SystemError, "Pool not initialized");
+		return NULL;
+	}
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist))
+		return NULL;
+
+	count = PyList_Size(self->targets);
+	result = PyList_New(count);
+	for (i = 0; i < count; ++i) {
+		twopence_target_stats_t stats;
+		PyObject *dict;
+
+		twopence_target_pool_get_stats(self->pool, i, &stats);
+		dict = Py_BuildValue("{s:O,s:I,s:I,s:I,s:d}",
+				"target", PyList_GetItem(self->targets, i),
+				"jobs", stats.jobs,
+				"failed", stats.failed,
+				"stolen", stats.stolen,
+				"busy", stats.busy_ms / 1000.0);
+		PyList_SET_ITEM(result, i, dict);
+	}
+
+	return result;
+}
@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "extension.h"
 
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/wait.h>
 
 #include "twopence.h"
@@ -36,13 +37,25 @@ static PyObject *	Target_waitAll(twopence_Target *self, PyObject *args, PyObject
 static PyObject *	Target_property(twopence_Target *self, PyObject *args, PyObject *kwds);
 static PyObject *	Target_inject(twopence_Target *self, PyObject *args, PyObject *kwds);
 static PyObject *	Target_extract(twopence_Target *self, PyObject *args, PyObject *kwds);
+static PyObject *	Target_extractIfChanged(twopence_Target *self, PyObject *args, PyObject *kwds);
 static PyObject *	Target_sendfile(twopence_Target *self, PyObject *args, PyObject *kwds);
 static PyObject *	Target_recvfile(twopence_Target *self, PyObject *args, PyObject *kwds);
 static PyObject *	Target_setenv(twopence_Target *, PyObject *, PyObject *);
 static PyObject *	Target_unsetenv(twopence_Target *, PyObject *, PyObject *);
 static PyObject *	Target_disconnect(twopence_Target *, PyObject *, PyObject *);
 static PyObject *	Target_cancel_transactions(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_interrupt(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_waitReady(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_connect(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_setCaptureBudget(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_setOption(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_getOption(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_pollfds(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_dispatch(twopence_Target *, PyObject *, PyObject *);
 static PyObject *	Target_chat(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_open(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_jobs(twopence_Target *, PyObject *, PyObject *);
+static PyObject *	Target_reattach(twopence_Target *, PyObject *, PyObject *);
 
 /*
  * Define the python bindings of class "Target"
@@ -75,6 +88,18 @@ static PyMethodDef twopence_targetMethods[] = {
       {	"extract", (PyCFunction) Target_extract, METH_VARARGS | METH_KEYWORDS,
 	"Extract a file from the SUT"
       },
+      {	"extractIfChanged", (PyCFunction) Target_extractIfChanged, METH_VARARGS | METH_KEYWORDS,
+	"Extract a file from the SUT, unless the local copy is up to date"
+      },
+      {	"open", (PyCFunction) Target_open, METH_VARARGS | METH_KEYWORDS,
+	"Open a file on the SUT for random access"
+      },
+      {	"jobs", (PyCFunction) Target_jobs, METH_VARARGS | METH_KEYWORDS,
+	"List the detached jobs the server holds"
+      },
+      {	"reattach", (PyCFunction) Target_reattach, METH_VARARGS | METH_KEYWORDS,
+	"Collect the output and exit status of a detached job"
+      },
       {	"sendfile", (PyCFunction) Target_sendfile, METH_VARARGS | METH_KEYWORDS,
 	"Transfer a file from the local node to the SUT"
       },
@@ -96,6 +121,30 @@ static PyMethodDef twopence_targetMethods[] = {
       {	"cancel_transactions", (PyCFunction) Target_cancel_transactions, METH_VARARGS | METH_KEYWORDS,
 	"Cancel all pending transactions"
       },
+      {	"interrupt", (PyCFunction) Target_interrupt, METH_VARARGS | METH_KEYWORDS,
+	"Interrupt a backgrounded command, or the current foreground command"
+      },
+      {	"waitReady", (PyCFunction) Target_waitReady, METH_VARARGS | METH_KEYWORDS,
+	"Wait for the target to become reachable"
+      },
+      {	"connect", (PyCFunction) Target_connect, METH_VARARGS | METH_KEYWORDS,
+	"Set up the link to the target right away"
+      },
+      {	"setCaptureBudget", (PyCFunction) Target_setCaptureBudget, METH_VARARGS | METH_KEYWORDS,
+	"Limit the memory used for capturing command output"
+      },
+      {	"setOption", (PyCFunction) Target_setOption, METH_VARARGS | METH_KEYWORDS,
+	"Set a target option"
+      },
+      {	"getOption", (PyCFunction) Target_getOption, METH_VARARGS | METH_KEYWORDS,
+	"Query a target option"
+      },
+      {	"pollfds", (PyCFunction) Target_pollfds, METH_VARARGS | METH_KEYWORDS,
+	"Return the fds and timeout to wait for in an external event loop"
+      },
+      {	"dispatch", (PyCFunction) Target_dispatch, METH_VARARGS | METH_KEYWORDS,
+	"Process events from an external event loop, and return completed commands"
+      },
 
       {	NULL }
 };
@@ -261,16 +310,37 @@ backgroundedCommandNew(twopence_Command *cmdObject)
 	return bg;
 }
 
+static struct backgroundedCommand *
+backgroundedTransferNew(twopence_Transfer *xferObject, bool recvfile)
+{
+	struct backgroundedCommand *bg;
+
+	bg = twopence_calloc(1, sizeof(*bg));
+	bg->xferObject = xferObject;
+	bg->recvfile = recvfile;
+	Py_INCREF(xferObject);
+
+	return bg;
+}
+
 void
 backgroundedCommandFree(struct backgroundedCommand *bg)
 {
 	if (bg->object) {
 		bg->object->pid = 0;
+		drop_object(&bg->object->target);
 		Py_DECREF(bg->object);
 		bg->object = NULL;
 	}
+	if (bg->xferObject) {
+		bg->xferObject->pid = 0;
+		drop_object(&bg->xferObject->target);
+		Py_DECREF(bg->xferObject);
+		bg->xferObject = NULL;
+	}
 
 	twopence_command_destroy(&bg->cmd);
+	twopence_file_xfer_destroy(&bg->xfer);
 	free(bg);
 }
 
@@ -302,11 +372,21 @@ Target_findBackgrounded(twopence_Target *tgtObject, pid_t pid)
 static PyObject *
 Target_buildCommandStatus(twopence_Command *cmdObject, twopence_command_t *cmd, twopence_status_t *status, int rc)
 {
-	twopence_Status *statusObject;
-
 	if (rc < 0 && !cmdObject->softfail)
 		return twopence_Exception("command execution failed", rc);
 
+	return Command_buildStatus(cmdObject, cmd, status, rc);
+}
+
+/*
+ * Same as above, but a local error is reported in the status
+ * object rather than by raising an exception
+ */
+PyObject *
+Command_buildStatus(twopence_Command *cmdObject, twopence_command_t *cmd, twopence_status_t *status, int rc)
+{
+	twopence_Status *statusObject;
+
 	/* Now funnel the captured data to the respective buffer objects */
 	if (twopence_AppendBuffer(cmdObject->stdout, &cmd->buffer[TWOPENCE_STDOUT]) < 0)
 		return NULL;
@@ -339,6 +419,47 @@ Target_buildCommandStatus(twopence_Command *cmdObject, twopence_command_t *cmd,
 	return (PyObject *) statusObject;
 }
 
+/*
+ * Given a file transfer and its status, build a status object.
+ * If recvfile did not write to a local file, the data is returned
+ * in the buffer attribute.
+ */
+PyObject *
+Transfer_buildStatus(twopence_Transfer *xferObject, twopence_status_t *status, bool recvfile)
+{
+	twopence_Status *statusObject;
+
+	statusObject = (twopence_Status *) twopence_callType(&twopence_StatusType, NULL, NULL);
+	statusObject->remoteStatus = status->major ?: status->minor;
+
+	/* If we didn't write to a local file, we sent our data to self->databuf.
+	 * copy that back to the data buffer, and return it in the status object */
+	if (recvfile && statusObject->remoteStatus == 0 && xferObject->local_filename == NULL) {
+		if (xferObject->buffer && PyByteArray_Check(xferObject->buffer)) {
+			statusObject->buffer = xferObject->buffer;
+			Py_INCREF(xferObject->buffer);
+		} else {
+			statusObject->buffer = twopence_callType(&PyByteArray_Type, NULL, NULL);
+		}
+		twopence_AppendBuffer(statusObject->buffer, &xferObject->databuf);
+	}
+	return (PyObject *) statusObject;
+}
+
+/*
+ * Build the status object of a backgrounded command or transfer
+ */
+static PyObject *
+Target_buildBackgroundedStatus(struct backgroundedCommand *bg, twopence_status_t *status, int rc)
+{
+	if (bg->xferObject == NULL)
+		return Target_buildCommandStatus(bg->object, &bg->cmd, status, rc);
+
+	if (rc < 0)
+		return twopence_Exception(bg->recvfile? "recvfile" : "sendfile", rc);
+	return Transfer_buildStatus(bg->xferObject, status, bg->recvfile);
+}
+
 static twopence_Status *
 Target_buildCommandStatusShort(twopence_Command *cmdObject, twopence_command_t *cmd, twopence_status_t *status)
 {
@@ -403,6 +524,27 @@ Target_run(twopence_Target *self, PyObject *args, PyObject *kwds)
 	handle = self->handle;
 
 	memset(&cmd, 0, sizeof(cmd));
+	if (cmdObject->detach) {
+		/* The server keeps the job running even if we go away;
+		 * return its ID for target.reattach() */
+		if (Command_build(cmdObject, &cmd) < 0)
+			goto out;
+
+		Py_BEGIN_ALLOW_THREADS
+		rc = twopence_run_test(handle, &cmd, &status);
+		Py_END_ALLOW_THREADS
+		if (rc < 0) {
+			twopence_Exception("run(detach)", rc);
+			goto out;
+		}
+		if (rc == 0) {
+			PyErr_Format(PyExc_SystemError, "run(detach): server failed to start the job (status %d.%d)",
+					status.major, status.minor);
+			goto out;
+		}
+
+		result = PyInt_FromLong(rc);
+	} else
 	if (cmdObject->background) {
 		twopence_Target *tgtObject = (twopence_Target *) self;
 		struct backgroundedCommand *bg;
@@ -412,8 +554,11 @@ Target_run(twopence_Target *self, PyObject *args, PyObject *kwds)
 			backgroundedCommandFree(bg);
 			goto out;
 		}
+		Command_usePrepared(cmdObject, self, &bg->cmd);
 
+		Py_BEGIN_ALLOW_THREADS
 		rc = twopence_run_test(handle, &bg->cmd, &status);
+		Py_END_ALLOW_THREADS
 		if (rc < 0) {
 			twopence_Exception("run(background)", rc);
 			backgroundedCommandFree(bg);
@@ -429,14 +574,18 @@ Target_run(twopence_Target *self, PyObject *args, PyObject *kwds)
 		bg->pid = rc;
 
 		cmdObject->pid = bg->pid;
+		assign_object(&cmdObject->target, (PyObject *) tgtObject);
 
 		result = Py_True;
 		Py_INCREF(result);
 	} else {
 		if (Command_build(cmdObject, &cmd) < 0)
 			goto out;
+		Command_usePrepared(cmdObject, self, &cmd);
 
+		Py_BEGIN_ALLOW_THREADS
 		rc = twopence_run_test(handle, &cmd, &status);
+		Py_END_ALLOW_THREADS
 		result = Target_buildCommandStatus(cmdObject, &cmd, &status, rc);
 	}
 
@@ -464,7 +613,9 @@ Target_wait_common(twopence_Target *tgtObject, int want_pid)
 	if ((handle = tgtObject->handle) == NULL)
 		return NULL;
 
+	Py_BEGIN_ALLOW_THREADS
 	pid = twopence_wait(handle, want_pid, &status);
+	Py_END_ALLOW_THREADS
 	if (pid < 0) {
 		if (status.pid > 0) {
 			bg = Target_findBackgrounded(tgtObject, status.pid);
@@ -485,7 +636,7 @@ Target_wait_common(twopence_Target *tgtObject, int want_pid)
 	}
 
 build_status:
-	result = Target_buildCommandStatus(bg->object, &bg->cmd, &status, pid);
+	result = Target_buildBackgroundedStatus(bg, &status, pid);
 	backgroundedCommandFree(bg);
 
 	return result;
@@ -520,6 +671,13 @@ Target_wait(twopence_Target *self, PyObject *args, PyObject *kwds)
 				"target.wait(): no running command matching this argument");
 			return NULL;
 		}
+	} else if (Transfer_Check(argObject)) {
+		pid = ((twopence_Transfer *) argObject)->pid;
+		if (pid == 0) {
+			PyErr_SetString(PyExc_ValueError,
+				"target.wait(): no running transfer matching this argument");
+			return NULL;
+		}
 	} else {
 		PyErr_SetString(PyExc_TypeError,
 				"target.wait(): Invalid argument type");
@@ -547,52 +705,67 @@ Target_waitAll(twopence_Target *self, PyObject *args, PyObject *kwds)
 		return NULL;
 
 	while (true) {
-		struct backgroundedCommand *bg;
-		twopence_status_t status;
-		int pid = 0;
+		twopence_status_t statuses[64];
+		int i, count;
 
-		pid = twopence_wait(handle, 0, &status);
-		if (pid < 0) {
+		Py_BEGIN_ALLOW_THREADS
+		count = twopence_wait_many(handle, 64, -1, statuses);
+		Py_END_ALLOW_THREADS
+		if (count < 0) {
 			if (ndots)
 				printf("\n");
-			return twopence_Exception("wait", pid);
+			return twopence_Exception("wait", count);
 		}
 
-		if (pid == 0) {
+		if (count == 0) {
 			if (ndots)
 				printf("\n");
 			break;
 		}
 
-		bg = Target_findBackgrounded(self, pid);
-		if (bg == NULL) {
-			if (ndots)
-				printf("\n");
-			PyErr_SetString(PyExc_SystemError, "Target.wait(): No record of PID returned by target");
-			return NULL;
-		}
-
-		if (result == NULL)
-			result = Target_buildCommandStatusShort(bg->object, &bg->cmd, &status);
+		for (i = 0; i < count; ++i) {
+			twopence_status_t *status = &statuses[i];
+			struct backgroundedCommand *bg;
+
+			bg = Target_findBackgrounded(self, status->pid);
+			if (bg == NULL) {
+				if (ndots)
+					printf("\n");
+				PyErr_SetString(PyExc_SystemError, "Target.wait(): No record of PID returned by target");
+				return NULL;
+			}
+
+			if (result == NULL) {
+				if (bg->object)
+					result = Target_buildCommandStatusShort(bg->object, &bg->cmd, status);
+				else
+					result = (twopence_Status *) twopence_callType(&twopence_StatusType, NULL, NULL);
+			}
+
+			/* We do this here rather than inside Target_buildCommandStatusShort,
+			 * because we want to accumulate error information */
+			if (bg->xferObject) {
+				/* File transfer; the server reports errors in major */
+				if (result->remoteStatus == 0)
+					result->remoteStatus = status->major ?: status->minor;
+			} else
+			if (status->major == EFAULT) {
+				/* Command exited with a signal */
+				result->exitSignal = status->minor;
+			} else {
+				/* Regular command exit; but make sure
+				 * we do not overwrite a previous non-zero exit value
+				 */
+				if (result->remoteStatus == 0)
+					result->remoteStatus = status->minor;
+			}
 
-		/* We do this here rather than inside Target_buildCommandStatusShort,
-		 * because we want to accumulate error information */
-		if (status.major == EFAULT) {
-			/* Command exited with a signal */
-			result->exitSignal = status.minor;
-		} else {
-			/* Regular command exit; but make sure
-			 * we do not overwrite a previous non-zero exit value
-			 */
-			if (result->remoteStatus == 0)
-				result->remoteStatus = status.minor;
-		}
-
-		backgroundedCommandFree(bg);
-		if (print_dots) {
-			fputc('.', stdout);
-			fflush(stdout);
-			ndots++;
+			backgroundedCommandFree(bg);
+			if (print_dots) {
+				fputc('.', stdout);
+				fflush(stdout);
+				ndots++;
+			}
 		}
 	}
 
@@ -666,6 +839,7 @@ Target_chat(twopence_Target *self, PyObject *args, PyObject *kwds)
 
 	cmdObject->pid = bg->pid;
 	chatObject->pid = bg->pid;
+	assign_object(&cmdObject->target, (PyObject *) tgtObject);
 
 	chatObject->command = cmdObject;
 	Py_INCREF(cmdObject);
@@ -748,6 +922,225 @@ Target_extract(twopence_Target *self, PyObject *args, PyObject *kwds)
 	return PyInt_FromLong(remoteRc);
 }
 
+/*
+ * Extract a file from the SUT, unless the local copy has the size and
+ * mtime of the remote file already.
+ * Returns True if the file was transferred, and False if it was not.
+ */
+static PyObject *
+Target_extractIfChanged(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"remote",
+		"local",
+		"user",
+		NULL
+	};
+	char *remoteFile, *localFile;
+	char *user = "root";
+	bool notModified = false;
+	int rc, remoteRc = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "ss|s", kwlist, &remoteFile, &localFile, &user))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	rc = twopence_extract_file_if_changed(self->handle, user, remoteFile, localFile, &remoteRc, &notModified);
+	Py_END_ALLOW_THREADS
+	if (rc < 0)
+		return twopence_Exception("extractIfChanged", rc);
+	if (remoteRc != 0) {
+		PyErr_Format(PyExc_SystemError, "extractIfChanged: remote error %d", remoteRc);
+		return NULL;
+	}
+
+	return return_bool(!notModified);
+}
+
+/*
+ * Open a file on the SUT, and return a File object
+ *
+ * file = target.open(path, mode = "r", user = "root", permissions = 0644)
+ */
+static PyObject *
+Target_open(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"path",
+		"mode",
+		"user",
+		"permissions",
+		NULL
+	};
+	twopence_File *fileObject;
+	char *path, *mode = "r";
+	char *user = "root";
+	unsigned int permissions = 0644;
+	unsigned int flags;
+	int fh, remoteRc = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|ssI", kwlist, &path, &mode, &user, &permissions))
+		return NULL;
+
+	if (File_parseMode(mode, &flags) < 0) {
+		PyErr_Format(PyExc_ValueError, "target.open(): invalid mode \"%s\"", mode);
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	fh = twopence_file_open(self->handle, user, path, flags, permissions, &remoteRc);
+	Py_END_ALLOW_THREADS
+	if (fh < 0) {
+		if (remoteRc != 0) {
+			/* Report the server's errno like a local open() would */
+			errno = remoteRc;
+			return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+		}
+		return twopence_Exception("open", fh);
+	}
+
+	fileObject = (twopence_File *) twopence_callType(&twopence_FileType, NULL, NULL);
+	if (fileObject == NULL) {
+		twopence_file_close(self->handle, fh);
+		return NULL;
+	}
+
+	fileObject->target = self;
+	Py_INCREF(self);
+	assign_string(&fileObject->path, path);
+	fileObject->fh = fh;
+
+	return (PyObject *) fileObject;
+}
+
+/*
+ * Return the detached jobs the server holds, as a list of dicts
+ */
+static PyObject *
+Target_jobs(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		NULL
+	};
+	twopence_detached_job_t *jobs = NULL;
+	unsigned int i, count = 0;
+	PyObject *result;
+	int rc;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	rc = twopence_list_detached_jobs(self->handle, &jobs, &count);
+	Py_END_ALLOW_THREADS
+	if (rc < 0)
+		return twopence_Exception("jobs", rc);
+
+	result = PyList_New(0);
+	for (i = 0; i < count; ++i) {
+		twopence_detached_job_t *job = &jobs[i];
+		PyObject *item, *code;
+
+		/* Same encoding as status.code */
+		if (job->running) {
+			code = Py_None;
+			Py_INCREF(code);
+		} else if (job->status.major == EFAULT) {
+			code = PyInt_FromLong(256 + job->status.minor);
+		} else {
+			code = PyInt_FromLong(job->status.minor);
+		}
+
+		item = Py_BuildValue("{s:I,s:s,s:O,s:K,s:N}",
+				"id", job->id,
+				"command", job->command? job->command : "",
+				"running", job->running? Py_True : Py_False,
+				"nbytes", (unsigned long long) job->nbytes,
+				"code", code);
+		PyList_Append(result, item);
+		Py_DECREF(item);
+	}
+
+	twopence_detached_jobs_free(jobs, count);
+	return result;
+}
+
+/*
+ * Wait for a detached job to exit, and return its status
+ *
+ * status = target.reattach(jobId, command = None)
+ *
+ * All output the job printed, including what it printed while nobody
+ * was attached, goes to the stdout and stderr of the given Command object,
+ * whose command line is not used. Without a command, the output is
+ * discarded.
+ */
+static PyObject *
+Target_reattach(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"job",
+		"command",
+		NULL
+	};
+	twopence_Command *cmdObject = NULL;
+	twopence_Status *statusObject;
+	twopence_command_t cmd;
+	twopence_status_t status;
+	unsigned int jobId;
+	PyObject *result = NULL;
+	int rc;
+
+	memset(&cmd, 0, sizeof(cmd));
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "I|O", kwlist, &jobId, &cmdObject))
+		return NULL;
+
+	if ((PyObject *) cmdObject == Py_None)
+		cmdObject = NULL;
+	if (cmdObject && !Command_Check((PyObject *) cmdObject)) {
+		PyErr_SetString(PyExc_TypeError, "target.reattach(): command must be a Command object");
+		return NULL;
+	}
+
+	if (cmdObject) {
+		if (Command_build(cmdObject, &cmd) < 0)
+			goto out;
+		/* Backgrounded reattach is not supported from python */
+		cmd.background = false;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	rc = twopence_reattach(self->handle, jobId, cmdObject? &cmd : NULL, &status);
+	Py_END_ALLOW_THREADS
+
+	if (rc == 0 && status.major == ESRCH) {
+		PyErr_Format(PyExc_SystemError, "reattach: no such job %u", jobId);
+		goto out;
+	}
+
+	if (cmdObject) {
+		result = Target_buildCommandStatus(cmdObject, &cmd, &status, rc);
+		goto out;
+	}
+
+	if (rc < 0) {
+		twopence_Exception("reattach", rc);
+		goto out;
+	}
+
+	statusObject = (twopence_Status *) twopence_callType(&twopence_StatusType, NULL, NULL);
+	if (status.major == EFAULT)
+		statusObject->exitSignal = status.minor;
+	else
+		statusObject->remoteStatus = status.minor;
+	result = (PyObject *) statusObject;
+
+out:
+	twopence_command_destroy(&cmd);
+	return result;
+}
+
 /*
  * Common functionality for sendfile/recvfile
  */
@@ -773,6 +1166,51 @@ Taget_send_recv_common(PyObject *args, PyObject *kwds)
 	return xferObject;
 }
 
+/*
+ * Start a file transfer in the background. The status is collected
+ * with target.wait(), like that of a backgrounded command.
+ */
+static PyObject *
+Target_backgroundTransfer(twopence_Target *self, twopence_Transfer *xferObject, bool recvfile)
+{
+	struct backgroundedCommand *bg;
+	twopence_status_t status;
+	PyObject *result;
+	int rc;
+
+	bg = backgroundedTransferNew(xferObject, recvfile);
+	if (recvfile)
+		rc = Transfer_build_recv(xferObject, &bg->xfer);
+	else
+		rc = Transfer_build_send(xferObject, &bg->xfer);
+	if (rc < 0) {
+		backgroundedCommandFree(bg);
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	if (recvfile)
+		rc = twopence_recv_file(self->handle, &bg->xfer, &status);
+	else
+		rc = twopence_send_file(self->handle, &bg->xfer, &status);
+	Py_END_ALLOW_THREADS
+	if (rc <= 0) {
+		backgroundedCommandFree(bg);
+		return twopence_Exception(recvfile? "recvfile(background)" : "sendfile(background)",
+				rc ?: TWOPENCE_INVALID_TRANSACTION);
+	}
+
+	Target_recordBackgrounded(self, bg);
+	bg->pid = rc;
+
+	xferObject->pid = bg->pid;
+	assign_object(&xferObject->target, (PyObject *) self);
+
+	result = Py_True;
+	Py_INCREF(result);
+	return result;
+}
+
 /*
  * transfer a file to the SUT
  */
@@ -781,7 +1219,6 @@ Target_sendfile(twopence_Target *self, PyObject *args, PyObject *kwds)
 {
 	struct twopence_target *handle = self->handle;
 	twopence_Transfer *xferObject = NULL;
-	twopence_Status *statusObject;
 	twopence_file_xfer_t xfer;
 	twopence_status_t status;
 	PyObject *result = NULL;
@@ -793,18 +1230,28 @@ Target_sendfile(twopence_Target *self, PyObject *args, PyObject *kwds)
 	if (xferObject == NULL)
 		goto out;
 
+	if (xferObject->pid != 0) {
+		PyErr_SetString(PyExc_SystemError, "Transfer already in progress");
+		goto out;
+	}
+
+	if (xferObject->background) {
+		result = Target_backgroundTransfer(self, xferObject, false);
+		goto out;
+	}
+
 	if (Transfer_build_send(xferObject, &xfer) < 0)
 		goto out;
 
+	Py_BEGIN_ALLOW_THREADS
 	rc = twopence_send_file(handle, &xfer, &status);
+	Py_END_ALLOW_THREADS
 	if (rc < 0) {
 		twopence_Exception("sendfile", rc);
 		goto out;
 	}
 
-	statusObject = (twopence_Status *) twopence_callType(&twopence_StatusType, NULL, NULL);
-	statusObject->remoteStatus = status.major ?: status.minor;
-	result = (PyObject *) statusObject;
+	result = Transfer_buildStatus(xferObject, &status, false);
 
 out:
 	if (xferObject) {
@@ -823,7 +1270,6 @@ Target_recvfile(twopence_Target *self, PyObject *args, PyObject *kwds)
 {
 	struct twopence_target *handle = self->handle;
 	twopence_Transfer *xferObject = NULL;
-	twopence_Status *statusObject;
 	twopence_file_xfer_t xfer;
 	twopence_status_t status;
 	PyObject *result = NULL;
@@ -835,30 +1281,28 @@ Target_recvfile(twopence_Target *self, PyObject *args, PyObject *kwds)
 	if (xferObject == NULL)
 		goto out;
 
+	if (xferObject->pid != 0) {
+		PyErr_SetString(PyExc_SystemError, "Transfer already in progress");
+		goto out;
+	}
+
+	if (xferObject->background) {
+		result = Target_backgroundTransfer(self, xferObject, true);
+		goto out;
+	}
+
 	if (Transfer_build_recv(xferObject, &xfer) < 0)
 		goto out;
 
+	Py_BEGIN_ALLOW_THREADS
 	rc = twopence_recv_file(handle, &xfer, &status);
+	Py_END_ALLOW_THREADS
 	if (rc < 0) {
 		twopence_Exception("recvfile", rc);
 		goto out;
 	}
 
-	statusObject = (twopence_Status *) twopence_callType(&twopence_StatusType, NULL, NULL);
-	statusObject->remoteStatus = status.major ?: status.minor;
-
-	/* If we didn't write to a local file, we sent our data to self->databuf.
-	 * copy that back to the data buffer, and return it in the status object */
-	if (statusObject->remoteStatus == 0 && xferObject->local_filename == NULL) {
-		if (xferObject->buffer && PyByteArray_Check(xferObject->buffer)) {
-			statusObject->buffer = xferObject->buffer;
-			Py_INCREF(xferObject->buffer);
-		} else {
-			statusObject->buffer = twopence_callType(&PyByteArray_Type, NULL, NULL);
-		}
-		twopence_AppendBuffer(statusObject->buffer, &xferObject->databuf);
-	}
-	result = (PyObject *) statusObject;
+	result = Transfer_buildStatus(xferObject, &status, true);
 
 out:
 	if (xferObject) {
@@ -939,3 +1383,436 @@ Target_cancel_transactions(twopence_Target *self, PyObject *args, PyObject *kwds
 	Py_INCREF(Py_None);
 	return Py_None;
 }
+
+/*
+ * Interrupt a command.
+ * Without argument, this interrupts the current foreground command.
+ * Otherwise, pass the Command object or the pid of a backgrounded command.
+ */
+static PyObject *
+Target_interrupt(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"command",
+		NULL
+	};
+	PyObject *argObject = NULL;
+	int pid = 0;
+	int rc;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &argObject))
+		return NULL;
+
+	if (self->handle == NULL) {
+		PyErr_SetString(PyExc_SystemError, "target.interrupt(): target without handle");
+		return NULL;
+	}
+
+	if (argObject == NULL || argObject == Py_None) {
+		rc = twopence_interrupt_command(self->handle);
+	} else {
+		if (PyInt_Check(argObject)) {
+			pid = PyInt_AsLong(argObject);
+		} else if (Command_Check(argObject)) {
+			pid = ((twopence_Command *) argObject)->pid;
+		} else {
+			PyErr_SetString(PyExc_TypeError,
+					"target.interrupt(): Invalid argument type");
+			return NULL;
+		}
+
+		if (pid <= 0) {
+			PyErr_SetString(PyExc_ValueError,
+				"target.interrupt(): no running command matching this argument");
+			return NULL;
+		}
+
+		rc = twopence_interrupt_pid(self->handle, pid);
+	}
+
+	if (rc < 0)
+		return twopence_Exception("interrupt", rc);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/*
+ * Convert a timeout in seconds to msec. None means no timeout.
+ */
+static int
+Target_parseTimeout(PyObject *timeoutObject, const char *method, int *timeout_ms)
+{
+	double timeout;
+
+	*timeout_ms = -1;
+	if (timeoutObject == NULL || timeoutObject == Py_None)
+		return 0;
+
+	timeout = PyFloat_AsDouble(timeoutObject);
+	if (timeout == -1 && PyErr_Occurred())
+		return -1;
+	if (timeout < 0) {
+		PyErr_Format(PyExc_ValueError, "target.%s(): timeout must not be negative", method);
+		return -1;
+	}
+	*timeout_ms = timeout * 1000;
+	return 0;
+}
+
+/*
+ * Wait for the SUT to come up, eg after a reboot
+ */
+static PyObject *
+Target_waitReady(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"timeout",
+		NULL
+	};
+	PyObject *timeoutObject = NULL;
+	int timeout_ms;
+	int rc;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &timeoutObject))
+		return NULL;
+
+	if (self->handle == NULL) {
+		PyErr_SetString(PyExc_SystemError, "target.waitReady(): target without handle");
+		return NULL;
+	}
+
+	if (Target_parseTimeout(timeoutObject, "waitReady", &timeout_ms) < 0)
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	rc = twopence_target_wait_ready(self->handle, timeout_ms);
+	Py_END_ALLOW_THREADS
+	if (rc < 0)
+		return twopence_Exception("waitReady", rc);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/*
+ * Open the link and do the handshake now rather than on the first command
+ */
+static PyObject *
+Target_connect(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"timeout",
+		NULL
+	};
+	PyObject *timeoutObject = NULL;
+	int timeout_ms;
+	int rc;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &timeoutObject))
+		return NULL;
+
+	if (self->handle == NULL) {
+		PyErr_SetString(PyExc_SystemError, "target.connect(): target without handle");
+		return NULL;
+	}
+
+	if (Target_parseTimeout(timeoutObject, "connect", &timeout_ms) < 0)
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	rc = twopence_target_connect(self->handle, timeout_ms);
+	Py_END_ALLOW_THREADS
+	if (rc < 0)
+		return twopence_Exception("connect", rc);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/*
+ * Limit the heap memory used by the buffers capturing the output of
+ * this target's commands. Beyond that, output is moved to a temp file.
+ * 0 means no limit.
+ */
+static PyObject *
+Target_setCaptureBudget(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"bytes",
+		NULL
+	};
+	unsigned long bytes;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "k", kwlist, &bytes))
+		return NULL;
+
+	if (self->handle == NULL) {
+		PyErr_SetString(PyExc_SystemError, "target.setCaptureBudget(): target without handle");
+		return NULL;
+	}
+
+	twopence_target_set_capture_budget(self->handle, bytes);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/*
+ * Target options, by the names we use in python.
+ * All values are integers, in the units the library uses.
+ */
+static struct Target_option {
+	const char *	name;
+	int		option;
+} Target_options[] = {
+	{ "keepalive",		TWOPENCE_TARGET_OPTION_KEEPALIVE },
+	{ "heartbeat",		TWOPENCE_TARGET_OPTION_HEARTBEAT },
+	{ "dead-peer-timeout",	TWOPENCE_TARGET_OPTION_DEAD_PEER_TIMEOUT },
+	{ "reconnect",		TWOPENCE_TARGET_OPTION_RECONNECT },
+	{ "io-thread",		TWOPENCE_TARGET_OPTION_IO_THREAD },
+	{ "completion-fd",	TWOPENCE_TARGET_OPTION_COMPLETION_FD },
+	{ "keep-warm",		TWOPENCE_TARGET_OPTION_KEEP_WARM },
+	{ "xmit-rate",		TWOPENCE_TARGET_OPTION_XMIT_RATE },
+	{ "xmit-burst",		TWOPENCE_TARGET_OPTION_XMIT_BURST },
+	{ "xmit-throttled",	TWOPENCE_TARGET_OPTION_XMIT_THROTTLED },
+	{ "recv-rate",		TWOPENCE_TARGET_OPTION_RECV_RATE },
+	{ "recv-burst",		TWOPENCE_TARGET_OPTION_RECV_BURST },
+	{ "recv-throttled",	TWOPENCE_TARGET_OPTION_RECV_THROTTLED },
+	{ NULL }
+};
+
+static int
+Target_parseOption(const char *name, const char *method)
+{
+	struct Target_option *opt;
+
+	for (opt = Target_options; opt->name; ++opt) {
+		if (!strcmp(opt->name, name))
+			return opt->option;
+	}
+
+	PyErr_Format(PyExc_ValueError, "target.%s(): unknown option \"%s\"", method, name);
+	return -1;
+}
+
+/*
+ * target.setOption("heartbeat", 200)
+ */
+static PyObject *
+Target_setOption(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"name",
+		"value",
+		NULL
+	};
+	const char *name;
+	int option, value;
+	int rc;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "si", kwlist, &name, &value))
+		return NULL;
+
+	if (self->handle == NULL) {
+		PyErr_SetString(PyExc_SystemError, "target.setOption(): target without handle");
+		return NULL;
+	}
+
+	if ((option = Target_parseOption(name, "setOption")) < 0)
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	rc = twopence_target_set_option(self->handle, option, &value);
+	Py_END_ALLOW_THREADS
+	if (rc < 0)
+		return twopence_Exception("setOption", rc);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+Target_getOption(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"name",
+		NULL
+	};
+	const char *name;
+	int option, value = 0;
+	int rc;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &name))
+		return NULL;
+
+	if (self->handle == NULL) {
+		PyErr_SetString(PyExc_SystemError, "target.getOption(): target without handle");
+		return NULL;
+	}
+
+	if ((option = Target_parseOption(name, "getOption")) < 0)
+		return NULL;
+
+	rc = twopence_target_get_option(self->handle, option, &value);
+	if (rc < 0)
+		return twopence_Exception("getOption", rc);
+
+	return PyInt_FromLong(value);
+}
+
+/*
+ * Event loop integration.
+ * pollfds() returns a tuple ([(fd, events), ...], timeout), with the timeout
+ * given in seconds, or None.
+ */
+static PyObject *
+Target_pollfds(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		NULL
+	};
+	struct pollfd pfd_array[16], *pfds = pfd_array;
+	unsigned int max = 16;
+	PyObject *list, *timeoutObject;
+	int timeout_ms, i, count;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist))
+		return NULL;
+
+	if (self->handle == NULL) {
+		PyErr_SetString(PyExc_SystemError, "target.pollfds(): target without handle");
+		return NULL;
+	}
+
+	while ((count = twopence_target_get_pollfds(self->handle, pfds, max, &timeout_ms)) > (int) max) {
+		if (pfds != pfd_array)
+			free(pfds);
+		max = count;
+		pfds = twopence_calloc(max, sizeof(*pfds));
+	}
+	if (count < 0) {
+		if (pfds != pfd_array)
+			free(pfds);
+		return twopence_Exception("pollfds", count);
+	}
+
+	list = PyList_New(count);
+	for (i = 0; i < count; ++i)
+		PyList_SET_ITEM(list, i, Py_BuildValue("(ii)", pfds[i].fd, pfds[i].events));
+	if (pfds != pfd_array)
+		free(pfds);
+
+	if (timeout_ms < 0) {
+		timeoutObject = Py_None;
+		Py_INCREF(timeoutObject);
+	} else {
+		timeoutObject = PyFloat_FromDouble(timeout_ms / 1000.0);
+	}
+
+	return Py_BuildValue("(NN)", list, timeoutObject);
+}
+
+/*
+ * dispatch() takes a list of (fd, revents) tuples, processes them,
+ * and returns the list of status objects for commands that completed.
+ */
+static PyObject *
+Target_dispatch(twopence_Target *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {
+		"events",
+		NULL
+	};
+	PyObject *eventsObject = NULL, *seq, *result;
+	struct pollfd *pfds;
+	unsigned int i, count;
+	int rc;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &eventsObject))
+		return NULL;
+
+	if (self->handle == NULL) {
+		PyErr_SetString(PyExc_SystemError, "target.dispatch(): target without handle");
+		return NULL;
+	}
+
+	if (eventsObject == NULL || eventsObject == Py_None) {
+		seq = PyTuple_New(0);
+	} else if (!(seq = PySequence_Fast(eventsObject, "target.dispatch(): events must be a sequence"))) {
+		return NULL;
+	}
+
+	count = PySequence_Fast_GET_SIZE(seq);
+	pfds = twopence_calloc(count? count : 1, sizeof(*pfds));
+	for (i = 0; i < count; ++i) {
+		int fd, revents;
+
+		if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "ii", &fd, &revents)) {
+			Py_DECREF(seq);
+			free(pfds);
+			return NULL;
+		}
+		pfds[i].fd = fd;
+		pfds[i].revents = revents;
+	}
+	Py_DECREF(seq);
+
+	rc = twopence_target_dispatch(self->handle, pfds, count);
+	free(pfds);
+	if (rc < 0)
+		return twopence_Exception("dispatch", rc);
+
+	/* Collect whatever completed, without blocking */
+	result = PyList_New(0);
+	while (true) {
+		twopence_status_t statuses[16];
+		int n;
+
+		statuses[0].pid = 0;
+		n = twopence_wait_many(self->handle, 16, 0, statuses);
+		if (n < 0) {
+			struct backgroundedCommand *bg;
+			PyObject *status;
+
+			if (statuses[0].pid <= 0
+			 || (bg = Target_findBackgrounded(self, statuses[0].pid)) == NULL) {
+				Py_DECREF(result);
+				return twopence_Exception("dispatch", n);
+			}
+			status = Target_buildBackgroundedStatus(bg, &statuses[0], n);
+			backgroundedCommandFree(bg);
+			if (status == NULL) {
+				Py_DECREF(result);
+				return NULL;
+			}
+			PyList_Append(result, status);
+			Py_DECREF(status);
+			continue;
+		}
+
+		for (i = 0; i < (unsigned int) n; ++i) {
+			struct backgroundedCommand *bg;
+			PyObject *status;
+
+			if ((bg = Target_findBackgrounded(self, statuses[i].pid)) == NULL) {
+				Py_DECREF(result);
+				PyErr_SetString(PyExc_SystemError, "Target.dispatch(): No record of PID returned by target");
+				return NULL;
+			}
+			status = Target_buildBackgroundedStatus(bg, &statuses[i], statuses[i].pid);
+			backgroundedCommandFree(bg);
+			if (status == NULL) {
+				Py_DECREF(result);
+				return NULL;
+			}
+			PyList_Append(result, status);
+			Py_DECREF(status);
+		}
+
+		if (n < 16)
+			break;
+	}
+
+	return result;
+}
@@ -143,6 +143,7 @@ static void
 __Timer_callback(twopence_timer_t *t, void *user_data)
 {
 	twopence_Timer *timerObj = (twopence_Timer *) user_data;
+	PyGILState_STATE gstate;
 	PyObject *v;
 
 	if (timerObj->callback == NULL || timerObj->callback == Py_None) {
@@ -150,6 +151,10 @@ __Timer_callback(twopence_timer_t *t, void *user_data)
 		return;
 	}
 
+	/* We're called from deep inside the library, which runs
+	 * without holding the interpreter lock. */
+	gstate = PyGILState_Ensure();
+
 	twopence_debug("Timer %u fired; invoking python callback", t->id);
 	v = twopence_callObject(timerObj->callback, NULL, NULL);
 	if (v == NULL) {
@@ -158,6 +163,8 @@ __Timer_callback(twopence_timer_t *t, void *user_data)
 		/* We don't care what it returned, we just need to dispose of it */
 		Py_DECREF(v);
 	}
+
+	PyGILState_Release(gstate);
 }
 
 /*
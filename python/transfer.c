@@ -55,6 +55,9 @@ static int		Transfer_setattr(twopence_Transfer *self, char *name, PyObject *);
  *	If not provided:
  *	 - send() will fail
  *	 - recv() will download the file contents to a data buffer.
+ *   background
+ *	If true, sendfile/recvfile return right away, and the status
+ *	is collected with target.wait()
  */
 static PyMethodDef twopence_transferMethods[] = {
       {	NULL }
@@ -96,6 +99,9 @@ Transfer_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 	self->user = NULL;
 	self->timeout = 0L;
 	self->buffer = NULL;
+	self->background = false;
+	self->pid = 0;
+	self->target = NULL;
 
 	twopence_buf_init(&self->databuf);
 
@@ -118,13 +124,15 @@ Transfer_init(twopence_Transfer *self, PyObject *args, PyObject *kwds)
 		"permissions",
 		"timeout",
 		"data",
+		"background",
 		NULL
 	};
 	PyObject *bufferObject = NULL;
 	char *remotefile = NULL, *localfile = NULL, *user = NULL;
 	long permissions = 0L, timeout = 0L;
+	int background = 0;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|ssllO", kwlist, &remotefile, &user, &localfile, &permissions, &timeout, &bufferObject))
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|ssllOi", kwlist, &remotefile, &user, &localfile, &permissions, &timeout, &bufferObject, &background))
 		return -1;
 
 	self->remote_filename = twopence_strdup(remotefile);
@@ -132,6 +140,7 @@ Transfer_init(twopence_Transfer *self, PyObject *args, PyObject *kwds)
 	self->user = user? twopence_strdup(user) : NULL;
 	self->permissions = permissions;
 	self->timeout = timeout;
+	self->background = !!background;
 	self->buffer = bufferObject;
 	if (bufferObject) {
 		Py_INCREF(bufferObject);
@@ -153,6 +162,7 @@ Transfer_dealloc(twopence_Transfer *self)
 	drop_string(&self->local_filename);
 	drop_string(&self->user);
 	drop_object(&self->buffer);
+	drop_object(&self->target);
 }
 
 int
@@ -169,6 +179,7 @@ Transfer_build_send(twopence_Transfer *self, twopence_file_xfer_t *xfer)
 	xfer->remote.name = self->remote_filename;
 	xfer->remote.mode = self->permissions;
 	xfer->user = self->user;
+	xfer->background = self->background;
 	/* xfer->timeout = self->timeout; */
 
 	if (self->local_filename) {
@@ -206,6 +217,7 @@ Transfer_build_recv(twopence_Transfer *self, twopence_file_xfer_t *xfer)
 
 	xfer->remote.name = self->remote_filename;
 	xfer->user = self->user;
+	xfer->background = self->background;
 	/* xfer->timeout = self->timeout; */
 
 	xfer->remote.mode = self->permissions;
@@ -250,6 +262,10 @@ Transfer_getattr(twopence_Transfer *self, char *name)
 		return PyInt_FromLong(self->timeout);
 	if (!strcmp(name, "data"))
 		return Transfer_data(self);
+	if (!strcmp(name, "background"))
+		return return_bool(self->background);
+	if (!strcmp(name, "pid"))
+		return PyInt_FromLong(self->pid);
 
 	return Py_FindMethod(twopence_transferMethods, (PyObject *) self, name);
 }
@@ -299,6 +315,10 @@ Transfer_setattr(twopence_Transfer *self, char *name, PyObject *v)
 		assign_object(&self->buffer, v);
 		return 0;
 	}
+	if (!strcmp(name, "background")) {
+		self->background = !!(PyObject_IsTrue(v));
+		return 0;
+	}
 
 	(void) PyErr_Format(PyExc_AttributeError, "Unknown attribute: %s", name);
 	return -1;
@@ -0,0 +1,291 @@
+/*
+ * Detached jobs for the test server.
+ *
+ * A detached job keeps running when the client that started it goes away.
+ * Its standard output and standard error are spooled to files, so that
+ * a client can later reattach to it, and collect its output and exit status.
+ * Jobs live as long as the server process; the spool directory is removed
+ * when the server exits.
+ *
+ * Copyright (C) 2014-2015 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+#include "utils.h"
+
+server_job_t *		server_jobs;
+
+static unsigned int	server_job_next_id = 1;
+static char *		server_job_spool_dir;
+static pid_t		server_job_spool_owner;
+
+static const char *	server_job_spool_names[2] = { "out", "err" };
+
+/*
+ * Remove the spool files of all jobs, and the spool directory.
+ * This is called on exit, and from a signal handler, so it only
+ * uses async-signal-safe calls and does not free anything.
+ * Child processes we forked leave the directory alone.
+ */
+static void
+server_job_remove_spool(void)
+{
+	server_job_t *job;
+	unsigned int i;
+
+	if (server_job_spool_dir == NULL || getpid() != server_job_spool_owner)
+		return;
+
+	for (job = server_jobs; job; job = job->next) {
+		for (i = 0; i < 2; ++i) {
+			if (job->spool_path[i])
+				unlink(job->spool_path[i]);
+		}
+	}
+	rmdir(server_job_spool_dir);
+}
+
+static void
+server_job_terminate(int sig)
+{
+	server_job_remove_spool();
+
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+/*
+ * Create the spool directory the first time we need it, and make sure it
+ * goes away when the server exits or is killed
+ */
+static const char *
+server_job_get_spool_dir(void)
+{
+	static const int signals[] = { SIGTERM, SIGINT, SIGHUP };
+	char tmpl[PATH_MAX];
+	struct sigaction sa;
+	unsigned int i;
+
+	if (server_job_spool_dir == NULL) {
+		snprintf(tmpl, sizeof(tmpl), "%s/twopence-jobs.XXXXXX", P_tmpdir);
+		if (mkdtemp(tmpl) == NULL) {
+			twopence_log_error("unable to create spool directory %s: %m", tmpl);
+			return NULL;
+		}
+		server_job_spool_dir = twopence_strdup(tmpl);
+		server_job_spool_owner = getpid();
+
+		atexit(server_job_remove_spool);
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = server_job_terminate;
+		for (i = 0; i < sizeof(signals) / sizeof(signals[0]); ++i)
+			sigaction(signals[i], &sa, NULL);
+	}
+	return server_job_spool_dir;
+}
+
+static void
+server_job_destroy(server_job_t *job)
+{
+	unsigned int i;
+
+	for (i = 0; i < 2; ++i) {
+		if (job->spool_path[i]) {
+			unlink(job->spool_path[i]);
+			free(job->spool_path[i]);
+		}
+	}
+	if (job->command)
+		free(job->command);
+	free(job);
+}
+
+server_job_t *
+server_job_start(twopence_command_t *cmd, int *status)
+{
+	const char *spool_dir;
+	server_job_t *job;
+	int fds[3] = { -1, -1, -1 };
+	char path[PATH_MAX];
+	unsigned int i;
+
+	if ((spool_dir = server_job_get_spool_dir()) == NULL) {
+		*status = errno;
+		return NULL;
+	}
+
+	job = twopence_calloc(1, sizeof(*job));
+	job->id = server_job_next_id++;
+
+	/* Nobody is going to feed the job any input */
+	if ((fds[0] = open("/dev/null", O_RDONLY)) < 0) {
+		*status = errno;
+		goto failed;
+	}
+
+	for (i = 0; i < 2; ++i) {
+		snprintf(path, sizeof(path), "%s/%u.%s", spool_dir, job->id, server_job_spool_names[i]);
+		job->spool_path[i] = twopence_strdup(path);
+
+		if ((fds[i + 1] = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+			*status = errno;
+			twopence_log_error("unable to create %s: %m", path);
+			goto failed;
+		}
+	}
+
+	job->pid = server_run_command_as(cmd, NULL, fds, status);
+	for (i = 0; i < 3; ++i)
+		close(fds[i]);
+
+	if (job->pid < 0) {
+		server_job_destroy(job);
+		return NULL;
+	}
+
+	job->command = twopence_strdup(cmd->command);
+	job->next = server_jobs;
+	server_jobs = job;
+	return job;
+
+failed:
+	for (i = 0; i < 3; ++i) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+	server_job_destroy(job);
+	return NULL;
+}
+
+server_job_t *
+server_job_find(unsigned int id)
+{
+	server_job_t *job;
+
+	for (job = server_jobs; job; job = job->next) {
+		if (job->id == id)
+			return job;
+	}
+	return NULL;
+}
+
+/*
+ * Check whether the job has exited. Returns true if it has.
+ */
+bool
+server_job_reap(server_job_t *job)
+{
+	int status;
+	pid_t pid;
+
+	if (job->exited)
+		return true;
+
+	pid = waitpid(job->pid, &status, WNOHANG);
+	if (pid < 0) {
+		/* Should not happen, unless somebody else reaped it */
+		twopence_log_error("waitpid(%d) failed: %m", (int) job->pid);
+		job->status = W_EXITCODE(127, 0);
+		job->exited = true;
+	} else if (pid == job->pid) {
+		twopence_debug("detached job %u (pid %d) exited with status 0x%x",
+				job->id, (int) pid, status);
+		job->status = status;
+		job->exited = true;
+	}
+
+	return job->exited;
+}
+
+void
+server_job_reap_all(void)
+{
+	server_job_t *job;
+
+	for (job = server_jobs; job; job = job->next)
+		server_job_reap(job);
+}
+
+/*
+ * Fill in the description we send to the client. Note that the command
+ * string is not copied.
+ */
+void
+server_job_describe(server_job_t *job, twopence_detached_job_t *info)
+{
+	struct stat stb;
+	unsigned int i;
+	int st = job->status;
+
+	memset(info, 0, sizeof(*info));
+	info->id = job->id;
+	info->command = job->command;
+	info->running = !job->exited;
+
+	for (i = 0; i < 2; ++i) {
+		if (stat(job->spool_path[i], &stb) >= 0)
+			info->nbytes += stb.st_size;
+	}
+
+	if (!job->exited)
+		return;
+
+	if (WIFEXITED(st)) {
+		info->status.major = 0;
+		info->status.minor = WEXITSTATUS(st);
+	} else
+	if (WIFSIGNALED(st) && WTERMSIG(st) == SIGALRM) {
+		info->status.major = ETIME;
+	} else
+	if (WIFSIGNALED(st)) {
+		info->status.major = EFAULT;
+		info->status.minor = WTERMSIG(st);
+	} else {
+		info->status.major = EFAULT;
+		info->status.minor = 2;
+	}
+}
+
+/*
+ * The job's exit status has been collected; forget about it
+ */
+void
+server_job_free(server_job_t *job)
+{
+	server_job_t **pos, *cur;
+
+	for (pos = &server_jobs; (cur = *pos) != NULL; pos = &cur->next) {
+		if (cur == job) {
+			*pos = job->next;
+			break;
+		}
+	}
+
+	server_job_destroy(job);
+}
@@ -206,7 +206,7 @@ int open_tcp_port(const char *arg)
 {
   struct sockaddr_in6 six;
   unsigned long port = 0;
-  int listen_fd;
+  int listen_fd, on;
 
   if (arg != NULL && strcmp(arg, "default")) {
     char *end;
@@ -236,6 +236,12 @@ int open_tcp_port(const char *arg)
     goto failed;
   }
 
+  /* Allow a restarted server to bind while old connections linger
+   * in TIME_WAIT, so that clients can reconnect right away */
+  on = 1;
+  if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+    twopence_debug("unable to set SO_REUSEADDR: %m");
+
   if (bind(listen_fd, (struct sockaddr *) &six, sizeof(six)) < 0) {
     fprintf(stderr, "Unable to bind tcp socket to port %lu: %m\n", port);
     goto failed;
@@ -91,16 +91,15 @@ server_restore_privileges(struct saved_ids *saved_ids)
 }
 
 static const char *
-server_build_path(const char *dir, const char *file)
+server_build_path(const char *dir, const char *file, char *pathbuf, size_t size)
 {
-	static char pathbuf[PATH_MAX];
 	unsigned int total;
 
 	/* snprintf returns the number it would have printed if the buffer
 	 * was big enough. This allows us to check quickly for names that
 	 * would exceed PATH_MAX */
-	total = snprintf(pathbuf, sizeof(pathbuf), "%s/%s", dir, file);
-	if (total >= sizeof(pathbuf))
+	total = snprintf(pathbuf, size, "%s/%s", dir, file);
+	if (total >= size)
 		return NULL;
 
 	return pathbuf;
@@ -174,6 +173,7 @@ server_open_file_as(const char *username, const char *filename, unsigned int fil
 	struct stat stb;
 	struct saved_ids saved_ids;
 	struct passwd *user;
+	char pathbuf[PATH_MAX];
 	int fd;
 
 	if (!(user = server_get_user(username, status))) {
@@ -184,13 +184,13 @@ server_open_file_as(const char *username, const char *filename, unsigned int fil
 	/* If the path is not absolute, interpret it relatively to the
 	 * user's home directory */
 	if (filename[0] != '/') {
-		filename = server_build_path(user->pw_dir, filename);
-		if (filename == NULL) {
+		if (server_build_path(user->pw_dir, filename, pathbuf, sizeof(pathbuf)) == NULL) {
 			twopence_log_error("Unable to build path from user %s's home \"%s\" and relative name \"%s\"\n",
 					username, user->pw_dir, filename);
 			*status = ENAMETOOLONG;
 			return false;
 		}
+		filename = pathbuf;
 	}
 
 	twopence_debug("%s(user=%s, file=%s, flags=0%0)\n", __func__, username, filename, oflags);
@@ -225,7 +225,7 @@ server_open_file_as(const char *username, const char *filename, unsigned int fil
 		close(fd);
 		return -1;
 	}
-	if (oflags != O_RDONLY && fchmod(fd, filemode) < 0) {
+	if (oflags != O_RDONLY && filemode != 0 && fchmod(fd, filemode) < 0) {
 		*status = errno;
 		twopence_log_error("failed to change file mode \"%s\" to 0%o: %m", filename, filemode);
 		close(fd);
@@ -309,8 +309,14 @@ server_build_shell_env(twopence_env_t *env, const struct passwd *pw)
 	return env->array;
 }
 
+/*
+ * Run a command as the requested user. Normally, the command is connected
+ * to pipes (or a pty), and the parent's ends are returned in parent_fds.
+ * A detached job instead gets the three fds in detached_fds; these are
+ * left for the caller to close.
+ */
 int
-server_run_command_as(twopence_command_t *cmd, int *parent_fds, int *status)
+server_run_command_as(twopence_command_t *cmd, int *parent_fds, const int *detached_fds, int *status)
 {
 	int pipefds[6], child_fds[3];
 	int pty_master = -1;
@@ -336,6 +342,8 @@ server_run_command_as(twopence_command_t *cmd, int *parent_fds, int *status)
 		parent_fds[0] = dup(pty_master);
 		parent_fds[1] = dup(pty_master);
 		parent_fds[2] = -1;
+	} else if (detached_fds) {
+		__init_fds(child_fds, detached_fds[0], detached_fds[1], detached_fds[2]);
 	} else {
 		for (nfds = 0; nfds < 3; ++nfds) {
 			if (pipe(pipefds + 2 * nfds) < 0) {
@@ -429,7 +437,8 @@ server_run_command_as(twopence_command_t *cmd, int *parent_fds, int *status)
 		exit(127);
 	}
 
-	__close_fds(child_fds);
+	if (detached_fds == NULL)
+		__close_fds(child_fds);
 
 out:
 	if (argv)
@@ -504,6 +513,7 @@ server_extract_file(twopence_transaction_t *trans, const twopence_file_xfer_t *x
 	twopence_trans_channel_t *source;
 	const char *username = xfer->user;
 	const char *filename = xfer->remote.name;
+	struct stat stb;
 	int status;
 	int fd;
 
@@ -513,6 +523,24 @@ server_extract_file(twopence_transaction_t *trans, const twopence_file_xfer_t *x
 		return false;
 	}
 
+	/* The client already has a copy of the file, stamped with the mtime we
+	 * reported when it was transferred. If it is still current, tell the
+	 * client so with a major status of 0, and skip the transfer. Otherwise,
+	 * report the mtime of the file we are about to send. */
+	if (xfer->if_changed && fstat(fd, &stb) == 0 && S_ISREG(stb.st_mode)) {
+		if ((uint64_t) stb.st_size == xfer->known_size
+		 && stb.st_mtime == xfer->known_mtime) {
+			twopence_debug("%s: not modified\n", filename);
+			twopence_transaction_send_major(trans, 0);
+			trans->done = true;
+			close(fd);
+			return true;
+		}
+
+		twopence_transaction_send_client(trans,
+				twopence_protocol_build_mtime_packet(&trans->ps, stb.st_mtime));
+	}
+
 	source = twopence_transaction_attach_local_source(trans, 0, fd);
 	if (source == NULL) {
 		/* Something is wrong */
@@ -527,6 +555,181 @@ server_extract_file(twopence_transaction_t *trans, const twopence_file_xfer_t *x
 	return true;
 }
 
+/*
+ * Remote file handles. The file stays open until the client closes the
+ * handle, or the transaction goes away with the connection.
+ */
+static int
+server_file_open_flags(unsigned int flags)
+{
+	int oflags;
+
+	if ((flags & TWOPENCE_OPEN_READ) && (flags & TWOPENCE_OPEN_WRITE))
+		oflags = O_RDWR;
+	else if (flags & TWOPENCE_OPEN_WRITE)
+		oflags = O_WRONLY;
+	else
+		oflags = O_RDONLY;
+
+	if (flags & TWOPENCE_OPEN_CREATE)
+		oflags |= O_CREAT;
+	if (flags & TWOPENCE_OPEN_TRUNCATE)
+		oflags |= O_TRUNC;
+	if (flags & TWOPENCE_OPEN_EXCLUSIVE)
+		oflags |= O_EXCL;
+	return oflags;
+}
+
+static void
+server_file_handle_reply(twopence_transaction_t *trans, uint32_t tag, int status, uint32_t result,
+			const void *data, unsigned int count)
+{
+	twopence_transaction_send_client(trans,
+			twopence_protocol_build_file_reply_packet(&trans->ps, tag, status, result, data, count));
+}
+
+static void
+server_file_handle_pread(twopence_transaction_t *trans, uint32_t tag, uint64_t offset, uint32_t count)
+{
+	char buffer[TWOPENCE_FILE_IO_MAX];
+	ssize_t n;
+
+	if (count > sizeof(buffer)) {
+		server_file_handle_reply(trans, tag, EINVAL, 0, NULL, 0);
+		return;
+	}
+
+	n = pread(trans->file_fd, buffer, count, offset);
+	if (n < 0)
+		server_file_handle_reply(trans, tag, errno, 0, NULL, 0);
+	else
+		server_file_handle_reply(trans, tag, 0, n, buffer, n);
+}
+
+static void
+server_file_handle_pwrite(twopence_transaction_t *trans, uint32_t tag, uint64_t offset, twopence_buf_t *payload)
+{
+	ssize_t n;
+
+	n = pwrite(trans->file_fd, twopence_buf_head(payload), twopence_buf_count(payload), offset);
+	if (n < 0)
+		server_file_handle_reply(trans, tag, errno, 0, NULL, 0);
+	else
+		server_file_handle_reply(trans, tag, 0, n, NULL, 0);
+}
+
+static void
+server_file_handle_fstat(twopence_transaction_t *trans, uint32_t tag)
+{
+	twopence_file_stat_t st;
+	struct stat stb;
+
+	if (fstat(trans->file_fd, &stb) < 0) {
+		server_file_handle_reply(trans, tag, errno, 0, NULL, 0);
+		return;
+	}
+
+	st.size = stb.st_size;
+	st.mode = stb.st_mode;
+	st.uid = stb.st_uid;
+	st.gid = stb.st_gid;
+	st.mtime = stb.st_mtime;
+	twopence_transaction_send_client(trans,
+			twopence_protocol_build_file_stat_reply_packet(&trans->ps, tag, &st));
+}
+
+bool
+server_file_handle_recv(twopence_transaction_t *trans, const twopence_hdr_t *hdr, twopence_buf_t *payload)
+{
+	uint64_t offset;
+	uint32_t tag, count;
+	int status = 0;
+
+	switch (hdr->type) {
+	case TWOPENCE_PROTO_TYPE_FILE_READ:
+	case TWOPENCE_PROTO_TYPE_FILE_WRITE:
+	case TWOPENCE_PROTO_TYPE_FILE_STAT:
+		if (!twopence_protocol_dissect_file_request_packet(payload, hdr->type, &tag, &offset, &count)) {
+			twopence_log_error("%s: bad %s packet", twopence_transaction_describe(trans),
+					twopence_protocol_packet_type_to_string(hdr->type));
+			twopence_transaction_fail(trans, EPROTO);
+			break;
+		}
+
+		if (hdr->type == TWOPENCE_PROTO_TYPE_FILE_READ)
+			server_file_handle_pread(trans, tag, offset, count);
+		else if (hdr->type == TWOPENCE_PROTO_TYPE_FILE_WRITE)
+			server_file_handle_pwrite(trans, tag, offset, payload);
+		else
+			server_file_handle_fstat(trans, tag);
+		break;
+
+	case TWOPENCE_PROTO_TYPE_FILE_CLOSE:
+		if (close(trans->file_fd) < 0)
+			status = errno;
+		trans->file_fd = -1;
+
+		twopence_transaction_send_minor(trans, status);
+		trans->done = true;
+		break;
+
+	default:
+		twopence_log_error("Unknown command code '%c' in transaction context\n", hdr->type);
+		break;
+	}
+
+	return true;
+}
+
+bool
+server_open_file_handle(twopence_transaction_t *trans, const char *username, const char *filename,
+			unsigned int flags, unsigned int filemode)
+{
+	int status;
+	int fd;
+
+	AUDIT("open \"%s\"; user=%s flags=0x%x\n", filename, username, flags);
+	/* O_TRUNC with O_RDONLY is undefined */
+	if ((flags & TWOPENCE_OPEN_TRUNCATE) && !(flags & TWOPENCE_OPEN_WRITE)) {
+		twopence_transaction_fail(trans, EINVAL);
+		return false;
+	}
+
+	if ((fd = server_open_file_as(username, filename, filemode, server_file_open_flags(flags), &status)) < 0) {
+		twopence_transaction_fail(trans, status);
+		return false;
+	}
+
+	trans->file_fd = fd;
+	trans->recv = server_file_handle_recv;
+
+	/* Tell the client the file is open; it will send its requests next */
+	twopence_transaction_send_major(trans, 0);
+	return true;
+}
+
+/*
+ * Report how a command exited, given its status as returned by waitpid
+ */
+static void
+server_send_exit_status(twopence_transaction_t *trans, int st)
+{
+	if (WIFEXITED(st)) {
+		twopence_transaction_send_major(trans, 0);
+		twopence_transaction_send_minor(trans, WEXITSTATUS(st));
+	} else
+	if (WIFSIGNALED(st)) {
+		if (WTERMSIG(st) == SIGALRM) {
+			twopence_transaction_send_timeout(trans);
+		} else {
+			twopence_transaction_fail2(trans, EFAULT, WTERMSIG(st));
+		}
+	} else {
+		twopence_transaction_fail2(trans, EFAULT, 2);
+	}
+	trans->done = true;
+}
+
 bool
 server_run_command_send(twopence_transaction_t *trans)
 {
@@ -553,24 +756,8 @@ server_run_command_send(twopence_transaction_t *trans)
 		}
 	}
 
-	if (!trans->done && trans->pid == 0 && !pending_output) {
-		int st = trans->status;
-
-		if (WIFEXITED(st)) {
-			twopence_transaction_send_major(trans, 0);
-			twopence_transaction_send_minor(trans, WEXITSTATUS(st));
-		} else
-		if (WIFSIGNALED(st)) {
-			if (WTERMSIG(st) == SIGALRM) {
-				twopence_transaction_send_timeout(trans);
-			} else {
-				twopence_transaction_fail2(trans, EFAULT, WTERMSIG(st));
-			}
-		} else {
-			twopence_transaction_fail2(trans, EFAULT, 2);
-		}
-		trans->done = true;
-	}
+	if (!trans->done && trans->pid == 0 && !pending_output)
+		server_send_exit_status(trans, trans->status);
 
 	return true;
 }
@@ -585,8 +772,11 @@ server_run_command_recv(twopence_transaction_t *trans, const twopence_hdr_t *hdr
 		 * it has to say, not even "aargh".
 		 */
 		if (trans->pid && !trans->done) {
-			/* Send the KILL signal to all processes in the process group */
-			kill(-trans->pid, SIGKILL);
+			/* Send the KILL signal to all processes in the process group.
+			 * If the child has not called setsid() yet, there is no such
+			 * group, and the child is the only process to kill. */
+			if (kill(-trans->pid, SIGKILL) < 0 && errno == ESRCH)
+				kill(trans->pid, SIGKILL);
 			twopence_transaction_close_sink(trans, 0);
 			twopence_transaction_close_source(trans, 0); /* ID zero means all */
 		}
@@ -600,6 +790,204 @@ server_run_command_recv(twopence_transaction_t *trans, const twopence_hdr_t *hdr
 	return true;
 }
 
+/*
+ * Detached jobs.
+ * Starting one is answered right away with a job packet. The job's
+ * output is spooled to files (see jobs.c); a client that reattaches
+ * is sent what has been spooled so far, and then follows the files until
+ * the job exits.
+ */
+#define SERVER_JOB_POLL_INTERVAL	100	/* msec */
+
+static void
+server_send_job(twopence_transaction_t *trans, server_job_t *job)
+{
+	twopence_detached_job_t info;
+	twopence_buf_t *bp;
+
+	server_job_describe(job, &info);
+	if ((bp = twopence_protocol_build_job_packet(&trans->ps, &info)) != NULL)
+		twopence_transaction_send_client(trans, bp);
+}
+
+static bool
+server_run_detached(twopence_transaction_t *trans, twopence_command_t *cmd)
+{
+	server_job_t *job;
+	int status;
+
+	/* Nobody would be there to talk to the tty */
+	if (cmd->request_tty) {
+		twopence_transaction_fail2(trans, EINVAL, 0);
+		return false;
+	}
+
+	if ((job = server_job_start(cmd, &status)) == NULL) {
+		twopence_transaction_fail2(trans, status, 0);
+		return false;
+	}
+
+	AUDIT("detached job %u, pid %d\n", job->id, (int) job->pid);
+	server_send_job(trans, job);
+	twopence_transaction_fail2(trans, 0, 0);
+	return true;
+}
+
+static void
+server_list_jobs(twopence_transaction_t *trans)
+{
+	server_job_t *job;
+
+	for (job = server_jobs; job; job = job->next) {
+		server_job_reap(job);
+		server_send_job(trans, job);
+	}
+	twopence_transaction_fail2(trans, 0, 0);
+}
+
+/*
+ * Forward whatever the job wrote to a spool file since we last looked.
+ * Returns false once we have reached the end of a job that has exited.
+ */
+static bool
+server_reattach_forward(twopence_transaction_t *trans, unsigned int index, bool exited)
+{
+	uint16_t channel_id = index? TWOPENCE_STDERR : TWOPENCE_STDOUT;
+	int fd = trans->job_fd[index];
+
+	while (twopence_sock_xmit_queue_allowed(trans->socket)) {
+		twopence_buf_t *bp;
+		int count;
+
+		bp = twopence_protocol_command_buffer_new();
+		twopence_buf_reserve_head(bp, TWOPENCE_PROTO_HEADER_SIZE + 2);
+		do {
+			count = read(fd, twopence_buf_tail(bp), twopence_buf_tailroom(bp));
+		} while (count < 0 && errno == EINTR);
+
+		if (count > 0) {
+			twopence_buf_advance_tail(bp, count);
+			twopence_protocol_build_data_header(bp, &trans->ps, channel_id);
+			twopence_transaction_send_client(trans, bp);
+			continue;
+		}
+
+		twopence_buf_free(bp);
+		if (count < 0) {
+			twopence_log_error("%s: cannot read spooled output: %m", twopence_transaction_describe(trans));
+			break;
+		}
+
+		/* We are at the end of the file. If the job has exited,
+		 * it is not going to write any more. */
+		if (!exited)
+			return true;
+
+		twopence_transaction_send_client(trans,
+				twopence_protocol_build_eof_packet(&trans->ps, channel_id));
+		close(fd);
+		trans->job_fd[index] = -1;
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+server_reattach_send(twopence_transaction_t *trans)
+{
+	server_job_t *job;
+	bool exited, pending = false;
+	unsigned int i;
+
+	if (trans->done)
+		return true;
+
+	/* Somebody else may have collected the job in the meantime */
+	if ((job = server_job_find(trans->job_id)) == NULL) {
+		twopence_transaction_fail2(trans, ESRCH, 0);
+		return true;
+	}
+
+	/* Check whether the job exited before reading its output,
+	 * so that we do not miss anything it wrote before it did */
+	exited = server_job_reap(job);
+
+	for (i = 0; i < 2; ++i) {
+		if (trans->job_fd[i] >= 0 && server_reattach_forward(trans, i, exited))
+			pending = true;
+	}
+
+	if (pending) {
+		/* A spool file never polls as anything but readable, so
+		 * check back regularly for output and for the job to exit */
+		if (trans->job_timer && twopence_timer_remaining(trans->job_timer) == 0) {
+			twopence_timer_release(trans->job_timer);
+			trans->job_timer = NULL;
+		}
+		if (trans->job_timer == NULL
+		 && twopence_timer_create(SERVER_JOB_POLL_INTERVAL, &trans->job_timer) == 0)
+			twopence_timer_hold(trans->job_timer);
+		return true;
+	}
+
+	if (!exited)
+		return true;
+
+	AUDIT("collected detached job %u\n", job->id);
+	server_send_exit_status(trans, job->status);
+	server_job_free(job);
+	return true;
+}
+
+static bool
+server_reattach_recv(twopence_transaction_t *trans, const twopence_hdr_t *hdr, twopence_buf_t *payload)
+{
+	server_job_t *job;
+
+	switch (hdr->type) {
+	case TWOPENCE_PROTO_TYPE_INTR:
+		/* Interrupting a reattached job kills it. We still forward
+		 * the rest of its output, and how it exited. */
+		if ((job = server_job_find(trans->job_id)) != NULL && !server_job_reap(job))
+			kill(-job->pid, SIGKILL);
+		break;
+
+	default:
+		twopence_log_error("Unknown command code '%c' in transaction context\n", hdr->type);
+		break;
+	}
+
+	return true;
+}
+
+static void
+server_reattach(twopence_transaction_t *trans, unsigned int job_id, unsigned int flags)
+{
+	server_job_t *job;
+	unsigned int i;
+
+	AUDIT("reattach to job %u\n", job_id);
+	if ((job = server_job_find(job_id)) == NULL) {
+		twopence_transaction_fail2(trans, ESRCH, 0);
+		return;
+	}
+
+	if (!(flags & TWOPENCE_PROTO_REATTACH_NO_OUTPUT)) {
+		for (i = 0; i < 2; ++i) {
+			if ((trans->job_fd[i] = open(job->spool_path[i], O_RDONLY | O_CLOEXEC)) < 0) {
+				twopence_log_error("unable to open %s: %m", job->spool_path[i]);
+				twopence_transaction_fail2(trans, errno, 0);
+				return;
+			}
+		}
+	}
+
+	trans->job_id = job_id;
+	trans->send = server_reattach_send;
+	trans->recv = server_reattach_recv;
+}
+
 bool
 server_run_command(twopence_transaction_t *trans, twopence_command_t *cmd)
 {
@@ -611,7 +999,10 @@ server_run_command(twopence_transaction_t *trans, twopence_command_t *cmd)
 
 	AUDIT("run \"%s\"; user=%s timeout=%u%s\n", cmd->command, cmd->user, cmd->timeout,
 				cmd->request_tty? ", use a tty" : "");
-	if ((pid = server_run_command_as(cmd, command_fds, &status)) < 0) {
+	if (cmd->detach)
+		return server_run_detached(trans, cmd);
+
+	if ((pid = server_run_command_as(cmd, command_fds, NULL, &status)) < 0) {
 		twopence_transaction_fail2(trans, status, 0);
 		return false;
 	}
@@ -667,6 +1058,8 @@ server_process_request(twopence_transaction_t *trans, twopence_buf_t *payload)
 {
 	twopence_file_xfer_t xfer;
 	twopence_command_t cmd;
+	const char *username, *filename;
+	unsigned int flags, filemode, job_id;
 
 	switch (trans->type) {
 	case TWOPENCE_PROTO_TYPE_INJECT:
@@ -697,6 +1090,24 @@ server_process_request(twopence_transaction_t *trans, twopence_buf_t *payload)
 		twopence_command_destroy(&cmd);
 		break;
 
+	case TWOPENCE_PROTO_TYPE_FILE_OPEN:
+		if (!twopence_protocol_dissect_file_open_packet(payload, &username, &filename, &flags, &filemode))
+			goto bad_packet;
+
+		server_open_file_handle(trans, username, filename, flags, filemode);
+		break;
+
+	case TWOPENCE_PROTO_TYPE_JOB_LIST:
+		server_list_jobs(trans);
+		break;
+
+	case TWOPENCE_PROTO_TYPE_REATTACH:
+		if (!twopence_protocol_dissect_reattach_packet(payload, &job_id, &flags))
+			goto bad_packet;
+
+		server_reattach(trans, job_id, flags);
+		break;
+
 	case TWOPENCE_PROTO_TYPE_QUIT:
 		server_request_quit();
 		/* we should not get here */
@@ -778,8 +1189,10 @@ __server_run(twopence_conn_t *conn)
 	pool = twopence_conn_pool_new();
 
 	twopence_conn_pool_add_connection(pool, conn);
-	while (twopence_conn_pool_poll(pool))
-		;
+	while (twopence_conn_pool_poll(pool)) {
+		/* Detached jobs that exit interrupt the poll with SIGCHLD */
+		server_job_reap_all();
+	}
 
 	sigprocmask(SIG_SETMASK, &omask, NULL);
 
@@ -29,6 +29,34 @@
 
 extern void		server_run(twopence_sock_t *);
 extern void		server_listen(twopence_sock_t *);
+extern int		server_run_command_as(twopence_command_t *cmd, int *parent_fds, const int *detached_fds, int *status);
+
+/*
+ * Detached jobs
+ */
+typedef struct server_job server_job_t;
+struct server_job {
+	server_job_t *		next;
+
+	unsigned int		id;
+	char *			command;
+	pid_t			pid;
+
+	bool			exited;
+	int			status;		/* as returned by waitpid */
+
+	/* stdout and stderr of the job are spooled here */
+	char *			spool_path[2];
+};
+
+extern server_job_t *	server_jobs;
+
+extern server_job_t *	server_job_start(twopence_command_t *cmd, int *status);
+extern server_job_t *	server_job_find(unsigned int id);
+extern bool		server_job_reap(server_job_t *job);
+extern void		server_job_reap_all(void);
+extern void		server_job_describe(server_job_t *job, twopence_detached_job_t *info);
+extern void		server_job_free(server_job_t *job);
 
 #define AUDIT(fmt, args...) \
 	do { \
@@ -136,7 +136,7 @@ Options: -u|--user <user>: user running the command (default: root)\n\
          -h|--help: print this help message\n\
 Target: serial:<character device>\n\
         ssh:<address and port>\n\
-        virtio:<socket file>\n\
+        virtio:<socket file>[,<socket file>...]\n\
 Command: any UNIX command\n", program_name);
 }
 
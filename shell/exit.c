@@ -34,7 +34,7 @@ void usage(const char *program_name)
     fprintf(stderr, "Usage: %s <target>\n\
 Target: serial:<character device>\n\
         ssh:<address and port>\n\
-        virtio:<socket file>\n", program_name);
+        virtio:<socket file>[,<socket file>...]\n", program_name);
 }
 
 // Example syntax for virtio plugin:
@@ -46,7 +46,7 @@ Options: -u|--user <user>: user extracting the file (default: root)\n\
          -h|--help: print this help message\n\
 Target: serial:<character device>\n\
         ssh:<address and port>\n\
-        virtio:<socket file>\n", program_name);
+        virtio:<socket file>[,<socket file>...]\n", program_name);
 }
 
 // Example syntax for virtio plugin:
@@ -517,9 +517,9 @@ try:
 	status = target.run(cmd)
 	if testCaseCheckStatus(status):
 		got_bytes = len(status.stdout)
-		# We do not check the total amount of data received;
-		# right now, the buffer size is capped at 64K which is not
-		# useful in this context
+		# stdout and stderr share a buffer, so this includes dd's statistics
+		if got_bytes < 1024 * 1024:
+			testCaseFail("expected at least 1048576 bytes of output, got %d" % got_bytes)
 except:
 	testCaseException()
 testCaseReport()
@@ -1128,5 +1128,1071 @@ except:
 
 testCaseReport()
 
+testCaseBegin("verify that many concurrent commands each get their own status")
+if not(backgroundingSupported):
+    testCaseSkip("background execution not available for %s plugin right now" % target.type)
+else:
+    try:
+	# Earlier chat tests do not wait for their commands
+	while target.wait() != None:
+		pass
+
+	cmds = []
+	for n in range(1, 101):
+		cmd = twopence.Command("sleep 1; exit %d" % n, background = 1, quiet = True)
+		target.run(cmd)
+		cmds.append(cmd)
+
+	# Note: the name "set" is clobbered by an earlier test
+	pids = {}
+	for cmd in cmds:
+		pids[cmd.pid] = cmd
+	if len(pids) != len(cmds):
+		testCaseFail("%d commands share %d pids" % (len(cmds), len(pids)))
+
+	# Reap them in reverse order, so that the IDs of the first
+	# commands stay in use while later ones are freed
+	cmds.reverse()
+	for cmd in cmds:
+		expect = int(cmd.commandline.split()[-1])
+		status = target.wait(cmd)
+		if status.command != cmd:
+			testCaseFail("target.wait() returned the wrong command")
+			break
+		if not testCaseCheckStatusQuiet(status, expect):
+			break
+	print "Reaped %d commands" % len(cmds)
+	if target.wait() != None:
+		testCaseFail("there were still commands left")
+    except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("verify that target.waitAll() reaps many commands at once")
+if not(backgroundingSupported):
+    testCaseSkip("background execution not available for %s plugin right now" % target.type)
+else:
+    try:
+	# More than waitAll() collects in one go
+	for n in range(150):
+		if n == 75:
+			target.run("sleep 1; exit 3", background = 1, quiet = True)
+		else:
+			target.run("sleep 1", background = 1, quiet = True)
+
+	status = target.waitAll()
+	testCaseCheckStatus(status, 3)
+	if target.wait() != None:
+		testCaseFail("there were still commands left after waitAll returned")
+    except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("interrupt one of several backgrounded commands")
+if not(backgroundingSupported):
+    testCaseSkip("background execution not available for %s plugin right now" % target.type)
+else:
+    try:
+	import time
+
+	cmd1 = twopence.Command("sleep 30", background = 1)
+	cmd2 = twopence.Command("sleep 2", background = 1)
+	target.run(cmd1)
+	target.run(cmd2)
+
+	t0 = time.time()
+	print "Interrupting cmd1 (pid %d)" % cmd1.pid
+	cmd1.interrupt()
+	status = target.wait(cmd1)
+	print "cmd1 finished after %.1f seconds" % (time.time() - t0)
+	if status.exitSignal is None:
+		testCaseFail("cmd1 should have been killed by a signal")
+	else:
+		print "Good, cmd1 was killed by signal %s" % status.exitSignal
+	if time.time() - t0 > 10:
+		testCaseFail("interrupting cmd1 took too long")
+
+	status = target.wait(cmd2)
+	testCaseCheckStatus(status)
+    except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("verify that heartbeats keep an idle link alive")
+try:
+	import time
+
+	target2 = twopence.Target(targetSpec)
+	try:
+		target2.setOption("heartbeat", 200)
+		heartbeatSupported = True
+	except:
+		heartbeatSupported = False
+
+	if not heartbeatSupported:
+		testCaseSkip("heartbeats not available for %s plugin right now" % target.type)
+	else:
+		status = target2.run("sleep 3")
+		testCaseCheckStatus(status)
+
+		timeout = target2.getOption("dead-peer-timeout")
+		print "Dead peer timeout is %d msec" % timeout
+		if timeout <= 0 or timeout > 5000:
+			testCaseFail("unexpected dead peer timeout %d msec" % timeout)
+
+		print "Sleeping for 2 seconds without talking to the target"
+		time.sleep(2)
+		status = target2.run("/bin/true")
+		testCaseCheckStatus(status)
+
+	target2 = None
+except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("wait for the target to become ready")
+if target.type == "ssh":
+    testCaseSkip("waiting for the target not available for %s plugin right now" % target.type)
+else:
+    try:
+	import time
+
+	target.waitReady(timeout = 10)
+	print "Good, target is ready"
+
+	# A target nobody is listening on
+	if target.type == "tcp":
+		deadSpec = "tcp:127.0.0.1:1"
+	elif target.type == "virtio":
+		deadSpec = "virtio:/does/not/exist"
+	else:
+		deadSpec = None
+
+	if deadSpec:
+		deadTarget = twopence.Target(deadSpec)
+		t0 = time.time()
+		try:
+			deadTarget.waitReady(timeout = 1)
+			testCaseFail("waitReady() on %s should have failed" % deadSpec)
+		except:
+			elapsed = time.time() - t0
+			print "Good, waitReady() on %s failed after %.1f seconds" % (deadSpec, elapsed)
+			if elapsed < 0.9 or elapsed > 3:
+				testCaseFail("waitReady() did not honor its timeout")
+		deadTarget = None
+    except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("run file transfers in the background")
+if target.type == "ssh":
+    testCaseSkip("background transfers not available for %s plugin right now" % target.type)
+else:
+    try:
+	import hashlib
+
+	def remoteChecksum(path):
+		status = target.run("md5sum %s" % path, stdout = bytearray(), quiet = True)
+		if not status:
+			return None
+		return str(status.stdout).split()[0]
+
+	target.run("head -c 1000000 /dev/urandom >/tmp/twopence-bgrecv", quiet = True)
+	data = bytearray(os.urandom(500000))
+
+	recvXfer = twopence.Transfer("/tmp/twopence-bgrecv", background = True)
+	sendXfer = twopence.Transfer("/tmp/twopence-bgsend", data = data, background = True)
+	if target.recvfile(recvXfer) != True or target.sendfile(sendXfer) != True:
+		testCaseFail("backgrounded transfers should return True")
+	elif not recvXfer.pid or not sendXfer.pid:
+		testCaseFail("backgrounded transfers should have a pid")
+	else:
+		print "Running a command while the transfers are in progress"
+		testCaseCheckStatus(target.run("/bin/true"))
+
+		status = target.wait(sendXfer)
+		if not status:
+			testCaseFail("sendfile failed: %s" % status.message)
+		elif remoteChecksum("/tmp/twopence-bgsend") != hashlib.md5(data).hexdigest():
+			testCaseFail("sent file was corrupted")
+		else:
+			print "Good, sent %d bytes in the background" % len(data)
+
+		status = target.wait(recvXfer)
+		if not status:
+			testCaseFail("recvfile failed: %s" % status.message)
+		elif hashlib.md5(status.buffer).hexdigest() != remoteChecksum("/tmp/twopence-bgrecv"):
+			testCaseFail("received file was corrupted")
+		else:
+			print "Good, received %d bytes in the background" % len(status.buffer)
+
+	if recvXfer.pid or sendXfer.pid:
+		testCaseFail("transfer pid should be reset to 0 after completion")
+
+	print "Receiving a file that does not exist"
+	xfer = twopence.Transfer("/does/not/exist", background = True)
+	target.recvfile(xfer)
+	try:
+		status = target.wait(xfer)
+		testCaseFail("wait() returned %s (should have thrown an exception)" % status)
+	except:
+		print "Good, wait() threw an exception as expected"
+	if target.wait() != None:
+		testCaseFail("there were still transfers left")
+
+	target.run("rm -f /tmp/twopence-bgrecv /tmp/twopence-bgsend", quiet = True)
+    except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("drive two targets from separate threads")
+try:
+	import threading
+	import time
+
+	results = {}
+	def runOnTarget(name):
+		t = twopence.Target(targetSpec)
+		out = bytearray()
+		results[name] = t.run("sleep 2; echo %s" % name, stdout = out, quiet = True)
+		t = None
+
+	threads = []
+	for name in ("thread1", "thread2"):
+		thread = threading.Thread(target = runOnTarget, args = (name,))
+		threads.append(thread)
+
+	t0 = time.time()
+	for thread in threads:
+		thread.start()
+	for thread in threads:
+		thread.join()
+	elapsed = time.time() - t0
+	print "Both threads finished after %.1f seconds" % elapsed
+
+	for name in ("thread1", "thread2"):
+		status = results.get(name)
+		if status is None:
+			testCaseFail("%s did not return a status" % name)
+		elif testCaseCheckStatusQuiet(status) and str(status.stdout).strip() != name:
+			testCaseFail("%s received \"%s\"" % (name, str(status.stdout).strip()))
+
+	if elapsed >= 3.5:
+		testCaseFail("the threads did not run concurrently")
+except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("drive backgrounded commands from a select.poll() loop")
+if not(backgroundingSupported):
+    testCaseSkip("background execution not available for %s plugin right now" % target.type)
+else:
+    try:
+	import select
+	import time
+
+	pending = {}
+	for n in range(1, 4):
+		cmd = twopence.Command("sleep %d; exit %d" % (n, n), background = 1, quiet = True)
+		target.run(cmd)
+		pending[cmd] = n
+
+	deadline = time.time() + 10
+	while pending and time.time() < deadline:
+		fds, timeout = target.pollfds()
+		poller = select.poll()
+		for fd, events in fds:
+			poller.register(fd, events)
+		if timeout is None or timeout > 1:
+			timeout = 1
+		ready = poller.poll(timeout * 1000)
+
+		for status in target.dispatch(ready):
+			cmd = status.command
+			if cmd not in pending:
+				testCaseFail("dispatch() returned an unexpected command")
+				continue
+			print "\"%s\" completed with status %d" % (cmd.commandline, status.code)
+			testCaseCheckStatusQuiet(status, pending[cmd])
+			del pending[cmd]
+
+	if pending:
+		testCaseFail("%d commands did not complete" % len(pending))
+	if target.wait() != None:
+		testCaseFail("there were still commands left")
+    except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("stream command output to a python callable")
+try:
+	import time
+
+	chunks = { 1: [], 2: [] }
+	stamps = []
+	def collect(channel, timestamp, data):
+		chunks.setdefault(channel, []).append(data)
+		stamps.append(timestamp)
+
+	t0 = time.time()
+	cmd = twopence.Command("seq 1 20000; echo oops >&2", stdout = collect, stderr = collect, quiet = True)
+	status = target.run(cmd)
+	testCaseCheckStatus(status)
+
+	out = "".join(chunks[1])
+	err = "".join(chunks[2])
+	expect = "".join(["%d\n" % i for i in range(1, 20001)])
+	print "Received %d bytes of stdout and %d bytes of stderr in %d chunks" % (len(out), len(err), len(stamps))
+	if out != expect:
+		testCaseFail("stdout callback did not see the expected output")
+	if err != "oops\n":
+		testCaseFail("stderr callback received \"%s\"" % err)
+	if len(chunks) != 2:
+		testCaseFail("callback invoked for unexpected channels %s" % chunks.keys())
+	if stamps != sorted(stamps) or stamps[0] < t0 - 1 or stamps[-1] > time.time() + 1:
+		testCaseFail("bad timestamps passed to the callback")
+except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("let an I/O thread service the link between calls")
+try:
+	import select
+	import time
+
+	target2 = twopence.Target(targetSpec)
+	try:
+		target2.setOption("io-thread", 1)
+		ioThreadSupported = True
+	except:
+		ioThreadSupported = False
+
+	if not ioThreadSupported:
+		testCaseSkip("I/O thread not available for %s plugin right now" % target.type)
+	else:
+		fd = target2.getOption("completion-fd")
+		print "Completion fd is %d" % fd
+
+		cmd = twopence.Command("sleep 1; echo done", stdout = bytearray(), background = 1, quiet = True)
+		target2.run(cmd)
+
+		t0 = time.time()
+		ready, _, _ = select.select([fd], [], [], 5)
+		if fd not in ready:
+			testCaseFail("completion fd did not become readable")
+		else:
+			print "Completion fd became readable after %.1f seconds" % (time.time() - t0)
+			status = target2.wait(cmd)
+			if testCaseCheckStatusQuiet(status) and str(status.stdout).strip() != "done":
+				testCaseFail("unexpected output \"%s\"" % str(status.stdout).strip())
+
+		# Without the I/O thread, output only arrives inside a twopence call
+		received = []
+		def collect(channel, timestamp, data):
+			received.append(data)
+
+		cmd = twopence.Command("echo hello", stdout = collect, background = 1, quiet = True)
+		target2.run(cmd)
+		print "Sleeping for 2 seconds without calling into twopence"
+		time.sleep(2)
+		if "".join(received) != "hello\n":
+			testCaseFail("output was not received while idle")
+		else:
+			print "Good, output was received while idle"
+		testCaseCheckStatus(target2.wait(cmd))
+
+	target2 = None
+except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("spread transactions across several virtio links")
+if target.type != "virtio":
+    testCaseSkip("multiple links not available for %s plugin" % target.type)
+else:
+    try:
+	import hashlib
+
+	# Connect to the same server through two links
+	path = targetSpec[len("virtio:"):].split(",")[0]
+	target2 = twopence.Target("virtio:%s,%s" % (path, path))
+
+	cmds = []
+	for n in range(1, 9):
+		cmd = twopence.Command("sleep 1; echo %d" % n, stdout = bytearray(), background = 1, quiet = True)
+		target2.run(cmd)
+		cmds.append(cmd)
+
+	data = bytearray(os.urandom(4000000))
+	status = target2.sendfile("/tmp/twopence-links", data = data)
+	if not status:
+		testCaseFail("sendfile failed: %s" % status.message)
+
+	for cmd in cmds:
+		expect = cmd.commandline.split()[-1]
+		status = target2.wait(cmd)
+		if testCaseCheckStatusQuiet(status) and str(status.stdout).strip() != expect:
+			testCaseFail("command \"%s\" printed \"%s\"" % (cmd.commandline, str(status.stdout).strip()))
+
+	xfer = twopence.Transfer("/tmp/twopence-links")
+	status = target2.recvfile(xfer)
+	if not status:
+		testCaseFail("recvfile failed: %s" % status.message)
+	elif hashlib.md5(status.buffer).hexdigest() != hashlib.md5(data).hexdigest():
+		testCaseFail("file was corrupted on its way through two links")
+	else:
+		print "Good, sent and received %d bytes" % len(data)
+
+	target2.run("rm -f /tmp/twopence-links", quiet = True)
+	target2 = None
+    except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("run a command on a group of targets")
+if not(backgroundingSupported):
+    testCaseSkip("background execution not available for %s plugin right now" % target.type)
+else:
+    try:
+	import time
+
+	targets = []
+	for n in range(3):
+		t = twopence.Target(targetSpec)
+		t.setenv("GROUPMEMBER", str(n))
+		targets.append(t)
+
+	group = twopence.Group(targets, concurrency = 2)
+	results = group.run("echo member $GROUPMEMBER")
+	for n in range(3):
+		t, status = results[n]
+		if t != targets[n]:
+			testCaseFail("results are not in target order")
+		elif testCaseCheckStatusQuiet(status) and str(status.stdout).strip() != "member %d" % n:
+			testCaseFail("target %d printed \"%s\"" % (n, str(status.stdout).strip()))
+
+	# The first target fails right away; the others should be cancelled
+	targets[0].setenv("DELAY", "0")
+	targets[1].setenv("DELAY", "10")
+	targets[2].setenv("DELAY", "10")
+	group = twopence.Group(targets, cancelOnFailure = True)
+	t0 = time.time()
+	results = group.run("sleep $DELAY; test $GROUPMEMBER != 0")
+	elapsed = time.time() - t0
+	print "Group run took %.1f seconds" % elapsed
+
+	testCaseCheckStatus(results[0][1], 1)
+	for t, status in results[1:]:
+		testCaseCheckLocalError(status, twopence.COMMAND_CANCELED_ERROR)
+	if elapsed > 5:
+		testCaseFail("the other targets were not cancelled in time")
+
+	group = None
+	targets = None
+    except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("run commands and transfers from a job queue")
+if not(backgroundingSupported):
+    testCaseSkip("background execution not available for %s plugin right now" % target.type)
+else:
+    try:
+	queue = twopence.JobQueue(concurrency = 2)
+
+	write = queue.command(target, "sleep 1; echo written >/tmp/twopence-jobq")
+	read = queue.command(target, twopence.Command("cat /tmp/twopence-jobq", stdout = bytearray(), quiet = True), after = write)
+	fail = queue.command(target, "exit 2")
+	skip = queue.command(target, "echo should not run", after = [write, fail])
+
+	send = queue.sendfile(target, twopence.Transfer("/tmp/twopence-jobq2", data = bytearray("payload")))
+	recv = queue.recvfile(target, twopence.Transfer("/tmp/twopence-jobq2"), after = send)
+
+	results = queue.run()
+	if len(results) != 6:
+		testCaseFail("expected 6 results, got %d" % len(results))
+	else:
+		testCaseCheckStatus(results[write])
+		if testCaseCheckStatusQuiet(results[read]) and str(results[read].stdout).strip() != "written":
+			testCaseFail("dependent job ran too early, and read \"%s\"" % str(results[read].stdout).strip())
+		testCaseCheckStatus(results[fail], 2)
+		testCaseCheckLocalError(results[skip], twopence.COMMAND_CANCELED_ERROR)
+
+		if not results[send]:
+			testCaseFail("queued sendfile failed")
+		elif not results[recv] or str(results[recv].buffer) != "payload":
+			testCaseFail("queued recvfile did not return the data sent before")
+		else:
+			print "Good, received the data sent by an earlier job"
+
+	try:
+		queue.command(target, "/bin/true", after = 100)
+		testCaseFail("a job should not depend on a job that does not exist")
+	except ValueError:
+		pass
+
+	target.run("rm -f /tmp/twopence-jobq /tmp/twopence-jobq2", quiet = True)
+	queue = None
+    except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("spread commands across a pool of targets")
+if not(backgroundingSupported):
+    testCaseSkip("background execution not available for %s plugin right now" % target.type)
+else:
+    try:
+	import time
+
+	targets = [twopence.Target(targetSpec) for n in range(3)]
+	pool = twopence.Pool(targets)
+
+	# Pin all jobs to the first target; the others have to steal them
+	cmds = []
+	for n in range(9):
+		cmd = twopence.Command("sleep 1; exit %d" % n, quiet = True)
+		pool.submit(cmd, affinity = 0)
+		cmds.append(cmd)
+
+	t0 = time.time()
+	results = pool.run()
+	elapsed = time.time() - t0
+	print "Ran %d commands in %.1f seconds" % (len(results), elapsed)
+
+	if len(results) != len(cmds):
+		testCaseFail("expected %d results, got %d" % (len(cmds), len(results)))
+	for n in range(len(results)):
+		t, status = results[n]
+		if status.command != cmds[n]:
+			testCaseFail("results are not in submission order")
+			break
+		testCaseCheckStatusQuiet(status, n)
+
+	stolen = 0
+	for stats in pool.stats():
+		print "target %d: %d jobs, %d stolen" % (targets.index(stats["target"]), stats["jobs"], stats["stolen"])
+		stolen += stats["stolen"]
+	if stolen == 0:
+		testCaseFail("idle targets did not take over any jobs")
+	if elapsed > 7:
+		testCaseFail("the pool did not run commands in parallel")
+
+	pool = None
+	targets = None
+    except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("run a prepared command over and over")
+try:
+	cmd = twopence.Command("echo $PREPARED", quiet = True)
+	cmd.setenv("PREPARED", "first")
+	cmd.prepare(target)
+	if not cmd.prepared:
+		testCaseFail("command should be prepared")
+
+	for n in range(20):
+		cmd.stdout = bytearray()
+		status = target.run(cmd)
+		if not testCaseCheckStatusQuiet(status):
+			break
+		if str(status.stdout).strip() != "first":
+			testCaseFail("prepared command printed \"%s\"" % str(status.stdout).strip())
+			break
+	print "Ran prepared command %d times" % (n + 1)
+
+	# Changing the environment must discard the prepared request
+	cmd.setenv("PREPARED", "second")
+	if cmd.prepared:
+		testCaseFail("setenv() should discard the prepared request")
+	cmd.stdout = bytearray()
+	status = target.run(cmd)
+	if testCaseCheckStatusQuiet(status) and str(status.stdout).strip() != "second":
+		testCaseFail("command printed \"%s\" after setenv" % str(status.stdout).strip())
+except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("set up the link early, and keep it warm")
+if target.type == "ssh":
+    testCaseSkip("connect() not available for %s plugin right now" % target.type)
+else:
+    try:
+	import time
+
+	warmTarget = twopence.Target(targetSpec)
+	warmTarget.setOption("keep-warm", 1)
+	if warmTarget.getOption("keep-warm") != 1:
+		testCaseFail("keep-warm option did not stick")
+
+	t0 = time.time()
+	warmTarget.connect(timeout = 5)
+	print "Connected after %.2f seconds" % (time.time() - t0)
+
+	status = warmTarget.run(twopence.Command("/bin/true", quiet = True))
+	testCaseCheckStatusQuiet(status)
+
+	if target.type == "tcp":
+		deadSpec = "tcp:127.0.0.1:1"
+	else:
+		deadSpec = "virtio:/does/not/exist"
+
+	deadTarget = twopence.Target(deadSpec)
+	t0 = time.time()
+	try:
+		deadTarget.connect(timeout = 2)
+		testCaseFail("connect() to %s should have failed" % deadSpec)
+	except:
+		elapsed = time.time() - t0
+		print "Good, connect() to %s failed after %.1f seconds" % (deadSpec, elapsed)
+		if elapsed > 3:
+			testCaseFail("connect() did not honor its timeout")
+
+	warmTarget = None
+	deadTarget = None
+    except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("command='/usr/bin/wc -c' with stdin generated by a callable")
+try:
+	class InputGenerator:
+		def __init__(self, total):
+			self.left = total
+			self.calls = 0
+			self.maxlenSeen = 0
+		def __call__(self, maxlen):
+			self.calls += 1
+			self.maxlenSeen = max(self.maxlenSeen, maxlen)
+			n = min(self.left, maxlen)
+			self.left -= n
+			return "x" * n
+
+	total = 4 * 1024 * 1024
+	gen = InputGenerator(total)
+	cmd = twopence.Command("wc -c", stdin = gen, quiet = True)
+	status = target.run(cmd)
+	if testCaseCheckStatusQuiet(status):
+		count = int(str(status.stdout).strip())
+		print "Callable was invoked %d times, at most %d bytes each; remote counted %d bytes" % (gen.calls, gen.maxlenSeen, count)
+		if count != total:
+			testCaseFail("remote command received %d bytes instead of %d" % (count, total))
+		if gen.calls < 2:
+			testCaseFail("input was not pulled in chunks")
+except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("capture lots of output with a small memory budget")
+try:
+	import threading
+	import tempfile
+	import shutil
+	import time
+
+	spillDir = tempfile.mkdtemp(prefix = "twopence-spill.")
+	savedTmpdir = os.environ.get("TMPDIR")
+	os.environ["TMPDIR"] = spillDir
+
+	# Look for a deleted file in spillDir among our open fds while
+	# the command is running
+	spillSeen = []
+	def watchSpill():
+		while not spillSeen and watcherRunning:
+			for fd in os.listdir("/proc/self/fd"):
+				try:
+					path = os.readlink("/proc/self/fd/" + fd)
+				except:
+					continue
+				if path.startswith(spillDir) and path.endswith("(deleted)"):
+					spillSeen.append(path)
+					break
+			time.sleep(0.05)
+
+	budgetTarget = twopence.Target(targetSpec)
+	budgetTarget.setCaptureBudget(64 * 1024)
+
+	watcherRunning = True
+	watcher = threading.Thread(target = watchSpill)
+	watcher.start()
+
+	print "Printing 2 MB of output with a capture budget of 64 KB"
+	cmd = twopence.Command("dd if=/dev/zero bs=1024 count=2048 2>/dev/null | tr '\\000' x; sleep 2", quiet = True)
+	status = budgetTarget.run(cmd)
+
+	watcherRunning = False
+	watcher.join()
+
+	if savedTmpdir is None:
+		del os.environ["TMPDIR"]
+	else:
+		os.environ["TMPDIR"] = savedTmpdir
+	shutil.rmtree(spillDir, True)
+
+	if testCaseCheckStatusQuiet(status):
+		output = str(status.stdout)
+		if len(output) != 2 * 1024 * 1024 or output.strip("x") != "":
+			testCaseFail("captured output is wrong (%d bytes)" % len(output))
+		else:
+			print "Good, captured all %d bytes" % len(output)
+	if spillSeen:
+		print "Good, output was spilled to %s" % spillSeen[0]
+	else:
+		testCaseFail("output was not spilled to a temp file")
+	budgetTarget = None
+except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("drive commands on two targets from one select.poll() loop")
+if not(backgroundingSupported):
+    testCaseSkip("background execution not available for %s plugin right now" % target.type)
+else:
+    try:
+	import select
+	import time
+
+	# With an ssh target, this also checks that its sessions take part
+	# in the same loop as the other target
+	targets = [target, twopence.Target(targetSpec)]
+
+	pending = {}
+	t0 = time.time()
+	for n in range(1, 5):
+		t = targets[n % 2]
+		cmd = twopence.Command("sleep %d; exit %d" % ((n + 1) / 2, n), background = 1, quiet = True)
+		t.run(cmd)
+		pending[cmd] = n
+
+	deadline = time.time() + 10
+	while pending and time.time() < deadline:
+		poller = select.poll()
+		owner = {}
+		timeout = 1
+		for t in targets:
+			fds, tmo = t.pollfds()
+			for fd, events in fds:
+				poller.register(fd, events)
+				owner[fd] = t
+			if tmo is not None and tmo < timeout:
+				timeout = tmo
+
+		ready = poller.poll(timeout * 1000)
+		for t in targets:
+			mine = [(fd, revents) for fd, revents in ready if owner[fd] == t]
+			for status in t.dispatch(mine):
+				cmd = status.command
+				if cmd not in pending:
+					testCaseFail("dispatch() returned an unexpected command")
+					continue
+				print "target %d: \"%s\" completed with status %d" % (targets.index(t), cmd.commandline, status.code)
+				testCaseCheckStatusQuiet(status, pending[cmd])
+				del pending[cmd]
+
+	elapsed = time.time() - t0
+	if pending:
+		testCaseFail("%d commands did not complete" % len(pending))
+	elif elapsed > 3.5:
+		testCaseFail("commands on the two targets did not run concurrently (%.1f seconds)" % elapsed)
+	else:
+		print "All commands completed after %.1f seconds" % elapsed
+	for t in targets:
+		if t.wait() != None:
+			testCaseFail("there were still commands left")
+	targets = None
+    except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("limit the bandwidth of a link")
+if target.type == "ssh":
+    testCaseSkip("bandwidth limits not available for %s plugin right now" % target.type)
+else:
+    try:
+	import time
+
+	slowTarget = twopence.Target(targetSpec)
+	slowTarget.setOption("xmit-rate", 200000)
+	slowTarget.setOption("xmit-burst", 50000)
+	if slowTarget.getOption("xmit-rate") != 200000:
+		testCaseFail("xmit-rate option did not stick")
+
+	print "Sending 500000 bytes at 200000 bytes/sec"
+	data = bytearray("x" * 500000)
+	t0 = time.time()
+	status = slowTarget.run(twopence.Command("wc -c", stdin = data, quiet = True))
+	elapsed = time.time() - t0
+	if testCaseCheckStatusQuiet(status):
+		print "Took %.1f seconds" % elapsed
+		if int(str(status.stdout).strip()) != 500000:
+			testCaseFail("remote command received %s bytes" % str(status.stdout).strip())
+		if elapsed < 1.8:
+			testCaseFail("transfer was not throttled")
+		if elapsed > 6:
+			testCaseFail("transfer was throttled too much")
+
+	throttled = slowTarget.getOption("xmit-throttled")
+	print "Data was held back for %d msec" % throttled
+	if throttled < 1000:
+		testCaseFail("xmit-throttled does not account for the delay")
+	if slowTarget.getOption("recv-throttled") != 0:
+		testCaseFail("the receive direction should not have been throttled")
+	slowTarget = None
+    except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("send one file to a group of targets")
+try:
+	targets = [twopence.Target(targetSpec) for n in range(3)]
+	group = twopence.Group(targets)
+
+	data = bytearray(os.urandom(300000))
+	xfer = twopence.Transfer("/tmp/twopence-group-inject", data = data, permissions = 0644)
+	results = group.sendfile(xfer)
+	if len(results) != len(targets):
+		testCaseFail("expected %d results, got %d" % (len(targets), len(results)))
+	for t, status in results:
+		if status.code != 0:
+			testCaseFail("sendfile to target %d failed: %d" % (targets.index(t), status.code))
+
+	# The targets may all be the same SUT, so fetch the file from each of them
+	for n in range(len(targets)):
+		xfer = twopence.Transfer("/tmp/twopence-group-inject")
+		status = targets[n].recvfile(xfer)
+		if status.code != 0 or status.buffer != data:
+			testCaseFail("target %d did not receive the right data" % n)
+	print "Good, sent %d bytes to %d targets" % (len(data), len(targets))
+
+	print "Sending to a directory that does not exist"
+	xfer = twopence.Transfer("/does/not/exist/file", data = data)
+	for t, status in group.sendfile(xfer):
+		if status.code == 0:
+			testCaseFail("sendfile to target %d should have failed" % targets.index(t))
+
+	target.run("rm -f /tmp/twopence-group-inject")
+	group = None
+	targets = None
+except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("extract a file only if it changed")
+try:
+	import tempfile
+	import shutil
+
+	localDir = tempfile.mkdtemp(prefix = "twopence-extract.")
+	localFile = localDir + "/extracted"
+	remoteFile = "/tmp/twopence-conditional"
+
+	target.sendfile(remoteFile, data = bytearray("first version\n"))
+
+	if not target.extractIfChanged(remoteFile, localFile):
+		testCaseFail("first extractIfChanged() did not transfer the file")
+	if open(localFile).read() != "first version\n":
+		testCaseFail("extracted file has the wrong contents")
+
+	print "Extracting the same file again"
+	if target.extractIfChanged(remoteFile, localFile):
+		testCaseFail("second extractIfChanged() transferred an unchanged file")
+	else:
+		print "Good, the file was not modified"
+
+	print "Changing the remote file, and extracting it again"
+	target.sendfile(remoteFile, data = bytearray("second, longer version\n"))
+	if not target.extractIfChanged(remoteFile, localFile):
+		testCaseFail("extractIfChanged() did not transfer the changed file")
+	if open(localFile).read() != "second, longer version\n":
+		testCaseFail("extracted file was not updated")
+
+	try:
+		target.extractIfChanged("/does/not/exist", localFile)
+		testCaseFail("extractIfChanged() of a missing file should have failed")
+	except:
+		print "Good, extracting a missing file threw an exception"
+	if open(localFile).read() != "second, longer version\n":
+		testCaseFail("failed extract clobbered the local copy")
+
+	target.run("rm -f " + remoteFile)
+	shutil.rmtree(localDir, True)
+except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("open a remote file, and read and write parts of it")
+if target.type == "ssh":
+    testCaseSkip("remote file handles not available for %s plugin right now" % target.type)
+else:
+    try:
+	path = "/tmp/twopence-file-handle"
+
+	f = target.open(path, "w+", permissions = 0600)
+	if f.path != path or f.closed:
+		testCaseFail("bad attributes on open file")
+
+	# More than fits into a single request
+	data = bytearray(os.urandom(100000))
+	count = f.pwrite(data, 0)
+	if count != len(data):
+		testCaseFail("pwrite() wrote %d bytes instead of %d" % (count, len(data)))
+	f.pwrite("HELLO", 50000)
+	data[50000:50005] = "HELLO"
+
+	st = f.fstat()
+	print "Remote file has %d bytes, mode 0%o" % (st["size"], st["mode"] & 07777)
+	if st["size"] != len(data):
+		testCaseFail("fstat() reports %d bytes instead of %d" % (st["size"], len(data)))
+	if st["mode"] & 07777 != 0600:
+		testCaseFail("file was created with mode 0%o" % (st["mode"] & 07777))
+
+	if f.pread(len(data), 0) != data:
+		testCaseFail("reading back the whole file returned different data")
+	if f.pread(10, 49998) != data[49998:50008]:
+		testCaseFail("reading back a small range returned different data")
+	tail = f.pread(1000, len(data) - 100)
+	if len(tail) != 100:
+		testCaseFail("short read at end of file returned %d bytes" % len(tail))
+	f.close()
+	if not f.closed:
+		testCaseFail("file not marked as closed")
+	try:
+		f.pread(10, 0)
+		testCaseFail("pread() on a closed file should have failed")
+	except ValueError:
+		pass
+
+	# Cross check with a regular download
+	status = target.recvfile(path)
+	if status.buffer != data:
+		testCaseFail("downloaded file does not match what was written")
+	else:
+		print "Good, file contents agree"
+
+	try:
+		target.open("/does/not/exist")
+		testCaseFail("opening a file that does not exist should have failed")
+	except IOError, e:
+		print "Good, open() of missing file raised:", e
+
+	target.run("rm -f " + path)
+    except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("drive several chats at once")
+if not(backgroundingSupported):
+    testCaseSkip("background execution not available for %s plugin right now" % target.type)
+else:
+    try:
+	import time
+
+	otherTarget = twopence.Target(targetSpec)
+	slow = target.chat("sleep 2; echo slow-ready; read X; echo slow-got=$X")
+	fast = otherTarget.chat("echo fast-ready; read X; echo fast-got=$X")
+
+	slow.expectStart("slow-ready", timeout = 10)
+	fast.expectStart("fast-ready", timeout = 10)
+	if not slow.pending or slow.expectCheck():
+		testCaseFail("expect should be pending right after expectStart()")
+
+	# The fast chat must be answered while the slow one is still waiting
+	resolved = twopence.pollChats([slow, fast])
+	if resolved != [fast]:
+		testCaseFail("expected only the fast chat to be resolved first")
+	elif fast.found != "fast-ready":
+		testCaseFail("fast chat found \"%s\"" % fast.found)
+	else:
+		print "Fast chat resolved while the slow one is pending"
+	fast.send("one\n")
+	fast.expectStart("fast-got=one", timeout = 10)
+
+	order = []
+	while slow.pending or fast.pending:
+		for chat in twopence.pollChats([slow, fast]):
+			order.append(chat.found)
+	print "Resolved:", order
+	if order != ["fast-got=one", "slow-ready"]:
+		testCaseFail("chats were resolved in the wrong order")
+	if not slow.expectCheck():
+		testCaseFail("expectCheck() should report the expect as resolved")
+
+	slow.send("two\n")
+	slow.expectStart("slow-got=two", timeout = 10)
+	twopence.pollChats([slow])
+	if slow.found != "slow-got=two":
+		testCaseFail("slow chat found \"%s\"" % slow.found)
+
+	print "Waiting for a string that never shows up"
+	stuck = target.chat("sleep 3")
+	stuck.expectStart("never", timeout = 1)
+	t0 = time.time()
+	twopence.pollChats([stuck])
+	elapsed = time.time() - t0
+	if stuck.pending or stuck.found is not None:
+		testCaseFail("expect should have timed out")
+	if elapsed > 2.5:
+		testCaseFail("expect timeout was not honored (%.1f seconds)" % elapsed)
+
+	for chat in (slow, fast, stuck):
+		if not chat.wait():
+			testCaseFail("chat command exited with non-zero status")
+	otherTarget = None
+    except:
+	testCaseException()
+testCaseReport()
+
+testCaseBegin("detach a job, disconnect, and reattach to it")
+if target.type == "ssh":
+    testCaseSkip("detached jobs not available for %s plugin right now" % target.type)
+else:
+    try:
+	import time
+
+	firstTarget = twopence.Target(targetSpec)
+	cmd = twopence.Command("echo started; sleep 2; echo finished; exit 7", detach = True)
+	jobId = firstTarget.run(cmd)
+	print "Started detached job %d" % jobId
+
+	jobs = [job for job in firstTarget.jobs() if job["id"] == jobId]
+	if len(jobs) != 1:
+		testCaseFail("job %d is not listed" % jobId)
+	elif not jobs[0]["running"] or jobs[0]["code"] is not None:
+		testCaseFail("job %d should still be running" % jobId)
+
+	# Go away while the job is running, and come back on a new connection
+	firstTarget.disconnect()
+	firstTarget = None
+	time.sleep(0.5)
+
+	newTarget = twopence.Target(targetSpec)
+	jobs = [job for job in newTarget.jobs() if job["id"] == jobId]
+	if len(jobs) != 1:
+		testCaseFail("job %d did not survive the disconnect" % jobId)
+	else:
+		print "Job %d survived: %s" % (jobId, jobs[0]["command"])
+
+	cmd = twopence.Command("reattach", quiet = True)
+	status = newTarget.reattach(jobId, command = cmd)
+	output = str(status.stdout)
+	print "Job exited with status %d, output %s" % (status.code, output.split())
+	if status.code != 7:
+		testCaseFail("job should have exited with status 7")
+	if output != "started\nfinished\n":
+		testCaseFail("did not receive all of the job's output")
+
+	if [job for job in newTarget.jobs() if job["id"] == jobId]:
+		testCaseFail("job %d is still listed after reattach" % jobId)
+
+	try:
+		newTarget.reattach(jobId)
+		testCaseFail("reattaching to a collected job should have failed")
+	except SystemError:
+		print "Good, reattaching again threw an exception"
+	newTarget = None
+    except:
+	testCaseException()
+testCaseReport()
+
 
 testSuiteExit()